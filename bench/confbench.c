@@ -0,0 +1,422 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark driver.  Measures the time it takes to load the file, print
+ * it out, filter, merge, remove and save it, and to build a tree from
+ * scratch, and prints out the results as a single line of JSON.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define	_GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "confctl.h"
+#include "confctl_ops.h"
+
+struct phase {
+	const char	*p_name;
+	uint64_t	p_ns;
+	long		p_maxrss;
+};
+
+static struct phase	phases[16];
+static int		nphases;
+static bool		Cflag, Eflag, Sflag;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: confbench [-CES] [-f filter] [-l label] [-m count] [-r repeat] config-path\n");
+	exit(1);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	int error;
+
+	error = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (error != 0)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static long
+maxrss(void)
+{
+	struct rusage ru;
+	int error;
+
+	error = getrusage(RUSAGE_SELF, &ru);
+	if (error != 0)
+		err(1, "getrusage");
+
+	return (ru.ru_maxrss);
+}
+
+static void
+phase_done(const char *name, uint64_t ns)
+{
+	struct phase *p;
+
+	if (nphases >= (int)(sizeof(phases) / sizeof(phases[0])))
+		errx(1, "too many phases");
+
+	p = &phases[nphases];
+	p->p_name = name;
+	p->p_ns = ns;
+	p->p_maxrss = maxrss();
+	nphases++;
+}
+
+static struct confctl *
+load(const char *path)
+{
+	struct confctl *cc;
+
+	cc = confctl_new();
+	confctl_set_equals_sign(cc, Eflag);
+	confctl_set_semicolon(cc, Sflag);
+	confctl_set_slash_slash_comments(cc, Cflag);
+	confctl_set_slash_star_comments(cc, Cflag);
+	confctl_load(cc, path);
+
+	return (cc);
+}
+
+/*
+ * Builds a tree from scratch, with 'count' variables containing BUILD_KEYS
+ * variables each, either one by one, or in bulk.
+ */
+#define	BUILD_KEYS	4
+
+static struct confctl *
+build(int count, bool bulk)
+{
+	struct confctl *cc;
+	struct confctl_var *root, *group, *cv;
+	char *name, *names[BUILD_KEYS], *values[BUILD_KEYS];
+	int i, j;
+
+	cc = confctl_new();
+	confctl_set_equals_sign(cc, Eflag);
+	confctl_set_semicolon(cc, Sflag);
+	root = confctl_root(cc);
+
+	for (i = 0; i < count; i++) {
+		if (asprintf(&name, "group%d", i) < 0)
+			err(1, "asprintf");
+		for (j = 0; j < BUILD_KEYS; j++) {
+			if (asprintf(&names[j], "key%d", j) < 0 ||
+			    asprintf(&values[j], "value%d.%d", i, j) < 0)
+				err(1, "asprintf");
+		}
+
+		if (bulk) {
+			group = confctl_var_append(root, (const char *const *)&name, NULL, 1);
+			confctl_var_append(group, (const char *const *)names, (const char *const *)values, BUILD_KEYS);
+		} else {
+			group = confctl_var_new(root, name);
+			for (j = 0; j < BUILD_KEYS; j++) {
+				cv = confctl_var_new(group, names[j]);
+				confctl_var_set_value(cv, values[j]);
+			}
+		}
+
+		free(name);
+		for (j = 0; j < BUILD_KEYS; j++) {
+			free(names[j]);
+			free(values[j]);
+		}
+	}
+
+	return (cc);
+}
+
+static char *
+slurp(const char *path)
+{
+	char *str = NULL;
+	size_t len = 0;
+	FILE *fp, *out;
+	int ch;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		err(1, "%s", path);
+	out = open_memstream(&str, &len);
+	if (out == NULL)
+		err(1, "open_memstream");
+	while ((ch = getc(fp)) != EOF)
+		putc(ch, out);
+	fclose(out);
+	fclose(fp);
+
+	return (str);
+}
+
+static uint64_t
+count_nodes(struct confctl_var *cv)
+{
+	struct confctl_var *child;
+	uint64_t n = 1;
+
+	for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child))
+		n += count_nodes(child);
+
+	return (n);
+}
+
+static void
+print_json_string(const char *str)
+{
+	const char *p;
+
+	putchar('"');
+	for (p = str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if ((unsigned char)*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+int
+main(int argc, char **argv)
+{
+	struct confctl *cc, *filter = NULL, *merge = NULL, *remove = NULL, *line;
+	struct confctl_frozen *cf;
+	bool *hidden;
+	struct stat sb;
+	const char *label = NULL, *path, *pattern = "**.nonexistent";
+	struct confctl *built, *copy;
+	char *str, *tmppath, *built_path[3], *built_str[3];
+	uint64_t best, nodes, start, took;
+	int ch, count = 1000, error, i, repeat = 3;
+	FILE *fp;
+
+	while ((ch = getopt(argc, argv, "CESf:l:m:r:")) != -1) {
+		switch (ch) {
+		case 'C':
+			Cflag = true;
+			break;
+		case 'E':
+			Eflag = true;
+			break;
+		case 'S':
+			Sflag = true;
+			break;
+		case 'f':
+			pattern = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'm':
+			count = atoi(optarg);
+			if (count <= 0)
+				errx(1, "invalid count");
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			if (repeat <= 0)
+				errx(1, "invalid repeat count");
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+	path = argv[0];
+	if (label == NULL)
+		label = path;
+
+	error = stat(path, &sb);
+	if (error != 0)
+		err(1, "%s", path);
+
+	/*
+	 * Loading is done several times, and the best result is used.
+	 */
+	best = UINT64_MAX;
+	for (i = 0; i < repeat; i++) {
+		start = now();
+		cc = load(path);
+		took = now() - start;
+		if (took < best)
+			best = took;
+		if (i < repeat - 1)
+			confctl_delete(cc);
+	}
+	phase_done("load", best);
+	nodes = count_nodes(confctl_root(cc));
+
+	fp = fopen("/dev/null", "w");
+	if (fp == NULL)
+		err(1, "/dev/null");
+	start = now();
+	cc_print(cc, fp, false);
+	if (fflush(fp) != 0)
+		err(1, "fflush");
+	phase_done("print", now() - start);
+	fclose(fp);
+
+	start = now();
+	line = confctl_from_line(pattern);
+	cc_merge(&filter, line);
+	cc_filter(cc, filter);
+	phase_done("filter", now() - start);
+
+	start = now();
+	cf = confctl_freeze(cc);
+	phase_done("freeze", now() - start);
+
+	fp = fopen("/dev/null", "w");
+	if (fp == NULL)
+		err(1, "/dev/null");
+	start = now();
+	cf_print(cf, NULL, fp, false, 1);
+	if (fflush(fp) != 0)
+		err(1, "fflush");
+	phase_done("frozen-print", now() - start);
+	fclose(fp);
+
+	start = now();
+	hidden = cf_filter(cf, filter);
+	phase_done("frozen-filter", now() - start);
+	free(hidden);
+	confctl_frozen_delete(cf);
+
+	/*
+	 * Build trees from scratch, one by one, in bulk, and by copying;
+	 * the results must be the same.
+	 */
+	for (i = 0; i < 3; i++) {
+		if (asprintf(&built_path[i], "%s.confbench%d", path, i) < 0)
+			err(1, "asprintf");
+	}
+	start = now();
+	built = build(count, false);
+	confctl_save(built, built_path[0]);
+	phase_done("build", now() - start);
+	start = now();
+	copy = build(count, true);
+	confctl_save(copy, built_path[1]);
+	phase_done("bulk-build", now() - start);
+	confctl_delete(copy);
+	copy = confctl_new();
+	confctl_set_equals_sign(copy, Eflag);
+	confctl_set_semicolon(copy, Sflag);
+	start = now();
+	confctl_var_append_tree(confctl_root(copy), confctl_root(built));
+	confctl_save(copy, built_path[2]);
+	phase_done("copy", now() - start);
+	confctl_delete(copy);
+	confctl_delete(built);
+	for (i = 0; i < 3; i++) {
+		built_str[i] = slurp(built_path[i]);
+		error = unlink(built_path[i]);
+		if (error != 0)
+			err(1, "unlink");
+		free(built_path[i]);
+	}
+	if (strcmp(built_str[0], built_str[1]) != 0)
+		errx(1, "tree built in bulk differs from the one built one by one");
+	if (strcmp(built_str[0], built_str[2]) != 0)
+		errx(1, "copied tree differs from the original one");
+	for (i = 0; i < 3; i++)
+		free(built_str[i]);
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		if (asprintf(&str, "confbench.variable%d=value%d", i, i) < 0)
+			err(1, "asprintf");
+		line = confctl_from_line(str);
+		cc_merge(&merge, line);
+		free(str);
+	}
+	cc_merge(&cc, merge);
+	phase_done("merge", now() - start);
+
+	start = now();
+	for (i = 0; i < count; i += 2) {
+		if (asprintf(&str, "confbench.variable%d", i) < 0)
+			err(1, "asprintf");
+		line = confctl_from_line(str);
+		cc_merge(&remove, line);
+		free(str);
+	}
+	cc_remove(cc, remove);
+	phase_done("remove", now() - start);
+
+	if (asprintf(&tmppath, "%s.confbench", path) < 0)
+		err(1, "asprintf");
+	start = now();
+	confctl_save(cc, tmppath);
+	phase_done("save", now() - start);
+	error = unlink(tmppath);
+	if (error != 0)
+		err(1, "unlink");
+	free(tmppath);
+
+	printf("{\"label\": ");
+	print_json_string(label);
+	printf(", \"bytes\": %ju, \"nodes\": %ju, \"max_rss_kb\": %ld, \"phases\": {",
+	    (uintmax_t)sb.st_size, (uintmax_t)nodes, maxrss());
+	for (i = 0; i < nphases; i++) {
+		printf("%s\"%s\": {\"ns\": %ju, \"ns_per_node\": %.2f, \"mb_per_s\": %.2f, \"max_rss_kb\": %ld}",
+		    i > 0 ? ", " : "", phases[i].p_name, (uintmax_t)phases[i].p_ns,
+		    (double)phases[i].p_ns / nodes,
+		    phases[i].p_ns > 0 ? (sb.st_size / 1048576.0) / (phases[i].p_ns / 1e9) : 0.0,
+		    phases[i].p_maxrss);
+	}
+	printf("}}\n");
+
+	return (0);
+}
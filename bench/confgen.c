@@ -0,0 +1,345 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Generator of synthetic configuration files, for benchmarking.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t	rng_state = 42;
+static uint64_t	written;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: confgen [-s size] [-r seed] type\n");
+	fprintf(stderr, "types: wide, deep, longval, hugeval, comments, jail, dhcpd, hast\n");
+	exit(1);
+}
+
+/*
+ * xorshift64*; we want the same output for the same seed everywhere,
+ * so that results of different runs can be compared.
+ */
+static uint32_t
+rng(void)
+{
+
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return ((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static void
+out(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+out(const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vprintf(fmt, ap);
+	va_end(ap);
+	if (ret < 0)
+		err(1, "printf");
+	written += ret;
+}
+
+static uint64_t
+parse_size(const char *str)
+{
+	uint64_t size;
+	char *end;
+
+	size = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'g':
+	case 'G':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'm':
+	case 'M':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'k':
+	case 'K':
+		size *= 1024;
+		end++;
+		break;
+	}
+	if (*end != '\0' || size == 0)
+		errx(1, "invalid size %s", str);
+
+	return (size);
+}
+
+/*
+ * Lots of variables in a single block.
+ */
+static void
+gen_wide(uint64_t size)
+{
+	uint64_t i;
+
+	out("wide {\n");
+	for (i = 0; written < size; i++)
+		out("\tvariable%ju\tvalue%u\n", (uintmax_t)i, rng());
+	out("}\n");
+}
+
+static void
+indent(int level)
+{
+	static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+	    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+	    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+	    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+
+	if (level > (int)sizeof(tabs) - 1)
+		level = sizeof(tabs) - 1;
+	out("%.*s", level, tabs);
+}
+
+/*
+ * Deeply nested blocks, with a few variables at every level.
+ */
+static void
+gen_deep(uint64_t size)
+{
+	uint64_t i;
+	int depth, level;
+
+	for (i = 0; written < size; i++) {
+		depth = 16 + rng() % 48;
+		for (level = 0; level < depth; level++) {
+			indent(level);
+			out("block%d {\n", level);
+			indent(level + 1);
+			out("value%ju %u\n", (uintmax_t)i, rng());
+		}
+		for (level = depth - 1; level >= 0; level--) {
+			indent(level);
+			out("}\n");
+		}
+	}
+}
+
+/*
+ * Few variables with long, quoted values.
+ */
+static void
+gen_longval(uint64_t size)
+{
+	uint64_t i;
+	int j, len;
+
+	for (i = 0; written < size; i++) {
+		len = 256 + rng() % 8192;
+		out("variable%ju \"", (uintmax_t)i);
+		for (j = 0; j < len; j++)
+			out("%c", 'a' + rng() % 26);
+		out("\"\n");
+	}
+}
+
+/*
+ * Single variable, with a value taking up the whole file; with sizes
+ * over 4G, this is for finding 32 bit lengths.
+ */
+static void
+gen_hugeval(uint64_t size)
+{
+	char buf[65536];
+	size_t i;
+
+	out("variable \"");
+	while (written < size) {
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = 'a' + rng() % 26;
+		if (fwrite(buf, 1, sizeof(buf), stdout) != sizeof(buf))
+			err(1, "fwrite");
+		written += sizeof(buf);
+	}
+	out("\"\n");
+}
+
+/*
+ * Variables surrounded by comments.
+ */
+static void
+gen_comments(uint64_t size)
+{
+	uint64_t i;
+
+	out("# This file was generated by confgen.\n");
+	for (i = 0; written < size; i++) {
+		out("\n# Comment for block%ju.\n", (uintmax_t)i);
+		out("# It spans two lines.\n");
+		out("block%ju {\n", (uintmax_t)i);
+		out("\t# Comment for variable.\n");
+		out("\tvariable\t%u # with a comment after it\n", rng());
+		out("\tother\t%u\n", rng());
+		out("} # end of block%ju\n", (uintmax_t)i);
+	}
+}
+
+/*
+ * jail.conf(5); use with '-CES'.
+ */
+static void
+gen_jail(uint64_t size)
+{
+	uint64_t i;
+
+	out("exec.start = \"/bin/sh /etc/rc\";\n");
+	out("exec.stop = \"/bin/sh /etc/rc.shutdown\";\n");
+	out("exec.clean;\n");
+	out("mount.devfs;\n");
+	out("path = \"/var/jail/$name\";\n");
+	for (i = 0; written < size; i++) {
+		out("\n// Jail number %ju.\n", (uintmax_t)i);
+		out("jail%ju {\n", (uintmax_t)i);
+		out("\thost.hostname = \"jail%ju.example.com\";\n", (uintmax_t)i);
+		out("\tip4.addr = 10.%u.%u.%u, 10.%u.%u.%u;\n",
+		    rng() % 256, rng() % 256, rng() % 256, rng() % 256, rng() % 256, rng() % 256);
+		out("\t/* Allow raw sockets. */\n");
+		out("\tallow.raw_sockets;\n");
+		out("\tpersist;\n");
+		out("}\n");
+	}
+}
+
+/*
+ * dhcpd.conf(5); use with '-CS'.
+ */
+static void
+gen_dhcpd(uint64_t size)
+{
+	uint64_t i;
+
+	out("authoritative;\n");
+	out("subnet 10.0.0.0 netmask 255.0.0.0 {\n");
+	out("\toption broadcast-address 10.255.255.255;\n");
+	out("\toption routers 10.0.0.1;\n");
+	for (i = 0; written < size; i++) {
+		out("\n\thost host%ju {\n", (uintmax_t)i);
+		out("\t\thardware ethernet 00:%02x:%02x:%02x:%02x:%02x;\n",
+		    rng() % 256, rng() % 256, rng() % 256, rng() % 256, rng() % 256);
+		out("\t\tfixed-address 10.%u.%u.%u;\n", rng() % 256, rng() % 256, rng() % 256);
+		out("\t}\n");
+	}
+	out("}\n");
+}
+
+/*
+ * hast.conf(5); no options needed.
+ */
+static void
+gen_hast(uint64_t size)
+{
+	uint64_t i;
+
+	out("replication memsync\n");
+	for (i = 0; written < size; i++) {
+		out("\nresource disk%ju {\n", (uintmax_t)i);
+		out("\ton hasta {\n");
+		out("\t\tlocal /dev/da%ju\n", (uintmax_t)i);
+		out("\t\tremote 10.0.%u.%u\n", rng() % 256, rng() % 256);
+		out("\t}\n");
+		out("\ton hastb {\n");
+		out("\t\tlocal /dev/da%ju\n", (uintmax_t)i);
+		out("\t\tremote 10.0.%u.%u\n", rng() % 256, rng() % 256);
+		out("\t}\n");
+		out("}\n");
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t size = 1024 * 1024;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:s:")) != -1) {
+		switch (ch) {
+		case 'r':
+			rng_state = strtoull(optarg, NULL, 10);
+			if (rng_state == 0)
+				errx(1, "seed must not be zero");
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	if (strcmp(argv[0], "wide") == 0)
+		gen_wide(size);
+	else if (strcmp(argv[0], "deep") == 0)
+		gen_deep(size);
+	else if (strcmp(argv[0], "longval") == 0)
+		gen_longval(size);
+	else if (strcmp(argv[0], "hugeval") == 0)
+		gen_hugeval(size);
+	else if (strcmp(argv[0], "comments") == 0)
+		gen_comments(size);
+	else if (strcmp(argv[0], "jail") == 0)
+		gen_jail(size);
+	else if (strcmp(argv[0], "dhcpd") == 0)
+		gen_dhcpd(size);
+	else if (strcmp(argv[0], "hast") == 0)
+		gen_hast(size);
+	else
+		usage();
+
+	if (fflush(stdout) != 0)
+		err(1, "fflush");
+
+	return (0);
+}
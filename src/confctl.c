@@ -23,8 +23,19 @@
  * SUCH DAMAGE.
  */
 
+#define	_GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include <sys/resource.h>
 #include <assert.h>
 #include <err.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,323 +45,533 @@
 #include "vis.h"
 
 #include "confctl.h"
+#include "confctl_ops.h"
+
+/*
+ * Syntax options, and other ones that affect the way files are loaded and saved.
+ */
+static bool	Cflag, Eflag, Fflag, Iflag, Rflag, Sflag, Tflag;
+static unsigned int	threads;
 
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: confctl [-CEISn] config-path [name...]\n");
-	fprintf(stderr, "       confctl [-CEISn] -a config-path\n");
-	fprintf(stderr, "       confctl [-CEIS] -w name=value config-path\n");
-	fprintf(stderr, "       confctl [-CEIS] -x name config-path\n");
+	fprintf(stderr, "usage: confctl [-CEFIRSTn] [-j threads] config-path [name...]\n");
+	fprintf(stderr, "       confctl [-CEFIRSTn] [-j threads] -a config-path\n");
+	fprintf(stderr, "       confctl [-CEFIST] [-j threads] -w name=value config-path...\n");
+	fprintf(stderr, "       confctl [-CEFIST] [-j threads] -x name config-path...\n");
+	fprintf(stderr, "       confctl [-CEFIST] --stream [-w name=value] [-x name] config-path\n");
+	fprintf(stderr, "       confctl [-CEFIRS] -W config-path [name...]\n");
+	fprintf(stderr, "       confctl [-CEFIRST] -v value[*] config-path\n");
+	fprintf(stderr, "       confctl [-CEIST] --index config-path\n");
 	exit(1);
 }
 
-/*
- * This is used for two purposes - first, when selecting variables to display
- * (e.g. 'confctl path some.variable some.other.variable'), we mark nodes
- * that should be hidden instead of removing them; this is just a performance
- * optimisation.  Second, when merging, we mark nodes that were already merged.
- */
-static bool
-cv_marked(struct confctl_var *cv)
+static void
+cv_print_name(struct confctl_var *cv, FILE *fp)
 {
+	struct confctl_var *parent;
+	char *name;
 
-	if (confctl_var_uptr(cv) != NULL)
-		return (true);
-	return (false);
+	parent = confctl_var_parent(cv);
+	if (parent != NULL && confctl_var_parent(parent) != NULL) {
+		cv_print_name(parent, fp);
+		fputc('.', fp);
+	}
+	name = cv_safe_name(cv);
+	fputs(name, fp);
+	free(name);
 }
 
 static void
-cv_mark(struct confctl_var *cv, bool v)
+cv_print_found(struct confctl_var *cv, FILE *fp)
 {
+	const char *value;
 
-	if (v)
-		confctl_var_set_uptr(cv, (void *)1);
-	else
-		confctl_var_set_uptr(cv, NULL);
+	cv_print_name(cv, fp);
+	fputc('=', fp);
+	value = confctl_var_value(cv);
+	print_safe(value, strlen(value), fp);
+	fputc('\n', fp);
 }
 
+/*
+ * Print out all the variables with a given value.  Trailing asterisk
+ * means the value is a prefix, unless escaped with a backslash.
+ */
 static void
-cv_merge_existing(struct confctl_var *cv, struct confctl_var *newcv)
+cc_find(struct confctl *cc, const char *value, FILE *fp)
 {
-	struct confctl_var *child, *newchild, *next, *newnext;
-
-	if (strcmp(confctl_var_name(cv), confctl_var_name(newcv)) != 0)
-		return;
-
-	if (confctl_var_has_value(newcv)) {
-		if (confctl_var_has_children(cv))
-			errx(1, "cannot replace container node with leaf node");
-		confctl_var_set_value(cv, confctl_var_value(newcv));
-		/*
-		 * Mark the node as done, so that we won't try
-		 * to add it in cv_merge_new().
-		 */
-		cv_mark(newcv, true);
-		return;
+	struct confctl_var *cv;
+	char *copy;
+	size_t len, backslashes;
+	ssize_t error;
+	bool prefix = false;
+
+	copy = strdup(value);
+	if (copy == NULL)
+		err(1, "strdup");
+
+	len = strlen(copy);
+	if (len > 0 && copy[len - 1] == '*') {
+		backslashes = 0;
+		while (backslashes < len - 1 && copy[len - 2 - backslashes] == '\\')
+			backslashes++;
+		if (backslashes % 2 == 0) {
+			prefix = true;
+			copy[len - 1] = '\0';
+		} else {
+			copy[len - 2] = '*';
+			copy[len - 1] = '\0';
+		}
 	}
 
-	/*
-	 * This code implements this:
-	 * TAILQ_FOREACH_SAFE(newchild, &newcv->cv_children, cv_next, newtmp) {
-	 * 	TAILQ_FOREACH_SAFE(child, &cv->cv_children, cv_next, tmp)
-	 * 		cv_merge_existing(child, newchild);
-	 * }
-	 */
-	newchild = confctl_var_first_child(newcv);
-	while (newchild != NULL) {
-		newnext = confctl_var_next(newchild);
-
-		child = confctl_var_first_child(cv);
-		while (child != NULL) {
-			next = confctl_var_next(child);
-			cv_merge_existing(child, newchild);
-			child = next;
-		}
+	error = strnunvis(copy, copy, strlen(copy) + 1);
+	if (error < 0)
+		errx(1, "invalid escape sequence");
 
-		newchild = newnext;
+	if (prefix) {
+		for (cv = confctl_find_by_value_prefix(cc, copy); cv != NULL;
+		    cv = confctl_find_next_by_value_prefix(cc, cv, copy))
+			cv_print_found(cv, fp);
+	} else {
+		for (cv = confctl_find_by_value(cc, copy); cv != NULL;
+		    cv = confctl_find_next_by_value(cv))
+			cv_print_found(cv, fp);
 	}
+
+	free(copy);
 }
 
-static bool
-cv_merge_new(struct confctl_var *cv, struct confctl_var *newcv)
+/*
+ * Snapshot of variable values, used by watch mode to find out what changed
+ * between two versions of the configuration file.
+ */
+struct snapshot_entry {
+	char	*se_name;
+	char	*se_value;
+	size_t	se_seq;
+	bool	se_changed;
+};
+
+struct snapshot {
+	struct snapshot_entry	*s_entries;
+	struct snapshot_entry	**s_sorted;
+	size_t			s_len;
+	size_t			s_allocated;
+};
+
+static void
+snapshot_add(struct snapshot *s, char *name, char *value)
 {
-	struct confctl_var *child, *newchild, *next, *newnext;
-	bool found;
+	struct snapshot_entry *se;
 
-	if (cv_marked(newcv))
-		return (true);
+	if (s->s_len >= s->s_allocated) {
+		if (s->s_allocated == 0)
+			s->s_allocated = 16;
+		else
+			s->s_allocated *= 2;
+		s->s_entries = realloc(s->s_entries, s->s_allocated * sizeof(*s->s_entries));
+		if (s->s_entries == NULL)
+			err(1, "realloc");
+	}
 
-	if (strcmp(confctl_var_name(cv), confctl_var_name(newcv)) != 0)
-		return (false);
+	se = &s->s_entries[s->s_len];
+	se->se_name = name;
+	se->se_value = value;
+	se->se_seq = s->s_len;
+	se->se_changed = false;
+	s->s_len++;
+}
 
-	/*
-	 * This code implements this:
-	 * TAILQ_FOREACH_SAFE(newchild, &newcv->cv_children, cv_next, newtmp) {
-	 * 	found = false;
-	 * 	TAILQ_FOREACH_SAFE(child, &cv->cv_children, cv_next, tmp) {
-	 * 		found = cv_merge_new(child, newchild);
-	 * 		if (found)
-	 * 			break;
-	 * 	}
-	 * 	if (!found)
-	 * 		confctl_var_move(newchild, cv);
-	 * }
-	 */
-	newchild = confctl_var_first_child(newcv);
-	while (newchild != NULL) {
-		newnext = confctl_var_next(newchild);
+static void
+cv_snapshot(struct confctl_var *cv, struct snapshot *s, const char *prefix)
+{
+	struct confctl_var *child;
+	char *newprefix, *name;
+	int written;
 
-		found = false;
-		child = confctl_var_first_child(cv);
-		while (child != NULL) {
-			next = confctl_var_next(child);
+	if (cv_marked(cv))
+		return;
 
-			found = cv_merge_new(child, newchild);
-			if (found)
-				break;
+	if (!confctl_var_has_children(cv) && !confctl_var_has_value(cv))
+		return;
 
-			child = next;
-		}
-		if (!found)
-			confctl_var_move(newchild, cv);
+	name = cv_safe_name(cv);
+	if (prefix != NULL) {
+		written = asprintf(&newprefix, "%s.%s", prefix, name);
+		free(name);
+		if (written < 0)
+			err(1, "asprintf");
+	} else
+		newprefix = name;
 
-		newchild = newnext;
-	}
+	if (confctl_var_has_children(cv)) {
+		for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child))
+			cv_snapshot(child, s, newprefix);
+		free(newprefix);
+	} else
+		snapshot_add(s, newprefix, cv_safe_value(cv));
+}
 
-	return (true);
+static int
+snapshot_entry_compare(const void *a, const void *b)
+{
+	const struct snapshot_entry *sa, *sb;
+	int cmp;
+
+	sa = *(const struct snapshot_entry * const *)a;
+	sb = *(const struct snapshot_entry * const *)b;
+
+	cmp = strcmp(sa->se_name, sb->se_name);
+	if (cmp != 0)
+		return (cmp);
+	if (sa->se_seq < sb->se_seq)
+		return (-1);
+	if (sa->se_seq > sb->se_seq)
+		return (1);
+	return (0);
 }
 
 static void
-cc_merge(struct confctl **cc, struct confctl *merge)
+cc_snapshot(struct confctl *cc, struct snapshot *s)
 {
-	struct confctl_var *root, *mergeroot;
-
-	if (*cc == NULL)
-		*cc = confctl_new();
+	struct confctl_var *child;
+	size_t i;
 
-	root = confctl_root(*cc);
-	mergeroot = confctl_root(merge);
+	memset(s, 0, sizeof(*s));
+	for (child = confctl_var_first_child(confctl_root(cc)); child != NULL; child = confctl_var_next(child))
+		cv_snapshot(child, s, NULL);
 
 	/*
-	 * Reason for doing it in two steps is that we need
-	 * to correctly handle duplicate nodes, such as this:
-	 * "1 { foo } 2 { bar } 1 { baz }".  In this case,
-	 * when merging '1.baz', we want to update the existing
-	 * node, not add a new sibling to "foo".
+	 * Names are not unique, so the sort order also takes the position
+	 * in the file into account; this way the Nth occurence of a name
+	 * in the old snapshot gets compared to the Nth one in the new one.
 	 */
-	cv_merge_existing(root, mergeroot);
-	cv_merge_new(root, mergeroot);
+	s->s_sorted = calloc(s->s_len + 1, sizeof(*s->s_sorted));
+	if (s->s_sorted == NULL)
+		err(1, "calloc");
+	for (i = 0; i < s->s_len; i++)
+		s->s_sorted[i] = &s->s_entries[i];
+	qsort(s->s_sorted, s->s_len, sizeof(*s->s_sorted), snapshot_entry_compare);
 }
 
 static void
-cv_remove(struct confctl_var *cv, struct confctl_var *remove)
+snapshot_delete(struct snapshot *s)
 {
-	struct confctl_var *child, *removechild, *next;
-
-	if (confctl_var_value(remove) != NULL)
-		errx(1, "variable to remove must not specify a value");
+	size_t i;
 
-	if (strcmp(confctl_var_name(remove), confctl_var_name(cv)) != 0)
-		return;
-
-	if (confctl_var_first_child(remove) == NULL) {
-		confctl_var_delete(cv);
-		return;
+	for (i = 0; i < s->s_len; i++) {
+		free(s->s_entries[i].se_name);
+		free(s->s_entries[i].se_value);
 	}
+	free(s->s_entries);
+	free(s->s_sorted);
+}
 
-	child = confctl_var_first_child(cv);
-	while (child != NULL) {
-		next = confctl_var_next(child);
+/*
+ * Print out variables that were added or changed, in the same format
+ * as used by '-a', followed by names of variables that were removed,
+ * without the equals sign.
+ */
+static void
+snapshot_diff(struct snapshot *old, struct snapshot *new, FILE *fp)
+{
+	struct snapshot_entry *o, *n;
+	size_t i = 0, j = 0, k;
+	int cmp;
 
-		for (removechild = confctl_var_first_child(remove); removechild != NULL; removechild = confctl_var_next(removechild))
-			cv_remove(child, removechild);
+	for (k = 0; k < old->s_len; k++)
+		old->s_entries[k].se_changed = false;
 
-		child = next;
+	while (i < old->s_len || j < new->s_len) {
+		if (i >= old->s_len) {
+			new->s_sorted[j++]->se_changed = true;
+			continue;
+		}
+		if (j >= new->s_len) {
+			old->s_sorted[i++]->se_changed = true;
+			continue;
+		}
+		o = old->s_sorted[i];
+		n = new->s_sorted[j];
+		cmp = strcmp(o->se_name, n->se_name);
+		if (cmp < 0) {
+			o->se_changed = true;
+			i++;
+		} else if (cmp > 0) {
+			n->se_changed = true;
+			j++;
+		} else {
+			if (strcmp(o->se_value, n->se_value) != 0)
+				n->se_changed = true;
+			i++;
+			j++;
+		}
 	}
 
-	if (confctl_var_is_implicit_container(cv) && confctl_var_first_child(cv) == NULL)
-		confctl_var_delete(cv);
+	for (k = 0; k < new->s_len; k++) {
+		n = &new->s_entries[k];
+		if (n->se_changed)
+			fprintf(fp, "%s=%s\n", n->se_name, n->se_value);
+	}
+	for (k = 0; k < old->s_len; k++) {
+		o = &old->s_entries[k];
+		if (o->se_changed)
+			fprintf(fp, "%s\n", o->se_name);
+	}
 }
 
-static void
-cc_remove(struct confctl *cc, struct confctl *remove)
+static struct confctl *
+cc_new(void)
 {
+	struct confctl *cc;
+
+	cc = confctl_new();
+	confctl_set_stats(cc, Tflag);
+	confctl_set_lossless(cc, !Rflag);
+	confctl_set_threads(cc, threads);
+	confctl_set_equals_sign(cc, Eflag);
+	confctl_set_follow_includes(cc, Fflag);
+	confctl_set_rewrite_in_place(cc, Iflag);
+	confctl_set_semicolon(cc, Sflag);
+	confctl_set_slash_slash_comments(cc, Cflag);
+	confctl_set_slash_star_comments(cc, Cflag);
 
-	cv_remove(confctl_root(cc), confctl_root(remove));
+	return (cc);
 }
 
-static bool
-cv_filter(struct confctl_var *cv, struct confctl_var *filter)
+static struct confctl *
+cc_load(const char *path)
 {
-	struct confctl_var *child, *filterchild;
-	bool found;
-
-	if (confctl_var_value(filter) != NULL)
-		errx(1, "filter must not specify a value");
+	struct confctl *cc;
 
-	if (strcmp(confctl_var_name(filter), confctl_var_name(cv)) != 0)
-		return (false);
+	cc = cc_new();
+	confctl_load(cc, path);
 
-	for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child)) {
-		if (confctl_var_first_child(filter) == NULL) {
-			found = true;
-		} else {
-			found = false;
-			for (filterchild = confctl_var_first_child(filter); filterchild != NULL; filterchild = confctl_var_next(filterchild)) {
-				if (cv_filter(child, filterchild))
-					found = true;
-			}
-		}
-		if (found)
-			cv_mark(child, false);
-		else
-			cv_mark(child, true);
-	}
-
-	return (true);
+	return (cc);
 }
 
-static void
-cc_filter(struct confctl *cc, struct confctl *filter)
+/*
+ * Merging consumes the tree being merged, so when editing several files,
+ * the trees to merge and remove need to be built from scratch for each.
+ */
+static struct confctl *
+cc_from_lines(char **lines, int nlines)
 {
-	bool found;
+	struct confctl *cc = NULL, *line;
+	int i;
+
+	for (i = 0; i < nlines; i++) {
+		line = confctl_from_line(lines[i]);
+		cc_merge(&cc, line);
+	}
 
-	found = cv_filter(confctl_root(cc), confctl_root(filter));
-	assert(found);
+	return (cc);
 }
 
-static char *
-cv_safe_name(struct confctl_var *cv)
-{
-	const char *name;
-	char *dst;
+/*
+ * Changes requested with -w and -x; they need to be kept around, in case
+ * the file changes before it gets saved and they need to be redone.
+ */
+struct edits {
+	char	**e_wlines;
+	int	e_nw;
+	char	**e_xlines;
+	int	e_nx;
+};
 
-	name = confctl_var_name(cv);
-	dst = malloc(strlen(name) * 4 + 1);
-	if (dst == NULL)
-		err(1, "malloc");
-	strvis(dst, name, VIS_NL | VIS_CSTYLE);
+static void
+cc_edit(struct confctl *cc, void *arg)
+{
+	struct edits *edits = arg;
+	struct confctl *merge, *remove;
 
-	return (dst);
+	/*
+	 * We're not using cv_filter() mechanism,
+	 * because we really want to remove the nodes here,
+	 * so that we can e.g. replace them by using -x
+	 * and -w together.  Also, cv_filter() works
+	 * the other way around, exposing selected nodes
+	 * and hiding all the rest; we would need to 'invert'
+	 * the filter somehow.
+	 */
+	remove = cc_from_lines(edits->e_xlines, edits->e_nx);
+	if (remove != NULL) {
+		confctl_stats_begin(cc, CONFCTL_PHASE_REMOVE);
+		cc_remove(cc, remove);
+		confctl_stats_end(cc, CONFCTL_PHASE_REMOVE);
+	}
+	merge = cc_from_lines(edits->e_wlines, edits->e_nw);
+	if (merge != NULL) {
+		confctl_stats_begin(cc, CONFCTL_PHASE_MERGE);
+		cc_merge(&cc, merge);
+		confctl_stats_end(cc, CONFCTL_PHASE_MERGE);
+	}
 }
 
-static char *
-cv_safe_value(struct confctl_var *cv)
+static void
+cc_print_stats(struct confctl *cc, FILE *fp)
 {
-	const char *value;
-	char *dst;
-
-	value = confctl_var_value(cv);
-	dst = malloc(strlen(value) * 4 + 1);
-	if (dst == NULL)
-		err(1, "malloc");
-	strvis(dst, value, VIS_NL | VIS_CSTYLE);
-
-	return (dst);
+	struct confctl_stats stats;
+	struct rusage ru;
+	int error, i;
+
+	confctl_get_stats(cc, &stats);
+	for (i = 0; i < CONFCTL_PHASE_MAX; i++) {
+		fprintf(fp, "stats.%s.wall_ns=%ju\n", confctl_phase_name(i), (uintmax_t)stats.cs_wall_ns[i]);
+		fprintf(fp, "stats.%s.cpu_ns=%ju\n", confctl_phase_name(i), (uintmax_t)stats.cs_cpu_ns[i]);
+	}
+	fprintf(fp, "stats.bytes_read=%ju\n", (uintmax_t)stats.cs_bytes_read);
+	fprintf(fp, "stats.bytes_written=%ju\n", (uintmax_t)stats.cs_bytes_written);
+	fprintf(fp, "stats.nodes=%ju\n", (uintmax_t)stats.cs_nodes);
+	fprintf(fp, "stats.bufs=%ju\n", (uintmax_t)stats.cs_bufs);
+	fprintf(fp, "stats.bytes_allocated=%ju\n", (uintmax_t)stats.cs_bytes_allocated);
+	fprintf(fp, "stats.reallocs=%ju\n", (uintmax_t)stats.cs_reallocs);
+	fprintf(fp, "stats.max_depth=%u\n", stats.cs_max_depth);
+	error = getrusage(RUSAGE_SELF, &ru);
+	if (error != 0)
+		err(1, "getrusage");
+	fprintf(fp, "stats.max_rss_kb=%ld\n", ru.ru_maxrss);
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Watch the file for changes, printing out variables that changed.  We watch
+ * the parent directory instead of the file itself, because the usual way to
+ * modify the file (including 'confctl -w' without '-I') is to replace it
+ * with rename(2), and the watch would stay with the old inode.
+ */
 static void
-cv_print(struct confctl_var *cv, FILE *fp, const char *prefix, bool values_only)
+cc_watch(const char *path, struct confctl *filter)
 {
-	struct confctl_var *child;
-	char *newprefix, *name, *value;
-	int written;
+	struct confctl *cc;
+	struct snapshot old, new;
+	const struct inotify_event *ev;
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	char *dir, *file, *tmp;
+	ssize_t len;
+	char *p;
+	bool changed;
+	int fd, wd;
+
+	tmp = strdup(path);
+	if (tmp == NULL)
+		err(1, "strdup");
+	dir = strdup(dirname(tmp));
+	if (dir == NULL)
+		err(1, "strdup");
+	free(tmp);
+	tmp = strdup(path);
+	if (tmp == NULL)
+		err(1, "strdup");
+	file = strdup(basename(tmp));
+	if (file == NULL)
+		err(1, "strdup");
+	free(tmp);
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0)
+		err(1, "inotify_init1");
+	wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0)
+		err(1, "cannot watch %s", dir);
 
-	if (cv_marked(cv))
-		return;
+	/*
+	 * Start with an empty snapshot, so that the initial contents get printed out.
+	 */
+	memset(&old, 0, sizeof(old));
+	changed = true;
+
+	for (;;) {
+		if (changed) {
+			cc = cc_new();
+			confctl_set_read_only(cc, true);
+			confctl_load(cc, path);
+			if (filter != NULL)
+				cc_filter(cc, filter);
+			cc_snapshot(cc, &new);
+			confctl_delete(cc);
+
+			snapshot_diff(&old, &new, stdout);
+			if (fflush(stdout) != 0)
+				err(1, "fflush");
+			snapshot_delete(&old);
+			old = new;
+		}
 
-	if (confctl_var_has_children(cv)) {
-		name = cv_safe_name(cv);
-		if (prefix != NULL)
-			written = asprintf(&newprefix, "%s.%s", prefix, name);
-		else
-			written = asprintf(&newprefix, "%s", name);
-		free(name);
-		if (written < 0)
-			err(1, "asprintf");
-		for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child))
-			cv_print(child, fp, newprefix, values_only);
-		free(newprefix);
-	} else if (confctl_var_has_value(cv)) {
-		value = cv_safe_value(cv);
-		if (values_only) {
-			fprintf(fp, "%s\n", value);
-		} else {
-			name = cv_safe_name(cv);
-			if (prefix != NULL)
-				fprintf(fp, "%s.%s=%s\n", prefix, name, value);
-			else
-				fprintf(fp, "%s=%s\n", name, value);
-			free(name);
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0)
+			err(1, "read");
+
+		changed = false;
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				changed = true;
+				continue;
+			}
+			if (ev->len == 0 || strcmp(ev->name, file) != 0)
+				continue;
+			changed = true;
 		}
-		free(value);
 	}
 }
-
-void
-cc_print(struct confctl *cc, FILE *fp, bool values_only)
+#else /* !HAVE_SYS_INOTIFY_H */
+static void
+cc_watch(const char *path, struct confctl *filter)
 {
-	struct confctl_var *cv, *child;
 
-	cv = confctl_root(cc);
-	for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child))
-		cv_print(child, fp, NULL, values_only);
+	errx(1, "-W is not supported on this system");
 }
+#endif /* !HAVE_SYS_INOTIFY_H */
+
+/*
+ * Long options that don't have short equivalents.
+ */
+enum {
+	OPT_INDEX = CHAR_MAX + 1,
+	OPT_STREAM,
+};
+
+static const struct option longopts[] = {
+	{ "index",	no_argument,	NULL,	OPT_INDEX },
+	{ "stream",	no_argument,	NULL,	OPT_STREAM },
+	{ NULL,		0,		NULL,	0 }
+};
 
 int
 main(int argc, char **argv)
 {
-	int ch, i;
-	bool aflag = false, Cflag = false, Eflag = false, Iflag = false, Sflag = false, nflag = false;
-	struct confctl *cc, *line, *merge = NULL, *remove = NULL, *filter = NULL;
+	int ch, i, nw = 0, nx = 0;
+	bool aflag = false, Wflag = false, nflag = false, indexflag = false;
+	bool streamflag = false;
+	bool merge, remove;
+	struct confctl *cc, **ccs, *line, *filter = NULL;
+	struct confctl_frozen *cf;
+	struct edits edits;
+	const char *value = NULL;
+	char *end, **wlines, **xlines;
+	bool *hidden = NULL;
 
 	if (argc <= 1)
 		usage();
 
-	while ((ch = getopt(argc, argv, "aCEISnw:x:")) != -1) {
+	wlines = calloc(argc, sizeof(*wlines));
+	xlines = calloc(argc, sizeof(*xlines));
+	if (wlines == NULL || xlines == NULL)
+		err(1, "calloc");
+
+	while ((ch = getopt_long(argc, argv, "aCEFIRSTj:nWv:w:x:", longopts, NULL)) != -1) {
 		switch (ch) {
+		case OPT_INDEX:
+			indexflag = true;
+			break;
+		case OPT_STREAM:
+			streamflag = true;
+			break;
 		case 'a':
 			aflag = true;
 			break;
@@ -360,22 +581,40 @@ main(int argc, char **argv)
 		case 'E':
 			Eflag = true;
 			break;
+		case 'F':
+			Fflag = true;
+			break;
 		case 'I':
 			Iflag = true;
 			break;
+		case 'R':
+			Rflag = true;
+			break;
 		case 'S':
 			Sflag = true;
 			break;
+		case 'T':
+			Tflag = true;
+			break;
+		case 'j':
+			threads = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || threads == 0)
+				errx(1, "invalid number of threads: %s", optarg);
+			break;
 		case 'n':
 			nflag = true;
 			break;
+		case 'W':
+			Wflag = true;
+			break;
+		case 'v':
+			value = optarg;
+			break;
 		case 'w':
-			line = confctl_from_line(optarg);
-			cc_merge(&merge, line);
+			wlines[nw++] = optarg;
 			break;
 		case 'x':
-			line = confctl_from_line(optarg);
-			cc_merge(&remove, line);
+			xlines[nx++] = optarg;
 			break;
 		case '?':
 		default:
@@ -384,13 +623,11 @@ main(int argc, char **argv)
 	}
 	argc -= optind;
 	argv += optind;
+	merge = nw > 0;
+	remove = nx > 0;
 
 	if (argc < 1)
 		errx(1, "missing config file path");
-	if (merge && argc > 1)
-		errx(1, "-w and variable names are mutually exclusive");
-	if (remove && argc > 1)
-		errx(1, "-x and variable names are mutually exclusive");
 	if (aflag && merge)
 		errx(1, "-a and -w are mutually exclusive");
 	if (aflag && remove)
@@ -401,40 +638,117 @@ main(int argc, char **argv)
 		errx(1, "-n and -x are mutually exclusive");
 	if (aflag && argc > 1)
 		errx(1, "-a and variable names are mutually exclusive");
-	if (!aflag && !merge && !remove && argc == 1)
-		errx(1, "neither -a, -w, -x, or variable names specified");
+	if (Wflag && (aflag || nflag))
+		errx(1, "-W and -a or -n are mutually exclusive");
+	if (Wflag && (merge || remove))
+		errx(1, "-W and -w or -x are mutually exclusive");
+	if (Rflag && (merge || remove))
+		errx(1, "-R and -w or -x are mutually exclusive");
+	if (Wflag && Tflag)
+		errx(1, "-W and -T are mutually exclusive");
+	if ((merge || remove) && Tflag && argc > 1)
+		errx(1, "-T and multiple config files are mutually exclusive");
+	if (value && (aflag || nflag || Wflag || merge || remove))
+		errx(1, "-v and -a, -n, -W, -w, or -x are mutually exclusive");
+	if (value && argc > 1)
+		errx(1, "-v and variable names are mutually exclusive");
+	if (indexflag && (aflag || nflag || Rflag || Wflag || merge || remove || value))
+		errx(1, "--index and -a, -n, -R, -W, -w, -x, or -v are mutually exclusive");
+	if (indexflag && argc > 1)
+		errx(1, "--index and variable names are mutually exclusive");
+	if (streamflag && !merge && !remove)
+		errx(1, "--stream requires -w or -x");
+	if (streamflag && argc > 1)
+		errx(1, "--stream and multiple config files are mutually exclusive");
+	if (!aflag && !merge && !remove && !Wflag && !value && !indexflag && argc == 1)
+		errx(1, "neither -a, -w, -x, -W, -v, --index, or variable names specified");
+
+	if (Wflag) {
+		for (i = 1; i < argc; i++) {
+			line = confctl_from_line(argv[i]);
+			cc_merge_filter(&filter, line);
+		}
+		cc_watch(argv[0], filter);
+		/* NOTREACHED */
+	}
 
-	cc = confctl_new();
-	confctl_set_equals_sign(cc, Eflag);
-	confctl_set_rewrite_in_place(cc, Iflag);
-	confctl_set_semicolon(cc, Sflag);
-	confctl_set_slash_slash_comments(cc, Cflag);
-	confctl_set_slash_star_comments(cc, Cflag);
-	confctl_load(cc, argv[0]);
-	if (merge == NULL && remove == NULL) {
+	cc = NULL;
+	if (streamflag) {
+		/*
+		 * Falls back to loading the file, below, when the options
+		 * need the whole of it.
+		 */
+		cc = cc_new();
+		if (cc_stream_edit(cc, argv[0], cc_from_lines(wlines, nw),
+		    cc_from_lines(xlines, nx)) != 0)
+			cc = NULL;
+	}
+
+	if (cc != NULL) {
+		/*
+		 * Already done.
+		 */
+	} else if (merge || remove) {
+		/*
+		 * With -w or -x, all the arguments are config files.
+		 */
+		ccs = calloc(argc, sizeof(*ccs));
+		if (ccs == NULL)
+			err(1, "calloc");
+		for (i = 0; i < argc; i++)
+			ccs[i] = cc_new();
+		confctl_load_many(ccs, argv, argc);
+		edits.e_wlines = wlines;
+		edits.e_nw = nw;
+		edits.e_xlines = xlines;
+		edits.e_nx = nx;
+		for (i = 0; i < argc; i++) {
+			confctl_set_replay(ccs[i], cc_edit, &edits);
+			cc_edit(ccs[i], &edits);
+		}
+		confctl_save_many(ccs, argv, argc);
+		cc = ccs[0];
+	} else if (value != NULL) {
+		cc = cc_new();
+		confctl_set_read_only(cc, true);
+		confctl_load(cc, argv[0]);
+		cc_find(cc, value, stdout);
+	} else if (indexflag) {
+		cc = cc_load(argv[0]);
+		confctl_save_index(cc, argv[0]);
+	} else {
+		/*
+		 * With an index, only the parts of the file that can match
+		 * get loaded.
+		 */
+		cc = cc_new();
+		confctl_set_read_only(cc, true);
 		if (!aflag) {
 			for (i = 1; i < argc; i++) {
 				line = confctl_from_line(argv[i]);
-				cc_merge(&filter, line);
+				cc_merge_filter(&filter, line);
 			}
-			cc_filter(cc, filter);
 		}
-		cc_print(cc, stdout, nflag);
-	} else {
+		if (aflag || confctl_load_indexed(cc, argv[0], filter) != 0)
+			confctl_load(cc, argv[0]);
+
 		/*
-		 * We're not using cv_filter() mechanism,
-		 * because we really want to remove the nodes here,
-		 * so that we can e.g. replace them by using -x
-		 * and -w together.  Also, cv_filter() works
-		 * the other way around, exposing selected nodes
-		 * and hiding all the rest; we would need to 'invert'
-		 * the filter somehow.
+		 * The tree is not going to change anymore, so freeze it;
+		 * filtering and printing are faster that way.
 		 */
-		if (remove != NULL)
-			cc_remove(cc, remove);
-		if (merge != NULL)
-			cc_merge(&cc, merge);
-		confctl_save(cc, argv[0]);
+		cf = confctl_freeze(cc);
+		if (!aflag) {
+			confctl_stats_begin(cc, CONFCTL_PHASE_FILTER);
+			hidden = cf_filter(cf, filter);
+			confctl_stats_end(cc, CONFCTL_PHASE_FILTER);
+		}
+		cf_print(cf, hidden, stdout, nflag, threads);
+	}
+
+	if (Tflag) {
+		if (fflush(stdout) != 0)
+			err(1, "fflush");
+		cc_print_stats(cc, stderr);
 	}
 
 	/*
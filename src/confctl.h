@@ -26,8 +26,19 @@
 #ifndef CONFCTL_H
 #define	CONFCTL_H
 
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/*
+ * The library is built with symbols hidden by default; this is its API.
+ */
+#ifdef __GNUC__
+#pragma GCC visibility push(default)
+#endif
+
 /*
  * 'struct confctl' represents the whole configuration tree.
  */
@@ -54,6 +65,46 @@ void			confctl_set_semicolon(struct confctl *cc, bool semicolon);
 void			confctl_set_slash_slash_comments(struct confctl *cc, bool slash);
 void			confctl_set_slash_star_comments(struct confctl *cc, bool star);
 
+/*
+ * Lossless mode is the default.  Turning it off, before loading, makes
+ * the parser skip comments and whitespace instead of keeping them, which
+ * makes loading faster and the tree smaller, but also makes it impossible
+ * to save it.
+ */
+void			confctl_set_lossless(struct confctl *cc, bool lossless);
+
+/*
+ * Trees loaded read-only, or not losslessly, can't be saved, nor have
+ * their offset index written, but loading them is cheaper: the file
+ * isn't read again to get the hash of its contents.  Defaults to false.
+ */
+void			confctl_set_read_only(struct confctl *cc, bool read_only);
+
+/*
+ * Number of threads used to load and write the file.  Zero, the default,
+ * means as many as there are CPUs, but only for large files and trees;
+ * anything else makes it always use that many.
+ */
+void			confctl_set_threads(struct confctl *cc, unsigned int threads);
+
+/*
+ * Following include directives, like 'include "file";' or '.include
+ * "dir/[a-z]*";'; disabled by default.  When enabled before loading,
+ * variables named "include" or ".include" - or, with equals sign syntax,
+ * ones whose name starts with either, followed by whitespace - are taken
+ * to refer to a file, or a glob(3) pattern, relative to the directory
+ * of the file they are in.  Variables from those files show up right
+ * after the directive.  Saving the tree writes the ones that changed
+ * back to the files they came from, leaving the directives as they were;
+ * after deleting a directive, the file is not saved anymore, but its
+ * variables stay in the tree until it's loaded again.  Files included
+ * at the same depth are loaded in parallel, and each one is parsed only
+ * once, even if included many times, or by several of the files loaded
+ * with confctl_load_many().  Trees with included files can't be saved
+ * in a group.
+ */
+void			confctl_set_follow_includes(struct confctl *cc, bool follow);
+
 /*
  * Loading, writing and retrieving the root.
  */
@@ -61,6 +112,58 @@ void			confctl_load(struct confctl *cc, const char *path);
 void			confctl_save(struct confctl *cc, const char *path);
 struct confctl_var	*confctl_root(struct confctl *cc);
 
+/*
+ * Saving a file that changed since it was loaded, e.g. by another process
+ * editing it at the same time, makes it get loaded again; 'replay' is then
+ * called to redo the changes on the fresh tree, and saving is retried.
+ * Without 'replay', saving such a file is an error.
+ */
+void			confctl_set_replay(struct confctl *cc,
+			    void (*replay)(struct confctl *cc, void *arg), void *arg);
+
+/*
+ * Same as calling confctl_load() or confctl_save() for each of the 'n'
+ * handles, but where io_uring(7) is available, the system calls for all
+ * the files get submitted in batches instead of one by one.  Without it,
+ * confctl_save_many() saves the files as a single group; see below.
+ */
+void			confctl_load_many(struct confctl **ccs, char *const *paths, size_t n);
+void			confctl_save_many(struct confctl **ccs, char *const *paths, size_t n);
+
+/*
+ * Saving several files durably, for roughly the cost of one: the files
+ * added to the group get written out when it's committed, synced together,
+ * and then renamed into place; each distinct parent directory gets synced
+ * once, at the end.  Committing the group also frees it;
+ * confctl_save_group_delete() frees it without saving anything.
+ */
+struct confctl_save_group;
+
+struct confctl_save_group	*confctl_save_group_begin(void);
+void			confctl_save_group_add(struct confctl_save_group *csg,
+			    struct confctl *cc, const char *path);
+void			confctl_save_group_commit(struct confctl_save_group *csg);
+void			confctl_save_group_delete(struct confctl_save_group *csg);
+
+/*
+ * Offset index, for large files that get queried much more often than
+ * changed.  confctl_save_index() writes it next to the file, as 'path'
+ * with ".idx" appended, using a tree that was just loaded from 'path'.
+ * It maps variables with children, and top-level ones, to where they are
+ * in the file.  confctl_load_indexed() uses it to load just the parts
+ * of the file where variables matching 'filter' can be, along with their
+ * parents; 'filter' is a tree of names, like the ones confctl_from_line()
+ * makes, and names containing '*', '?' or '[' are patterns.  The tree
+ * loaded that way can't be saved.  It returns -1, leaving the tree as it
+ * was, if there is no index, or the file changed since it was written,
+ * or the filter starts with a pattern, or includes are to be followed;
+ * the caller should use confctl_load() then.  Saving the file removes
+ * the index.
+ */
+void			confctl_save_index(struct confctl *cc, const char *path);
+int			confctl_load_indexed(struct confctl *cc, const char *path,
+			    struct confctl *filter);
+
 /*
  * Routines to manipulate individual nodes.
  */
@@ -70,12 +173,174 @@ const char		*confctl_var_value(struct confctl_var *cv);
 void			confctl_var_set_value(struct confctl_var *cv, const char *value);
 bool			confctl_var_has_children(const struct confctl_var *cv);
 bool			confctl_var_has_value(const struct confctl_var *cv);
+struct confctl_var	*confctl_var_parent(struct confctl_var *cv);
 struct confctl_var	*confctl_var_first_child(struct confctl_var *parent);
 struct confctl_var	*confctl_var_next(struct confctl_var *cv);
 struct confctl_var	*confctl_var_new(struct confctl_var *parent, const char *name);
 void			confctl_var_delete(struct confctl_var *cv);
 void			confctl_var_move(struct confctl_var *cv, struct confctl_var *new_parent);
 
+/*
+ * Typed views of the value.  confctl_var_value_unquoted() returns it with
+ * quotes and backslash escapes removed, the way the parser reads them,
+ * and its length in 'lenp'; it's not NUL-terminated, as it usually points
+ * into the value itself, and it's valid until the value changes.  The rest
+ * convert the unquoted value to a number, decimal or hexadecimal with "0x",
+ * to a boolean - "yes", "true", "on", "1", "no", "false", "off" or "0", in
+ * any case - or to an IPv4 or IPv6 address, optionally followed by '/' and
+ * the prefix length.  They return -1, setting errno to EINVAL, or ERANGE
+ * for numbers that don't fit, if the variable has no value or it can't be
+ * converted.  Results, failures included, are computed once and kept in
+ * the variable until confctl_var_set_value(); as they modify it, they must
+ * not be called for the same tree from several threads at the same time.
+ */
+struct confctl_inet {
+	int			cia_family;	/* AF_INET or AF_INET6. */
+	struct in_addr		cia_addr4;
+	struct in6_addr		cia_addr6;
+	int			cia_prefixlen;	/* -1 if not given. */
+};
+
+const char		*confctl_var_value_unquoted(struct confctl_var *cv,
+			    size_t *lenp);
+int			confctl_var_value_int64(struct confctl_var *cv,
+			    int64_t *valp);
+int			confctl_var_value_bool(struct confctl_var *cv,
+			    bool *valp);
+int			confctl_var_value_inet(struct confctl_var *cv,
+			    struct confctl_inet *cia);
+
+/*
+ * Elements of list values, like "10.1.1.1, 10.1.1.2".  confctl_list_first()
+ * returns the first element of the value of 'cv', and confctl_list_next()
+ * the ones after it, or NULL when there are no more; elements are separated
+ * by runs of any of the characters in 'separators', except within quotes
+ * or after a backslash.  Elements are returned as they are in the value,
+ * quotes included, with their length in 'lenp'; they point into the value,
+ * so they are not NUL-terminated, and they are valid until it changes.
+ * confctl_list_set() replaces the element returned last with 'element',
+ * leaving the rest of the value as it was; iteration continues after it.
+ * confctl_list_append() adds 'element' at the end of the value, after
+ * 'separator', unless the value is empty.  Neither quotes the element.
+ */
+struct confctl_list {
+	struct confctl_var	*cl_var;
+	const char		*cl_separators;
+	size_t			cl_start;
+	size_t			cl_len;
+	size_t			cl_next;
+};
+
+const char		*confctl_list_first(struct confctl_list *cl,
+			    struct confctl_var *cv, const char *separators,
+			    size_t *lenp);
+const char		*confctl_list_next(struct confctl_list *cl, size_t *lenp);
+void			confctl_list_set(struct confctl_list *cl,
+			    const char *element);
+void			confctl_list_append(struct confctl_var *cv,
+			    const char *separator, const char *element);
+
+/*
+ * Change notifications.  confctl_set_observer() makes the callbacks
+ * in 'co' get called, with 'ctx', whenever a variable is added by
+ * confctl_var_new() or confctl_var_append(), or along with its children
+ * by confctl_var_append_tree(), deleted, along with its children, moved,
+ * or gets a new name or value; callbacks left NULL are not called, and
+ * a NULL 'co' removes the observer.  Changes are reported as soon as they
+ * are made, except deletion, which is reported just before.  Between
+ * confctl_batch_begin() and confctl_batch_end(), which can be nested,
+ * reports are held back until the outermost confctl_batch_end(), and each
+ * changed variable is reported once, in the order they were first changed:
+ * one that was added is reported as added, one that was deleted as deleted,
+ * unless it was added in the same batch, and the rest with every kind of
+ * change that happened to them; changes to variables that later got deleted
+ * along with their parent are not reported.  Deleted variables are freed
+ * after they are reported, so the callbacks can still look at them.
+ * Callbacks must not change the tree, and a batch must not be open when
+ * loading into it.  Loading doesn't report anything.  When saving finds
+ * the file changed, and loads it again (see confctl_set_replay()), changes
+ * held back by an open batch are reported first, then the old top-level
+ * variables as deleted and the new ones as added, and then the replayed
+ * changes, as usual.
+ */
+struct confctl_observer {
+	void	(*co_new)(void *ctx, struct confctl_var *cv);
+	void	(*co_delete)(void *ctx, struct confctl_var *cv);
+	void	(*co_move)(void *ctx, struct confctl_var *cv);
+	void	(*co_set_name)(void *ctx, struct confctl_var *cv);
+	void	(*co_set_value)(void *ctx, struct confctl_var *cv);
+};
+
+void			confctl_set_observer(struct confctl *cc,
+			    const struct confctl_observer *co, void *ctx);
+void			confctl_batch_begin(struct confctl *cc);
+void			confctl_batch_end(struct confctl *cc);
+
+/*
+ * Building trees in bulk.  confctl_var_append() adds 'n' variables
+ * to 'parent', named 'names[i]', with values 'values[i]'; a NULL value,
+ * or NULL 'values', makes a variable without value, to add children to.
+ * confctl_var_append_tree() adds a copy of 'tree', along with everything
+ * below it, or, if 'tree' is a root, copies of its children.  Both return
+ * the first variable added.  The result is the same as adding variables
+ * one by one, using confctl_var_new() and confctl_var_set_value(), with
+ * the formatting of the original tree not being copied, but it's much
+ * cheaper.
+ */
+struct confctl_var	*confctl_var_append(struct confctl_var *parent,
+			    const char *const *names, const char *const *values, size_t n);
+struct confctl_var	*confctl_var_append_tree(struct confctl_var *parent,
+			    struct confctl_var *tree);
+
+/*
+ * Finding children by name.  The first one returns the first child of 'parent'
+ * named 'name', the second one returns the next sibling with the same name as
+ * 'cv'.  For variables with many children, these use a hash table, built on
+ * first lookup and then kept up to date.
+ */
+struct confctl_var	*confctl_var_find_child(struct confctl_var *parent, const char *name);
+struct confctl_var	*confctl_var_find_next_child(struct confctl_var *cv);
+
+/*
+ * Reverse lookups, i.e. finding variables by value.  These use an index,
+ * which gets built the first time it's needed, or when explicitly enabled
+ * using confctl_set_value_index(), and then kept up to date when variables
+ * are changed, added, moved or deleted.  Prefix lookups return variables
+ * sorted by value; changing any value while iterating over them with
+ * confctl_find_next_by_value_prefix() is not allowed.
+ */
+void			confctl_set_value_index(struct confctl *cc, bool index);
+struct confctl_var	*confctl_find_by_value(struct confctl *cc, const char *value);
+struct confctl_var	*confctl_find_next_by_value(struct confctl_var *cv);
+struct confctl_var	*confctl_find_by_value_prefix(struct confctl *cc, const char *prefix);
+struct confctl_var	*confctl_find_next_by_value_prefix(struct confctl *cc, struct confctl_var *cv, const char *prefix);
+
+/*
+ * Frozen trees.  confctl_freeze() makes a compact, read-only copy of the
+ * tree, laid out for fast traversal.  Nodes are referred to by indices;
+ * they are numbered in preorder, with the root being 0, so walking over
+ * all of them is just iterating from 0 to confctl_frozen_len() - 1, and
+ * skipping a node along with its children means adding the subtree size.
+ * Routines that return indices return CONFCTL_FROZEN_NONE if there is
+ * no such node.  Names and values are NUL-terminated; their lengths are
+ * returned via 'lenp', unless it's NULL.  Changes to the tree made after
+ * freezing it are not reflected in the copy.
+ */
+#define	CONFCTL_FROZEN_NONE	((size_t)-1)
+
+struct confctl_frozen;
+
+struct confctl_frozen	*confctl_freeze(struct confctl *cc);
+void			confctl_frozen_delete(struct confctl_frozen *cf);
+size_t			confctl_frozen_len(const struct confctl_frozen *cf);
+const char		*confctl_frozen_name(const struct confctl_frozen *cf, size_t i, size_t *lenp);
+const char		*confctl_frozen_value(const struct confctl_frozen *cf, size_t i, size_t *lenp);
+bool			confctl_frozen_has_children(const struct confctl_frozen *cf, size_t i);
+size_t			confctl_frozen_parent(const struct confctl_frozen *cf, size_t i);
+size_t			confctl_frozen_first_child(const struct confctl_frozen *cf, size_t i);
+size_t			confctl_frozen_next(const struct confctl_frozen *cf, size_t i);
+size_t			confctl_frozen_subtree_size(const struct confctl_frozen *cf, size_t i);
+
 /*
  * Say you have something like this: 'on whatever { some more stuff }'.  In this case,
  * parser will mark the 'on' node as implicit.  What this means is when you delete
@@ -90,9 +355,152 @@ bool			confctl_var_is_implicit_container(struct confctl_var *cv);
 void			*confctl_var_uptr(struct confctl_var *cv);
 void			confctl_var_set_uptr(struct confctl_var *cv, void *uptr);
 
+/*
+ * Statistics, to find out where the time goes.  Collecting them is disabled
+ * by default, and costs nothing in that case.  Phases can nest; for example,
+ * time spent in CONFCTL_PHASE_REINDENT is also included in CONFCTL_PHASE_WRITE.
+ * Library measures loading and saving; other phases are to be measured
+ * by the caller, using confctl_stats_begin() and confctl_stats_end().
+ * Number of nodes, buffers and maximum depth are computed when calling
+ * confctl_get_stats().
+ * Allocation counters only count allocations done for this handle's tree
+ * while collecting statistics is enabled.
+ */
+enum confctl_phase {
+	CONFCTL_PHASE_LOAD,
+	CONFCTL_PHASE_FREEZE,
+	CONFCTL_PHASE_FILTER,
+	CONFCTL_PHASE_MERGE,
+	CONFCTL_PHASE_REMOVE,
+	CONFCTL_PHASE_REINDENT,
+	CONFCTL_PHASE_WRITE,
+	CONFCTL_PHASE_FSYNC,
+	CONFCTL_PHASE_RENAME,
+	CONFCTL_PHASE_MAX
+};
+
+struct confctl_stats {
+	uint64_t	cs_wall_ns[CONFCTL_PHASE_MAX];
+	uint64_t	cs_cpu_ns[CONFCTL_PHASE_MAX];
+	uint64_t	cs_bytes_read;
+	uint64_t	cs_bytes_written;
+	uint64_t	cs_nodes;
+	uint64_t	cs_bufs;
+	uint64_t	cs_bytes_allocated;
+	uint64_t	cs_reallocs;
+	unsigned int	cs_max_depth;
+};
+
+void			confctl_set_stats(struct confctl *cc, bool stats);
+void			confctl_stats_begin(struct confctl *cc, enum confctl_phase phase);
+void			confctl_stats_end(struct confctl *cc, enum confctl_phase phase);
+void			confctl_get_stats(struct confctl *cc, struct confctl_stats *stats);
+const char		*confctl_phase_name(enum confctl_phase phase);
+
 /*
  * Additional utility routines.
  */
 struct confctl		*confctl_from_line(const char *line);
 
+/*
+ * Errors.  Routines above that fail, e.g. because the file cannot be read
+ * or doesn't parse, print a message and exit.  Long-running programs, which
+ * can't afford that, should use the ones below instead.  On failure, they
+ * return -1, and leave the tree as it was before the call; the details
+ * are kept in the handle, and '*errorp', unless NULL, is set to point
+ * to them, until the next call that uses the handle.  Saving in place
+ * might leave the file partially written.  confctl_from_line2() returns
+ * NULL on failure, and fills in 'error' instead.
+ *
+ * Running out of memory is the exception: like everywhere else in the library,
+ * a failed malloc(3) or realloc(3) prints a message and exits, even in these
+ * routines.  Every buffer and variable gets allocated through routines that
+ * can't fail, and most of the editing API has no way to report an error,
+ * so undoing a half-built tree after a failed allocation deep in the parser
+ * can't be done reliably.  Programs that need to survive that should limit
+ * the memory available to the process, or run the risky operation in a child.
+ */
+enum confctl_error_code {
+	CONFCTL_ERROR_NONE,
+	CONFCTL_ERROR_SYSTEM,		/* System call failed; see ce_errno. */
+	CONFCTL_ERROR_SYNTAX,		/* Invalid syntax; see ce_line and ce_offset. */
+	CONFCTL_ERROR_LOSSY,		/* Tree loaded in lossy mode, or partially, can't be saved. */
+	CONFCTL_ERROR_CHANGED,		/* File changed since it was loaded. */
+	CONFCTL_ERROR_UNSUPPORTED,	/* Can't be done that way; load the file instead. */
+};
+
+#define	CONFCTL_ERROR_MESSAGE_MAX	1024
+
+struct confctl_error {
+	enum confctl_error_code	ce_code;
+	int			ce_errno;
+	uint64_t		ce_offset;
+	size_t			ce_line;
+	char			ce_message[CONFCTL_ERROR_MESSAGE_MAX];
+};
+
+int			confctl_load2(struct confctl *cc, const char *path,
+			    const struct confctl_error **errorp);
+int			confctl_save2(struct confctl *cc, const char *path,
+			    const struct confctl_error **errorp);
+int			confctl_save_index2(struct confctl *cc, const char *path,
+			    const struct confctl_error **errorp);
+struct confctl		*confctl_from_line2(const char *line, struct confctl_error *error);
+
+/*
+ * The same for several files.  A failure isn't always about a single one
+ * of them, so the details are copied to every handle, and '*errorp' points
+ * to the ones in the first.  The files loaded or saved before the failure
+ * stay that way; for saving, the message lists them.  On failure, temporary
+ * files get removed, and committing still frees the group.  A group
+ * that confctl_save_group_add2() failed to add to stays as it was.
+ */
+int			confctl_load_many2(struct confctl **ccs, char *const *paths,
+			    size_t n, const struct confctl_error **errorp);
+int			confctl_save_many2(struct confctl **ccs, char *const *paths,
+			    size_t n, const struct confctl_error **errorp);
+int			confctl_save_group_add2(struct confctl_save_group *csg,
+			    struct confctl *cc, const char *path,
+			    const struct confctl_error **errorp);
+int			confctl_save_group_commit2(struct confctl_save_group *csg,
+			    const struct confctl_error **errorp);
+
+/*
+ * Editing files too large to load, with memory use that doesn't depend
+ * on their size, just on how deeply the variables nest.  The file is read
+ * a variable at a time, at least twice: first just to see what changes,
+ * so that new variables can be formatted like the ones around them, and
+ * then to write the result to a temporary file, which replaces the original.
+ * cso_begin() gets called at the start of each pass, with 'writing' false
+ * for the ones before the last.  cso_enter() gets called for every variable,
+ * after its parent; by then, the whole chain below an implicit container
+ * is there.  It may set the value of a variable with no children; returning
+ * false removes the variable, along with its children.  Variables with no
+ * value, and the root, at the end, also get cso_leave(), after their
+ * children; it may add new ones, with confctl_var_append_tree(), or set
+ * the value, if there are none.  Only the parents of the variable, and some
+ * of the siblings, are in memory at that point; nothing else may be touched.
+ * The changes made in the last pass must be the same as in the one before.
+ * For changes that depend on what comes later in the file, cso_settled(),
+ * unless NULL, gets called after each pass that doesn't write; returning
+ * false repeats it.  The passes start over if the file changes in
+ * the meantime.  The result is the same as if the file was loaded, changed
+ * the same way and saved.  Following includes and rewriting in place are
+ * not supported; confctl_stream() fails with CONFCTL_ERROR_UNSUPPORTED then.
+ */
+struct confctl_stream_ops {
+	void	(*cso_begin)(void *arg, bool writing);
+	bool	(*cso_enter)(void *arg, struct confctl_var *cv);
+	void	(*cso_leave)(void *arg, struct confctl_var *cv);
+	bool	(*cso_settled)(void *arg);
+};
+
+int			confctl_stream(struct confctl *cc, const char *path,
+			    const struct confctl_stream_ops *ops, void *arg,
+			    const struct confctl_error **errorp);
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
 #endif /* !CONFCTL_H */
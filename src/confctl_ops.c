@@ -0,0 +1,998 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the operations on whole trees used by confctl(1):
+ * merging, removal, filtering and printing, and streaming versions
+ * of the first two.  They are implemented on top
+ * of the libconfctl api, and use the user pointer to mark nodes, which
+ * makes them unsuitable for the library itself.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define	_GNU_SOURCE
+#include <assert.h>
+#include <err.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vis.h"
+
+#include "confctl.h"
+#include "confctl_ops.h"
+#include "confctl_parallel.h"
+
+/*
+ * This is used for two purposes - first, when selecting variables to display
+ * (e.g. 'confctl path some.variable some.other.variable'), we mark nodes
+ * that should be hidden instead of removing them; this is just a performance
+ * optimisation.  Second, when merging, we mark nodes that were already merged.
+ * Filter nodes also remember whether they were named in full, in a separate
+ * bit.
+ */
+#define	CV_MARKED	0x1
+#define	CV_WHOLE	0x2
+
+static void
+cv_set_flag(struct confctl_var *cv, uintptr_t flag, bool v)
+{
+	uintptr_t flags;
+
+	flags = (uintptr_t)confctl_var_uptr(cv);
+	if (v)
+		flags |= flag;
+	else
+		flags &= ~flag;
+	confctl_var_set_uptr(cv, (void *)flags);
+}
+
+bool
+cv_marked(struct confctl_var *cv)
+{
+
+	if (((uintptr_t)confctl_var_uptr(cv) & CV_MARKED) != 0)
+		return (true);
+	return (false);
+}
+
+void
+cv_mark(struct confctl_var *cv, bool v)
+{
+
+	cv_set_flag(cv, CV_MARKED, v);
+}
+
+static bool
+cv_whole(struct confctl_var *cv)
+{
+
+	if (((uintptr_t)confctl_var_uptr(cv) & CV_WHOLE) != 0)
+		return (true);
+	return (false);
+}
+
+static void
+cv_merge_existing(struct confctl_var *cv, struct confctl_var *newcv)
+{
+	struct confctl_var *child, *newchild, *next, *newnext;
+
+	if (strcmp(confctl_var_name(cv), confctl_var_name(newcv)) != 0)
+		return;
+
+	if (confctl_var_has_value(newcv)) {
+		if (confctl_var_has_children(cv))
+			errx(1, "cannot replace container node with leaf node");
+		confctl_var_set_value(cv, confctl_var_value(newcv));
+		/*
+		 * Mark the node as done, so that we won't try
+		 * to add it in cv_merge_new().
+		 */
+		cv_mark(newcv, true);
+		return;
+	}
+
+	/*
+	 * For every new child, merge it into every existing child
+	 * with the same name.
+	 */
+	newchild = confctl_var_first_child(newcv);
+	while (newchild != NULL) {
+		newnext = confctl_var_next(newchild);
+
+		child = confctl_var_find_child(cv, confctl_var_name(newchild));
+		while (child != NULL) {
+			next = confctl_var_find_next_child(child);
+			cv_merge_existing(child, newchild);
+			child = next;
+		}
+
+		newchild = newnext;
+	}
+}
+
+static void
+cv_merge_new(struct confctl_var *cv, struct confctl_var *newcv)
+{
+	struct confctl_var *child, *newchild, *newnext;
+
+	if (cv_marked(newcv))
+		return;
+
+	if (strcmp(confctl_var_name(cv), confctl_var_name(newcv)) != 0)
+		return;
+
+	/*
+	 * For every new child, merge it into the first existing child
+	 * with the same name, or, if there is none, move it over.
+	 * Children already handled by cv_merge_existing() are skipped.
+	 */
+	newchild = confctl_var_first_child(newcv);
+	while (newchild != NULL) {
+		newnext = confctl_var_next(newchild);
+
+		if (!cv_marked(newchild)) {
+			child = confctl_var_find_child(cv, confctl_var_name(newchild));
+			if (child != NULL && cv_whole(newchild))
+				cv_set_flag(child, CV_WHOLE, true);
+			if (child != NULL)
+				cv_merge_new(child, newchild);
+			else
+				confctl_var_move(newchild, cv);
+		}
+
+		newchild = newnext;
+	}
+}
+
+void
+cc_merge(struct confctl **cc, struct confctl *merge)
+{
+	struct confctl_var *root, *mergeroot;
+
+	if (*cc == NULL)
+		*cc = confctl_new();
+
+	root = confctl_root(*cc);
+	mergeroot = confctl_root(merge);
+
+	/*
+	 * Reason for doing it in two steps is that we need
+	 * to correctly handle duplicate nodes, such as this:
+	 * "1 { foo } 2 { bar } 1 { baz }".  In this case,
+	 * when merging '1.baz', we want to update the existing
+	 * node, not add a new sibling to "foo".
+	 */
+	cv_merge_existing(root, mergeroot);
+	cv_merge_new(root, mergeroot);
+}
+
+/*
+ * Same as cc_merge(), for filters.  The variable named by 'line' matches
+ * everything below it, even if another line adds children to it, e.g.
+ * 'a' along with 'a.b'.
+ */
+void
+cc_merge_filter(struct confctl **filter, struct confctl *line)
+{
+	struct confctl_var *cv, *child;
+
+	cv = confctl_root(line);
+	while ((child = confctl_var_first_child(cv)) != NULL)
+		cv = child;
+	cv_set_flag(cv, CV_WHOLE, true);
+
+	cc_merge(filter, line);
+}
+
+/*
+ * Returns true if 'cv' got deleted.
+ */
+static bool
+cv_remove(struct confctl_var *cv, struct confctl_var *remove)
+{
+	struct confctl_var *child, *removechild, *next;
+
+	if (confctl_var_value(remove) != NULL)
+		errx(1, "variable to remove must not specify a value");
+
+	if (strcmp(confctl_var_name(remove), confctl_var_name(cv)) != 0)
+		return (false);
+
+	if (confctl_var_first_child(remove) == NULL) {
+		confctl_var_delete(cv);
+		return (true);
+	}
+
+	for (removechild = confctl_var_first_child(remove); removechild != NULL; removechild = confctl_var_next(removechild)) {
+		child = confctl_var_find_child(cv, confctl_var_name(removechild));
+		while (child != NULL) {
+			next = confctl_var_find_next_child(child);
+			cv_remove(child, removechild);
+			child = next;
+		}
+	}
+
+	if (confctl_var_is_implicit_container(cv) && confctl_var_first_child(cv) == NULL) {
+		confctl_var_delete(cv);
+		return (true);
+	}
+
+	return (false);
+}
+
+void
+cc_remove(struct confctl *cc, struct confctl *remove)
+{
+
+	cv_remove(confctl_root(cc), confctl_root(remove));
+}
+
+/*
+ * Streaming counterparts of cc_remove() and cc_merge(), for files too large
+ * to load.  For every block being read, there's the node of each tree
+ * matching it, if any.  Blocks on the path cv_merge_new() would take are
+ * "first"; these get the new variables added at the end.  A new variable
+ * gets added unless it's marked, or was already found in that block; which
+ * ones get marked is only known at the end of the file, so the first pass
+ * is repeated if it added something that got marked later on.  Errors wait
+ * until the end of a pass, for removal to be reported first, like it would
+ * be with the whole tree loaded.
+ */
+struct stream_level {
+	struct confctl_var	*sl_merge;
+	struct confctl_var	*sl_remove;
+	struct confctl_var	*sl_set;	/* Value, if no children. */
+	bool			sl_first;
+};
+
+struct stream_edit {
+	struct confctl		*se_merge;
+	struct confctl		*se_remove;
+	struct stream_level	*se_levels;
+	size_t			se_depth;
+	size_t			se_allocated;
+	struct confctl_var	**se_found;	/* In their "first" block. */
+	size_t			se_nfound;
+	struct confctl_var	**se_added;
+	size_t			se_nadded;
+	size_t			se_nnodes;	/* In the tree to merge. */
+	bool			se_writing;
+	bool			se_repeat;
+	bool			se_remove_failed;
+	bool			se_merge_failed;
+};
+
+static size_t
+cv_unmark_tree(struct confctl_var *cv)
+{
+	struct confctl_var *child;
+	size_t nodes = 1;
+
+	cv_mark(cv, false);
+	for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child))
+		nodes += cv_unmark_tree(child);
+
+	return (nodes);
+}
+
+static bool
+stream_found(struct stream_edit *se, struct confctl_var *newcv)
+{
+	size_t i;
+
+	for (i = 0; i < se->se_nfound; i++) {
+		if (se->se_found[i] == newcv)
+			return (true);
+	}
+	return (false);
+}
+
+static void
+stream_push(struct stream_edit *se, struct confctl_var *merge,
+    struct confctl_var *remove, bool first)
+{
+	struct stream_level *sl;
+
+	if (se->se_depth == se->se_allocated) {
+		se->se_allocated = se->se_allocated * 2 + 16;
+		se->se_levels = reallocarray(se->se_levels, se->se_allocated,
+		    sizeof(*se->se_levels));
+		if (se->se_levels == NULL)
+			err(1, "reallocarray");
+	}
+	sl = &se->se_levels[se->se_depth++];
+	sl->sl_merge = merge;
+	sl->sl_remove = remove;
+	sl->sl_set = NULL;
+	if (merge != NULL && confctl_var_has_value(merge))
+		sl->sl_set = merge;
+	sl->sl_first = first;
+}
+
+/*
+ * Adds the new variables, as cv_merge_new() would.
+ */
+static void
+stream_add(struct stream_edit *se, struct confctl_var *cv, struct confctl_var *newcv)
+{
+	struct confctl_var *newchild;
+
+	for (newchild = confctl_var_first_child(newcv); newchild != NULL; newchild = confctl_var_next(newchild)) {
+		if (cv_marked(newchild) || stream_found(se, newchild))
+			continue;
+		confctl_var_append_tree(cv, newchild);
+		if (!se->se_writing)
+			se->se_added[se->se_nadded++] = newchild;
+	}
+}
+
+/*
+ * Returns true if 'cv' is to be removed, along with the rest of the chain,
+ * if it's an implicit container, like cv_remove() would.
+ */
+static bool
+stream_removed(struct stream_edit *se, struct confctl_var *cv, struct confctl_var *remove)
+{
+
+	for (;;) {
+		if (confctl_var_value(remove) != NULL) {
+			se->se_remove_failed = true;
+			return (false);
+		}
+		if (confctl_var_first_child(remove) == NULL)
+			return (true);
+		if (!confctl_var_is_implicit_container(cv))
+			return (false);
+		cv = confctl_var_first_child(cv);
+		remove = confctl_var_find_child(remove, confctl_var_name(cv));
+		if (remove == NULL)
+			return (false);
+	}
+}
+
+static void
+stream_edit_begin(void *arg, bool writing)
+{
+	struct stream_edit *se = arg;
+
+	/*
+	 * Marks are kept when repeating the first pass; it's what
+	 * it's repeated for.
+	 */
+	if (!writing && !se->se_repeat && se->se_merge != NULL)
+		se->se_nnodes = cv_unmark_tree(confctl_root(se->se_merge));
+	if (se->se_found == NULL) {
+		se->se_found = calloc(se->se_nnodes + 1, sizeof(*se->se_found));
+		se->se_added = calloc(se->se_nnodes + 1, sizeof(*se->se_added));
+		if (se->se_found == NULL || se->se_added == NULL)
+			err(1, "calloc");
+	}
+	se->se_writing = writing;
+	se->se_repeat = false;
+	se->se_nfound = 0;
+	se->se_nadded = 0;
+	se->se_remove_failed = false;
+	se->se_merge_failed = false;
+	se->se_depth = 0;
+	stream_push(se, se->se_merge != NULL ? confctl_root(se->se_merge) : NULL,
+	    se->se_remove != NULL ? confctl_root(se->se_remove) : NULL, true);
+}
+
+static bool
+stream_edit_enter(void *arg, struct confctl_var *cv)
+{
+	struct stream_edit *se = arg;
+	struct stream_level *sl;
+	struct confctl_var *merge = NULL, *remove = NULL;
+	bool first = false;
+
+	sl = &se->se_levels[se->se_depth - 1];
+	if (sl->sl_remove != NULL)
+		remove = confctl_var_find_child(sl->sl_remove, confctl_var_name(cv));
+	if (remove != NULL && stream_removed(se, cv, remove))
+		return (false);
+
+	if (sl->sl_merge != NULL)
+		merge = confctl_var_find_child(sl->sl_merge, confctl_var_name(cv));
+	if (merge != NULL && sl->sl_first && !stream_found(se, merge)) {
+		se->se_found[se->se_nfound++] = merge;
+		first = true;
+	}
+
+	if (confctl_var_has_value(cv)) {
+		if (merge != NULL && confctl_var_has_value(merge)) {
+			confctl_var_set_value(cv, confctl_var_value(merge));
+			cv_mark(merge, true);
+		}
+		if (first && se->se_writing)
+			stream_add(se, cv, merge);
+		return (true);
+	}
+
+	stream_push(se, merge, remove, first);
+	return (true);
+}
+
+static void
+stream_edit_leave(void *arg, struct confctl_var *cv)
+{
+	struct stream_edit *se = arg;
+	struct stream_level *sl;
+
+	sl = &se->se_levels[--se->se_depth];
+	if (sl->sl_set != NULL) {
+		if (confctl_var_has_children(cv)) {
+			se->se_merge_failed = true;
+		} else {
+			confctl_var_set_value(cv, confctl_var_value(sl->sl_set));
+			cv_mark(sl->sl_set, true);
+		}
+	}
+	if (sl->sl_first && sl->sl_merge != NULL && !cv_marked(sl->sl_merge))
+		stream_add(se, cv, sl->sl_merge);
+}
+
+static bool
+stream_edit_settled(void *arg)
+{
+	struct stream_edit *se = arg;
+	size_t i;
+
+	for (i = 0; i < se->se_nadded; i++) {
+		if (cv_marked(se->se_added[i])) {
+			se->se_repeat = true;
+			return (false);
+		}
+	}
+
+	if (se->se_remove_failed)
+		errx(1, "variable to remove must not specify a value");
+	if (se->se_merge_failed)
+		errx(1, "cannot replace container node with leaf node");
+
+	return (true);
+}
+
+static const struct confctl_stream_ops stream_edit_ops = {
+	.cso_begin = stream_edit_begin,
+	.cso_enter = stream_edit_enter,
+	.cso_leave = stream_edit_leave,
+	.cso_settled = stream_edit_settled,
+};
+
+/*
+ * Returns -1 if the file needs to be loaded instead.
+ */
+int
+cc_stream_edit(struct confctl *cc, const char *path, struct confctl *merge,
+    struct confctl *remove)
+{
+	struct stream_edit se;
+	const struct confctl_error *ce;
+	int error;
+
+	memset(&se, 0, sizeof(se));
+	se.se_merge = merge;
+	se.se_remove = remove;
+	error = confctl_stream(cc, path, &stream_edit_ops, &se, &ce);
+	free(se.se_levels);
+	free(se.se_found);
+	free(se.se_added);
+	if (error != 0 && ce->ce_code != CONFCTL_ERROR_UNSUPPORTED)
+		errx(1, "%s", ce->ce_message);
+
+	return (error);
+}
+
+/*
+ * Filtering is done by treating the filter tree, created by merging all
+ * the variable names to display, as a nondeterministic automaton, and
+ * matching all of them during a single walk over the configuration tree.
+ * Each state is a filter node whose name matched the node being visited;
+ * its children are to be matched against the children of that node.
+ * Filter node names can be shell-style patterns; additionally, the "**"
+ * pattern matches any number of path components, including zero.
+ */
+struct filter_states {
+	struct confctl_var	**fs_states;
+	size_t			fs_len;
+	size_t			fs_allocated;
+	bool			fs_accepting;
+};
+
+static bool
+filter_is_any(struct confctl_var *filter)
+{
+
+	if (strcmp(confctl_var_name(filter), "**") == 0)
+		return (true);
+	return (false);
+}
+
+static bool
+filter_is_pattern(struct confctl_var *filter)
+{
+
+	if (strpbrk(confctl_var_name(filter), "*?[") != NULL)
+		return (true);
+	return (false);
+}
+
+static bool
+filter_matches(struct confctl_var *filter, const char *name)
+{
+
+	if (fnmatch(confctl_var_name(filter), name, 0) == 0)
+		return (true);
+	return (false);
+}
+
+static void
+filter_states_add(struct filter_states *fs, struct confctl_var *filter)
+{
+	size_t i;
+
+	for (i = 0; i < fs->fs_len; i++) {
+		if (fs->fs_states[i] == filter)
+			return;
+	}
+
+	if (fs->fs_len >= fs->fs_allocated) {
+		if (fs->fs_allocated == 0)
+			fs->fs_allocated = 4;
+		else
+			fs->fs_allocated *= 2;
+		fs->fs_states = realloc(fs->fs_states, fs->fs_allocated * sizeof(*fs->fs_states));
+		if (fs->fs_states == NULL)
+			err(1, "realloc");
+	}
+
+	fs->fs_states[fs->fs_len] = filter;
+	fs->fs_len++;
+
+	/*
+	 * Filter without children matches everything below.
+	 */
+	if (confctl_var_first_child(filter) == NULL || cv_whole(filter))
+		fs->fs_accepting = true;
+}
+
+/*
+ * Compute the set of states after matching a node named 'name'.  Filter
+ * nodes are marked by filter_check() if they have any children that are
+ * patterns; otherwise there is no need to look at children other than
+ * the ones named the same way.
+ */
+static void
+filter_states_step(struct filter_states *fs, struct confctl_var *filter, const char *name)
+{
+	struct confctl_var *filterchild;
+
+	for (filterchild = confctl_var_find_child(filter, name); filterchild != NULL; filterchild = confctl_var_find_next_child(filterchild)) {
+		if (!filter_is_pattern(filterchild))
+			filter_states_add(fs, filterchild);
+	}
+
+	if (filter_is_any(filter))
+		filter_states_add(fs, filter);
+
+	if (!cv_marked(filter))
+		return;
+
+	for (filterchild = confctl_var_first_child(filter); filterchild != NULL; filterchild = confctl_var_next(filterchild)) {
+		if (!filter_is_pattern(filterchild))
+			continue;
+		if (filter_is_any(filterchild)) {
+			/*
+			 * The "**" either matches this path component,
+			 * and possibly more of them, or none at all.
+			 */
+			filter_states_add(fs, filterchild);
+			filter_states_step(fs, filterchild, name);
+		} else if (filter_matches(filterchild, name)) {
+			filter_states_add(fs, filterchild);
+		}
+	}
+}
+
+static void
+cv_filter(struct confctl_var *cv, const struct filter_states *fs)
+{
+	struct confctl_var *child;
+	struct filter_states newfs;
+	size_t i;
+
+	memset(&newfs, 0, sizeof(newfs));
+
+	for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child)) {
+		newfs.fs_len = 0;
+		newfs.fs_accepting = false;
+		for (i = 0; i < fs->fs_len; i++)
+			filter_states_step(&newfs, fs->fs_states[i], confctl_var_name(child));
+
+		/*
+		 * Variables with values are only shown when they match
+		 * the whole filter, not just a part of it.
+		 */
+		if (newfs.fs_len == 0 || (!newfs.fs_accepting && !confctl_var_has_children(child))) {
+			cv_mark(child, true);
+			continue;
+		}
+		cv_mark(child, false);
+		if (!newfs.fs_accepting)
+			cv_filter(child, &newfs);
+	}
+
+	free(newfs.fs_states);
+}
+
+static void
+filter_check(struct confctl_var *filter)
+{
+	struct confctl_var *filterchild;
+
+	if (confctl_var_value(filter) != NULL)
+		errx(1, "filter must not specify a value");
+
+	cv_mark(filter, false);
+	for (filterchild = confctl_var_first_child(filter); filterchild != NULL; filterchild = confctl_var_next(filterchild)) {
+		if (filter_is_pattern(filterchild))
+			cv_mark(filter, true);
+		filter_check(filterchild);
+	}
+}
+
+void
+cc_filter(struct confctl *cc, struct confctl *filter)
+{
+	struct filter_states fs;
+
+	filter_check(confctl_root(filter));
+
+	memset(&fs, 0, sizeof(fs));
+	filter_states_add(&fs, confctl_root(filter));
+	cv_filter(confctl_root(cc), &fs);
+	free(fs.fs_states);
+}
+
+/*
+ * Same as cv_filter(), except that it sets 'hidden' for the node index
+ * instead of marking it.
+ */
+static void
+cf_filter_node(const struct confctl_frozen *cf, size_t i, const struct filter_states *fs, bool *hidden)
+{
+	struct filter_states newfs;
+	size_t child, j;
+
+	memset(&newfs, 0, sizeof(newfs));
+
+	for (child = confctl_frozen_first_child(cf, i); child != CONFCTL_FROZEN_NONE; child = confctl_frozen_next(cf, child)) {
+		newfs.fs_len = 0;
+		newfs.fs_accepting = false;
+		for (j = 0; j < fs->fs_len; j++)
+			filter_states_step(&newfs, fs->fs_states[j], confctl_frozen_name(cf, child, NULL));
+
+		if (newfs.fs_len == 0 || (!newfs.fs_accepting && !confctl_frozen_has_children(cf, child))) {
+			hidden[child] = true;
+			continue;
+		}
+		if (!newfs.fs_accepting)
+			cf_filter_node(cf, child, &newfs, hidden);
+	}
+
+	free(newfs.fs_states);
+}
+
+bool *
+cf_filter(const struct confctl_frozen *cf, struct confctl *filter)
+{
+	struct filter_states fs;
+	bool *hidden;
+
+	hidden = calloc(confctl_frozen_len(cf), sizeof(*hidden));
+	if (hidden == NULL)
+		err(1, "calloc");
+
+	filter_check(confctl_root(filter));
+
+	memset(&fs, 0, sizeof(fs));
+	filter_states_add(&fs, confctl_root(filter));
+	cf_filter_node(cf, 0, &fs, hidden);
+	free(fs.fs_states);
+
+	return (hidden);
+}
+
+/*
+ * Same as strvisx(3), except it returns size_t, as names and values
+ * can be longer than INT_MAX.  The encoding of the last character
+ * depends on what follows it, which is passed in 'next'.
+ */
+static size_t
+safe_encode(char *dst, const char *src, size_t len, char next)
+{
+	char *start;
+	size_t i;
+
+	for (start = dst, i = 0; i < len; i++)
+		dst = vis(dst, src[i], VIS_NL | VIS_CSTYLE, i + 1 < len ? src[i + 1] : next);
+	*dst = '\0';
+
+	return (dst - start);
+}
+
+static char *
+safe_string(const char *str, size_t len)
+{
+	char *dst;
+
+	dst = malloc(len * 4 + 1);
+	if (dst == NULL)
+		err(1, "malloc");
+	safe_encode(dst, str, len, '\0');
+
+	return (dst);
+}
+
+/*
+ * How much of a string print_safe() encodes at a time.
+ */
+#define	SAFE_CHUNK	4096
+
+/*
+ * Prints out the string encoded the same way as safe_string(), without
+ * allocating four times its length, which matters for huge values.
+ * The string must be NUL-terminated.
+ */
+void
+print_safe(const char *str, size_t len, FILE *fp)
+{
+	char buf[SAFE_CHUNK * 4 + 1];
+	size_t i, chunk, encoded;
+
+	for (i = 0; i < len; i += chunk) {
+		chunk = len - i < SAFE_CHUNK ? len - i : SAFE_CHUNK;
+		encoded = safe_encode(buf, str + i, chunk, str[i + chunk]);
+		fwrite(buf, 1, encoded, fp);
+	}
+}
+
+char *
+cv_safe_name(struct confctl_var *cv)
+{
+	const char *name;
+
+	name = confctl_var_name(cv);
+	return (safe_string(name, strlen(name)));
+}
+
+char *
+cv_safe_value(struct confctl_var *cv)
+{
+	const char *value;
+
+	value = confctl_var_value(cv);
+	return (safe_string(value, strlen(value)));
+}
+
+static void
+cv_print(struct confctl_var *cv, FILE *fp, const char *prefix, bool values_only)
+{
+	struct confctl_var *child;
+	char *newprefix, *name;
+	const char *value;
+	int written;
+
+	if (cv_marked(cv))
+		return;
+
+	if (confctl_var_has_children(cv)) {
+		name = cv_safe_name(cv);
+		if (prefix != NULL)
+			written = asprintf(&newprefix, "%s.%s", prefix, name);
+		else
+			written = asprintf(&newprefix, "%s", name);
+		free(name);
+		if (written < 0)
+			err(1, "asprintf");
+		for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child))
+			cv_print(child, fp, newprefix, values_only);
+		free(newprefix);
+	} else if (confctl_var_has_value(cv)) {
+		if (!values_only) {
+			name = cv_safe_name(cv);
+			if (prefix != NULL)
+				fprintf(fp, "%s.%s=", prefix, name);
+			else
+				fprintf(fp, "%s=", name);
+			free(name);
+		}
+		value = confctl_var_value(cv);
+		print_safe(value, strlen(value), fp);
+		fputc('\n', fp);
+	}
+}
+
+void
+cc_print(struct confctl *cc, FILE *fp, bool values_only)
+{
+	struct confctl_var *cv, *child;
+
+	cv = confctl_root(cc);
+	for (child = confctl_var_first_child(cv); child != NULL; child = confctl_var_next(child))
+		cv_print(child, fp, NULL, values_only);
+}
+
+/*
+ * Prints frozen tree nodes from 'first' up to, but not including, 'last';
+ * they must be top-level nodes, or start at the top-level one and end at
+ * the end of the tree.  Nodes are visited in index order, skipping the hidden
+ * ones along with their children.  Since the nodes are in preorder,
+ * the prefix of the parent is always at the beginning of 'prefix', and its
+ * length is remembered in 'prefix_len', which is shared between threads;
+ * each of them only touches entries for nodes it prints.
+ */
+static void
+cf_print_range(const struct confctl_frozen *cf, const bool *hidden, size_t *prefix_len,
+    size_t first, size_t last, FILE *fp, bool values_only)
+{
+	size_t i, parent, prefix_allocated = 0, name_len, value_len;
+	const char *name, *value;
+	char *prefix = NULL;
+
+	i = first;
+	while (i < last) {
+		if (hidden != NULL && hidden[i]) {
+			i += confctl_frozen_subtree_size(cf, i);
+			continue;
+		}
+
+		parent = confctl_frozen_parent(cf, i);
+		name = confctl_frozen_name(cf, i, &name_len);
+		value = confctl_frozen_value(cf, i, &value_len);
+
+		if (confctl_frozen_has_children(cf, i)) {
+			if (prefix_len[parent] + name_len * 4 + 2 > prefix_allocated) {
+				prefix_allocated = (prefix_len[parent] + name_len * 4 + 2) * 2;
+				prefix = realloc(prefix, prefix_allocated);
+				if (prefix == NULL)
+					err(1, "realloc");
+			}
+			prefix_len[i] = prefix_len[parent];
+			if (parent != 0)
+				prefix[prefix_len[i]++] = '.';
+			prefix_len[i] += safe_encode(prefix + prefix_len[i], name, name_len, '\0');
+		} else if (value != NULL) {
+			if (!values_only) {
+				if (parent != 0) {
+					fwrite(prefix, 1, prefix_len[parent], fp);
+					fputc('.', fp);
+				}
+				print_safe(name, name_len, fp);
+				fputc('=', fp);
+			}
+			print_safe(value, value_len, fp);
+			fputc('\n', fp);
+		}
+		i++;
+	}
+
+	free(prefix);
+}
+
+/*
+ * Top-level nodes of a frozen tree, split into tasks to print in parallel.
+ * Task 'i' consists of nodes from pt_first[i], up to, but not including,
+ * pt_first[i + 1].
+ */
+struct print_tasks {
+	const struct confctl_frozen	*pt_cf;
+	const bool			*pt_hidden;
+	size_t				*pt_prefix_len;
+	size_t				*pt_first;
+	size_t				pt_len;
+	bool				pt_values_only;
+};
+
+static void
+print_task(void *arg, size_t i, FILE *fp)
+{
+	struct print_tasks *pt;
+	size_t last;
+
+	pt = arg;
+	if (i + 1 < pt->pt_len)
+		last = pt->pt_first[i + 1];
+	else
+		last = confctl_frozen_len(pt->pt_cf);
+
+	cf_print_range(pt->pt_cf, pt->pt_hidden, pt->pt_prefix_len,
+	    pt->pt_first[i], last, fp, pt->pt_values_only);
+}
+
+/*
+ * Same as cc_print(), but for frozen trees.  Large trees get printed
+ * in parallel, using 'threads' threads; zero means to decide automatically,
+ * based on the size of the tree and the number of CPUs.
+ */
+void
+cf_print(const struct confctl_frozen *cf, const bool *hidden, FILE *fp, bool values_only, unsigned int threads)
+{
+	struct print_tasks pt;
+	size_t i, len, target, sum;
+
+	len = confctl_frozen_len(cf);
+	pt.pt_prefix_len = calloc(len, sizeof(*pt.pt_prefix_len));
+	if (pt.pt_prefix_len == NULL)
+		err(1, "calloc");
+
+	if (threads == 0) {
+		if (len >= PARALLEL_MIN_NODES)
+			threads = parallel_ncpus();
+		else
+			threads = 1;
+	}
+
+	if (threads <= 1) {
+		cf_print_range(cf, hidden, pt.pt_prefix_len, 1, len, fp, values_only);
+		free(pt.pt_prefix_len);
+		return;
+	}
+
+	pt.pt_cf = cf;
+	pt.pt_hidden = hidden;
+	pt.pt_values_only = values_only;
+	pt.pt_first = calloc(len, sizeof(*pt.pt_first));
+	if (pt.pt_first == NULL)
+		err(1, "calloc");
+	pt.pt_len = 0;
+	target = len / (threads * PARALLEL_TASKS_PER_THREAD) + 1;
+	sum = target;
+	for (i = confctl_frozen_first_child(cf, 0); i != CONFCTL_FROZEN_NONE; i = confctl_frozen_next(cf, i)) {
+		if (sum >= target) {
+			pt.pt_first[pt.pt_len] = i;
+			pt.pt_len++;
+			sum = 0;
+		}
+		sum += confctl_frozen_subtree_size(cf, i);
+	}
+
+	if (pt.pt_len > 0) {
+		if (fflush(fp) != 0)
+			err(1, "fflush");
+		parallel_write(fileno(fp), threads, pt.pt_len, print_task, &pt);
+	}
+
+	free(pt.pt_first);
+	free(pt.pt_prefix_len);
+}
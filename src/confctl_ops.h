@@ -0,0 +1,46 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef CONFCTL_OPS_H
+#define	CONFCTL_OPS_H
+
+bool	cv_marked(struct confctl_var *cv);
+void	cv_mark(struct confctl_var *cv, bool v);
+char	*cv_safe_name(struct confctl_var *cv);
+char	*cv_safe_value(struct confctl_var *cv);
+void	print_safe(const char *str, size_t len, FILE *fp);
+
+void	cc_merge(struct confctl **cc, struct confctl *merge);
+void	cc_merge_filter(struct confctl **filter, struct confctl *line);
+void	cc_remove(struct confctl *cc, struct confctl *remove);
+int	cc_stream_edit(struct confctl *cc, const char *path,
+	    struct confctl *merge, struct confctl *remove);
+void	cc_filter(struct confctl *cc, struct confctl *filter);
+void	cc_print(struct confctl *cc, FILE *fp, bool values_only);
+
+bool	*cf_filter(const struct confctl_frozen *cf, struct confctl *filter);
+void	cf_print(const struct confctl_frozen *cf, const bool *hidden, FILE *fp, bool values_only, unsigned int threads);
+
+#endif /* !CONFCTL_OPS_H */
@@ -0,0 +1,238 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines for serializing parts of the tree
+ * in parallel.  It's used by both the library and confctl(1).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "confctl_parallel.h"
+
+#ifndef IOV_MAX
+#define	IOV_MAX	1024
+#endif
+
+struct parallel {
+	void			(*p_task)(void *arg, size_t i);
+	void			*p_arg;
+	size_t			p_ntasks;
+	size_t			p_next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		p_lock;
+#endif
+};
+
+struct parallel_output {
+	char	*po_buf;
+	size_t	po_len;
+};
+
+struct parallel_write {
+	void			(*pw_task)(void *arg, size_t i, FILE *fp);
+	void			*pw_arg;
+	struct parallel_output	*pw_outputs;
+};
+
+/*
+ * Threads take tasks in order, one at a time, until there are none left.
+ */
+static void *
+parallel_thread(void *arg)
+{
+	struct parallel *p;
+	size_t i;
+
+	p = arg;
+	for (;;) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&p->p_lock);
+#endif
+		i = p->p_next;
+		if (i < p->p_ntasks)
+			p->p_next++;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&p->p_lock);
+#endif
+		if (i >= p->p_ntasks)
+			break;
+		p->p_task(p->p_arg, i);
+	}
+
+	return (NULL);
+}
+
+void
+parallel_run(unsigned int nthreads, size_t ntasks,
+    void (*task)(void *arg, size_t i), void *arg)
+{
+	struct parallel p;
+#ifdef HAVE_PTHREAD_H
+	pthread_t *threads;
+	unsigned int t;
+	int error;
+#endif
+
+	p.p_task = task;
+	p.p_arg = arg;
+	p.p_ntasks = ntasks;
+	p.p_next = 0;
+
+#ifdef HAVE_PTHREAD_H
+	if (nthreads > ntasks)
+		nthreads = ntasks;
+	pthread_mutex_init(&p.p_lock, NULL);
+	threads = calloc(nthreads, sizeof(*threads));
+	if (threads == NULL)
+		err(1, "calloc");
+	/*
+	 * The calling thread does its share of the work, too.
+	 */
+	for (t = 1; t < nthreads; t++) {
+		error = pthread_create(&threads[t], NULL, parallel_thread, &p);
+		if (error != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+	parallel_thread(&p);
+	for (t = 1; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+	pthread_mutex_destroy(&p.p_lock);
+#else
+	parallel_thread(&p);
+#endif
+}
+
+static void
+parallel_write_task(void *arg, size_t i)
+{
+	struct parallel_write *pw;
+	struct parallel_output *po;
+	FILE *fp;
+
+	pw = arg;
+	po = &pw->pw_outputs[i];
+	fp = open_memstream(&po->po_buf, &po->po_len);
+	if (fp == NULL)
+		err(1, "open_memstream");
+	pw->pw_task(pw->pw_arg, i, fp);
+	if (fclose(fp) != 0)
+		err(1, "fclose");
+}
+
+static int
+parallel_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t written;
+
+	while (iovcnt > 0) {
+		written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return (0);
+}
+
+ssize_t
+parallel_write(int fd, unsigned int nthreads, size_t ntasks,
+    void (*task)(void *arg, size_t i, FILE *fp), void *arg)
+{
+	struct parallel_write pw;
+	struct iovec *iov;
+	size_t i, n;
+	ssize_t total = 0;
+
+	pw.pw_task = task;
+	pw.pw_arg = arg;
+	pw.pw_outputs = calloc(ntasks, sizeof(*pw.pw_outputs));
+	if (pw.pw_outputs == NULL)
+		err(1, "calloc");
+
+	parallel_run(nthreads, ntasks, parallel_write_task, &pw);
+
+	iov = calloc(ntasks, sizeof(*iov));
+	if (iov == NULL)
+		err(1, "calloc");
+	for (i = 0; i < ntasks; i++) {
+		iov[i].iov_base = pw.pw_outputs[i].po_buf;
+		iov[i].iov_len = pw.pw_outputs[i].po_len;
+		total += pw.pw_outputs[i].po_len;
+	}
+	for (i = 0; i < ntasks; i += n) {
+		n = ntasks - i;
+		if (n > IOV_MAX)
+			n = IOV_MAX;
+		if (total >= 0 && parallel_writev(fd, iov + i, n) != 0)
+			total = -1;
+	}
+	for (i = 0; i < ntasks; i++)
+		free(pw.pw_outputs[i].po_buf);
+	free(iov);
+	free(pw.pw_outputs);
+
+	return (total);
+}
+
+unsigned int
+parallel_ncpus(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return (1);
+	return (n);
+}
@@ -0,0 +1,65 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef CONFCTL_PARALLEL_H
+#define	CONFCTL_PARALLEL_H
+
+/*
+ * Trees with fewer nodes than this are serialized in a single thread,
+ * unless the number of threads was set explicitly.  Every thread gets
+ * PARALLEL_TASKS_PER_THREAD tasks, to even out differences in their sizes.
+ */
+#define	PARALLEL_MIN_NODES		65536
+#define	PARALLEL_TASKS_PER_THREAD	4
+
+/*
+ * Files smaller than this are parsed in a single thread, unless the number
+ * of threads was set explicitly.
+ */
+#define	PARALLEL_MIN_BYTES		(4 * 1024 * 1024)
+
+/*
+ * Runs 'task' for each of 'ntasks' tasks, using up to 'nthreads' threads,
+ * and waits for all of them to finish.
+ */
+void	parallel_run(unsigned int nthreads, size_t ntasks,
+	    void (*task)(void *arg, size_t i), void *arg);
+
+/*
+ * Runs 'task' for each of 'ntasks' tasks, using up to 'nthreads' threads.
+ * Every task writes its output into its own memory stream, 'fp'; after all
+ * of them are done, the outputs get written to 'fd', in order, with writev(2).
+ * Returns the number of bytes written, or -1, with errno set, if writing
+ * failed.
+ */
+ssize_t	parallel_write(int fd, unsigned int nthreads, size_t ntasks,
+	    void (*task)(void *arg, size_t i, FILE *fp), void *arg);
+
+/*
+ * Returns the number of threads to use by default.
+ */
+unsigned int	parallel_ncpus(void);
+
+#endif /* !CONFCTL_PARALLEL_H */
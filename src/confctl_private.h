@@ -26,6 +26,11 @@
 #ifndef CONFCTL_PRIVATE_H
 #define	CONFCTL_PRIVATE_H
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+
 #include "queue.h"
 
 struct buf {
@@ -39,7 +44,8 @@ struct buf {
  * name, it's value, subvalues (children), "junk text" (comments, whitespace,
  * newlines, curly brackets etc) stored in the configuration file before the
  * variable name (cv_before), between the name and value or child variables
- * (cv_middle), and after value or child variables (cv_after).
+ * (cv_middle), and after value or child variables (cv_after).  Things that
+ * only some of the variables need are kept in cv_ext, allocated on first use.
  */
 struct confctl_var {
 	TAILQ_ENTRY(confctl_var)	cv_next;
@@ -49,23 +55,323 @@ struct confctl_var {
 	struct buf			*cv_value;
 	struct buf			*cv_after;
 	struct confctl_var		*cv_parent;
+	struct confctl_var_ext		*cv_ext;
 	void				*cv_uptr;
 	bool				cv_implicit_container:1;
 	bool				cv_needs_reindent:1;
 	TAILQ_HEAD(confctl_var_head, confctl_var)	cv_children;
 };
 
+/*
+ * The root element points back to the 'struct confctl' it belongs to.
+ * Top-level variables of included files point to the file they came from
+ * (cx_include); the ones below them belong to the same file, unless they
+ * point elsewhere.  Typed views of the value are computed on demand and
+ * kept in cx_values.
+ */
+struct confctl_var_ext {
+	struct confctl			*cx_confctl;
+	struct confctl_varmap		*cx_names;	/* Children, by name. */
+	struct confctl_style		*cx_style;
+	struct confctl_include		*cx_include;
+	struct confctl_value_cache	*cx_values;
+	uint8_t				cx_events;	/* Pending in a batch. */
+};
+
+/*
+ * Field of cv_ext, or NULL (or zero) if there is none.
+ */
+#define	CV_EXT(cv, field)	((cv)->cv_ext != NULL ? (cv)->cv_ext->field : 0)
+
+/*
+ * Variables hashed by a string - their value or their name - with the ones
+ * having the same string kept in the order they were added, in a chain of
+ * entries.  Entries are numbered, and the free ones are chained through
+ * cme_next.  The entry for a given variable is found through cvm_slots,
+ * an open addressing hash table keyed by its address.  Used for the value
+ * index, and for finding children of variables that have many by name.
+ */
+#define	CONFCTL_VARMAP_NONE	((size_t)-1)
+
+struct confctl_varmap_entry {
+	struct confctl_var	*cme_var;	/* NULL if free. */
+	size_t			cme_prev;
+	size_t			cme_next;
+};
+
+struct confctl_varmap_bucket {
+	size_t	cmb_first;
+	size_t	cmb_last;
+};
+
+struct confctl_varmap {
+	struct confctl_varmap_entry	*cvm_entries;
+	size_t				cvm_allocated;	/* Entries ever used. */
+	size_t				cvm_entries_allocated;
+	size_t				cvm_free;
+	size_t				cvm_len;
+	struct confctl_varmap_bucket	*cvm_buckets;
+	size_t				cvm_nbuckets;
+	size_t				*cvm_slots;
+	size_t				cvm_nslots;
+	size_t				cvm_min;
+	bool				cvm_by_value;
+};
+
+/*
+ * Value index, mapping values to variables that have them.  It's a hash
+ * table, and an array of the same variables sorted by value, for prefix
+ * lookups.  The latter is rebuilt on demand after any change to the index;
+ * ci_ranks holds the positions in it, by entry number.
+ */
+struct confctl_index {
+	struct confctl_varmap	*ci_map;
+	struct confctl_var	**ci_sorted;
+	size_t			*ci_ranks;
+};
+
+/*
+ * How the children of a variable are formatted, so that new ones can be
+ * made to look the same.  It's computed from the children on first use
+ * while reindenting, and dropped whenever any of them changes.  Strings
+ * are NULL where there was nothing to learn from.
+ */
+struct confctl_style {
+	char		*st_indent;	/* Most common indentation. */
+	char		*st_step;	/* What st_indent adds to the parent's. */
+	char		*st_separator;	/* Most common cv_middle of values. */
+	char		*st_align;	/* If aligned, what follows the spaces. */
+	size_t		st_column;	/* If aligned, where st_align starts. */
+	char		*st_brace;	/* Most common cv_middle of containers. */
+	bool		st_semicolon;	/* Values mostly end with ';'. */
+	bool		st_brace_semicolon; /* Containers mostly end with '};'. */
+	bool		st_partial;	/* Some children weren't formatted yet. */
+	bool		st_own;		/* Learned beforehand; nothing inherited. */
+};
+
+/*
+ * How many children to learn the style from, and how many previous
+ * siblings to look at when a variable has nothing to learn from.
+ */
+#define	STYLE_SAMPLES		256
+#define	STYLE_SIBLINGS		4
+
+/*
+ * How many times to try saving a file that keeps getting changed
+ * by someone else in the meantime.
+ */
+#define	SAVE_ATTEMPTS	100
+
+/*
+ * Statistics, allocated when enabled with confctl_set_stats().
+ */
+struct confctl_stats_state {
+	struct confctl_stats	css_stats;
+	uint64_t		css_wall_started[CONFCTL_PHASE_MAX];
+	uint64_t		css_cpu_started[CONFCTL_PHASE_MAX];
+};
+
+/*
+ * Frozen copy of the tree.  Nodes are stored in preorder, with the root
+ * at index 0, so that the children of a node immediately follow it; each
+ * array holds a single field for all the nodes.  Names and values are
+ * copied, NUL-terminated, into cf_strings, and are referred to by offsets.
+ */
+struct confctl_frozen {
+	size_t	cf_len;
+	size_t	*cf_name;
+	size_t	*cf_name_len;
+	size_t	*cf_value;
+	size_t	*cf_value_len;
+	size_t	*cf_parent;
+	size_t	*cf_next;
+	size_t	*cf_size;
+	char	*cf_strings;
+	size_t	cf_strings_len;
+};
+
+/*
+ * Hash of the file contents, computed a word at a time; partial words
+ * are kept in ch_buf, so that the result doesn't depend on how the data
+ * is split between calls to confctl_hash_update().
+ */
+struct confctl_hash {
+	uint64_t	ch_hash;
+	uint64_t	ch_total;
+	unsigned char	ch_buf[8];
+	unsigned int	ch_buf_len;
+};
+
+/*
+ * What the file looked like when it was loaded, or last saved; used
+ * to detect changes made in the meantime by someone else.  The hash
+ * is only known for loaded files.
+ */
+struct confctl_identity {
+	char		*ci_path;
+	dev_t		ci_dev;
+	ino_t		ci_ino;
+	off_t		ci_size;
+	struct timespec	ci_mtime;
+	struct timespec	ci_ctime;
+	uint64_t	ci_hash;
+	bool		ci_hash_valid;
+};
+
+/*
+ * File included by an include directive, with its variables grafted into
+ * the tree after the directive, as its siblings.  Saving the tree writes
+ * them back to the file, between the junk that was around them; the file
+ * is only rewritten if that comes out different from what it was.  Once
+ * the directive is gone, the file is detached, and isn't saved anymore;
+ * its variables stay where they are, but don't get written anywhere.
+ */
+struct confctl_include {
+	TAILQ_ENTRY(confctl_include)	cin_next;
+	struct confctl_include		*cin_parent;	/* NULL if included by the main file. */
+	struct confctl_var		*cin_directive;
+	struct confctl_var		*cin_where;	/* Parent of the directive. */
+	struct confctl_identity		*cin_identity;
+	uint64_t			cin_hash;	/* Of the contents on disk. */
+	struct buf			*cin_before;
+	struct buf			*cin_middle;
+	struct buf			*cin_after;
+	bool				cin_detached;
+};
+
+/*
+ * Included files that were parsed already, so that a file included more
+ * than once, or by several of the files being loaded at the same time,
+ * only gets parsed once.  The trees in here are never modified, just copied.
+ */
+struct confctl_include_cache {
+	struct confctl	**cic_ccs;
+	size_t		cic_len;
+	size_t		cic_allocated;
+};
+
 /*
  * Root of the configuration tree.  Apart from being root, it also contains
  * variables that control configuration file syntax.
  */
 struct confctl {
 	struct confctl_var	*cc_root;
+	struct confctl_index	*cc_index;
+	struct confctl_stats_state	*cc_stats;
+	struct buf		*cc_junk;
+	struct confctl_identity	*cc_identity;
+	const uint16_t		*cc_lex;	/* Character classes. */
+	struct confctl_error	cc_error;	/* Why the last call failed. */
+	void			(*cc_replay)(struct confctl *cc, void *arg);
+	void			*cc_replay_arg;
+	TAILQ_HEAD(confctl_include_head, confctl_include)	cc_includes;
+	struct confctl_include_cache	*cc_include_cache; /* Shared while loading many. */
+	struct confctl_include	*cc_writing;	/* Included file being written. */
+	struct confctl_observer	cc_observer;
+	void			*cc_observer_ctx;
+	struct confctl_var	**cc_pending;	/* Changed during the batch. */
+	size_t			cc_pending_len;
+	size_t			cc_pending_allocated;
+	unsigned int		cc_batch;	/* Nesting depth. */
+	unsigned int		cc_threads;
+	bool			cc_lossy;
+	bool			cc_observed;
+	bool			cc_partial;	/* Loaded using the offset index. */
+	bool			cc_read_only;
 	bool			cc_equals_sign;
+	bool			cc_follow_includes;
 	bool			cc_rewrite_in_place;
 	bool			cc_semicolon;
 	bool			cc_slash_slash_comments;
 	bool			cc_slash_star_comments;
 };
 
+/*
+ * Files to be saved together by confctl_save_group_commit().
+ */
+struct confctl_save_group {
+	struct confctl	**csg_ccs;
+	char		**csg_paths;
+	size_t		csg_len;
+	size_t		csg_allocated;
+};
+
+/*
+ * Routines shared between the files implementing the library.  The ones
+ * returning int return -1 on failure, with the reason in 'cc->cc_error',
+ * or in 'ce'; confctl_error_exit() turns it into the usual err(3)-style
+ * message, for the callers that just exit.
+ */
+void	confctl_error_set(struct confctl_error *ce, enum confctl_error_code code,
+	    int errnum, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+void	confctl_error_exit(const struct confctl_error *ce) __attribute__((noreturn));
+int	confctl_parse(struct confctl *cc, FILE *fp, const char *path);
+int	confctl_parse_or_undo(struct confctl *cc, FILE *fp, const char *path);
+void	confctl_parse_begin(struct confctl *cc);
+struct confctl_var	*confctl_parse_var(struct confctl *cc,
+	    struct confctl_var *parent, FILE *fp, struct confctl_var **innerp);
+void	confctl_parse_locate_error(struct confctl *cc, FILE *fp, const char *path);
+void	confctl_var_reindent(struct confctl *cc, struct confctl_var *cv);
+struct confctl_style	*confctl_style_learn(struct confctl_var *parent);
+void	confctl_style_delete(struct confctl_style *st);
+int	confctl_write(struct confctl *cc, FILE *fp);
+int	confctl_sync_dirs(char *const *paths, size_t n, struct confctl_error *ce);
+void	confctl_error_saved(struct confctl_error *ce, char *const *paths,
+	    const bool *saved, size_t n);
+void	confctl_hash_init(struct confctl_hash *ch);
+void	confctl_hash_update(struct confctl_hash *ch, const void *buf, size_t len);
+uint64_t	confctl_hash_final(struct confctl_hash *ch);
+int	confctl_hash_file(struct confctl *cc, int fd, const char *path,
+	    uint64_t *hashp);
+void	confctl_set_identity(struct confctl *cc, const char *path,
+	    const struct stat *sb, const uint64_t *hash);
+int	confctl_replace(struct confctl *cc, const char *path,
+	    const char *tmppath, int tmpfd);
+int	confctl_reload(struct confctl *cc, const char *path);
+int	confctl_offsets_invalidate(struct confctl *cc, const char *path);
+struct buf	*confctl_buf_copy(const struct confctl *cc, const struct buf *b);
+void	confctl_buf_delete(struct buf *b);
+struct confctl_var	*confctl_var_clone(const struct confctl *cc,
+	    const struct confctl_var *tree);
+void	confctl_var_insert_after(struct confctl_var *prev, struct confctl_var *cv);
+struct confctl_include_cache	*confctl_include_cache_new(void);
+void	confctl_include_cache_delete(struct confctl_include_cache *cic);
+int	confctl_include_expand(struct confctl *cc, const char *path,
+	    const struct stat *sb, struct confctl_var *first);
+void	confctl_include_forget(struct confctl *cc, struct confctl_var *cv);
+void	confctl_include_delete(struct confctl_include *ci);
+void	confctl_value_cache_delete(struct confctl_value_cache *cvc);
+struct confctl_var_ext	*confctl_var_ext(struct confctl_var *cv);
+uint32_t	confctl_varmap_hash(const char *key);
+struct confctl_varmap	*confctl_varmap_new(bool by_value, size_t min);
+void	confctl_varmap_delete(struct confctl_varmap *cvm);
+void	confctl_varmap_insert(struct confctl_varmap *cvm, struct confctl_var *cv);
+void	confctl_varmap_insert_after(struct confctl_varmap *cvm,
+	    struct confctl_var *cv, struct confctl_var *prev);
+void	confctl_varmap_remove(struct confctl_varmap *cvm, struct confctl_var *cv);
+size_t	confctl_varmap_entry(const struct confctl_varmap *cvm,
+	    const struct confctl_var *cv);
+bool	confctl_varmap_contains(const struct confctl_varmap *cvm,
+	    const struct confctl_var *cv);
+struct confctl_var	*confctl_varmap_find(struct confctl_varmap *cvm,
+	    const char *key);
+struct confctl_var	*confctl_varmap_find_next(struct confctl_varmap *cvm,
+	    struct confctl_var *cv);
+/*
+ * Changes reported to the observer; see confctl_set_observer().
+ */
+#define	CONFCTL_EVENT_NEW	0x01
+#define	CONFCTL_EVENT_DELETE	0x02
+#define	CONFCTL_EVENT_MOVE	0x04
+#define	CONFCTL_EVENT_NAME	0x08
+#define	CONFCTL_EVENT_VALUE	0x10
+
+void	confctl_observe(struct confctl *cc, struct confctl_var *cv,
+	    unsigned int event);
+void	confctl_batch_discard(struct confctl *cc);
+void	confctl_observe_reload(struct confctl *cc, struct confctl *fresh);
+void	confctl_observe_replayed(struct confctl *cc, struct confctl *fresh);
+void	confctl_var_splice_value(struct confctl_var *cv, size_t off,
+	    size_t len, const char *str, size_t str_len);
+
 #endif /* !CONFCTL_PRIVATE_H */
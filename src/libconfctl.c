@@ -23,46 +23,154 @@
  * SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #define	_GNU_SOURCE
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <assert.h>
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "queue.h"
 
 #include "confctl.h"
+#include "confctl_parallel.h"
 #include "confctl_private.h"
 
+static struct confctl	*cv_confctl(struct confctl_var *cv);
+static void	names_insert(struct confctl_var *parent, struct confctl_var *cv);
+static void	style_invalidate(struct confctl_var *cv);
+
+/*
+ * Records why something failed.  Like err(3), appends the error message
+ * for 'errnum', unless it's zero.
+ */
+void
+confctl_error_set(struct confctl_error *ce, enum confctl_error_code code,
+    int errnum, const char *fmt, ...)
+{
+	va_list ap;
+	size_t len;
+
+	memset(ce, 0, offsetof(struct confctl_error, ce_message));
+	ce->ce_code = code;
+	ce->ce_errno = errnum;
+
+	va_start(ap, fmt);
+	vsnprintf(ce->ce_message, sizeof(ce->ce_message), fmt, ap);
+	va_end(ap);
+
+	if (errnum != 0) {
+		len = strlen(ce->ce_message);
+		snprintf(ce->ce_message + len, sizeof(ce->ce_message) - len,
+		    ": %s", strerror(errnum));
+	}
+}
+
+void
+confctl_error_exit(const struct confctl_error *ce)
+{
+
+	errx(1, "%s", ce->ce_message);
+}
+
+static void
+error_clear(struct confctl *cc)
+{
+
+	memset(&cc->cc_error, 0, offsetof(struct confctl_error, ce_message));
+	cc->cc_error.ce_message[0] = '\0';
+}
+
+/*
+ * Counts memory allocated for the tree, when statistics are enabled.
+ * Threads parsing parts of a file count into their own handles, which
+ * get added up afterwards.
+ */
+static void
+stats_allocated(const struct confctl *cc, size_t bytes, bool reallocated)
+{
+
+	if (cc == NULL || cc->cc_stats == NULL)
+		return;
+	cc->cc_stats->css_stats.cs_bytes_allocated += bytes;
+	if (reallocated)
+		cc->cc_stats->css_stats.cs_reallocs++;
+}
+
 static struct buf *
-buf_new(void)
+buf_new(const struct confctl *cc)
 {
 	struct buf *b;
 
 	b = calloc(sizeof(*b), 1);
 	if (b == NULL)
 		err(1, "malloc");
+	stats_allocated(cc, sizeof(*b), false);
 	return (b);
 }
 
+/*
+ * Buffers created from known contents have them allocated along with
+ * the buffer itself, in a single allocation, with no spare room; they
+ * only get a separate one if they need to grow.
+ */
+static bool
+buf_is_inline(const struct buf *b)
+{
+
+	return (b->b_buf == (const char *)(b + 1));
+}
+
+/*
+ * Buffers grow fourfold while small, to keep the number of reallocations
+ * down.  Past BUF_LARGE, they only grow by a quarter, so that a huge value
+ * doesn't end up with up to three times its size in unused space; realloc(3)
+ * of buffers that large remaps the pages instead of copying them.
+ */
+#define	BUF_LARGE	(1024 * 1024)
+
 static void
-buf_append(struct buf *b, char ch)
+buf_append(const struct confctl *cc, struct buf *b, char ch)
 {
+	size_t old;
+	char *p;
 
 	if (b->b_len + 1 >= b->b_allocated) {
+		old = b->b_allocated;
 		if (b->b_allocated == 0)
 			b->b_allocated = 16;
-		else
+		else if (b->b_allocated < BUF_LARGE)
 			b->b_allocated *= 4;
-		b->b_buf = realloc(b->b_buf, b->b_allocated);
-		if (b->b_buf == NULL)
-			err(1, "realloc");
+		else
+			b->b_allocated += b->b_allocated / 4;
+		if (buf_is_inline(b)) {
+			p = malloc(b->b_allocated);
+			if (p == NULL)
+				err(1, "malloc");
+			memcpy(p, b->b_buf, b->b_len);
+			b->b_buf = p;
+		} else {
+			b->b_buf = realloc(b->b_buf, b->b_allocated);
+			if (b->b_buf == NULL)
+				err(1, "realloc");
+		}
+		stats_allocated(cc, b->b_allocated - old, true);
 	}
 
 	b->b_buf[b->b_len] = ch;
@@ -70,17 +178,17 @@ buf_append(struct buf *b, char ch)
 }
 
 static void
-buf_finish(struct buf *b)
+buf_finish(const struct confctl *cc, struct buf *b)
 {
 
-	buf_append(b, '\0');
+	buf_append(cc, b, '\0');
 	b->b_len--;
 }
 
-static char
+static unsigned char
 buf_last(struct buf *b)
 {
-	char ch;
+	unsigned char ch;
 
 	assert(b->b_len >= 1);
 
@@ -97,31 +205,134 @@ buf_strip(struct buf *b)
 	b->b_len--;
 }
 
+/*
+ * Returns a new buffer containing 'first', followed by 'second'.
+ */
 static struct buf *
-buf_new_from_str(const char *str)
+buf_new_from_parts(const struct confctl *cc, const char *first, size_t first_len,
+    const char *second, size_t second_len)
 {
 	struct buf *b;
-	const char *p;
+	size_t len;
+
+	len = first_len + second_len;
+	b = malloc(sizeof(*b) + len + 1);
+	if (b == NULL)
+		err(1, "malloc");
+	stats_allocated(cc, sizeof(*b) + len + 1, false);
+
+	b->b_buf = (char *)(b + 1);
+	memcpy(b->b_buf, first, first_len);
+	memcpy(b->b_buf + first_len, second, second_len);
+	b->b_buf[len] = '\0';
+	b->b_len = len;
+	b->b_allocated = len + 1;
+
+	return (b);
+}
+
+static struct buf *
+buf_new_from_str(const struct confctl *cc, const char *str)
+{
+
+	return (buf_new_from_parts(cc, str, strlen(str), "", 0));
+}
+
+/*
+ * Returns buffer for "junk text".  When not in lossless mode, it's
+ * a scratch buffer, reused for all the junk, since it's not going
+ * to be stored anyway.
+ */
+static struct buf *
+buf_new_junk(const struct confctl *cc)
+{
+
+	if (!cc->cc_lossy)
+		return (buf_new(cc));
+
+	cc->cc_junk->b_len = 0;
+	return (cc->cc_junk);
+}
+
+/*
+ * Returns the junk to be stored in the tree, or NULL if it's not stored.
+ */
+static struct buf *
+buf_keep_junk(const struct confctl *cc, struct buf *b)
+{
 
-	b = buf_new();
-	for (p = str; *p != '\0'; p++)
-		buf_append(b, *p);
-	buf_finish(b);
+	if (cc->cc_lossy)
+		return (NULL);
 	return (b);
 }
 
+/*
+ * When not in lossless mode, there won't be any more changes to names
+ * and values, so there is no point in keeping spare room in them.
+ */
+static void
+buf_trim(const struct confctl *cc, struct buf *b)
+{
+	char *p;
+
+	if (!cc->cc_lossy || b->b_allocated <= b->b_len + 1 || buf_is_inline(b))
+		return;
+
+	p = realloc(b->b_buf, b->b_len + 1);
+	if (p == NULL)
+		err(1, "realloc");
+	b->b_buf = p;
+	b->b_allocated = b->b_len + 1;
+}
+
+/*
+ * Replaces 'len' bytes at 'off' with 'str', leaving the rest in place.
+ */
+static void
+buf_splice(const struct confctl *cc, struct buf *b, size_t off, size_t len, const char *str, size_t str_len)
+{
+	size_t need, old;
+	char *p;
+
+	assert(off + len <= b->b_len);
+
+	need = b->b_len - len + str_len + 1;
+	if (need > b->b_allocated) {
+		old = b->b_allocated;
+		b->b_allocated = need + need / 4;
+		if (buf_is_inline(b)) {
+			p = malloc(b->b_allocated);
+			if (p == NULL)
+				err(1, "malloc");
+			memcpy(p, b->b_buf, b->b_len + 1);
+			b->b_buf = p;
+		} else {
+			b->b_buf = realloc(b->b_buf, b->b_allocated);
+			if (b->b_buf == NULL)
+				err(1, "realloc");
+		}
+		stats_allocated(cc, b->b_allocated - old, true);
+	}
+
+	memmove(b->b_buf + off + str_len, b->b_buf + off + len,
+	    b->b_len - off - len + 1);
+	memcpy(b->b_buf + off, str, str_len);
+	b->b_len = need - 1;
+}
+
+/*
+ * Write errors stick to the stream; confctl_write() checks for them
+ * once it's done.
+ */
 static void
 buf_print(struct buf *b, FILE *fp)
 {
-	size_t written;
 
 	if (b == NULL)
 		return;
 	if (b->b_len == 0)
 		return;
-	written = fwrite(b->b_buf, b->b_len, 1, fp);
-	if (written != 1)
-		err(1, "fwrite");
+	fwrite(b->b_buf, b->b_len, 1, fp);
 }
 
 static void
@@ -130,44 +341,161 @@ buf_delete(struct buf *b)
 
 	if (b == NULL)
 		return;
-	if (b->b_buf != NULL)
+	if (b->b_buf != NULL && !buf_is_inline(b))
 		free(b->b_buf);
 	free(b);
 }
 
+struct buf *
+confctl_buf_copy(const struct confctl *cc, const struct buf *b)
+{
+
+	if (b == NULL)
+		return (NULL);
+	return (buf_new_from_parts(cc, b->b_buf, b->b_len, "", 0));
+}
+
+void
+confctl_buf_delete(struct buf *b)
+{
+
+	buf_delete(b);
+}
+
 static struct confctl_var *
-cv_new(struct confctl_var *parent, struct buf *name)
+cv_new(const struct confctl *cc, struct confctl_var *parent, struct buf *name)
 {
 	struct confctl_var *cv;
 
 	cv = calloc(sizeof(*cv), 1);
 	if (cv == NULL)
 		err(1, "malloc");
+	stats_allocated(cc, sizeof(*cv), false);
 
 	assert(name != NULL);
 
+	cv->cv_name = name;
+	TAILQ_INIT(&cv->cv_children);
+
 	if (parent != NULL) {
 		assert(!confctl_var_has_value(parent));
 		cv->cv_parent = parent;
 		TAILQ_INSERT_TAIL(&parent->cv_children, cv, cv_next);
+		names_insert(parent, cv);
+		style_invalidate(parent);
 	}
 
-	cv->cv_name = name;
-	TAILQ_INIT(&cv->cv_children);
-
 	return (cv);
 }
 
 struct confctl_var *
-cv_new_root(void)
+cv_new_root(const struct confctl *cc)
 {
 	struct confctl_var *cv;
 
-	cv = cv_new(NULL, buf_new_from_str("HKEY_CLASSES_ROOT"));
+	cv = cv_new(cc, NULL, buf_new_from_str(cc, "HKEY_CLASSES_ROOT"));
 
 	return (cv);
 }
 
+struct confctl_var_ext *
+confctl_var_ext(struct confctl_var *cv)
+{
+
+	if (cv->cv_ext != NULL)
+		return (cv->cv_ext);
+
+	cv->cv_ext = calloc(1, sizeof(*cv->cv_ext));
+	if (cv->cv_ext == NULL)
+		err(1, "calloc");
+	stats_allocated(cv_confctl(cv), sizeof(*cv->cv_ext), false);
+
+	return (cv->cv_ext);
+}
+
+/*
+ * Character classes used by the parser.  Instead of checking the syntax
+ * options, and calling the locale-dependent isspace(3), for every byte,
+ * the parser looks the byte up in a table built at compile time for every
+ * combination of the options; confctl_parse() picks the right one.
+ */
+#define	LEX_SPACE	0x0001	/* Whitespace, as in the C locale. */
+#define	LEX_NEWLINE	0x0002	/* '\n' or '\r'. */
+#define	LEX_JUNK	0x0004	/* Whitespace or ';'. */
+#define	LEX_MIDDLE	0x0008	/* Whitespace or '='. */
+#define	LEX_NAME_BREAK	0x0010	/* Ends a name and the spaces before it. */
+#define	LEX_NAME_END	0x0020	/* Ends a name. */
+#define	LEX_MIDDLE_END	0x0040	/* Ends cv_middle; the rest goes to cv_after. */
+#define	LEX_VALUE_END	0x0080	/* Ends a value. */
+#define	LEX_COMMENT	0x0100	/* Starts a comment when following '/'. */
+#define	LEX_QUOTE	0x0200	/* '"' or '\''. */
+#define	LEX_BACKSLASH	0x0400	/* '\\'. */
+#define	LEX_SLASH	0x0800	/* '/'. */
+
+#define	LEX_OPT_SEMICOLON	0x01
+#define	LEX_OPT_EQUALS_SIGN	0x02
+#define	LEX_OPT_SLASH_SLASH	0x04
+#define	LEX_OPT_SLASH_STAR	0x08
+
+#define	LEX_IS_SPACE(c)		((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+#define	LEX_IS_NEWLINE(c)	((c) == '\n' || (c) == '\r')
+#define	LEX_IS_BREAK(c)		((c) == '#' || (c) == ';' || (c) == '{' || (c) == '}')
+
+#define	LEX_CLASS(c, o)							\
+	((LEX_IS_SPACE(c) ? LEX_SPACE | LEX_JUNK | LEX_MIDDLE : 0) |	\
+	(LEX_IS_NEWLINE(c) ? LEX_NEWLINE | LEX_NAME_END |		\
+	    ((o) & LEX_OPT_SEMICOLON ? 0 :				\
+	    LEX_MIDDLE_END | LEX_VALUE_END) : 0) |			\
+	(LEX_IS_SPACE(c) && !((o) & LEX_OPT_EQUALS_SIGN) ?		\
+	    LEX_NAME_END : 0) |						\
+	(LEX_IS_BREAK(c) ? LEX_NAME_BREAK | LEX_VALUE_END : 0) |	\
+	((c) == '#' || (c) == ';' ? LEX_MIDDLE_END : 0) |		\
+	((c) == ';' ? LEX_JUNK : 0) |					\
+	((c) == '=' ? LEX_NAME_BREAK | LEX_MIDDLE : 0) |		\
+	((c) == '/' && (o) & LEX_OPT_SLASH_SLASH ? LEX_COMMENT : 0) |	\
+	((c) == '*' && (o) & LEX_OPT_SLASH_STAR ? LEX_COMMENT : 0) |	\
+	((c) == '"' || (c) == '\'' ? LEX_QUOTE : 0) |			\
+	((c) == '\\' ? LEX_BACKSLASH : 0) |				\
+	((c) == '/' ? LEX_SLASH : 0))
+
+#define	LEX_4(c, o)	LEX_CLASS(c, o), LEX_CLASS(c + 1, o),		\
+			LEX_CLASS(c + 2, o), LEX_CLASS(c + 3, o)
+#define	LEX_16(c, o)	LEX_4(c, o), LEX_4(c + 4, o),			\
+			LEX_4(c + 8, o), LEX_4(c + 12, o)
+#define	LEX_64(c, o)	LEX_16(c, o), LEX_16(c + 16, o),		\
+			LEX_16(c + 32, o), LEX_16(c + 48, o)
+#define	LEX_TABLE(o)	{ LEX_64(0, o), LEX_64(64, o),			\
+			LEX_64(128, o), LEX_64(192, o) }
+
+static const uint16_t lex_tables[16][256] = {
+	LEX_TABLE(0), LEX_TABLE(1), LEX_TABLE(2), LEX_TABLE(3),
+	LEX_TABLE(4), LEX_TABLE(5), LEX_TABLE(6), LEX_TABLE(7),
+	LEX_TABLE(8), LEX_TABLE(9), LEX_TABLE(10), LEX_TABLE(11),
+	LEX_TABLE(12), LEX_TABLE(13), LEX_TABLE(14), LEX_TABLE(15),
+};
+
+static const uint16_t *
+lex_table(const struct confctl *cc)
+{
+	int o = 0;
+
+	if (cc->cc_semicolon)
+		o |= LEX_OPT_SEMICOLON;
+	if (cc->cc_equals_sign)
+		o |= LEX_OPT_EQUALS_SIGN;
+	if (cc->cc_slash_slash_comments)
+		o |= LEX_OPT_SLASH_SLASH;
+	if (cc->cc_slash_star_comments)
+		o |= LEX_OPT_SLASH_STAR;
+
+	return (lex_tables[o]);
+}
+
+/*
+ * The streams the parser reads from are never shared between threads,
+ * so it uses getc_unlocked(3); with threads around, getc(3) would take
+ * a lock for every byte.
+ */
 static void
 ungetc_checked(int ch, FILE *fp)
 {
@@ -178,31 +506,31 @@ ungetc_checked(int ch, FILE *fp)
 }
 
 static void
-buf_read_until_newline(struct buf *b, FILE *fp)
+buf_read_until_newline(const struct confctl *cc, struct buf *b, FILE *fp)
 {
 	int ch;
 
 	for (;;) {
-		ch = getc(fp);
+		ch = getc_unlocked(fp);
 		if (ch == EOF)
 			break;
-		buf_append(b, ch);
+		buf_append(cc, b, ch);
 		if (ch == '\n' || ch == '\r')
 			break;
 	}
 }
 
 static void
-buf_read_until_star_slash(struct buf *b, FILE *fp)
+buf_read_until_star_slash(const struct confctl *cc, struct buf *b, FILE *fp)
 {
 	int ch;
 	bool asterisked = false;
 
 	for (;;) {
-		ch = getc(fp);
+		ch = getc_unlocked(fp);
 		if (ch == EOF)
 			break;
-		buf_append(b, ch);
+		buf_append(cc, b, ch);
 		if (asterisked && ch == '/')
 			break;
 		if (ch == '*')
@@ -217,22 +545,21 @@ buf_read_slashed(struct buf *b, const struct confctl *cc, FILE *fp)
 {
 	int ch;
 
-	ch = getc(fp);
+	ch = getc_unlocked(fp);
 	if (ch == EOF)
 		return (false);
 
-	if (ch == '/' && cc->cc_slash_slash_comments) {
-		buf_append(b, ch);
-		buf_read_until_newline(b, fp);
-		return (true);
-	} else if (ch == '*' && cc->cc_slash_star_comments) {
-		buf_append(b, ch);
-		buf_read_until_star_slash(b, fp);
-		return (true);
-	} else {
+	if ((cc->cc_lex[ch] & LEX_COMMENT) == 0) {
 		ungetc_checked(ch, fp);
 		return (false);
 	}
+
+	buf_append(cc, b, ch);
+	if (ch == '/')
+		buf_read_until_newline(cc, b, fp);
+	else
+		buf_read_until_star_slash(cc, b, fp);
+	return (true);
 }
 
 static struct buf *
@@ -244,10 +571,10 @@ buf_read_before(const struct confctl *cc, FILE *fp, bool *closing_bracket)
 
 	*closing_bracket = false;
 
-	b = buf_new();
+	b = buf_new_junk(cc);
 
 	for (;;) {
-		ch = getc(fp);
+		ch = getc_unlocked(fp);
 		if (ch == EOF) {
 			*closing_bracket = true;
 			break;
@@ -258,7 +585,7 @@ buf_read_before(const struct confctl *cc, FILE *fp, bool *closing_bracket)
 		 * Handle C++-style comments.
 		 */
 		if (ch == '/') {
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			comment_parsed = buf_read_slashed(b, cc, fp);
 			if (!comment_parsed) {
 				buf_strip(b);
@@ -277,8 +604,8 @@ buf_read_before(const struct confctl *cc, FILE *fp, bool *closing_bracket)
 		 * Handle shell-style comments.
 		 */
 		if (ch == '#') {
-			buf_append(b, ch);
-			buf_read_until_newline(b, fp);
+			buf_append(cc, b, ch);
+			buf_read_until_newline(cc, b, fp);
 			if (no_newline) {
 				ch = buf_last(b);
 				buf_strip(b);
@@ -294,48 +621,76 @@ buf_read_before(const struct confctl *cc, FILE *fp, bool *closing_bracket)
 		if (ch == '}') {
 			no_newline = true;
 			*closing_bracket = true;
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			continue;
 		}
-		if (isspace(ch) || ch == ';') {
-			buf_append(b, ch);
+		if ((cc->cc_lex[ch] & LEX_JUNK) != 0) {
+			buf_append(cc, b, ch);
 			continue;
 		}
 unget:
 		ungetc_checked(ch, fp);
 		break;
 	}
-	buf_finish(b);
+	buf_finish(cc, b);
 #if 0
 	fprintf(stderr, "before '%s'\n", b->b_buf);
 #endif
 	return (b);
 }
 
+/*
+ * Called on end of file inside quotes.  Records the error, pointing at
+ * the start of the name or value, 'b', and lets the parser carry on,
+ * like it would at the end of file anyway.
+ */
+static void
+parse_fail_quote(struct confctl *cc, FILE *fp, const struct buf *b)
+{
+	off_t pos;
+
+	if (cc->cc_error.ce_code != CONFCTL_ERROR_NONE)
+		return;
+	confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYNTAX, 0,
+	    "unterminated quote");
+	pos = ftello(fp);
+	if (pos >= (off_t)b->b_len)
+		cc->cc_error.ce_offset = pos - b->b_len;
+}
+
 static struct buf *
-buf_read_name(const struct confctl *cc, FILE *fp)
+buf_read_name(struct confctl *cc, FILE *fp)
 {
+	const uint16_t *lex = cc->cc_lex;
 	int ch;
 	struct buf *b;
 	bool escaped = false, quoted = false, squoted = false, slashed = false;
 
-	b = buf_new();
+	b = buf_new(cc);
 
 	for (;;) {
-		ch = getc(fp);
+		ch = getc_unlocked(fp);
 		if (ch == EOF) {
 			if (quoted || squoted)
-				errx(1, "premature end of file");
+				parse_fail_quote(cc, fp, b);
 			break;
 		}
+		/*
+		 * Most characters have no special meaning anywhere.
+		 */
+		if (lex[ch] == 0) {
+			buf_append(cc, b, ch);
+			escaped = slashed = false;
+			continue;
+		}
 		if (escaped) {
 			assert(!slashed);
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			escaped = false;
 			continue;
 		}
 		if (ch == '\\') {
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			escaped = true;
 			slashed = false;
 			continue;
@@ -345,11 +700,11 @@ buf_read_name(const struct confctl *cc, FILE *fp)
 		if (!quoted && ch == '\'')
 			squoted = !squoted;
 		if (quoted || squoted) {
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			slashed = false;
 			continue;
 		}
-		if (ch == '#' || ch == ';' || ch == '{' || ch == '}' || ch == '=') {
+		if ((lex[ch] & LEX_NAME_BREAK) != 0) {
 			ungetc_checked(ch, fp);
 			/*
 			 * All the trailing whitespace after the name should go into cv_middle.
@@ -358,7 +713,7 @@ buf_read_name(const struct confctl *cc, FILE *fp)
 				if (b->b_len == 0)
 					break;
 				ch = buf_last(b);
-				if (!isspace(ch))
+				if ((lex[ch] & LEX_SPACE) == 0)
 					break;
 				buf_strip(b);
 				ungetc_checked(ch, fp);
@@ -368,7 +723,7 @@ buf_read_name(const struct confctl *cc, FILE *fp)
 		/*
 		 * C++-style comments should go into cv_middle.
 		 */
-		if (slashed && ((ch == '/' && cc->cc_slash_slash_comments) || (ch == '*' && cc->cc_slash_star_comments))) {
+		if (slashed && (lex[ch] & LEX_COMMENT) != 0) {
 			ungetc_checked(ch, fp);
 			buf_strip(b);
 			ungetc_checked('/', fp);
@@ -379,7 +734,7 @@ buf_read_name(const struct confctl *cc, FILE *fp)
 				if (b->b_len == 0)
 					break;
 				ch = buf_last(b);
-				if (!isspace(ch))
+				if ((lex[ch] & LEX_SPACE) == 0)
 					break;
 				buf_strip(b);
 				ungetc_checked(ch, fp);
@@ -391,13 +746,13 @@ buf_read_name(const struct confctl *cc, FILE *fp)
 		else
 			slashed = false;
 
-		if ((isspace(ch) && cc->cc_equals_sign == 0) || (ch == '\n' || ch == '\r')) {
+		if ((lex[ch] & LEX_NAME_END) != 0) {
 			ungetc_checked(ch, fp);
 			break;
 		}
-		buf_append(b, ch);
+		buf_append(cc, b, ch);
 	}
-	buf_finish(b);
+	buf_finish(cc, b);
 #if 0
 	fprintf(stderr, "name '%s'\n", b->b_buf);
 #endif
@@ -407,27 +762,28 @@ buf_read_name(const struct confctl *cc, FILE *fp)
 static struct buf *
 buf_read_middle(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 {
+	const uint16_t *lex = cc->cc_lex;
 	int ch;
 	struct buf *b;
 	bool escaped = false;
 
 	*opening_bracket = false;
 
-	b = buf_new();
+	b = buf_new_junk(cc);
 
 	for (;;) {
-		ch = getc(fp);
+		ch = getc_unlocked(fp);
 		if (ch == EOF)
 			break;
 		if (ch == '\\') {
 			escaped = true;
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			continue;
 		}
 		if (escaped) {
 			escaped = false;
 			if (ch == '\n' || ch == '\r') {
-				buf_append(b, ch);
+				buf_append(cc, b, ch);
 				continue;
 			} else {
 				/*
@@ -448,32 +804,32 @@ buf_read_middle(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 		 * all that stuff including trailing spaces should go to cv_after,
 		 * not cv_middle.
 		 */
-		if ((cc->cc_semicolon == 0 && (ch == '\n' || ch == '\r')) || ch == '#' || ch == ';') {
+		if ((lex[ch] & LEX_MIDDLE_END) != 0) {
 			ungetc_checked(ch, fp);
 			for (;;) {
 				if (b->b_len == 0)
 					break;
 				ch = buf_last(b);
-				if (!isspace(ch) && ch != '=')
+				if ((lex[ch] & LEX_MIDDLE) == 0)
 					break;
 				buf_strip(b);
 				ungetc_checked(ch, fp);
 			}
 			break;
 		}
-		if (isspace(ch) || ch == '=') {
-			buf_append(b, ch);
+		if ((lex[ch] & LEX_MIDDLE) != 0) {
+			buf_append(cc, b, ch);
 			continue;
 		}
 		if (ch == '{' && *opening_bracket == false) {
 			*opening_bracket = true;
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			continue;
 		}
 		ungetc_checked(ch, fp);
 		break;
 	}
-	buf_finish(b);
+	buf_finish(cc, b);
 #if 0
 	fprintf(stderr, "middle '%s'\n", b->b_buf);
 #endif
@@ -481,31 +837,40 @@ buf_read_middle(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 }
 
 static struct buf *
-buf_read_value(const struct confctl *cc, FILE *fp, bool *opening_bracket)
+buf_read_value(struct confctl *cc, FILE *fp, bool *opening_bracket)
 {
+	const uint16_t *lex = cc->cc_lex;
 	int ch;
 	struct buf *b;
 	bool escaped = false, quoted = false, squoted = false, slashed = false;
 
 	*opening_bracket = false;
 
-	b = buf_new();
+	b = buf_new(cc);
 
 	for (;;) {
-		ch = getc(fp);
+		ch = getc_unlocked(fp);
 		if (ch == EOF) {
 			if (quoted || squoted)
-				errx(1, "premature end of file");
+				parse_fail_quote(cc, fp, b);
 			break;
 		}
+		/*
+		 * Most characters have no special meaning anywhere.
+		 */
+		if (lex[ch] == 0) {
+			buf_append(cc, b, ch);
+			escaped = slashed = false;
+			continue;
+		}
 		if (escaped) {
 			assert(!slashed);
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			escaped = false;
 			continue;
 		}
 		if (ch == '\\') {
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			escaped = true;
 			slashed = false;
 			continue;
@@ -515,11 +880,11 @@ buf_read_value(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 		if (!quoted && ch == '\'')
 			squoted = !squoted;
 		if (quoted || squoted) {
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			slashed = false;
 			continue;
 		}
-		if ((cc->cc_semicolon == 0 && (ch == '\n' || ch == '\r')) || ch == '#' || ch == ';' || ch == '{' || ch == '}') {
+		if ((lex[ch] & LEX_VALUE_END) != 0) {
 			if (ch == '{')
 				*opening_bracket = true;
 			ungetc_checked(ch, fp);
@@ -530,7 +895,7 @@ buf_read_value(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 				if (b->b_len == 0)
 					break;
 				ch = buf_last(b);
-				if (!isspace(ch))
+				if ((lex[ch] & LEX_SPACE) == 0)
 					break;
 				buf_strip(b);
 				ungetc_checked(ch, fp);
@@ -540,7 +905,7 @@ buf_read_value(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 		/*
 		 * C++-style comments should go into cv_after.
 		 */
-		if (slashed && ((ch == '/' && cc->cc_slash_slash_comments) || (ch == '*' && cc->cc_slash_star_comments))) {
+		if (slashed && (lex[ch] & LEX_COMMENT) != 0) {
 			ungetc_checked(ch, fp);
 			buf_strip(b);
 			ungetc_checked('/', fp);
@@ -551,7 +916,7 @@ buf_read_value(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 				if (b->b_len == 0)
 					break;
 				ch = buf_last(b);
-				if (!isspace(ch))
+				if ((lex[ch] & LEX_SPACE) == 0)
 					break;
 				buf_strip(b);
 				ungetc_checked(ch, fp);
@@ -564,9 +929,9 @@ buf_read_value(const struct confctl *cc, FILE *fp, bool *opening_bracket)
 		else
 			slashed = false;
 
-		buf_append(b, ch);
+		buf_append(cc, b, ch);
 	}
-	buf_finish(b);
+	buf_finish(cc, b);
 #if 0
 	fprintf(stderr, "value '%s'\n", b->b_buf);
 #endif
@@ -580,17 +945,17 @@ buf_read_after(const struct confctl *cc, FILE *fp)
 	struct buf *b;
 	bool comment_parsed;
 
-	b = buf_new();
+	b = buf_new_junk(cc);
 
 	for (;;) {
-		ch = getc(fp);
+		ch = getc_unlocked(fp);
 		if (ch == EOF)
 			break;
 		/*
 		 * Handle C++-style comments.
 		 */
 		if (ch == '/') {
-			buf_append(b, ch);
+			buf_append(cc, b, ch);
 			comment_parsed = buf_read_slashed(b, cc, fp);
 			if (!comment_parsed) {
 				buf_strip(b);
@@ -602,32 +967,40 @@ buf_read_after(const struct confctl *cc, FILE *fp)
 		 * Handle shell-style comments.
 		 */
 		if (ch == '#') {
-			buf_append(b, ch);
-			buf_read_until_newline(b, fp);
+			buf_append(cc, b, ch);
+			buf_read_until_newline(cc, b, fp);
 			continue;
 		}
-		if ((isspace(ch) && ch != '\n' && ch != '\r') || ch == ';') {
-			buf_append(b, ch);
+		if ((cc->cc_lex[ch] & (LEX_JUNK | LEX_NEWLINE)) == LEX_JUNK) {
+			buf_append(cc, b, ch);
 			continue;
 		}
 unget:
 		ungetc_checked(ch, fp);
 		break;
 	}
-	buf_finish(b);
+	buf_finish(cc, b);
 #if 0
 	fprintf(stderr, "after '%s'\n", b->b_buf);
 #endif
 	return (b);
 }
 
-static bool
-cv_load(const struct confctl *cc, struct confctl_var *parent, FILE *fp)
+/*
+ * Reads a single variable, but not its children, if any; these are for
+ * the caller to read, into '*innerp', which is NULL for variables with
+ * a value.  Unless 'attach' is false, the variable gets added to 'parent'.
+ * Returns NULL when there are no more variables in 'parent'; whatever
+ * followed the last one is in its cv_after then.
+ */
+static struct confctl_var *
+cv_read(struct confctl *cc, struct confctl_var *parent, bool attach, FILE *fp,
+    struct confctl_var **innerp)
 {
 	struct buf *before, *name, *middle, *value, *after;
 	bool closing_bracket, opening_bracket;
-	char ch;
-	struct confctl_var *cv;
+	int ch;
+	struct confctl_var *cv, *inner;
 
 	/*
 	 * There are three cases here:
@@ -644,390 +1017,3497 @@ cv_load(const struct confctl *cc, struct confctl_var *parent, FILE *fp)
 
 	before = buf_read_before(cc, fp, &closing_bracket);
 	if (closing_bracket) {
-		parent->cv_after = before;
-		return (true);
+		parent->cv_after = buf_keep_junk(cc, before);
+		return (NULL);
 	}
+	before = buf_keep_junk(cc, before);
 
 	name = buf_read_name(cc, fp);
+	buf_trim(cc, name);
 	middle = buf_read_middle(cc, fp, &opening_bracket);
 
-	cv = cv_new(parent, name);
+	cv = cv_new(cc, attach ? parent : NULL, name);
 	cv->cv_before = before;
-	cv->cv_middle = middle;
+	cv->cv_middle = buf_keep_junk(cc, middle);
 
 	if (opening_bracket) {
 		/*
 		 * Case 2 - opening bracket after name.
 		 */
-		for (;;) {
-			closing_bracket = cv_load(cc, cv, fp);
-			if (closing_bracket)
-				break;
-		}
-	} else {
+		*innerp = cv;
+		return (cv);
+	}
+
+	/*
+	 * Case 1 or 3.
+	 */
+	value = buf_read_value(cc, fp, &opening_bracket);
+	if (!opening_bracket) {
 		/*
-		 * Case 1 or 3.
+		 * Case 1.
 		 */
-		value = buf_read_value(cc, fp, &opening_bracket);
-		if (opening_bracket) {
-			/*
-			 * Case 3.
-			 */
-			/*
-			 * First, push the 'value' back into the
-			 * stream; we have to reparse it as names.
-			 */
-			while (value->b_len > 0) {
-				ch = buf_last(value);
-				buf_strip(value);
-				ungetc_checked(ch, fp);
-			}
-			buf_delete(value);
-			value = NULL;
+		buf_trim(cc, value);
+		after = buf_read_after(cc, fp);
+		cv->cv_value = value;
+		cv->cv_after = buf_keep_junk(cc, after);
+		*innerp = NULL;
+		return (cv);
+	}
 
-			for (;;) {
-				cv->cv_implicit_container = true;
+	/*
+	 * Case 3.
+	 */
+	/*
+	 * First, push the 'value' back into the
+	 * stream; we have to reparse it as names.
+	 */
+	while (value->b_len > 0) {
+		ch = buf_last(value);
+		buf_strip(value);
+		ungetc_checked(ch, fp);
+	}
+	buf_delete(value);
 
-				name = buf_read_name(cc, fp);
-				middle = buf_read_middle(cc, fp, &opening_bracket);
-				cv = cv_new(cv, name);
-				cv->cv_middle = middle;
+	inner = cv;
+	for (;;) {
+		inner->cv_implicit_container = true;
 
-				if (opening_bracket)
-					break;
-			}
+		name = buf_read_name(cc, fp);
+		buf_trim(cc, name);
+		middle = buf_read_middle(cc, fp, &opening_bracket);
+		inner = cv_new(cc, inner, name);
+		inner->cv_middle = buf_keep_junk(cc, middle);
 
-			for (;;) {
-				closing_bracket = cv_load(cc, cv, fp);
-				if (closing_bracket)
-					break;
-			}
-		} else {
-			/*
-			 * Case 1.
-			 */
-			after = buf_read_after(cc, fp);
-			cv->cv_value = value;
-			cv->cv_after = after;
+		if (opening_bracket)
+			break;
+	}
+
+	*innerp = inner;
+	return (cv);
+}
+
+static bool
+cv_load(struct confctl *cc, struct confctl_var *parent, FILE *fp)
+{
+	struct confctl_var *cv, *inner;
+	bool closing_bracket;
+
+	cv = cv_read(cc, parent, true, fp, &inner);
+	if (cv == NULL)
+		return (true);
+
+	if (inner != NULL) {
+		for (;;) {
+			closing_bracket = cv_load(cc, inner, fp);
+			if (closing_bracket)
+				break;
 		}
 	}
 
 	return (false);
 }
 
-static struct buf *
-buf_get_indent(struct confctl_var *cv)
+/*
+ * Returns the indentation of 'cv', i.e. its cv_before, starting from the last
+ * newline, or NULL if there isn't any.  The result points into cv_before.
+ */
+static const char *
+cv_get_indent(const struct confctl_var *cv, size_t *lenp)
 {
-	struct buf *b;
-	int i;
+	const struct buf *b;
+	const char *p;
 
 	b = cv->cv_before;
 	if (b == NULL || b->b_len <= 1)
 		return (NULL);
 
-	for (i = b->b_len; i >= 0; i--) {
-		if (b->b_buf[i] == '\n' || b->b_buf[i] == '\r')
+	for (p = b->b_buf + b->b_len; p > b->b_buf; p--) {
+		if (p[-1] == '\n' || p[-1] == '\r') {
+			p--;
 			break;
+		}
 	}
+	*lenp = b->b_buf + b->b_len - p;
 
-	b = buf_new_from_str(b->b_buf + i);
-
-	return (b);
+	return (p);
 }
 
+/*
+ * How many different ways of formatting to keep count of.
+ */
+#define	STYLE_CANDIDATES	8
+
+struct style_tally {
+	const char	*stt_str[STYLE_CANDIDATES];
+	size_t		stt_len[STYLE_CANDIDATES];
+	size_t		stt_column[STYLE_CANDIDATES];
+	unsigned int	stt_count[STYLE_CANDIDATES];
+	unsigned int	stt_n;
+};
+
 static void
-cv_reindent(struct confctl *cc, struct confctl_var *cv)
+style_tally(struct style_tally *stt, const char *str, size_t len, size_t column)
 {
-	struct buf *b = NULL;
-	struct confctl_var *prev;
-
-	/*
-	 * Check for cv_parent, as we don't want to add brackets for the root element.
-	 */
-	if (cv->cv_parent == NULL)
-		return;
+	unsigned int i;
 
-	if (cv->cv_before == NULL) {
-		prev = TAILQ_PREV(cv, confctl_var_head, cv_next);
-		if (prev != NULL)
-			b = buf_get_indent(prev);
-		if (b == NULL) {
-			b = buf_get_indent(cv->cv_parent);
-			if (b == NULL) {
-				/*
-				 * For the first variable in file, cv_before should an be empty string,
-				 * to avoid empty line on the top of the newly created file.
-				 */
-				if (cv->cv_parent->cv_parent == NULL && TAILQ_PREV(cv, confctl_var_head, cv_next) == NULL) {
-					b = buf_new_from_str("");
-					/*
-					 * If the cv_after for the root node is empty, add newline there,
-					 * to make sure the file ends with a newline.
-					 */
-					if (cv->cv_parent->cv_after->b_len == 0)
-						cv->cv_parent->cv_after = buf_new_from_str("\n");
-				} else
-					b = buf_new_from_str("\n");
-			}
-			if (cv->cv_parent->cv_parent != NULL) {
-				buf_append(b, '\t');
-				buf_finish(b);
-			}
+	for (i = 0; i < stt->stt_n; i++) {
+		if (stt->stt_len[i] == len && stt->stt_column[i] == column &&
+		    memcmp(stt->stt_str[i], str, len) == 0) {
+			stt->stt_count[i]++;
+			return;
 		}
-		cv->cv_before = b;
 	}
 
-	if (confctl_var_has_children(cv)) {
-		if (confctl_var_first_child(cv) != NULL) {
-			/*
-			 * XXX: check before appending brackets.
-			 */
-			cv->cv_middle = buf_new_from_str(" {");
-			if (cv->cv_before != NULL)
-				cv->cv_after = buf_new_from_str(cv->cv_before->b_buf);
-			buf_append(cv->cv_after, '}');
-			buf_finish(cv->cv_after);
-		}
-	} else {
-		if (cv->cv_value != NULL && cv->cv_value->b_len > 0 && (cv->cv_middle == NULL || cv->cv_middle->b_len == 0)) {
-			if (cc->cc_equals_sign && (cv->cv_middle == NULL || cv->cv_middle->b_len == 0))
-				cv->cv_middle = buf_new_from_str(" = ");
-			else
-				cv->cv_middle = buf_new_from_str(" ");
-		}
-		if (cc->cc_semicolon && (cv->cv_after == NULL || cv->cv_after->b_len == 0))
-			cv->cv_after = buf_new_from_str(";");
-	}
+	if (stt->stt_n == STYLE_CANDIDATES)
+		return;
+	stt->stt_str[i] = str;
+	stt->stt_len[i] = len;
+	stt->stt_column[i] = column;
+	stt->stt_count[i] = 1;
+	stt->stt_n++;
 }
 
-static void
-cv_write(struct confctl *cc, struct confctl_var *cv, FILE *fp, bool reindent_anyway)
+/*
+ * Returns the most common candidate, the first one seen on ties,
+ * or -1 if there weren't any.
+ */
+static int
+style_winner(const struct style_tally *stt)
 {
-	struct confctl_var *child;
+	unsigned int i, best;
 
-	/*
-	 * Reindent nodes marked with cv_needs_reindent, along with all its children,
-	 * whether marked or not.
-	 */
-	if (cv->cv_needs_reindent || reindent_anyway) {
-		cv_reindent(cc, cv);
-		reindent_anyway = true;
+	if (stt->stt_n == 0)
+		return (-1);
+
+	best = 0;
+	for (i = 1; i < stt->stt_n; i++) {
+		if (stt->stt_count[i] > stt->stt_count[best])
+			best = i;
 	}
 
-	buf_print(cv->cv_before, fp);
-	if (confctl_root(cc) != cv) /* XXX */
-		buf_print(cv->cv_name, fp);
-	buf_print(cv->cv_middle, fp);
-	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
-		cv_write(cc, child, fp, reindent_anyway);
-	buf_print(cv->cv_value, fp);
-	buf_print(cv->cv_after, fp);
+	return (best);
 }
 
-static void
-confctl_write(struct confctl *cc, FILE *fp)
+static char *
+style_strndup(const char *str, size_t len)
 {
+	char *p;
+
+	p = strndup(str, len);
+	if (p == NULL)
+		err(1, "strndup");
 
-	cv_write(cc, confctl_root(cc), fp, false);
+	return (p);
 }
 
 static void
-remove_tmpfile(const char *tmppath)
+style_delete(struct confctl_style *st)
 {
-	int error, saved_errno;
 
-	saved_errno = errno;
-	error = unlink(tmppath);
+	if (st == NULL)
+		return;
+	free(st->st_indent);
+	free(st->st_step);
+	free(st->st_separator);
+	free(st->st_align);
+	free(st->st_brace);
+	free(st);
+}
+
+/*
+ * Called whenever children of 'cv' change.
+ */
+static void
+style_invalidate(struct confctl_var *cv)
+{
+
+	if (cv == NULL || CV_EXT(cv, cx_style) == NULL)
+		return;
+	style_delete(cv->cv_ext->cx_style);
+	cv->cv_ext->cx_style = NULL;
+}
+
+/*
+ * Learns the style from the children of 'parent' that are already
+ * formatted, i.e. weren't just added.
+ */
+static struct confctl_style *
+style_learn(struct confctl_var *parent)
+{
+	struct style_tally indents, separators, columns, braces;
+	struct confctl_style *st;
+	struct confctl_var *child;
+	struct buf *middle;
+	const char *indent, *parent_indent, *after;
+	size_t len, parent_len, spaces;
+	unsigned int samples = 0, values = 0, semicolons = 0;
+	unsigned int containers = 0, brace_semicolons = 0;
+	int i, j;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		err(1, "calloc");
+	memset(&indents, 0, sizeof(indents));
+	memset(&separators, 0, sizeof(separators));
+	memset(&columns, 0, sizeof(columns));
+	memset(&braces, 0, sizeof(braces));
+
+	TAILQ_FOREACH(child, &parent->cv_children, cv_next) {
+		/*
+		 * Without looking at the rest, there's no telling whether
+		 * they are all formatted.
+		 */
+		if (samples == STYLE_SAMPLES) {
+			st->st_partial = true;
+			break;
+		}
+		if (child->cv_before == NULL) {
+			st->st_partial = true;
+			continue;
+		}
+		samples++;
+
+		indent = cv_get_indent(child, &len);
+		if (indent != NULL)
+			style_tally(&indents, indent, len, 0);
+
+		middle = child->cv_middle;
+		if (middle == NULL || middle->b_len == 0)
+			continue;
+
+		if (confctl_var_has_children(child)) {
+			if (child->cv_implicit_container || buf_last(middle) != '{')
+				continue;
+			containers++;
+			style_tally(&braces, middle->b_buf, middle->b_len, 0);
+			if (child->cv_after != NULL) {
+				after = child->cv_after->b_buf;
+				after += strspn(after, " \t\n\r");
+				if (*after == '}') {
+					after += 1 + strspn(after + 1, " \t");
+					if (*after == ';')
+						brace_semicolons++;
+				}
+			}
+			continue;
+		}
+		if (child->cv_value == NULL || child->cv_value->b_len == 0)
+			continue;
+
+		values++;
+		style_tally(&separators, middle->b_buf, middle->b_len, 0);
+		spaces = strspn(middle->b_buf, " ");
+		if (spaces > 0 && strpbrk(middle->b_buf, "\n\r") == NULL) {
+			style_tally(&columns, middle->b_buf + spaces,
+			    middle->b_len - spaces, child->cv_name->b_len + spaces);
+		}
+		if (child->cv_after != NULL) {
+			after = child->cv_after->b_buf;
+			after += strspn(after, " \t");
+			if (*after == ';')
+				semicolons++;
+		}
+	}
+
+	i = style_winner(&indents);
+	if (i >= 0) {
+		st->st_indent = style_strndup(indents.stt_str[i], indents.stt_len[i]);
+		parent_indent = cv_get_indent(parent, &parent_len);
+		if (parent_indent != NULL && indents.stt_len[i] > parent_len &&
+		    memcmp(indents.stt_str[i], parent_indent, parent_len) == 0) {
+			st->st_step = style_strndup(indents.stt_str[i] + parent_len,
+			    indents.stt_len[i] - parent_len);
+		}
+	}
+
+	/*
+	 * Values are aligned if more of them start at the same column
+	 * than share the same separator.
+	 */
+	i = style_winner(&separators);
+	j = style_winner(&columns);
+	if (j >= 0 && columns.stt_count[j] >= 2 && columns.stt_count[j] * 2 > values &&
+	    columns.stt_count[j] > separators.stt_count[i]) {
+		st->st_align = style_strndup(columns.stt_str[j], columns.stt_len[j]);
+		st->st_column = columns.stt_column[j];
+	} else if (i >= 0) {
+		st->st_separator = style_strndup(separators.stt_str[i], separators.stt_len[i]);
+	}
+	st->st_semicolon = values > 0 && semicolons * 2 > values;
+
+	i = style_winner(&braces);
+	if (i >= 0)
+		st->st_brace = style_strndup(braces.stt_str[i], braces.stt_len[i]);
+	st->st_brace_semicolon = containers > 0 && brace_semicolons * 2 > containers;
+
+	return (st);
+}
+
+static bool
+style_has_values(const struct confctl_style *st)
+{
+
+	return (st->st_separator != NULL || st->st_align != NULL);
+}
+
+/*
+ * Fills in whatever 'st' is missing from 'from'.
+ */
+static void
+style_inherit(struct confctl_style *st, const struct confctl_style *from)
+{
+
+	if (!style_has_values(st) && style_has_values(from)) {
+		if (from->st_separator != NULL)
+			st->st_separator = style_strndup(from->st_separator, strlen(from->st_separator));
+		if (from->st_align != NULL)
+			st->st_align = style_strndup(from->st_align, strlen(from->st_align));
+		st->st_column = from->st_column;
+		st->st_semicolon = from->st_semicolon;
+	}
+	if (st->st_step == NULL && from->st_step != NULL)
+		st->st_step = style_strndup(from->st_step, strlen(from->st_step));
+	if (st->st_brace == NULL && from->st_brace != NULL) {
+		st->st_brace = style_strndup(from->st_brace, strlen(from->st_brace));
+		st->st_brace_semicolon = from->st_brace_semicolon;
+	}
+}
+
+static bool
+style_complete(const struct confctl_style *st)
+{
+
+	return (style_has_values(st) && st->st_step != NULL && st->st_brace != NULL);
+}
+
+static struct confctl_style	*style_get(struct confctl_var *cv);
+
+/*
+ * Returns the style of children of 'cv'.  It's learned once, and kept
+ * until they change, so that adding lots of variables doesn't mean looking
+ * at their siblings over and over.  Whatever can't be learned from the
+ * children, e.g. for a newly added block, is taken from the previous
+ * siblings of 'cv', and then from its parent.
+ */
+static struct confctl_style *
+style_get(struct confctl_var *cv)
+{
+	struct confctl_style *st, *sibling_st;
+	struct confctl_var *sibling;
+	int i;
+
+	st = CV_EXT(cv, cx_style);
+	if (st != NULL && !st->st_own)
+		return (st);
+
+	/*
+	 * When streaming, the style might have been learned beforehand,
+	 * from children that are gone by now.
+	 */
+	if (st != NULL)
+		st->st_own = false;
+	else
+		st = style_learn(cv);
+	sibling = NULL;
+	if (cv->cv_parent != NULL)
+		sibling = TAILQ_PREV(cv, confctl_var_head, cv_next);
+	for (i = 0; i < STYLE_SIBLINGS && sibling != NULL && !style_complete(st); i++) {
+		if (!confctl_var_has_children(sibling)) {
+			sibling = TAILQ_PREV(sibling, confctl_var_head, cv_next);
+			continue;
+		}
+		/*
+		 * Style learned when the sibling's children were still being
+		 * added is stale by now.  Don't look at its own siblings,
+		 * though; that could end up going through all of them.
+		 */
+		sibling_st = CV_EXT(sibling, cx_style);
+		if (sibling_st == NULL || sibling_st->st_partial) {
+			sibling_st = style_learn(sibling);
+			if (!sibling_st->st_partial) {
+				style_invalidate(sibling);
+				confctl_var_ext(sibling)->cx_style = sibling_st;
+			}
+		}
+		style_inherit(st, sibling_st);
+		if (sibling_st != CV_EXT(sibling, cx_style))
+			style_delete(sibling_st);
+		sibling = TAILQ_PREV(sibling, confctl_var_head, cv_next);
+	}
+	if (cv->cv_parent != NULL && !style_complete(st))
+		style_inherit(st, style_get(cv->cv_parent));
+
+	confctl_var_ext(cv)->cx_style = st;
+	return (st);
+}
+
+static void
+cv_reindent(struct confctl *cc, struct confctl_var *cv)
+{
+	struct confctl_var *prev;
+	struct confctl_style *st;
+	const char *indent = NULL, *step;
+	char *spaces;
+	size_t len, name_len, nspaces;
+
+	/*
+	 * Check for cv_parent, as we don't want to add brackets for the root element.
+	 */
+	if (cv->cv_parent == NULL)
+		return;
+
+	st = style_get(cv->cv_parent);
+
+	if (cv->cv_before == NULL) {
+		prev = TAILQ_PREV(cv, confctl_var_head, cv_next);
+		if (st->st_indent != NULL) {
+			indent = st->st_indent;
+			len = strlen(indent);
+		} else if (prev != NULL) {
+			indent = cv_get_indent(prev, &len);
+		}
+		if (indent != NULL) {
+			cv->cv_before = buf_new_from_parts(cc, indent, len, "", 0);
+		} else {
+			indent = cv_get_indent(cv->cv_parent, &len);
+			if (indent == NULL) {
+				/*
+				 * For the first variable in file, cv_before should an be empty string,
+				 * to avoid empty line on the top of the newly created file.
+				 */
+				if (cv->cv_parent->cv_parent == NULL && prev == NULL) {
+					indent = "";
+					len = 0;
+					/*
+					 * If the cv_after for the root node is empty, add newline there,
+					 * to make sure the file ends with a newline.
+					 */
+					if (cv->cv_parent->cv_after == NULL || cv->cv_parent->cv_after->b_len == 0) {
+						buf_delete(cv->cv_parent->cv_after);
+						cv->cv_parent->cv_after = buf_new_from_str(cc, "\n");
+					}
+				} else {
+					indent = "\n";
+					len = 1;
+				}
+			}
+			if (cv->cv_parent->cv_parent != NULL) {
+				step = st->st_step != NULL ? st->st_step : "\t";
+				cv->cv_before = buf_new_from_parts(cc, indent, len, step, strlen(step));
+			} else {
+				cv->cv_before = buf_new_from_parts(cc, indent, len, "", 0);
+			}
+		}
+	}
+
+	if (confctl_var_has_children(cv)) {
+		if (confctl_var_first_child(cv) != NULL) {
+			/*
+			 * XXX: check before appending brackets.
+			 */
+			buf_delete(cv->cv_middle);
+			cv->cv_middle = buf_new_from_str(cc, st->st_brace != NULL ? st->st_brace : " {");
+			buf_delete(cv->cv_after);
+			if (st->st_brace_semicolon)
+				cv->cv_after = buf_new_from_parts(cc, cv->cv_before->b_buf, cv->cv_before->b_len, "};", 2);
+			else
+				cv->cv_after = buf_new_from_parts(cc, cv->cv_before->b_buf, cv->cv_before->b_len, "}", 1);
+		}
+	} else {
+		if (cv->cv_value != NULL && cv->cv_value->b_len > 0 && (cv->cv_middle == NULL || cv->cv_middle->b_len == 0)) {
+			buf_delete(cv->cv_middle);
+			if (cc->cc_equals_sign && (st->st_separator == NULL || strchr(st->st_separator, '=') == NULL) &&
+			    (st->st_align == NULL || strchr(st->st_align, '=') == NULL)) {
+				cv->cv_middle = buf_new_from_str(cc, " = ");
+			} else if (st->st_align != NULL) {
+				/*
+				 * Align the value with the ones around it, if the name
+				 * isn't too long for that.
+				 */
+				name_len = cv->cv_name->b_len;
+				nspaces = st->st_column > name_len ? st->st_column - name_len : 1;
+				spaces = malloc(nspaces);
+				if (spaces == NULL)
+					err(1, "malloc");
+				memset(spaces, ' ', nspaces);
+				cv->cv_middle = buf_new_from_parts(cc, spaces, nspaces, st->st_align, strlen(st->st_align));
+				free(spaces);
+			} else if (st->st_separator != NULL) {
+				cv->cv_middle = buf_new_from_str(cc, st->st_separator);
+			} else {
+				cv->cv_middle = buf_new_from_str(cc, " ");
+			}
+		}
+		if ((cc->cc_semicolon || st->st_semicolon) && (cv->cv_after == NULL || cv->cv_after->b_len == 0)) {
+			buf_delete(cv->cv_after);
+			cv->cv_after = buf_new_from_str(cc, ";");
+		}
+	}
+}
+
+/*
+ * Reindent nodes marked with cv_needs_reindent, along with all its children,
+ * whether marked or not.  Returns the number of nodes.
+ */
+static size_t
+cv_reindent_tree(struct confctl *cc, struct confctl_var *cv, bool reindent_anyway)
+{
+	struct confctl_var *child;
+	size_t nodes = 1;
+
+	if (cv->cv_needs_reindent || reindent_anyway) {
+		confctl_stats_begin(cc, CONFCTL_PHASE_REINDENT);
+		cv_reindent(cc, cv);
+		confctl_stats_end(cc, CONFCTL_PHASE_REINDENT);
+		reindent_anyway = true;
+	}
+
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		nodes += cv_reindent_tree(cc, child, reindent_anyway);
+
+	return (nodes);
+}
+
+/*
+ * This must not modify anything, as it might run in several threads
+ * at the same time; that's why reindenting is done beforehand.  Variables
+ * from included files only get written to the file they came from.
+ */
+static void
+cv_write(struct confctl *cc, struct confctl_var *cv, FILE *fp)
+{
+	struct confctl_var *child;
+
+	if (CV_EXT(cv, cx_include) != NULL && cv->cv_ext->cx_include != cc->cc_writing)
+		return;
+	buf_print(cv->cv_before, fp);
+	if (confctl_root(cc) != cv) /* XXX */
+		buf_print(cv->cv_name, fp);
+	buf_print(cv->cv_middle, fp);
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		cv_write(cc, child, fp);
+	buf_print(cv->cv_value, fp);
+	buf_print(cv->cv_after, fp);
+}
+
+/*
+ * Reindents 'cv', if it's marked with cv_needs_reindent, along with
+ * everything below it that needs it.
+ */
+void
+confctl_var_reindent(struct confctl *cc, struct confctl_var *cv)
+{
+
+	cv_reindent_tree(cc, cv, false);
+}
+
+struct confctl_style *
+confctl_style_learn(struct confctl_var *parent)
+{
+
+	return (style_learn(parent));
+}
+
+void
+confctl_style_delete(struct confctl_style *st)
+{
+
+	style_delete(st);
+}
+
+/*
+ * Top-level variables, split into tasks to write in parallel.  Task 'i'
+ * consists of variables starting with wt_first[i], up to, but not including,
+ * wt_first[i + 1].
+ */
+struct write_tasks {
+	struct confctl		*wt_cc;
+	struct confctl_var	**wt_first;
+	size_t			wt_len;
+};
+
+static void
+write_task(void *arg, size_t i, FILE *fp)
+{
+	struct write_tasks *wt;
+	struct confctl_var *cv, *last;
+
+	wt = arg;
+	if (i + 1 < wt->wt_len)
+		last = wt->wt_first[i + 1];
+	else
+		last = NULL;
+
+	for (cv = wt->wt_first[i]; cv != last; cv = TAILQ_NEXT(cv, cv_next))
+		cv_write(wt->wt_cc, cv, fp);
+}
+
+/*
+ * Writes the included file, i.e. its variables, which are somewhere
+ * among the siblings of the directive, with the junk that was around them.
+ */
+static void
+include_write(struct confctl *cc, struct confctl_include *ci, FILE *fp)
+{
+	struct confctl_var *cv;
+
+	buf_print(ci->cin_before, fp);
+	buf_print(ci->cin_middle, fp);
+	TAILQ_FOREACH(cv, &ci->cin_where->cv_children, cv_next) {
+		if (CV_EXT(cv, cx_include) == ci)
+			cv_write(cc, cv, fp);
+	}
+	buf_print(ci->cin_after, fp);
+}
+
+static size_t
+buf_len(const struct buf *b)
+{
+
+	if (b == NULL)
+		return (0);
+	return (b->b_len);
+}
+
+/*
+ * Returns -1, with errno set, if writing failed.
+ */
+int
+confctl_write(struct confctl *cc, FILE *fp)
+{
+	struct confctl_var *root, *child;
+	struct write_tasks wt;
+	size_t *nodes, i, n = 0, total, target, sum;
+	unsigned int threads;
+	ssize_t done;
+	off_t written;
+
+	/*
+	 * Reindent first, remembering the sizes of top-level subtrees.
+	 */
+	root = confctl_root(cc);
+	TAILQ_FOREACH(child, &root->cv_children, cv_next)
+		n++;
+	nodes = calloc(n + 1, sizeof(*nodes));
+	if (nodes == NULL)
+		err(1, "calloc");
+	if (root->cv_needs_reindent) {
+		confctl_stats_begin(cc, CONFCTL_PHASE_REINDENT);
+		cv_reindent(cc, root);
+		confctl_stats_end(cc, CONFCTL_PHASE_REINDENT);
+	}
+	total = 1;
+	i = 0;
+	TAILQ_FOREACH(child, &root->cv_children, cv_next) {
+		nodes[i] = cv_reindent_tree(cc, child, root->cv_needs_reindent);
+		total += nodes[i];
+		i++;
+	}
+
+	threads = cc->cc_threads;
+	if (threads == 0) {
+		if (total >= PARALLEL_MIN_NODES)
+			threads = parallel_ncpus();
+		else
+			threads = 1;
+	}
+
+	/*
+	 * Memory streams don't have file descriptors to writev(2) to.
+	 * Included files are usually small, so they don't bother either.
+	 */
+	if (threads <= 1 || n < 2 || fileno(fp) < 0 || cc->cc_writing != NULL) {
+		free(nodes);
+		if (cc->cc_writing != NULL)
+			include_write(cc, cc->cc_writing, fp);
+		else
+			cv_write(cc, root, fp);
+		if (fflush(fp) != 0 || ferror(fp) != 0)
+			return (-1);
+		if (cc->cc_stats != NULL)
+			cc->cc_stats->css_stats.cs_bytes_written += ftello(fp);
+		return (0);
+	}
+
+	/*
+	 * Split top-level variables into tasks of roughly the same number
+	 * of nodes.
+	 */
+	wt.wt_cc = cc;
+	wt.wt_first = calloc(n, sizeof(*wt.wt_first));
+	if (wt.wt_first == NULL)
+		err(1, "calloc");
+	wt.wt_len = 0;
+	target = total / (threads * PARALLEL_TASKS_PER_THREAD) + 1;
+	sum = target;
+	i = 0;
+	TAILQ_FOREACH(child, &root->cv_children, cv_next) {
+		if (sum >= target) {
+			wt.wt_first[wt.wt_len] = child;
+			wt.wt_len++;
+			sum = 0;
+		}
+		sum += nodes[i];
+		i++;
+	}
+	free(nodes);
+
+	buf_print(root->cv_before, fp);
+	buf_print(root->cv_middle, fp);
+	if (fflush(fp) != 0 || ferror(fp) != 0) {
+		free(wt.wt_first);
+		return (-1);
+	}
+	written = ftello(fp);
+	done = parallel_write(fileno(fp), threads, wt.wt_len, write_task, &wt);
+	free(wt.wt_first);
+	if (done < 0)
+		return (-1);
+	written += done;
+	buf_print(root->cv_value, fp);
+	buf_print(root->cv_after, fp);
+	if (fflush(fp) != 0 || ferror(fp) != 0)
+		return (-1);
+	written += buf_len(root->cv_value) + buf_len(root->cv_after);
+
+	if (cc->cc_stats != NULL)
+		cc->cc_stats->css_stats.cs_bytes_written += written;
+
+	return (0);
+}
+
+static void
+remove_tmpfile(const char *tmppath)
+{
+	int error, saved_errno;
+
+	saved_errno = errno;
+	error = unlink(tmppath);
 	if (error != 0)
 		warn("unlink");
 	errno = saved_errno;
 }
 
+void
+confctl_hash_init(struct confctl_hash *ch)
+{
+
+	memset(ch, 0, sizeof(*ch));
+	ch->ch_hash = 0xcbf29ce484222325ULL;
+}
+
+static void
+hash_word(struct confctl_hash *ch, const unsigned char *p)
+{
+	uint64_t word;
+
+	memcpy(&word, p, sizeof(word));
+	ch->ch_hash = (ch->ch_hash ^ word) * 0x100000001b3ULL;
+	ch->ch_hash ^= ch->ch_hash >> 29;
+}
+
+void
+confctl_hash_update(struct confctl_hash *ch, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	ch->ch_total += len;
+	while (len > 0 && ch->ch_buf_len > 0) {
+		ch->ch_buf[ch->ch_buf_len++] = *p++;
+		len--;
+		if (ch->ch_buf_len == sizeof(ch->ch_buf)) {
+			hash_word(ch, ch->ch_buf);
+			ch->ch_buf_len = 0;
+		}
+	}
+	for (; len >= sizeof(ch->ch_buf); p += sizeof(ch->ch_buf), len -= sizeof(ch->ch_buf))
+		hash_word(ch, p);
+	memcpy(ch->ch_buf + ch->ch_buf_len, p, len);
+	ch->ch_buf_len += len;
+}
+
+uint64_t
+confctl_hash_final(struct confctl_hash *ch)
+{
+	unsigned char total[8];
+
+	memset(ch->ch_buf + ch->ch_buf_len, 0, sizeof(ch->ch_buf) - ch->ch_buf_len);
+	hash_word(ch, ch->ch_buf);
+	memcpy(total, &ch->ch_total, sizeof(total));
+	hash_word(ch, total);
+
+	return (ch->ch_hash);
+}
+
+/*
+ * When loading, the file is read again to get its hash, instead of hashing
+ * the data on its way to the parser; it's in the page cache anyway, and
+ * reading through stdio cookies makes getc(3) much slower.
+ */
+int
+confctl_hash_file(struct confctl *cc, int fd, const char *path, uint64_t *hashp)
+{
+	struct confctl_hash ch;
+	char buf[65536];
+	ssize_t done;
+	off_t offset;
+
+	confctl_hash_init(&ch);
+	for (offset = 0;; offset += done) {
+		done = pread(fd, buf, sizeof(buf), offset);
+		if (done < 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot read %s", path);
+			return (-1);
+		}
+		if (done == 0)
+			break;
+		confctl_hash_update(&ch, buf, done);
+	}
+
+	*hashp = confctl_hash_final(&ch);
+	return (0);
+}
+
+void
+confctl_set_identity(struct confctl *cc, const char *path, const struct stat *sb, const uint64_t *hash)
+{
+	struct confctl_identity *ci;
+
+	ci = cc->cc_identity;
+	if (ci == NULL) {
+		ci = calloc(1, sizeof(*ci));
+		if (ci == NULL)
+			err(1, "calloc");
+		cc->cc_identity = ci;
+	}
+	if (ci->ci_path == NULL || strcmp(ci->ci_path, path) != 0) {
+		free(ci->ci_path);
+		ci->ci_path = strdup(path);
+		if (ci->ci_path == NULL)
+			err(1, "strdup");
+	}
+	ci->ci_dev = sb->st_dev;
+	ci->ci_ino = sb->st_ino;
+	ci->ci_size = sb->st_size;
+	ci->ci_mtime = sb->st_mtim;
+	ci->ci_ctime = sb->st_ctim;
+	ci->ci_hash_valid = hash != NULL;
+	if (hash != NULL)
+		ci->ci_hash = *hash;
+}
+
+static bool
+timespec_equal(const struct timespec *a, const struct timespec *b)
+{
+
+	return (a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec);
+}
+
+/*
+ * Returns 1 if 'fd', opened and locked by the caller, is still the file
+ * at 'path', and it didn't change since it was loaded or last saved, 0 if
+ * it did, or -1 if it couldn't be checked.  Files saved by someone else
+ * without actually changing anything, e.g. rewritten with the same contents,
+ * are found unchanged by comparing the hash.
+ */
+static int
+identity_unchanged(struct confctl *cc, const char *path, int fd)
+{
+	struct confctl_identity *ci;
+	struct stat sb, psb;
+	uint64_t hash;
+	int error;
+
+	ci = cc->cc_identity;
+
+	error = fstat(fd, &sb);
+	if (error != 0)
+		goto fail;
+	error = stat(path, &psb);
+	if (error != 0) {
+		if (errno == ENOENT)
+			return (0);
+		goto fail;
+	}
+	if (sb.st_dev != psb.st_dev || sb.st_ino != psb.st_ino)
+		return (0);
+
+	if (sb.st_dev == ci->ci_dev && sb.st_ino == ci->ci_ino &&
+	    sb.st_size == ci->ci_size && timespec_equal(&sb.st_mtim, &ci->ci_mtime) &&
+	    timespec_equal(&sb.st_ctim, &ci->ci_ctime))
+		return (1);
+
+	if (!ci->ci_hash_valid || sb.st_size != ci->ci_size)
+		return (0);
+
+	error = confctl_hash_file(cc, fd, path, &hash);
+	if (error != 0)
+		return (-1);
+	return (hash == ci->ci_hash);
+
+fail:
+	confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+	    "cannot stat %s", path);
+	return (-1);
+}
+
+static bool
+identity_applies(struct confctl *cc, const char *path)
+{
+
+	return (cc->cc_identity != NULL && strcmp(cc->cc_identity->ci_path, path) == 0);
+}
+
+/*
+ * Atomically replaces 'path' with the temporary file, unless the former
+ * changed since it was loaded.  The old file is locked between the check
+ * and the rename, and so is the new one, until its identity gets recorded,
+ * so that concurrent writers doing the same can't sneak in between.
+ * Returns 1 if the file got replaced, or 0 if it changed; in that case,
+ * and on failure, which returns -1, the temporary file gets removed,
+ * unless it was already renamed.
+ */
+int
+confctl_replace(struct confctl *cc, const char *path, const char *tmppath, int tmpfd)
+{
+	struct stat sb;
+	int error, fd = -1, unchanged;
+
+	error = flock(tmpfd, LOCK_EX);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "unable to lock %s", tmppath);
+		remove_tmpfile(tmppath);
+		return (-1);
+	}
+
+	if (identity_applies(cc, path)) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 && errno != ENOENT) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "unable to open %s", path);
+			remove_tmpfile(tmppath);
+			return (-1);
+		}
+		unchanged = 0;
+		if (fd >= 0) {
+			error = flock(fd, LOCK_EX);
+			if (error != 0) {
+				confctl_error_set(&cc->cc_error,
+				    CONFCTL_ERROR_SYSTEM, errno,
+				    "unable to lock %s", path);
+				unchanged = -1;
+			} else {
+				unchanged = identity_unchanged(cc, path, fd);
+			}
+		}
+		if (unchanged <= 0) {
+			if (fd >= 0)
+				close(fd);
+			remove_tmpfile(tmppath);
+			return (unchanged);
+		}
+	}
+
+	error = rename(tmppath, path);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot replace %s; use -I to rewrite file in place", path);
+		remove_tmpfile(tmppath);
+		goto fail;
+	}
+	error = fstat(tmpfd, &sb);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot stat %s", path);
+		goto fail;
+	}
+	confctl_set_identity(cc, path, &sb, NULL);
+	error = confctl_offsets_invalidate(cc, path);
+	if (error != 0)
+		goto fail;
+
+	if (fd >= 0)
+		close(fd);
+	error = flock(tmpfd, LOCK_UN);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "unable to unlock %s", path);
+		return (-1);
+	}
+
+	return (1);
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	return (-1);
+}
+
+static int	load_file(struct confctl *cc, const char *path);
+
+/*
+ * Called when the file changed since it was loaded: loads it again,
+ * and lets the caller redo their changes.
+ */
+int
+confctl_reload(struct confctl *cc, const char *path)
+{
+	struct confctl *fresh;
+	struct confctl_var *root;
+	struct confctl_index *index;
+	struct confctl_identity *identity;
+	int error;
+
+	if (cc->cc_replay == NULL) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_CHANGED, 0,
+		    "%s changed since it was loaded", path);
+		return (-1);
+	}
+
+	fresh = confctl_new();
+	fresh->cc_stats = cc->cc_stats;
+	fresh->cc_threads = cc->cc_threads;
+	fresh->cc_equals_sign = cc->cc_equals_sign;
+	fresh->cc_follow_includes = cc->cc_follow_includes;
+	fresh->cc_read_only = cc->cc_read_only;
+	fresh->cc_rewrite_in_place = cc->cc_rewrite_in_place;
+	fresh->cc_semicolon = cc->cc_semicolon;
+	fresh->cc_slash_slash_comments = cc->cc_slash_slash_comments;
+	fresh->cc_slash_star_comments = cc->cc_slash_star_comments;
+	confctl_set_value_index(fresh, cc->cc_index != NULL);
+	error = load_file(fresh, path);
+	if (error != 0) {
+		cc->cc_error = fresh->cc_error;
+		fresh->cc_stats = NULL;
+		confctl_delete(fresh);
+		return (-1);
+	}
+	confctl_observe_reload(cc, fresh);
+	cc->cc_replay(fresh, cc->cc_replay_arg);
+	confctl_observe_replayed(cc, fresh);
+
+	/*
+	 * Swap the trees, and get rid of the old one.
+	 */
+	root = cc->cc_root;
+	index = cc->cc_index;
+	identity = cc->cc_identity;
+	cc->cc_root = fresh->cc_root;
+	cc->cc_index = fresh->cc_index;
+	cc->cc_identity = fresh->cc_identity;
+	fresh->cc_root = root;
+	fresh->cc_index = index;
+	fresh->cc_identity = identity;
+	TAILQ_SWAP(&cc->cc_includes, &fresh->cc_includes, confctl_include, cin_next);
+	cc->cc_root->cv_ext->cx_confctl = cc;
+	fresh->cc_root->cv_ext->cx_confctl = fresh;
+	fresh->cc_stats = NULL;
+	confctl_delete(fresh);
+
+	return (0);
+}
+
+static int
+confctl_save_in_place(struct confctl *cc, const char *path)
+{
+	struct stat sb;
+	FILE *fp;
+	int error, fd, attempts, unchanged;
+
+	for (attempts = 0;; attempts++) {
+		if (attempts >= SAVE_ATTEMPTS) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_CHANGED,
+			    0, "%s keeps changing; giving up", path);
+			return (-1);
+		}
+
+		/*
+		 * Don't truncate the file before it's locked and checked.
+		 */
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if (fd < 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot open %s", path);
+			return (-1);
+		}
+		error = flock(fd, LOCK_EX);
+		if (error != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "unable to lock %s", path);
+			close(fd);
+			return (-1);
+		}
+		if (!identity_applies(cc, path))
+			break;
+		unchanged = identity_unchanged(cc, path, fd);
+		if (unchanged > 0)
+			break;
+		close(fd);
+		if (unchanged < 0)
+			return (-1);
+		error = confctl_reload(cc, path);
+		if (error != 0)
+			return (-1);
+	}
+
+	error = ftruncate(fd, 0);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot truncate %s", path);
+		close(fd);
+		return (-1);
+	}
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fdopen");
+		close(fd);
+		return (-1);
+	}
+	confctl_stats_begin(cc, CONFCTL_PHASE_WRITE);
+	error = confctl_write(cc, fp);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot write %s", path);
+		goto fail;
+	}
+	confctl_stats_end(cc, CONFCTL_PHASE_WRITE);
+	confctl_stats_begin(cc, CONFCTL_PHASE_FSYNC);
+	error = fsync(fd);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fsync");
+		goto fail;
+	}
+	confctl_stats_end(cc, CONFCTL_PHASE_FSYNC);
+	error = fstat(fd, &sb);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot stat %s", path);
+		goto fail;
+	}
+	confctl_set_identity(cc, path, &sb, NULL);
+	error = confctl_offsets_invalidate(cc, path);
+	if (error != 0)
+		goto fail;
+	error = flock(fd, LOCK_UN);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "unable to unlock %s", path);
+		goto fail;
+	}
+	error = fclose(fp);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fclose");
+		return (-1);
+	}
+
+	return (0);
+
+fail:
+	fclose(fp);
+	return (-1);
+}
+
+static int
+confctl_save_atomic(struct confctl *cc, const char *path)
+{
+	FILE *fp;
+	int error, fd, written, attempts, replaced;
+	char *tmppath = NULL;
+
+	for (attempts = 0;; attempts++) {
+		if (attempts >= SAVE_ATTEMPTS) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_CHANGED,
+			    0, "%s keeps changing; giving up", path);
+			return (-1);
+		}
+
+		written = asprintf(&tmppath, "%s.XXXXXXXXX", path);
+		if (written < 0)
+			err(1, "asprintf");
+		fd = mkstemp(tmppath);
+		if (fd < 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot create temporary file %s; use -I to rewrite file in place", tmppath);
+			free(tmppath);
+			return (-1);
+		}
+		fp = fdopen(fd, "w");
+		if (fp == NULL) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "fdopen");
+			close(fd);
+			goto fail;
+		}
+		confctl_stats_begin(cc, CONFCTL_PHASE_WRITE);
+		error = confctl_write(cc, fp);
+		if (error != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot write %s", tmppath);
+			fclose(fp);
+			goto fail;
+		}
+		confctl_stats_end(cc, CONFCTL_PHASE_WRITE);
+		confctl_stats_begin(cc, CONFCTL_PHASE_FSYNC);
+		error = fsync(fd);
+		if (error != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "fsync");
+			fclose(fp);
+			goto fail;
+		}
+		confctl_stats_end(cc, CONFCTL_PHASE_FSYNC);
+		confctl_stats_begin(cc, CONFCTL_PHASE_RENAME);
+		replaced = confctl_replace(cc, path, tmppath, fd);
+		confctl_stats_end(cc, CONFCTL_PHASE_RENAME);
+		free(tmppath);
+		tmppath = NULL;
+		error = fclose(fp);
+		if (replaced < 0)
+			return (-1);
+		if (error != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "fclose");
+			return (-1);
+		}
+		if (replaced)
+			break;
+		error = confctl_reload(cc, path);
+		if (error != 0)
+			return (-1);
+	}
+
+	confctl_stats_begin(cc, CONFCTL_PHASE_RENAME);
+	error = confctl_sync_dirs((char *const *)&path, 1, &cc->cc_error);
+	confctl_stats_end(cc, CONFCTL_PHASE_RENAME);
+
+	return (error);
+
+fail:
+	remove_tmpfile(tmppath);
+	free(tmppath);
+	return (-1);
+}
+
+/*
+ * Past the point where some of the files are saved, failing to save
+ * the others leaves the group half done; this adds the ones that got
+ * saved to the error message.
+ */
+void
+confctl_error_saved(struct confctl_error *ce, char *const *paths,
+    const bool *saved, size_t n)
+{
+	const char *sep = "; already saved: ";
+	size_t i, len;
+
+	for (i = 0; i < n; i++) {
+		if (!saved[i])
+			continue;
+		len = strlen(ce->ce_message);
+		snprintf(ce->ce_message + len, sizeof(ce->ce_message) - len,
+		    "%s%s", sep, paths[i]);
+		sep = ", ";
+	}
+}
+
+static int
+strcmp_ptr(const void *a, const void *b)
+{
+
+	return (strcmp(*(char *const *)a, *(char *const *)b));
+}
+
+/*
+ * Rename is only durable once the directory containing the file gets synced.
+ * Sync each distinct parent directory of 'paths' once.
+ */
+int
+confctl_sync_dirs(char *const *paths, size_t n, struct confctl_error *ce)
+{
+	char **dirs, *copy;
+	size_t i;
+	int error = 0, fd;
+
+	dirs = calloc(n, sizeof(*dirs));
+	if (dirs == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++) {
+		copy = strdup(paths[i]);
+		if (copy == NULL)
+			err(1, "strdup");
+		dirs[i] = strdup(dirname(copy));
+		if (dirs[i] == NULL)
+			err(1, "strdup");
+		free(copy);
+	}
+	qsort(dirs, n, sizeof(*dirs), strcmp_ptr);
+
+	for (i = 0; i < n; i++) {
+		if (i > 0 && strcmp(dirs[i], dirs[i - 1]) == 0)
+			continue;
+		fd = open(dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "cannot open %s", dirs[i]);
+			error = -1;
+			break;
+		}
+		/*
+		 * Some filesystems can't sync directories; nothing we can do.
+		 */
+		if (fsync(fd) != 0 && errno != EINVAL) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "cannot sync %s", dirs[i]);
+			error = -1;
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+
+	for (i = 0; i < n; i++)
+		free(dirs[i]);
+	free(dirs);
+
+	return (error);
+}
+
+struct confctl_save_group *
+confctl_save_group_begin(void)
+{
+	struct confctl_save_group *csg;
+
+	csg = calloc(1, sizeof(*csg));
+	if (csg == NULL)
+		err(1, "calloc");
+
+	return (csg);
+}
+
+int
+confctl_save_group_add2(struct confctl_save_group *csg, struct confctl *cc,
+    const char *path, const struct confctl_error **errorp)
+{
+
+	error_clear(cc);
+	if (errorp != NULL)
+		*errorp = &cc->cc_error;
+
+	if (cc->cc_lossy) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_LOSSY, 0,
+		    "cannot save %s: loaded without comments and formatting",
+		    path);
+		return (-1);
+	}
+	if (cc->cc_partial) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_LOSSY, 0,
+		    "cannot save %s: only parts of it were loaded", path);
+		return (-1);
+	}
+	if (cc->cc_read_only) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_UNSUPPORTED, 0,
+		    "cannot save %s: loaded read-only", path);
+		return (-1);
+	}
+	if (!TAILQ_EMPTY(&cc->cc_includes)) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_UNSUPPORTED, 0,
+		    "cannot save %s along with others: it includes files", path);
+		return (-1);
+	}
+
+	if (csg->csg_len == csg->csg_allocated) {
+		csg->csg_allocated = csg->csg_allocated * 2 + 8;
+		csg->csg_ccs = realloc(csg->csg_ccs, csg->csg_allocated * sizeof(*csg->csg_ccs));
+		csg->csg_paths = realloc(csg->csg_paths, csg->csg_allocated * sizeof(*csg->csg_paths));
+		if (csg->csg_ccs == NULL || csg->csg_paths == NULL)
+			err(1, "realloc");
+	}
+
+	csg->csg_ccs[csg->csg_len] = cc;
+	csg->csg_paths[csg->csg_len] = strdup(path);
+	if (csg->csg_paths[csg->csg_len] == NULL)
+		err(1, "strdup");
+	csg->csg_len++;
+
+	return (0);
+}
+
+void
+confctl_save_group_add(struct confctl_save_group *csg, struct confctl *cc, const char *path)
+{
+	const struct confctl_error *ce;
+
+	if (confctl_save_group_add2(csg, cc, path, &ce) != 0)
+		confctl_error_exit(ce);
+}
+
+void
+confctl_save_group_delete(struct confctl_save_group *csg)
+{
+	size_t i;
+
+	for (i = 0; i < csg->csg_len; i++)
+		free(csg->csg_paths[i]);
+	free(csg->csg_paths);
+	free(csg->csg_ccs);
+	free(csg);
+}
+
+struct dev_file {
+	dev_t	df_dev;
+	size_t	df_file;
+};
+
+static int
+dev_file_compare(const void *a, const void *b)
+{
+	const struct dev_file *dfa = a, *dfb = b;
+
+	if (dfa->df_dev != dfb->df_dev)
+		return (dfa->df_dev < dfb->df_dev ? -1 : 1);
+	if (dfa->df_file != dfb->df_file)
+		return (dfa->df_file < dfb->df_file ? -1 : 1);
+	return (0);
+}
+
+/*
+ * A single syncfs(2), or fdatasync(2) of a single file.
+ */
+struct sync_job {
+	int	sj_fd;
+	bool	sj_syncfs;
+	int	sj_errno;
+};
+
+static void
+sync_task(void *arg, size_t i)
+{
+	struct sync_job *sj;
+	int error;
+
+	sj = (struct sync_job *)arg + i;
+#ifdef HAVE_SYNCFS
+	if (sj->sj_syncfs)
+		error = syncfs(sj->sj_fd);
+	else
+#endif
+		error = fdatasync(sj->sj_fd);
+	sj->sj_errno = error != 0 ? errno : 0;
+}
+
+/*
+ * Sync the data of all the files; NULL entries are skipped.  Where there
+ * is more than one of them on a filesystem, a single syncfs(2) is cheaper
+ * than syncing each one.  The syncs are waiting for different disks, or
+ * at least different files, so they're all done at the same time.
+ */
+static int
+save_group_sync(FILE **fps, size_t n)
+{
+	struct dev_file *dfs;
+	struct sync_job *sjs;
+	struct stat sb;
+	size_t i, j, m, njobs = 0;
+	int error = 0;
+
+	dfs = calloc(n, sizeof(*dfs));
+	sjs = calloc(n, sizeof(*sjs));
+	if (dfs == NULL || sjs == NULL)
+		err(1, "calloc");
+	for (i = 0, m = 0; i < n; i++) {
+		if (fps[i] == NULL)
+			continue;
+		if (fstat(fileno(fps[i]), &sb) != 0)
+			err(1, "fstat");
+		dfs[m].df_dev = sb.st_dev;
+		dfs[m].df_file = i;
+		m++;
+	}
+	n = m;
+	qsort(dfs, n, sizeof(*dfs), dev_file_compare);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; j++) {
+			if (dfs[j].df_dev != dfs[i].df_dev)
+				break;
+		}
+#ifdef HAVE_SYNCFS
+		if (j - i > 1) {
+			sjs[njobs].sj_fd = fileno(fps[dfs[i].df_file]);
+			sjs[njobs].sj_syncfs = true;
+			njobs++;
+			continue;
+		}
+#endif
+		for (m = i; m < j; m++) {
+			sjs[njobs].sj_fd = fileno(fps[dfs[m].df_file]);
+			njobs++;
+		}
+	}
+
+	if (njobs > 0)
+		parallel_run(parallel_ncpus(), njobs, sync_task, sjs);
+	for (i = 0; i < njobs; i++) {
+		if (sjs[i].sj_errno != 0) {
+			errno = sjs[i].sj_errno;
+			error = -1;
+			break;
+		}
+	}
+
+	free(sjs);
+	free(dfs);
+
+	return (error);
+}
+
+/*
+ * Does the work of confctl_save_group_commit2(), with the reason for
+ * failure in 'ce'.  On failure, the temporary files get removed, and
+ * the ones opened to rewrite in place get closed, which unlocks them.
+ */
+static int
+save_group_commit(struct confctl_save_group *csg, struct confctl_error *ce)
+{
+	struct confctl *cc;
+	struct stat sb;
+	FILE **fps;
+	char **tmppaths, **renamed;
+	size_t i, n, nrenamed = 0;
+	int error, fd, unchanged;
+	bool *conflicts, *committed;
+
+	n = csg->csg_len;
+	fps = calloc(n, sizeof(*fps));
+	tmppaths = calloc(n, sizeof(*tmppaths));
+	renamed = calloc(n, sizeof(*renamed));
+	conflicts = calloc(n, sizeof(*conflicts));
+	committed = calloc(n, sizeof(*committed));
+	if (fps == NULL || tmppaths == NULL || renamed == NULL ||
+	    conflicts == NULL || committed == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; i++) {
+		cc = csg->csg_ccs[i];
+		if (cc->cc_rewrite_in_place) {
+			fd = open(csg->csg_paths[i], O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+			if (fd < 0) {
+				confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+				    errno, "cannot open %s", csg->csg_paths[i]);
+				goto fail;
+			}
+			error = flock(fd, LOCK_EX);
+			if (error != 0) {
+				confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+				    errno, "unable to lock %s", csg->csg_paths[i]);
+				close(fd);
+				goto fail;
+			}
+			unchanged = 1;
+			if (identity_applies(cc, csg->csg_paths[i]))
+				unchanged = identity_unchanged(cc, csg->csg_paths[i], fd);
+			if (unchanged < 0) {
+				*ce = cc->cc_error;
+				close(fd);
+				goto fail;
+			}
+			if (unchanged == 0) {
+				close(fd);
+				conflicts[i] = true;
+				continue;
+			}
+			error = ftruncate(fd, 0);
+			if (error != 0) {
+				confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+				    errno, "cannot truncate %s", csg->csg_paths[i]);
+				close(fd);
+				goto fail;
+			}
+		} else {
+			error = asprintf(&tmppaths[i], "%s.XXXXXXXXX", csg->csg_paths[i]);
+			if (error < 0)
+				err(1, "asprintf");
+			fd = mkstemp(tmppaths[i]);
+			if (fd < 0) {
+				confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+				    errno, "cannot create temporary file %s.XXXXXXXXX; use -I to rewrite file in place",
+				    csg->csg_paths[i]);
+				free(tmppaths[i]);
+				tmppaths[i] = NULL;
+				goto fail;
+			}
+		}
+		fps[i] = fdopen(fd, "w");
+		if (fps[i] == NULL) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "fdopen");
+			close(fd);
+			goto fail;
+		}
+		confctl_stats_begin(cc, CONFCTL_PHASE_WRITE);
+		error = confctl_write(cc, fps[i]);
+		if (error != 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "cannot write %s", csg->csg_paths[i]);
+			goto fail;
+		}
+		confctl_stats_end(cc, CONFCTL_PHASE_WRITE);
+	}
+
+	for (i = 0; i < n; i++)
+		confctl_stats_begin(csg->csg_ccs[i], CONFCTL_PHASE_FSYNC);
+	error = save_group_sync(fps, n);
+	if (error != 0) {
+		confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno, "fsync");
+		goto fail;
+	}
+	for (i = 0; i < n; i++)
+		confctl_stats_end(csg->csg_ccs[i], CONFCTL_PHASE_FSYNC);
+
+	/*
+	 * Files rewritten in place are done now.
+	 */
+	for (i = 0; i < n; i++) {
+		if (fps[i] != NULL && tmppaths[i] == NULL)
+			committed[i] = true;
+	}
+	for (i = 0; i < n; i++) {
+		if (fps[i] == NULL || tmppaths[i] != NULL)
+			continue;
+		error = fstat(fileno(fps[i]), &sb);
+		if (error != 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "cannot stat %s", csg->csg_paths[i]);
+			goto fail;
+		}
+		confctl_set_identity(csg->csg_ccs[i], csg->csg_paths[i], &sb, NULL);
+		error = confctl_offsets_invalidate(csg->csg_ccs[i],
+		    csg->csg_paths[i]);
+		if (error != 0) {
+			*ce = csg->csg_ccs[i]->cc_error;
+			goto fail;
+		}
+		error = flock(fileno(fps[i]), LOCK_UN);
+		if (error != 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "unable to unlock %s", csg->csg_paths[i]);
+			goto fail;
+		}
+		error = fclose(fps[i]);
+		fps[i] = NULL;
+		if (error != 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "fclose");
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		confctl_stats_begin(csg->csg_ccs[i], CONFCTL_PHASE_RENAME);
+	for (i = 0; i < n; i++) {
+		if (tmppaths[i] == NULL)
+			continue;
+		cc = csg->csg_ccs[i];
+		error = confctl_replace(cc, csg->csg_paths[i], tmppaths[i], fileno(fps[i]));
+		/*
+		 * Whatever happened, the temporary file is gone now.
+		 */
+		free(tmppaths[i]);
+		tmppaths[i] = NULL;
+		if (error < 0) {
+			*ce = cc->cc_error;
+			goto fail;
+		}
+		if (error > 0) {
+			renamed[nrenamed] = csg->csg_paths[i];
+			nrenamed++;
+			committed[i] = true;
+		} else {
+			conflicts[i] = true;
+		}
+		error = fclose(fps[i]);
+		fps[i] = NULL;
+		if (error != 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "fclose");
+			goto fail;
+		}
+	}
+	if (confctl_sync_dirs(renamed, nrenamed, ce) != 0)
+		goto fail;
+	for (i = 0; i < n; i++)
+		confctl_stats_end(csg->csg_ccs[i], CONFCTL_PHASE_RENAME);
+
+	/*
+	 * Files changed by someone else in the meantime get loaded again,
+	 * and saved one by one.
+	 */
+	for (i = 0; i < n; i++) {
+		if (!conflicts[i])
+			continue;
+		cc = csg->csg_ccs[i];
+		if (confctl_reload(cc, csg->csg_paths[i]) != 0 ||
+		    confctl_save2(cc, csg->csg_paths[i], NULL) != 0) {
+			*ce = cc->cc_error;
+			goto fail;
+		}
+		committed[i] = true;
+	}
+
+	error = 0;
+	goto out;
+
+fail:
+	confctl_error_saved(ce, csg->csg_paths, committed, n);
+	for (i = 0; i < n; i++) {
+		if (fps[i] != NULL)
+			fclose(fps[i]);
+		if (tmppaths[i] != NULL) {
+			remove_tmpfile(tmppaths[i]);
+			free(tmppaths[i]);
+		}
+	}
+	error = -1;
+out:
+	free(committed);
+	free(conflicts);
+	free(renamed);
+	free(tmppaths);
+	free(fps);
+	return (error);
+}
+
+int
+confctl_save_group_commit2(struct confctl_save_group *csg,
+    const struct confctl_error **errorp)
+{
+	struct confctl_error ce;
+	size_t i;
+	int error;
+
+	for (i = 0; i < csg->csg_len; i++)
+		error_clear(csg->csg_ccs[i]);
+
+	error = save_group_commit(csg, &ce);
+	if (error != 0) {
+		for (i = 0; i < csg->csg_len; i++)
+			csg->csg_ccs[i]->cc_error = ce;
+	}
+	if (errorp != NULL)
+		*errorp = csg->csg_len > 0 ? &csg->csg_ccs[0]->cc_error : NULL;
+	confctl_save_group_delete(csg);
+
+	return (error);
+}
+
+void
+confctl_save_group_commit(struct confctl_save_group *csg)
+{
+	const struct confctl_error *ce;
+
+	if (confctl_save_group_commit2(csg, &ce) != 0)
+		confctl_error_exit(ce);
+}
+
+static void	cv_delete(struct confctl_index *ci, struct confctl_var *cv);
+
+static struct confctl *
+cv_confctl(struct confctl_var *cv)
+{
+
+	while (cv->cv_parent != NULL)
+		cv = cv->cv_parent;
+
+	return (CV_EXT(cv, cx_confctl));
+}
+
+static void
+index_invalidate_sorted(struct confctl_index *ci)
+{
+
+	free(ci->ci_sorted);
+	ci->ci_sorted = NULL;
+	free(ci->ci_ranks);
+	ci->ci_ranks = NULL;
+}
+
+static bool
+index_contains(struct confctl_index *ci, struct confctl_var *cv)
+{
+
+	if (ci == NULL)
+		return (false);
+	return (confctl_varmap_contains(ci->ci_map, cv));
+}
+
+static void
+index_insert(struct confctl_index *ci, struct confctl_var *cv)
+{
+
+	assert(confctl_var_has_value(cv));
+
+	confctl_varmap_insert(ci->ci_map, cv);
+	index_invalidate_sorted(ci);
+}
+
+static void
+index_remove(struct confctl_index *ci, struct confctl_var *cv)
+{
+
+	confctl_varmap_remove(ci->ci_map, cv);
+	index_invalidate_sorted(ci);
+}
+
+static void
+index_insert_tree(struct confctl_index *ci, struct confctl_var *cv)
+{
+	struct confctl_var *child;
+
+	if (confctl_var_has_value(cv) && !index_contains(ci, cv))
+		index_insert(ci, cv);
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		index_insert_tree(ci, child);
+}
+
+static void
+index_remove_tree(struct confctl_index *ci, struct confctl_var *cv)
+{
+	struct confctl_var *child;
+
+	if (index_contains(ci, cv))
+		index_remove(ci, cv);
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		index_remove_tree(ci, child);
+}
+
+static void
+index_delete(struct confctl_index *ci)
+{
+
+	if (ci == NULL)
+		return;
+	confctl_varmap_delete(ci->ci_map);
+	free(ci->ci_sorted);
+	free(ci->ci_ranks);
+	free(ci);
+}
+
+static struct confctl_index *
+index_get(struct confctl *cc)
+{
+
+	if (cc->cc_index == NULL)
+		confctl_set_value_index(cc, true);
+	return (cc->cc_index);
+}
+
+/*
+ * Variable, and where it is in the file, for sorting.
+ */
+struct index_sort {
+	struct confctl_var	*is_var;
+	size_t			is_rank;
+};
+
+static void
+index_collect(struct confctl_index *ci, struct confctl_var *cv,
+    struct index_sort *sorted, size_t *n)
+{
+	struct confctl_var *child;
+
+	if (index_contains(ci, cv)) {
+		sorted[*n].is_var = cv;
+		sorted[*n].is_rank = *n;
+		(*n)++;
+	}
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		index_collect(ci, child, sorted, n);
+}
+
+static int
+index_compare(const void *a, const void *b)
+{
+	const struct index_sort *isa, *isb;
+	int cmp;
+
+	isa = a;
+	isb = b;
+
+	cmp = strcmp(isa->is_var->cv_value->b_buf, isb->is_var->cv_value->b_buf);
+	if (cmp != 0)
+		return (cmp);
+	/*
+	 * Keep variables with the same value in the order they appear in the file.
+	 */
+	if (isa->is_rank < isb->is_rank)
+		return (-1);
+	if (isa->is_rank > isb->is_rank)
+		return (1);
+	return (0);
+}
+
+static struct confctl_var **
+index_sorted(struct confctl *cc)
+{
+	struct confctl_index *ci;
+	struct index_sort *sorted;
+	size_t i, n = 0;
+
+	ci = index_get(cc);
+	if (ci->ci_sorted != NULL)
+		return (ci->ci_sorted);
+
+	sorted = calloc(ci->ci_map->cvm_len + 1, sizeof(*sorted));
+	ci->ci_sorted = calloc(ci->ci_map->cvm_len + 1, sizeof(*ci->ci_sorted));
+	ci->ci_ranks = calloc(ci->ci_map->cvm_allocated + 1, sizeof(*ci->ci_ranks));
+	if (sorted == NULL || ci->ci_sorted == NULL || ci->ci_ranks == NULL)
+		err(1, "calloc");
+	index_collect(ci, confctl_root(cc), sorted, &n);
+	assert(n == ci->ci_map->cvm_len);
+	qsort(sorted, n, sizeof(*sorted), index_compare);
+	for (i = 0; i < n; i++) {
+		ci->ci_sorted[i] = sorted[i].is_var;
+		ci->ci_ranks[confctl_varmap_entry(ci->ci_map, sorted[i].is_var)] = i;
+	}
+	free(sorted);
+
+	return (ci->ci_sorted);
+}
+
+/*
+ * Below this number of children, finding them by name is done
+ * by just walking the list.
+ */
+#define	NAMES_MIN	16
+
+/*
+ * New children are always appended at the end, which
+ * is what keeps the table in the order of siblings.
+ */
+static void
+names_insert(struct confctl_var *parent, struct confctl_var *cv)
+{
+	struct confctl_varmap *names;
+
+	names = CV_EXT(parent, cx_names);
+	if (names == NULL)
+		return;
+
+	assert(TAILQ_NEXT(cv, cv_next) == NULL);
+	confctl_varmap_insert(names, cv);
+}
+
+static void
+names_remove(struct confctl_var *parent, struct confctl_var *cv)
+{
+	struct confctl_varmap *names;
+
+	names = CV_EXT(parent, cx_names);
+	if (names == NULL)
+		return;
+
+	confctl_varmap_remove(names, cv);
+}
+
+/*
+ * Puts back a child that was removed to be renamed.  It has to come
+ * after the siblings before it that have the same name; they're only
+ * looked for when there are any.
+ */
+static void
+names_rename(struct confctl_var *parent, struct confctl_var *cv)
+{
+	struct confctl_varmap *names;
+	struct confctl_var *prev;
+
+	names = CV_EXT(parent, cx_names);
+	if (names == NULL)
+		return;
+
+	if (confctl_varmap_find(names, cv->cv_name->b_buf) == NULL) {
+		confctl_varmap_insert(names, cv);
+		return;
+	}
+
+	for (prev = TAILQ_PREV(cv, confctl_var_head, cv_next); prev != NULL;
+	    prev = TAILQ_PREV(prev, confctl_var_head, cv_next)) {
+		if (strcmp(prev->cv_name->b_buf, cv->cv_name->b_buf) == 0)
+			break;
+	}
+	confctl_varmap_insert_after(names, cv, prev);
+}
+
+static void
+names_delete(struct confctl_var *parent)
+{
+
+	if (CV_EXT(parent, cx_names) == NULL)
+		return;
+	confctl_varmap_delete(parent->cv_ext->cx_names);
+	parent->cv_ext->cx_names = NULL;
+}
+
+/*
+ * Returns the table, building it if there are enough children
+ * to make it worthwhile, or NULL if there aren't.
+ */
+static struct confctl_varmap *
+names_get(struct confctl_var *parent)
+{
+	struct confctl_varmap *names;
+	struct confctl_var *child;
+	size_t n = 0;
+
+	names = CV_EXT(parent, cx_names);
+	if (names != NULL)
+		return (names);
+
+	TAILQ_FOREACH(child, &parent->cv_children, cv_next) {
+		n++;
+		if (n >= NAMES_MIN)
+			break;
+	}
+	if (n < NAMES_MIN)
+		return (NULL);
+
+	names = confctl_varmap_new(false, NAMES_MIN * 2);
+	TAILQ_FOREACH(child, &parent->cv_children, cv_next)
+		confctl_varmap_insert(names, child);
+	confctl_var_ext(parent)->cx_names = names;
+
+	return (names);
+}
+
+bool
+confctl_var_has_children(const struct confctl_var *cv)
+{
+
+	if (!TAILQ_EMPTY(&cv->cv_children))
+		return (true);
+	return (false);
+}
+
+bool
+confctl_var_has_value(const struct confctl_var *cv)
+{
+
+	if (cv->cv_value != NULL)
+		return (true);
+	return (false);
+}
+
+struct confctl *
+confctl_new(void)
+{
+	struct confctl *cc;
+
+	cc = calloc(sizeof(*cc), 1);
+	if (cc == NULL)
+		err(1, "calloc");
+	cc->cc_root = cv_new_root(cc);
+	confctl_var_ext(cc->cc_root)->cx_confctl = cc;
+	TAILQ_INIT(&cc->cc_includes);
+
+	return (cc);
+}
+
+void
+confctl_delete(struct confctl *cc)
+{
+	struct confctl_include *ci;
+
+	while ((ci = TAILQ_FIRST(&cc->cc_includes)) != NULL) {
+		TAILQ_REMOVE(&cc->cc_includes, ci, cin_next);
+		confctl_include_delete(ci);
+	}
+	confctl_batch_discard(cc);
+	cv_delete(cc->cc_index, cc->cc_root);
+	index_delete(cc->cc_index);
+	buf_delete(cc->cc_junk);
+	confctl_set_stats(cc, false);
+	if (cc->cc_identity != NULL)
+		free(cc->cc_identity->ci_path);
+	free(cc->cc_identity);
+	free(cc);
+}
+
+void
+confctl_set_lossless(struct confctl *cc, bool lossless)
+{
+
+	cc->cc_lossy = !lossless;
+	if (cc->cc_lossy && cc->cc_junk == NULL)
+		cc->cc_junk = buf_new(cc);
+}
+
+void
+confctl_set_read_only(struct confctl *cc, bool read_only)
+{
+
+	cc->cc_read_only = read_only;
+}
+
+void
+confctl_set_replay(struct confctl *cc, void (*replay)(struct confctl *cc, void *arg), void *arg)
+{
+
+	cc->cc_replay = replay;
+	cc->cc_replay_arg = arg;
+}
+
+void
+confctl_set_threads(struct confctl *cc, unsigned int threads)
+{
+
+	cc->cc_threads = threads;
+}
+
+void
+confctl_set_follow_includes(struct confctl *cc, bool follow)
+{
+
+	cc->cc_follow_includes = follow;
+}
+
+void
+confctl_set_equals_sign(struct confctl *cc, bool equals)
+{
+
+	cc->cc_equals_sign = equals;
+}
+
+void
+confctl_set_value_index(struct confctl *cc, bool index)
+{
+
+	if (!index) {
+		index_delete(cc->cc_index);
+		cc->cc_index = NULL;
+		return;
+	}
+
+	if (cc->cc_index != NULL)
+		return;
+
+	cc->cc_index = calloc(sizeof(*cc->cc_index), 1);
+	if (cc->cc_index == NULL)
+		err(1, "calloc");
+	cc->cc_index->ci_map = confctl_varmap_new(true, 64);
+	index_insert_tree(cc->cc_index, confctl_root(cc));
+}
+
+void
+confctl_set_stats(struct confctl *cc, bool stats)
+{
+
+	if (!stats) {
+		free(cc->cc_stats);
+		cc->cc_stats = NULL;
+		return;
+	}
+
+	if (cc->cc_stats != NULL)
+		return;
+
+	cc->cc_stats = calloc(sizeof(*cc->cc_stats), 1);
+	if (cc->cc_stats == NULL)
+		err(1, "calloc");
+}
+
+static uint64_t
+stats_clock(clockid_t clock)
+{
+	struct timespec ts;
+	int error;
+
+	error = clock_gettime(clock, &ts);
+	if (error != 0)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void
+confctl_stats_begin(struct confctl *cc, enum confctl_phase phase)
+{
+	struct confctl_stats_state *css;
+
+	css = cc->cc_stats;
+	if (css == NULL)
+		return;
+
+	css->css_wall_started[phase] = stats_clock(CLOCK_MONOTONIC);
+	css->css_cpu_started[phase] = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void
+confctl_stats_end(struct confctl *cc, enum confctl_phase phase)
+{
+	struct confctl_stats_state *css;
+
+	css = cc->cc_stats;
+	if (css == NULL)
+		return;
+
+	css->css_stats.cs_wall_ns[phase] += stats_clock(CLOCK_MONOTONIC) - css->css_wall_started[phase];
+	css->css_stats.cs_cpu_ns[phase] += stats_clock(CLOCK_PROCESS_CPUTIME_ID) - css->css_cpu_started[phase];
+}
+
+static void
+stats_count(struct confctl_var *cv, struct confctl_stats *stats, unsigned int depth)
+{
+	struct confctl_var *child;
+
+	stats->cs_nodes++;
+	if (cv->cv_before != NULL)
+		stats->cs_bufs++;
+	if (cv->cv_name != NULL)
+		stats->cs_bufs++;
+	if (cv->cv_middle != NULL)
+		stats->cs_bufs++;
+	if (cv->cv_value != NULL)
+		stats->cs_bufs++;
+	if (cv->cv_after != NULL)
+		stats->cs_bufs++;
+	if (depth > stats->cs_max_depth)
+		stats->cs_max_depth = depth;
+
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		stats_count(child, stats, depth + 1);
+}
+
+void
+confctl_get_stats(struct confctl *cc, struct confctl_stats *stats)
+{
+
+	if (cc->cc_stats == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	*stats = cc->cc_stats->css_stats;
+
+	/*
+	 * Don't count the root node, which is always there.
+	 */
+	stats_count(confctl_root(cc), stats, 0);
+	stats->cs_nodes--;
+}
+
+const char *
+confctl_phase_name(enum confctl_phase phase)
+{
+	static const char *names[CONFCTL_PHASE_MAX] = {
+		[CONFCTL_PHASE_LOAD] = "load",
+		[CONFCTL_PHASE_FREEZE] = "freeze",
+		[CONFCTL_PHASE_FILTER] = "filter",
+		[CONFCTL_PHASE_MERGE] = "merge",
+		[CONFCTL_PHASE_REMOVE] = "remove",
+		[CONFCTL_PHASE_REINDENT] = "reindent",
+		[CONFCTL_PHASE_WRITE] = "write",
+		[CONFCTL_PHASE_FSYNC] = "fsync",
+		[CONFCTL_PHASE_RENAME] = "rename",
+	};
+
+	assert(phase < CONFCTL_PHASE_MAX);
+
+	return (names[phase]);
+}
+
+void
+confctl_set_rewrite_in_place(struct confctl *cc, bool rewrite)
+{
+
+	cc->cc_rewrite_in_place = rewrite;
+}
+
+void
+confctl_set_semicolon(struct confctl *cc, bool semicolon)
+{
+
+	cc->cc_semicolon = semicolon;
+}
+
+void
+confctl_set_slash_slash_comments(struct confctl *cc, bool slash)
+{
+
+	cc->cc_slash_slash_comments = slash;
+}
+
+void
+confctl_set_slash_star_comments(struct confctl *cc, bool star)
+{
+
+	cc->cc_slash_star_comments = star;
+}
+
+/*
+ * Parsing a large file in several threads.  The file is cut at newlines
+ * into chunks.  Every chunk gets scanned for quotes, escapes, comments
+ * and curly brackets, assuming it does not start inside a quoted string
+ * or a comment.  Adding up the results tells which newlines are at the
+ * top level; chunks whose guess turns out to be wrong get scanned again.
+ * The file is then split at the first top-level newline of each chunk,
+ * and the pieces are parsed concurrently by cv_load().  Each piece is
+ * parsed a bit past its end, to the end of the variable it ends in.
+ *
+ * Between two calls to cv_load() for the root, the parser state is just
+ * the offset in the file.  Each piece remembers the offsets it went through,
+ * and the pieces are joined where one of them stopped at an offset the next
+ * one went through.  When there is no such offset, because the guess
+ * was wrong, the variables get parsed serially until there is.  This way
+ * the tree is always the same as from a serial parse.
+ */
+enum scan_state {
+	SCAN_NORMAL,
+	SCAN_ESCAPED,
+	SCAN_SLASH,
+	SCAN_DQUOTE,
+	SCAN_DQUOTE_ESCAPED,
+	SCAN_SQUOTE,
+	SCAN_SQUOTE_ESCAPED,
+	SCAN_LINE_COMMENT,
+	SCAN_BLOCK_COMMENT,
+	SCAN_BLOCK_STAR,
+};
+
+/*
+ * Chunks starting deeper than this don't get split.
+ */
+#define	SCAN_DEPTHS	16
+
+struct scan_chunk {
+	size_t		sc_start;
+	size_t		sc_end;
+	enum scan_state	sc_state;	/* State at sc_end. */
+	bool		sc_content;	/* Last line has more than junk. */
+	long		sc_depth;	/* Change in depth. */
+	long		sc_min_depth;	/* Lowest depth, relative to start. */
+	size_t		sc_split[SCAN_DEPTHS];	/* See scan_chunk(). */
+};
+
+struct parse_piece {
+	size_t			pp_start;
+	size_t			pp_end;		/* Where the parsing stopped. */
+	size_t			*pp_offsets;	/* Offsets between variables. */
+	size_t			pp_len;
+	size_t			pp_allocated;
+	struct confctl		pp_cc;
+	struct confctl_var	*pp_root;
+	bool			pp_done;	/* Reached the end. */
+};
+
+struct parse {
+	const struct confctl	*p_cc;
+	const char		*p_path;
+	const char		*p_base;
+	size_t			p_len;
+	struct scan_chunk	*p_chunks;
+	struct parse_piece	*p_pieces;
+	size_t			p_npieces;
+};
+
+/*
+ * Scans the chunk, starting in 'state'.  A newline is a candidate for
+ * splitting if it isn't escaped or quoted, and there is something other
+ * than whitespace, semicolons and comments in its line.  For every depth 'd'
+ * the chunk could start at, sc_split[d] is the first such newline at the
+ * top level, or 0 if there isn't one.
+ */
+static void
+scan_chunk(const struct confctl *cc, const char *base, struct scan_chunk *sc,
+    enum scan_state state, bool content)
+{
+	const uint16_t *lex = cc->cc_lex;
+	unsigned char ch;
+	long depth = 0, min_depth = 0;
+	size_t i;
+
+	memset(sc->sc_split, 0, sizeof(sc->sc_split));
+
+	for (i = sc->sc_start; i < sc->sc_end; i++) {
+		ch = base[i];
+		switch (state) {
+		case SCAN_NORMAL:
+			break;
+		case SCAN_ESCAPED:
+			state = SCAN_NORMAL;
+			continue;
+		case SCAN_SLASH:
+			if ((lex[ch] & LEX_COMMENT) != 0) {
+				if (ch == '/')
+					state = SCAN_LINE_COMMENT;
+				else
+					state = SCAN_BLOCK_COMMENT;
+				continue;
+			}
+			state = SCAN_NORMAL;
+			content = true;
+			break;
+		case SCAN_DQUOTE:
+			if (ch == '\\')
+				state = SCAN_DQUOTE_ESCAPED;
+			else if (ch == '"')
+				state = SCAN_NORMAL;
+			continue;
+		case SCAN_DQUOTE_ESCAPED:
+			state = SCAN_DQUOTE;
+			continue;
+		case SCAN_SQUOTE:
+			if (ch == '\\')
+				state = SCAN_SQUOTE_ESCAPED;
+			else if (ch == '\'')
+				state = SCAN_NORMAL;
+			continue;
+		case SCAN_SQUOTE_ESCAPED:
+			state = SCAN_SQUOTE;
+			continue;
+		case SCAN_LINE_COMMENT:
+			if ((lex[ch] & LEX_NEWLINE) == 0)
+				continue;
+			state = SCAN_NORMAL;
+			break;
+		case SCAN_BLOCK_COMMENT:
+			if (ch == '*')
+				state = SCAN_BLOCK_STAR;
+			continue;
+		case SCAN_BLOCK_STAR:
+			if (ch == '/')
+				state = SCAN_NORMAL;
+			else if (ch != '*')
+				state = SCAN_BLOCK_COMMENT;
+			continue;
+		}
+
+		if (lex[ch] == 0) {
+			content = true;
+			continue;
+		}
+		switch (ch) {
+		case '\n':
+			if (content && depth <= 0 && -depth < SCAN_DEPTHS &&
+			    sc->sc_split[-depth] == 0)
+				sc->sc_split[-depth] = i;
+			content = false;
+			break;
+		case '\\':
+			state = SCAN_ESCAPED;
+			content = true;
+			break;
+		case '"':
+			state = SCAN_DQUOTE;
+			content = true;
+			break;
+		case '\'':
+			state = SCAN_SQUOTE;
+			content = true;
+			break;
+		case '#':
+			state = SCAN_LINE_COMMENT;
+			break;
+		case '/':
+			state = SCAN_SLASH;
+			break;
+		case '{':
+			depth++;
+			content = true;
+			break;
+		case '}':
+			depth--;
+			if (depth < min_depth)
+				min_depth = depth;
+			content = true;
+			break;
+		default:
+			if ((lex[ch] & LEX_JUNK) == 0)
+				content = true;
+			break;
+		}
+	}
+
+	sc->sc_state = state;
+	sc->sc_content = content;
+	sc->sc_depth = depth;
+	sc->sc_min_depth = min_depth;
+}
+
+static void
+scan_task(void *arg, size_t i)
+{
+	struct parse *p;
+
+	p = arg;
+	scan_chunk(p->p_cc, p->p_base, &p->p_chunks[i], SCAN_NORMAL, false);
+}
+
+static void
+parse_piece_add_offset(struct parse_piece *pp, size_t offset)
+{
+	size_t *offsets;
+
+	if (pp->pp_len == pp->pp_allocated) {
+		pp->pp_allocated = pp->pp_allocated * 2 + 16;
+		offsets = realloc(pp->pp_offsets,
+		    pp->pp_allocated * sizeof(*offsets));
+		if (offsets == NULL)
+			err(1, "realloc");
+		pp->pp_offsets = offsets;
+	}
+	pp->pp_offsets[pp->pp_len++] = offset;
+}
+
+/*
+ * Returns the number of variables parsed before reaching 'offset',
+ * or -1 if the piece didn't go through it.
+ */
+static ssize_t
+parse_piece_find_offset(const struct parse_piece *pp, size_t offset)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = pp->pp_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pp->pp_offsets[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < pp->pp_len && pp->pp_offsets[lo] == offset)
+		return (lo);
+	return (-1);
+}
+
 static void
-confctl_save_in_place(struct confctl *cc, const char *path)
+parse_task(void *arg, size_t i)
 {
+	struct parse *p;
+	struct parse_piece *pp;
+	size_t end;
+	off_t pos;
 	FILE *fp;
-	int error;
+	bool done;
 
-	fp = fopen(path, "w");
-	if (fp == NULL)
-		err(1, "cannot open %s", path);
-	error = flock(fileno(fp), LOCK_EX);
-	if (error != 0)
-		err(1, "unable to lock %s", path);
-	confctl_write(cc, fp);
-	error = fflush(fp);
-	if (error != 0)
-		err(1, "fflush");
-	error = fsync(fileno(fp));
-	if (error != 0)
-		err(1, "fsync");
-	error = flock(fileno(fp), LOCK_UN);
-	if (error != 0)
-		err(1, "unable to unlock %s", path);
-	error = fclose(fp);
-	if (error != 0)
-		err(1, "fclose");
+	p = arg;
+	pp = &p->p_pieces[i];
+
+	/*
+	 * The last piece gets parsed until the end, like the serial parser does.
+	 */
+	if (i + 1 < p->p_npieces)
+		end = p->p_pieces[i + 1].pp_start;
+	else
+		end = SIZE_MAX;
+
+	pp->pp_root = cv_new_root(&pp->pp_cc);
+	fp = fmemopen((char *)p->p_base + pp->pp_start, p->p_len - pp->pp_start, "r");
+	if (fp == NULL) {
+		confctl_error_set(&pp->pp_cc.cc_error, CONFCTL_ERROR_SYSTEM,
+		    errno, "cannot read %s: fmemopen", p->p_path);
+		return;
+	}
+
+	parse_piece_add_offset(pp, pp->pp_start);
+	for (;;) {
+		done = cv_load(&pp->pp_cc, pp->pp_root, fp);
+		if (ferror(fp) != 0) {
+			confctl_error_set(&pp->pp_cc.cc_error,
+			    CONFCTL_ERROR_SYSTEM, errno, "cannot read %s",
+			    p->p_path);
+			break;
+		}
+		pos = ftello(fp);
+		if (pos < 0) {
+			confctl_error_set(&pp->pp_cc.cc_error,
+			    CONFCTL_ERROR_SYSTEM, errno, "cannot read %s: ftello",
+			    p->p_path);
+			break;
+		}
+		pp->pp_end = pp->pp_start + pos;
+		if (done) {
+			pp->pp_done = true;
+			break;
+		}
+		parse_piece_add_offset(pp, pp->pp_end);
+		if (pp->pp_end >= end)
+			break;
+	}
+
+	if (fclose(fp) != 0 &&
+	    pp->pp_cc.cc_error.ce_code != CONFCTL_ERROR_SYSTEM) {
+		confctl_error_set(&pp->pp_cc.cc_error, CONFCTL_ERROR_SYSTEM,
+		    errno, "cannot read %s: fclose", p->p_path);
+	}
 }
 
+/*
+ * Moves the top-level variables parsed from a piece into 'root',
+ * except for the first 'skip' ones, which get thrown away.
+ */
 static void
-confctl_save_atomic(struct confctl *cc, const char *path)
+parse_splice(struct confctl_var *root, struct confctl_var *from, size_t skip)
+{
+	struct confctl_var *cv;
+
+	while ((cv = TAILQ_FIRST(&from->cv_children)) != NULL) {
+		if (skip > 0) {
+			cv_delete(NULL, cv);
+			skip--;
+			continue;
+		}
+		TAILQ_REMOVE(&from->cv_children, cv, cv_next);
+		cv->cv_parent = root;
+		TAILQ_INSERT_TAIL(&root->cv_children, cv, cv_next);
+		names_insert(root, cv);
+	}
+	style_invalidate(root);
+}
+
+/*
+ * Returns the offset the parsing stopped at, or -1 if the file couldn't
+ * be split and should be parsed serially.  Errors are recorded in the handle.
+ */
+static off_t
+parse_parallel(struct confctl *cc, FILE *fp, const char *path, const char *base,
+    size_t len, unsigned int threads)
+{
+	struct parse p;
+	struct scan_chunk *sc;
+	struct parse_piece *pp;
+	struct confctl_var *root;
+	enum scan_state state;
+	size_t i, next, nchunks, start, end, offset;
+	ssize_t skip;
+	off_t pos;
+	long depth;
+	bool content, done;
+
+	p.p_cc = cc;
+	p.p_path = path;
+	p.p_base = base;
+	p.p_len = len;
+
+	/*
+	 * Cut the file into chunks, just after newlines, and scan them.
+	 */
+	nchunks = threads * PARALLEL_TASKS_PER_THREAD;
+	p.p_chunks = calloc(nchunks, sizeof(*p.p_chunks));
+	if (p.p_chunks == NULL)
+		err(1, "calloc");
+	start = 0;
+	for (i = 0; i < nchunks && start < len; i++) {
+		end = len / nchunks * (i + 1);
+		if (end < start)
+			end = start;
+		while (end < len && base[end] != '\n')
+			end++;
+		if (end < len)
+			end++;
+		if (i == nchunks - 1)
+			end = len;
+		p.p_chunks[i].sc_start = start;
+		p.p_chunks[i].sc_end = end;
+		start = end;
+	}
+	nchunks = i;
+	parallel_run(threads, nchunks, scan_task, &p);
+
+	/*
+	 * Rescan the chunks that didn't start where they were assumed to,
+	 * and pick the places to split at.
+	 */
+	p.p_pieces = calloc(nchunks + 1, sizeof(*p.p_pieces));
+	if (p.p_pieces == NULL)
+		err(1, "calloc");
+	p.p_npieces = 1;
+	state = SCAN_NORMAL;
+	content = false;
+	depth = 0;
+	for (i = 0; i < nchunks; i++) {
+		sc = &p.p_chunks[i];
+		if (state != SCAN_NORMAL || content)
+			scan_chunk(cc, base, sc, state, content);
+		/*
+		 * Unbalanced closing bracket; the serial parser stops there.
+		 */
+		if (depth + sc->sc_min_depth < 0)
+			break;
+		if (depth < SCAN_DEPTHS && sc->sc_split[depth] != 0)
+			p.p_pieces[p.p_npieces++].pp_start = sc->sc_split[depth];
+		state = sc->sc_state;
+		content = sc->sc_content;
+		depth += sc->sc_depth;
+	}
+	free(p.p_chunks);
+
+	if (p.p_npieces < 2) {
+		free(p.p_pieces);
+		return (-1);
+	}
+
+	for (i = 0; i < p.p_npieces; i++) {
+		pp = &p.p_pieces[i];
+		pp->pp_cc.cc_lossy = cc->cc_lossy;
+		pp->pp_cc.cc_lex = cc->cc_lex;
+		if (cc->cc_stats != NULL) {
+			pp->pp_cc.cc_stats = calloc(1, sizeof(*pp->pp_cc.cc_stats));
+			if (pp->pp_cc.cc_stats == NULL)
+				err(1, "calloc");
+		}
+		if (cc->cc_lossy)
+			pp->pp_cc.cc_junk = buf_new(&pp->pp_cc);
+	}
+	parallel_run(threads, p.p_npieces, parse_task, &p);
+
+	/*
+	 * Unlike syntax errors, which only count if the piece gets used,
+	 * failing to read any of them fails the whole thing.
+	 */
+	offset = 0;
+	done = false;
+	for (i = 0; i < p.p_npieces; i++) {
+		pp = &p.p_pieces[i];
+		if (pp->pp_cc.cc_error.ce_code == CONFCTL_ERROR_SYSTEM) {
+			cc->cc_error = pp->pp_cc.cc_error;
+			done = true;
+			break;
+		}
+	}
+
+	/*
+	 * Put the pieces together.  The first one starts at the beginning
+	 * of the file, so it's known to be right.
+	 */
+	root = confctl_root(cc);
+	next = 0;
+	while (!done) {
+		while (next < p.p_npieces && p.p_pieces[next].pp_end < offset)
+			next++;
+		skip = -1;
+		if (next < p.p_npieces)
+			skip = parse_piece_find_offset(&p.p_pieces[next], offset);
+		if (skip >= 0) {
+			pp = &p.p_pieces[next];
+			parse_splice(root, pp->pp_root, skip);
+			if (pp->pp_done) {
+				buf_delete(root->cv_after);
+				root->cv_after = pp->pp_root->cv_after;
+				pp->pp_root->cv_after = NULL;
+			}
+			if (pp->pp_cc.cc_error.ce_code != CONFCTL_ERROR_NONE &&
+			    cc->cc_error.ce_code == CONFCTL_ERROR_NONE) {
+				cc->cc_error = pp->pp_cc.cc_error;
+				cc->cc_error.ce_offset += pp->pp_start;
+			}
+			offset = pp->pp_end;
+			done = pp->pp_done;
+			next++;
+			continue;
+		}
+
+		/*
+		 * None of the pieces went through this offset; parse
+		 * another variable serially.
+		 */
+		if (ftello(fp) != (off_t)offset &&
+		    fseeko(fp, offset, SEEK_SET) != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot seek in %s", path);
+			break;
+		}
+		done = cv_load(cc, root, fp);
+		if (ferror(fp) != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot read %s", path);
+			break;
+		}
+		pos = ftello(fp);
+		if (pos < 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot seek in %s", path);
+			break;
+		}
+		offset = pos;
+	}
+
+	for (i = 0; i < p.p_npieces; i++) {
+		pp = &p.p_pieces[i];
+		cv_delete(NULL, pp->pp_root);
+		buf_delete(pp->pp_cc.cc_junk);
+		free(pp->pp_offsets);
+		if (pp->pp_cc.cc_stats != NULL) {
+			cc->cc_stats->css_stats.cs_bytes_allocated +=
+			    pp->pp_cc.cc_stats->css_stats.cs_bytes_allocated;
+			cc->cc_stats->css_stats.cs_reallocs +=
+			    pp->pp_cc.cc_stats->css_stats.cs_reallocs;
+			free(pp->pp_cc.cc_stats);
+		}
+	}
+	free(p.p_pieces);
+
+	return (offset);
+}
+
+/*
+ * Turns the offset of a syntax error into a line number, by reading
+ * the file again up to there, and puts both the path and the line
+ * into the message.
+ */
+void
+confctl_parse_locate_error(struct confctl *cc, FILE *fp, const char *path)
+{
+	struct confctl_error *ce;
+	char reason[CONFCTL_ERROR_MESSAGE_MAX];
+	uint64_t offset;
+	int ch;
+
+	ce = &cc->cc_error;
+	if (fseeko(fp, 0, SEEK_SET) == 0) {
+		ce->ce_line = 1;
+		for (offset = 0; offset < ce->ce_offset; offset++) {
+			ch = getc_unlocked(fp);
+			if (ch == EOF)
+				break;
+			if (ch == '\n')
+				ce->ce_line++;
+		}
+	}
+
+	memcpy(reason, ce->ce_message, sizeof(reason));
+	if (ce->ce_line > 0) {
+		snprintf(ce->ce_message, sizeof(ce->ce_message), "%s:%zu: %.*s",
+		    path, ce->ce_line, (int)(sizeof(reason) / 2), reason);
+	} else {
+		snprintf(ce->ce_message, sizeof(ce->ce_message), "%s: %.*s",
+		    path, (int)(sizeof(reason) / 2), reason);
+	}
+}
+
+/*
+ * Gets the handle ready for parsing with its current syntax options.
+ */
+void
+confctl_parse_begin(struct confctl *cc)
+{
+
+	cc->cc_lex = lex_table(cc);
+	error_clear(cc);
+}
+
+/*
+ * Reads the next variable in 'parent', without adding it there; see cv_read().
+ */
+struct confctl_var *
+confctl_parse_var(struct confctl *cc, struct confctl_var *parent, FILE *fp,
+    struct confctl_var **innerp)
+{
+
+	return (cv_read(cc, parent, false, fp, innerp));
+}
+
+/*
+ * Parses 'fp', adding what's in there to the tree.  On failure, returns -1;
+ * the variables parsed up to that point are left in the tree, for the caller
+ * to get rid of.
+ */
+int
+confctl_parse(struct confctl *cc, FILE *fp, const char *path)
+{
+	struct stat sb;
+	unsigned int threads;
+	void *base;
+	off_t pos = -1;
+	bool done;
+
+	confctl_parse_begin(cc);
+
+	/*
+	 * Only regular files, read from the start, can be parsed in parallel.
+	 */
+	threads = cc->cc_threads;
+	if (fileno(fp) < 0 || fstat(fileno(fp), &sb) != 0 ||
+	    !S_ISREG(sb.st_mode) || sb.st_size == 0 ||
+	    (uintmax_t)sb.st_size > SIZE_MAX || ftello(fp) != 0)
+		threads = 1;
+	if (threads == 0) {
+		if (sb.st_size >= PARALLEL_MIN_BYTES)
+			threads = parallel_ncpus();
+		else
+			threads = 1;
+	}
+
+	if (threads > 1) {
+		base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+		if (base != MAP_FAILED) {
+			pos = parse_parallel(cc, fp, path, base, sb.st_size, threads);
+			if (munmap(base, sb.st_size) != 0 &&
+			    cc->cc_error.ce_code == CONFCTL_ERROR_NONE) {
+				confctl_error_set(&cc->cc_error,
+				    CONFCTL_ERROR_SYSTEM, errno, "munmap");
+			}
+		}
+	}
+
+	if (pos < 0) {
+		for (;;) {
+			done = cv_load(cc, confctl_root(cc), fp);
+			if (ferror(fp) != 0) {
+				confctl_error_set(&cc->cc_error,
+				    CONFCTL_ERROR_SYSTEM, errno,
+				    "cannot read %s", path);
+				break;
+			}
+			if (done)
+				break;
+		}
+		pos = ftello(fp);
+	}
+
+	if (cc->cc_error.ce_code == CONFCTL_ERROR_SYNTAX)
+		confctl_parse_locate_error(cc, fp, path);
+	if (cc->cc_error.ce_code != CONFCTL_ERROR_NONE)
+		return (-1);
+
+	if (cc->cc_stats != NULL)
+		cc->cc_stats->css_stats.cs_bytes_read += pos;
+
+	if (cc->cc_index != NULL)
+		index_insert_tree(cc->cc_index, confctl_root(cc));
+
+	return (0);
+}
+
+/*
+ * Where the tree ended before loading, to be able to cut off what got
+ * added if it fails.
+ */
+struct load_mark {
+	struct confctl_var	*lm_last;
+	struct buf		*lm_after;
+};
+
+static void
+load_mark(struct confctl *cc, struct load_mark *lm)
+{
+	struct confctl_var *root;
+
+	root = confctl_root(cc);
+	lm->lm_last = TAILQ_LAST(&root->cv_children, confctl_var_head);
+	lm->lm_after = root->cv_after;
+	root->cv_after = NULL;
+}
+
+/*
+ * Returns the first variable added since load_mark().
+ */
+static struct confctl_var *
+load_added(struct confctl *cc, const struct load_mark *lm)
+{
+	struct confctl_var *root;
+
+	root = confctl_root(cc);
+	if (lm->lm_last == NULL)
+		return (TAILQ_FIRST(&root->cv_children));
+	return (TAILQ_NEXT(lm->lm_last, cv_next));
+}
+
+static void
+load_undo(struct confctl *cc, struct load_mark *lm)
+{
+	struct confctl_var *root, *cv;
+
+	root = confctl_root(cc);
+	for (;;) {
+		cv = TAILQ_LAST(&root->cv_children, confctl_var_head);
+		if (cv == lm->lm_last)
+			break;
+		cv_delete(cc->cc_index, cv);
+	}
+	buf_delete(root->cv_after);
+	root->cv_after = lm->lm_after;
+}
+
+/*
+ * Same as confctl_parse(), except that on failure, it leaves the tree
+ * as it was.
+ */
+int
+confctl_parse_or_undo(struct confctl *cc, FILE *fp, const char *path)
+{
+	struct load_mark lm;
+
+	load_mark(cc, &lm);
+	if (confctl_parse(cc, fp, path) != 0) {
+		load_undo(cc, &lm);
+		return (-1);
+	}
+	buf_delete(lm.lm_after);
+
+	return (0);
+}
+
+/*
+ * Loads the file, adding its variables to the tree.  On failure, returns -1,
+ * and leaves the tree as it was.
+ */
+static int
+load_file(struct confctl *cc, const char *path)
 {
+	struct load_mark lm;
+	struct stat sb;
+	uint64_t hash;
 	FILE *fp;
-	int error, fd, written;
-	char *tmppath = NULL;
+	int error;
+	bool hashed;
 
-	written = asprintf(&tmppath, "%s.XXXXXXXXX", path);
-	if (written < 0)
-		err(1, "asprintf");
-	fd = mkstemp(tmppath);
-	if (fd < 0)
-		err(1, "cannot create temporary file %s; use -I to rewrite file in place", tmppath);
-	fp = fdopen(fd, "w");
+	error_clear(cc);
+	confctl_stats_begin(cc, CONFCTL_PHASE_LOAD);
+
+	fp = fopen(path, "r");
 	if (fp == NULL) {
-		remove_tmpfile(tmppath);
-		err(1, "fdopen");
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "unable to open %s", path);
+		return (-1);
 	}
-	confctl_write(cc, fp);
-	error = fflush(fp);
-	if (error != 0) {
-		remove_tmpfile(tmppath);
-		err(1, "fflush");
+
+	if (cc->cc_rewrite_in_place) {
+		error = flock(fileno(fp), LOCK_SH);
+		if (error != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "unable to lock %s", path);
+			fclose(fp);
+			return (-1);
+		}
 	}
-	error = fsync(fd);
+
+	error = fstat(fileno(fp), &sb);
 	if (error != 0) {
-		remove_tmpfile(tmppath);
-		err(1, "fsync");
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot stat %s", path);
+		fclose(fp);
+		return (-1);
 	}
-	error = fclose(fp);
+
+	/*
+	 * The hash is only needed to save the tree, or to write the index.
+	 */
+	hashed = !cc->cc_lossy && !cc->cc_read_only;
+	if (hashed) {
+		error = confctl_hash_file(cc, fileno(fp), path, &hash);
+		if (error != 0) {
+			fclose(fp);
+			return (-1);
+		}
+	}
+
+	load_mark(cc, &lm);
+	error = confctl_parse(cc, fp, path);
+	if (error == 0 && cc->cc_follow_includes)
+		error = confctl_include_expand(cc, path, &sb, load_added(cc, &lm));
 	if (error != 0) {
-		remove_tmpfile(tmppath);
-		err(1, "fclose");
+		load_undo(cc, &lm);
+		fclose(fp);
+		return (-1);
+	}
+	buf_delete(lm.lm_after);
+
+	confctl_set_identity(cc, path, &sb, hashed ? &hash : NULL);
+
+	/*
+	 * Past this point, the file is loaded; unlocking and closing a file
+	 * that was only read from can't really fail.
+	 */
+	if (cc->cc_rewrite_in_place)
+		flock(fileno(fp), LOCK_UN);
+	fclose(fp);
+
+	confctl_stats_end(cc, CONFCTL_PHASE_LOAD);
+
+	return (0);
+}
+
+void	
+confctl_load(struct confctl *cc, const char *path)
+{
+
+	if (load_file(cc, path) != 0)
+		confctl_error_exit(&cc->cc_error);
+}
+
+int
+confctl_load2(struct confctl *cc, const char *path,
+    const struct confctl_error **errorp)
+{
+	int error;
+
+	error = load_file(cc, path);
+	if (errorp != NULL)
+		*errorp = &cc->cc_error;
+
+	return (error);
+}
+
+/*
+ * Computes the hash of what the included file would look like if it was
+ * saved now.
+ */
+static int
+include_hash(struct confctl *cc, struct confctl_include *ci, uint64_t *hashp)
+{
+	struct confctl_stats_state *stats;
+	struct confctl_hash ch;
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0;
+	int error, saved_errno;
+
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot save %s: open_memstream",
+		    ci->cin_identity->ci_path);
+		return (-1);
+	}
+	stats = cc->cc_stats;
+	cc->cc_stats = NULL;
+	cc->cc_writing = ci;
+	error = confctl_write(cc, fp);
+	saved_errno = errno;
+	cc->cc_writing = NULL;
+	cc->cc_stats = stats;
+	if (fclose(fp) != 0 && error == 0) {
+		error = -1;
+		saved_errno = errno;
 	}
-	error = rename(tmppath, path);
 	if (error != 0) {
-		remove_tmpfile(tmppath);
-		err(1, "cannot replace %s; use -I to rewrite file in place", path);
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+		    saved_errno, "cannot save %s", ci->cin_identity->ci_path);
+		free(buf);
+		return (-1);
+	}
+
+	confctl_hash_init(&ch);
+	confctl_hash_update(&ch, buf, len);
+	free(buf);
+	*hashp = confctl_hash_final(&ch);
+
+	return (0);
+}
+
+/*
+ * Checks whether the file already has the contents with the given hash,
+ * e.g. because it's included by several files, which all got the same
+ * changes, and one of them got saved first; if so, updates the identity.
+ */
+static bool
+include_saved_already(struct confctl *cc, const char *path, uint64_t hash)
+{
+	struct stat sb;
+	uint64_t current;
+	int fd;
+	bool same = false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (false);
+	if (fstat(fd, &sb) == 0 &&
+	    confctl_hash_file(cc, fd, path, &current) == 0 && current == hash) {
+		confctl_set_identity(cc, path, &sb, &current);
+		same = true;
 	}
+	close(fd);
+	error_clear(cc);
+
+	return (same);
+}
+
+/*
+ * Whether the two entries are copies of the same file, included twice.
+ */
+static bool
+include_same(const struct confctl_include *a, const struct confctl_include *b)
+{
+
+	return (a->cin_identity->ci_dev == b->cin_identity->ci_dev &&
+	    a->cin_identity->ci_ino == b->cin_identity->ci_ino);
+}
+
+/*
+ * Included files to be saved, in order: the copies that changed, their new
+ * hashes, and for each, which one is the first copy of the same file.
+ */
+struct include_saves {
+	struct confctl_include	**is_cis;
+	uint64_t		*is_hashes;
+	size_t			*is_firsts;
+	size_t			is_len;
+};
+
+static void
+include_saves_free(struct include_saves *is)
+{
+
+	free(is->is_cis);
+	free(is->is_hashes);
+	free(is->is_firsts);
 }
 
-bool
-confctl_var_has_children(const struct confctl_var *cv)
+/*
+ * Finds the included files that changed.  A file included more than once
+ * is only written once, so all the copies that changed must have come out
+ * the same; this is checked before writing anything, the main file
+ * included.  Saving replaces the file, so this also remembers which copy
+ * of it comes first now.
+ */
+static int
+include_saves_prepare(struct confctl *cc, struct include_saves *is)
 {
+	struct confctl_include *ci;
+	size_t j, n = 0;
+
+	memset(is, 0, sizeof(*is));
+	TAILQ_FOREACH(ci, &cc->cc_includes, cin_next)
+		n++;
+	if (n == 0)
+		return (0);
+	is->is_cis = calloc(n, sizeof(*is->is_cis));
+	is->is_hashes = calloc(n, sizeof(*is->is_hashes));
+	is->is_firsts = calloc(n, sizeof(*is->is_firsts));
+	if (is->is_cis == NULL || is->is_hashes == NULL ||
+	    is->is_firsts == NULL)
+		err(1, "calloc");
 
-	if (!TAILQ_EMPTY(&cv->cv_children))
-		return (true);
-	return (false);
+	n = 0;
+	TAILQ_FOREACH(ci, &cc->cc_includes, cin_next) {
+		if (ci->cin_detached)
+			continue;
+		if (include_hash(cc, ci, &is->is_hashes[n]) != 0)
+			goto fail;
+		if (is->is_hashes[n] == ci->cin_hash)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (include_same(is->is_cis[j], ci))
+				break;
+		}
+		if (j < n && is->is_hashes[j] != is->is_hashes[n]) {
+			confctl_error_set(&cc->cc_error,
+			    CONFCTL_ERROR_UNSUPPORTED, 0,
+			    "cannot save %s: included more than once, "
+			    "with different changes", ci->cin_identity->ci_path);
+			goto fail;
+		}
+		is->is_firsts[n] = j;
+		is->is_cis[n++] = ci;
+	}
+	is->is_len = n;
+
+	return (0);
+
+fail:
+	include_saves_free(is);
+	return (-1);
 }
 
-bool
-confctl_var_has_value(const struct confctl_var *cv)
+/*
+ * Saves the included files that changed, each to its own path, after
+ * the main one.  If one of them got changed by someone else in the meantime,
+ * it's an error, unless it was changed the same way; loading it again
+ * wouldn't help, as the replay callback redoes the changes for the whole
+ * tree.  Saving the main file might have loaded it again, included files
+ * and all, so they are looked at anew.
+ */
+static int
+save_includes(struct confctl *cc)
 {
+	struct include_saves is;
+	struct confctl_include *ci;
+	struct confctl_identity *identity;
+	void (*replay)(struct confctl *cc, void *arg);
+	size_t i;
+	char *path;
+	int error = 0;
+
+	if (include_saves_prepare(cc, &is) != 0)
+		return (-1);
+	for (i = 0; i < is.is_len; i++) {
+		ci = is.is_cis[i];
+		if (is.is_firsts[i] < i) {
+			/*
+			 * Saved already, as the earlier copy; make this
+			 * one refer to the new file.
+			 */
+			path = ci->cin_identity->ci_path;
+			*ci->cin_identity =
+			    *is.is_cis[is.is_firsts[i]]->cin_identity;
+			ci->cin_identity->ci_path = path;
+			ci->cin_hash = is.is_hashes[i];
+			continue;
+		}
 
-	if (cv->cv_value != NULL)
-		return (true);
-	return (false);
+		identity = cc->cc_identity;
+		replay = cc->cc_replay;
+		cc->cc_identity = ci->cin_identity;
+		cc->cc_replay = NULL;
+		cc->cc_writing = ci;
+		if (include_saved_already(cc, ci->cin_identity->ci_path,
+		    is.is_hashes[i]))
+			error = 0;
+		else if (cc->cc_rewrite_in_place)
+			error = confctl_save_in_place(cc, ci->cin_identity->ci_path);
+		else
+			error = confctl_save_atomic(cc, ci->cin_identity->ci_path);
+		cc->cc_writing = NULL;
+		ci->cin_identity = cc->cc_identity;
+		cc->cc_identity = identity;
+		cc->cc_replay = replay;
+		if (error != 0)
+			break;
+		ci->cin_hash = is.is_hashes[i];
+	}
+	include_saves_free(&is);
+
+	return (error);
 }
 
-struct confctl *
-confctl_new(void)
+static int
+save_file(struct confctl *cc, const char *path)
 {
-	struct confctl *cc;
+	struct include_saves is;
+	int error;
 
-	cc = calloc(sizeof(*cc), 1);
-	if (cc == NULL)
-		err(1, "calloc");
-	cc->cc_root = cv_new_root();
+	error_clear(cc);
 
-	return (cc);
+	if (cc->cc_lossy) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_LOSSY, 0,
+		    "cannot save %s: loaded without comments and formatting",
+		    path);
+		return (-1);
+	}
+	if (cc->cc_partial) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_LOSSY, 0,
+		    "cannot save %s: only parts of it were loaded", path);
+		return (-1);
+	}
+	if (cc->cc_read_only) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_UNSUPPORTED, 0,
+		    "cannot save %s: loaded read-only", path);
+		return (-1);
+	}
+
+	/*
+	 * Don't write anything if the included files cannot be saved.
+	 */
+	if (include_saves_prepare(cc, &is) != 0)
+		return (-1);
+	include_saves_free(&is);
+
+	if (cc->cc_rewrite_in_place)
+		error = confctl_save_in_place(cc, path);
+	else
+		error = confctl_save_atomic(cc, path);
+	if (error != 0)
+		return (-1);
+
+	return (save_includes(cc));
 }
 
-void
-confctl_set_equals_sign(struct confctl *cc, bool equals)
+void	
+confctl_save(struct confctl *cc, const char *path)
 {
 
-	cc->cc_equals_sign = equals;
+	if (save_file(cc, path) != 0)
+		confctl_error_exit(&cc->cc_error);
 }
 
-void
-confctl_set_rewrite_in_place(struct confctl *cc, bool rewrite)
+int
+confctl_save2(struct confctl *cc, const char *path,
+    const struct confctl_error **errorp)
 {
+	int error;
 
-	cc->cc_rewrite_in_place = rewrite;
+	error = save_file(cc, path);
+	if (errorp != NULL)
+		*errorp = &cc->cc_error;
+
+	return (error);
 }
 
-void
-confctl_set_semicolon(struct confctl *cc, bool semicolon)
+struct confctl_var *
+confctl_root(struct confctl *cc)
 {
 
-	cc->cc_semicolon = semicolon;
+	return (cc->cc_root);
 }
 
-void
-confctl_set_slash_slash_comments(struct confctl *cc, bool slash)
+struct confctl_var *
+confctl_find_by_value(struct confctl *cc, const char *value)
 {
 
-	cc->cc_slash_slash_comments = slash;
+	return (confctl_varmap_find(index_get(cc)->ci_map, value));
 }
 
-void
-confctl_set_slash_star_comments(struct confctl *cc, bool star)
+struct confctl_var *
+confctl_find_next_by_value(struct confctl_var *cv)
 {
+	struct confctl *cc;
 
-	cc->cc_slash_star_comments = star;
+	cc = cv_confctl(cv);
+	assert(cc != NULL && cc->cc_index != NULL);
+
+	return (confctl_varmap_find_next(cc->cc_index->ci_map, cv));
 }
 
-void	
-confctl_load(struct confctl *cc, const char *path)
+struct confctl_var *
+confctl_find_by_value_prefix(struct confctl *cc, const char *prefix)
 {
-	bool done;
-	FILE *fp;
-	int error;
-
-	fp = fopen(path, "r");
-	if (fp == NULL)
-		err(1, "unable to open %s", path);
+	struct confctl_var **sorted;
+	size_t first, last, middle, len;
 
-	if (cc->cc_rewrite_in_place) {
-		error = flock(fileno(fp), LOCK_SH);
-		if (error != 0)
-			err(1, "unable to lock %s", path);
-	}
+	sorted = index_sorted(cc);
 
-	for (;;) {
-		done = cv_load(cc, confctl_root(cc), fp);
-		if (ferror(fp) != 0)
-			err(1, "read");
-		if (done)
-			break;
+	/*
+	 * Find the first variable with value not less than the prefix.
+	 */
+	first = 0;
+	last = cc->cc_index->ci_map->cvm_len;
+	while (first < last) {
+		middle = first + (last - first) / 2;
+		if (strcmp(sorted[middle]->cv_value->b_buf, prefix) < 0)
+			first = middle + 1;
+		else
+			last = middle;
 	}
 
-	if (cc->cc_rewrite_in_place) {
-		error = flock(fileno(fp), LOCK_UN);
-		if (error != 0)
-			err(1, "unable to unlock %s", path);
-	}
+	len = strlen(prefix);
+	if (first < cc->cc_index->ci_map->cvm_len && strncmp(sorted[first]->cv_value->b_buf, prefix, len) == 0)
+		return (sorted[first]);
 
-	error = fclose(fp);
-	if (error != 0)
-		err(1, "fclose");
+	return (NULL);
 }
 
-void	
-confctl_save(struct confctl *cc, const char *path)
+struct confctl_var *
+confctl_find_next_by_value_prefix(struct confctl *cc, struct confctl_var *cv, const char *prefix)
 {
+	struct confctl_var **sorted;
+	size_t entry, i;
 
-	if (cc->cc_rewrite_in_place)
-		confctl_save_in_place(cc, path);
-	else
-		confctl_save_atomic(cc, path);
-}
+	sorted = index_sorted(cc);
+	entry = confctl_varmap_entry(cc->cc_index->ci_map, cv);
+	assert(entry != CONFCTL_VARMAP_NONE);
+	assert(sorted[cc->cc_index->ci_ranks[entry]] == cv);
 
-struct confctl_var *
-confctl_root(struct confctl *cc)
-{
+	i = cc->cc_index->ci_ranks[entry] + 1;
+	if (i < cc->cc_index->ci_map->cvm_len && strncmp(sorted[i]->cv_value->b_buf, prefix, strlen(prefix)) == 0)
+		return (sorted[i]);
 
-	return (cc->cc_root);
+	return (NULL);
 }
 
 const char *
@@ -1043,8 +4523,17 @@ void
 confctl_var_set_name(struct confctl_var *cv, const char *name)
 {
 
+	if (cv->cv_parent != NULL)
+		names_remove(cv->cv_parent, cv);
+	style_invalidate(cv->cv_parent);
+
 	buf_delete(cv->cv_name);
-	cv->cv_name = buf_new_from_str(name);
+	cv->cv_name = buf_new_from_str(cv_confctl(cv), name);
+
+	if (cv->cv_parent != NULL)
+		names_rename(cv->cv_parent, cv);
+
+	confctl_observe(cv_confctl(cv), cv, CONFCTL_EVENT_NAME);
 }
 
 const char *
@@ -1059,16 +4548,60 @@ confctl_var_value(struct confctl_var *cv)
 void
 confctl_var_set_value(struct confctl_var *cv, const char *value)
 {
+	struct confctl *cc;
 
 	assert(!confctl_var_has_children(cv));
 
+	cc = cv_confctl(cv);
+	if (cc != NULL && index_contains(cc->cc_index, cv))
+		index_remove(cc->cc_index, cv);
+
 	buf_delete(cv->cv_value);
-	cv->cv_value = buf_new_from_str(value);
+	cv->cv_value = buf_new_from_str(cc, value);
+	if (cv->cv_ext != NULL) {
+		confctl_value_cache_delete(cv->cv_ext->cx_values);
+		cv->cv_ext->cx_values = NULL;
+	}
+	style_invalidate(cv->cv_parent);
+
+	if (cc != NULL && cc->cc_index != NULL)
+		index_insert(cc->cc_index, cv);
 
 	/*
 	 * Variable will need proper cv_middle.
 	 */
 	cv->cv_needs_reindent = true;
+
+	confctl_observe(cc, cv, CONFCTL_EVENT_VALUE);
+}
+
+/*
+ * Replaces a part of the value, like confctl_var_set_value() does with
+ * the whole of it.
+ */
+void
+confctl_var_splice_value(struct confctl_var *cv, size_t off, size_t len,
+    const char *str, size_t str_len)
+{
+	struct confctl *cc;
+
+	assert(cv->cv_value != NULL);
+
+	cc = cv_confctl(cv);
+	if (cc != NULL && index_contains(cc->cc_index, cv))
+		index_remove(cc->cc_index, cv);
+
+	buf_splice(cc, cv->cv_value, off, len, str, str_len);
+	if (cv->cv_ext != NULL) {
+		confctl_value_cache_delete(cv->cv_ext->cx_values);
+		cv->cv_ext->cx_values = NULL;
+	}
+	style_invalidate(cv->cv_parent);
+
+	if (cc != NULL && cc->cc_index != NULL)
+		index_insert(cc->cc_index, cv);
+
+	confctl_observe(cc, cv, CONFCTL_EVENT_VALUE);
 }
 
 struct confctl_var *
@@ -1085,6 +4618,45 @@ confctl_var_next(struct confctl_var *cv)
 	return (TAILQ_NEXT(cv, cv_next));
 }
 
+struct confctl_var *
+confctl_var_find_child(struct confctl_var *parent, const char *name)
+{
+	struct confctl_varmap *names;
+	struct confctl_var *child;
+
+	names = names_get(parent);
+	if (names == NULL) {
+		TAILQ_FOREACH(child, &parent->cv_children, cv_next) {
+			if (strcmp(child->cv_name->b_buf, name) == 0)
+				return (child);
+		}
+		return (NULL);
+	}
+
+	return (confctl_varmap_find(names, name));
+}
+
+struct confctl_var *
+confctl_var_find_next_child(struct confctl_var *cv)
+{
+	struct confctl_varmap *names;
+	struct confctl_var *next;
+
+	if (cv->cv_parent == NULL)
+		return (NULL);
+
+	names = names_get(cv->cv_parent);
+	if (names == NULL) {
+		for (next = TAILQ_NEXT(cv, cv_next); next != NULL; next = TAILQ_NEXT(next, cv_next)) {
+			if (strcmp(next->cv_name->b_buf, cv->cv_name->b_buf) == 0)
+				return (next);
+		}
+		return (NULL);
+	}
+
+	return (confctl_varmap_find_next(names, cv));
+}
+
 struct confctl_var *
 confctl_var_new(struct confctl_var *parent, const char *name)
 {
@@ -1093,7 +4665,8 @@ confctl_var_new(struct confctl_var *parent, const char *name)
 	assert(parent != NULL);
 	assert(!confctl_var_has_value(parent));
 
-	cv = cv_new(parent, buf_new_from_str(name));
+	cv = cv_new(cv_confctl(parent), parent,
+	    buf_new_from_str(cv_confctl(parent), name));
 
 	/*
 	 * If the parent didn't have any children, it might not have
@@ -1104,19 +4677,111 @@ confctl_var_new(struct confctl_var *parent, const char *name)
 		parent->cv_needs_reindent = true;
 	cv->cv_needs_reindent = true;
 
+	confctl_observe(cv_confctl(parent), cv, CONFCTL_EVENT_NEW);
+
 	return (cv);
 }
 
-void
-confctl_var_delete(struct confctl_var *cv)
+struct confctl_var *
+confctl_var_append(struct confctl_var *parent, const char *const *names,
+    const char *const *values, size_t n)
+{
+	struct confctl_var *cv, *first = NULL;
+	struct confctl *cc;
+	size_t i;
+
+	assert(parent != NULL);
+	assert(!confctl_var_has_value(parent));
+
+	if (n == 0)
+		return (NULL);
+
+	cc = cv_confctl(parent);
+	if (TAILQ_EMPTY(&parent->cv_children))
+		parent->cv_needs_reindent = true;
+
+	for (i = 0; i < n; i++) {
+		cv = cv_new(cc, parent, buf_new_from_str(cc, names[i]));
+		if (values != NULL && values[i] != NULL) {
+			cv->cv_value = buf_new_from_str(cc, values[i]);
+			if (cc != NULL && cc->cc_index != NULL)
+				index_insert(cc->cc_index, cv);
+		}
+		cv->cv_needs_reindent = true;
+		confctl_observe(cc, cv, CONFCTL_EVENT_NEW);
+		if (first == NULL)
+			first = cv;
+	}
+
+	return (first);
+}
+
+static struct confctl_var *
+cv_copy(struct confctl *cc, struct confctl_var *parent, struct confctl_var *tree)
+{
+	struct confctl_var *cv, *child;
+
+	cv = cv_new(cc, parent, buf_new_from_parts(cc, tree->cv_name->b_buf, tree->cv_name->b_len, "", 0));
+	cv->cv_needs_reindent = true;
+	if (tree->cv_value != NULL) {
+		cv->cv_value = buf_new_from_parts(cc, tree->cv_value->b_buf, tree->cv_value->b_len, "", 0);
+		if (cc != NULL && cc->cc_index != NULL)
+			index_insert(cc->cc_index, cv);
+	} else {
+		TAILQ_FOREACH(child, &tree->cv_children, cv_next)
+			cv_copy(cc, cv, child);
+	}
+
+	return (cv);
+}
+
+struct confctl_var *
+confctl_var_append_tree(struct confctl_var *parent, struct confctl_var *tree)
+{
+	struct confctl_var *cv, *child, *first = NULL;
+	struct confctl *cc;
+
+	assert(parent != NULL);
+	assert(!confctl_var_has_value(parent));
+
+	cc = cv_confctl(parent);
+	if (TAILQ_EMPTY(&parent->cv_children))
+		parent->cv_needs_reindent = true;
+
+	if (tree->cv_parent != NULL) {
+		cv = cv_copy(cc, parent, tree);
+		confctl_observe(cc, cv, CONFCTL_EVENT_NEW);
+		return (cv);
+	}
+
+	TAILQ_FOREACH(child, &tree->cv_children, cv_next) {
+		cv = cv_copy(cc, parent, child);
+		confctl_observe(cc, cv, CONFCTL_EVENT_NEW);
+		if (first == NULL)
+			first = cv;
+	}
+
+	return (first);
+}
+
+static void
+cv_delete(struct confctl_index *ci, struct confctl_var *cv)
 {
 	struct confctl_var *child, *tmp;
 
 	TAILQ_FOREACH_SAFE(child, &cv->cv_children, cv_next, tmp)
-		confctl_var_delete(child);
+		cv_delete(ci, child);
+
+	if (index_contains(ci, cv))
+		index_remove(ci, cv);
+	if (cv->cv_parent != NULL)
+		names_remove(cv->cv_parent, cv);
+	names_delete(cv);
+	style_invalidate(cv->cv_parent);
+	style_invalidate(cv);
 
 	buf_delete(cv->cv_before);
-	cv->cv_value = NULL;
+	cv->cv_before = NULL;
 	buf_delete(cv->cv_name);
 	cv->cv_name = NULL;
 	buf_delete(cv->cv_middle);
@@ -1125,6 +4790,11 @@ confctl_var_delete(struct confctl_var *cv)
 	cv->cv_value = NULL;
 	buf_delete(cv->cv_after);
 	cv->cv_after = NULL;
+	if (cv->cv_ext != NULL) {
+		confctl_value_cache_delete(cv->cv_ext->cx_values);
+		free(cv->cv_ext);
+		cv->cv_ext = NULL;
+	}
 
 	if (cv->cv_parent != NULL)
 		TAILQ_REMOVE(&cv->cv_parent->cv_children, cv, cv_next);
@@ -1132,13 +4802,57 @@ confctl_var_delete(struct confctl_var *cv)
 	free(cv);
 }
 
+/*
+ * Takes the variable out of the tree, leaving it, and its children,
+ * otherwise intact, to be freed at the end of the batch.
+ */
+static void
+cv_detach(struct confctl *cc, struct confctl_var *cv)
+{
+	struct confctl_var *parent;
+
+	index_remove_tree(cc->cc_index, cv);
+
+	parent = cv->cv_parent;
+	names_remove(parent, cv);
+	TAILQ_REMOVE(&parent->cv_children, cv, cv_next);
+	style_invalidate(parent);
+	cv->cv_parent = NULL;
+}
+
+void
+confctl_var_delete(struct confctl_var *cv)
+{
+	struct confctl *cc;
+
+	cc = cv_confctl(cv);
+	if (cc != NULL && !TAILQ_EMPTY(&cc->cc_includes))
+		confctl_include_forget(cc, cv);
+	if (cc != NULL && cc->cc_batch > 0 && cv->cv_parent != NULL) {
+		cv_detach(cc, cv);
+		confctl_observe(cc, cv, CONFCTL_EVENT_DELETE);
+		return;
+	}
+	confctl_observe(cc, cv, CONFCTL_EVENT_DELETE);
+	cv_delete(cc != NULL ? cc->cc_index : NULL, cv);
+}
+
 void
 confctl_var_move(struct confctl_var *cv, struct confctl_var *parent)
 {
+	struct confctl *oldcc, *newcc;
 
 	assert(parent != NULL);
 	assert(!confctl_var_has_value(parent));
 
+	/*
+	 * When moving between trees, move the value index entries as well.
+	 */
+	oldcc = cv_confctl(cv);
+	newcc = cv_confctl(parent);
+	if (oldcc != newcc && oldcc != NULL && oldcc->cc_index != NULL)
+		index_remove_tree(oldcc->cc_index, cv);
+
 	/*
 	 * If the parent didn't have any children, it might not have
 	 * the brackets ('{' and '}') in cv_middle and cv_after.
@@ -1148,10 +4862,86 @@ confctl_var_move(struct confctl_var *cv, struct confctl_var *parent)
 		parent->cv_needs_reindent = true;
 	cv->cv_needs_reindent = true;
 
-	if (cv->cv_parent != NULL)
+	if (cv->cv_parent != NULL) {
+		names_remove(cv->cv_parent, cv);
 		TAILQ_REMOVE(&cv->cv_parent->cv_children, cv, cv_next);
+		style_invalidate(cv->cv_parent);
+	}
 	cv->cv_parent = parent;
 	TAILQ_INSERT_TAIL(&parent->cv_children, cv, cv_next);
+	names_insert(parent, cv);
+	style_invalidate(parent);
+
+	/*
+	 * Wherever it came from, it now belongs to the same file as its parent.
+	 */
+	if (cv->cv_ext != NULL)
+		cv->cv_ext->cx_include = NULL;
+
+	if (oldcc != newcc && newcc != NULL && newcc->cc_index != NULL)
+		index_insert_tree(newcc->cc_index, cv);
+
+	confctl_observe(newcc, cv, CONFCTL_EVENT_MOVE);
+}
+
+/*
+ * Copies the variable, with everything below it, including formatting;
+ * the copy doesn't belong to any tree.
+ */
+struct confctl_var *
+confctl_var_clone(const struct confctl *cc, const struct confctl_var *tree)
+{
+	struct confctl_var *cv, *child, *copy;
+
+	cv = cv_new(cc, NULL, confctl_buf_copy(cc, tree->cv_name));
+	cv->cv_before = confctl_buf_copy(cc, tree->cv_before);
+	cv->cv_middle = confctl_buf_copy(cc, tree->cv_middle);
+	cv->cv_value = confctl_buf_copy(cc, tree->cv_value);
+	cv->cv_after = confctl_buf_copy(cc, tree->cv_after);
+	cv->cv_implicit_container = tree->cv_implicit_container;
+	TAILQ_FOREACH(child, &tree->cv_children, cv_next) {
+		copy = confctl_var_clone(cc, child);
+		copy->cv_parent = cv;
+		TAILQ_INSERT_TAIL(&cv->cv_children, copy, cv_next);
+	}
+
+	return (cv);
+}
+
+/*
+ * Inserts 'cv', which doesn't belong to any tree, right after 'prev',
+ * as it is, without reindenting.
+ */
+void
+confctl_var_insert_after(struct confctl_var *prev, struct confctl_var *cv)
+{
+	struct confctl_var *parent;
+	struct confctl *cc;
+
+	parent = prev->cv_parent;
+	assert(parent != NULL);
+	assert(cv->cv_parent == NULL);
+
+	cv->cv_parent = parent;
+	TAILQ_INSERT_AFTER(&parent->cv_children, prev, cv, cv_next);
+
+	/*
+	 * Names are kept in the order of siblings by only ever appending;
+	 * the table gets built again when needed.
+	 */
+	names_delete(parent);
+	style_invalidate(parent);
+
+	cc = cv_confctl(parent);
+	if (cc != NULL && cc->cc_index != NULL)
+		index_insert_tree(cc->cc_index, cv);
+}
+
+struct confctl_var *
+confctl_var_parent(struct confctl_var *cv)
+{
+
+	return (cv->cv_parent);
 }
 
 bool
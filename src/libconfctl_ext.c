@@ -29,21 +29,43 @@
  * of the stuff implemented in libconfctl.c.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <ctype.h>
 #include <err.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "vis.h"
 #include "confctl.h"
 
+static struct confctl *
+from_line_fail(struct confctl *cc, char *copy, struct confctl_error *error,
+    size_t offset, const char *message)
+{
+
+	memset(error, 0, sizeof(*error));
+	error->ce_code = CONFCTL_ERROR_SYNTAX;
+	error->ce_offset = offset;
+	snprintf(error->ce_message, sizeof(error->ce_message), "%s", message);
+	confctl_delete(cc);
+	free(copy);
+
+	return (NULL);
+}
+
 struct confctl *
-confctl_from_line(const char *line)
+confctl_from_line2(const char *line, struct confctl_error *error)
 {
 	struct confctl *cc;
 	struct confctl_var *cv, *parent;
 	bool escaped = false, quoted = false, squoted = false;
-	int i, j, len;
+	size_t i, j;
+	ssize_t len;
 	char ch;
 	char *copy, *name, *value;
 
@@ -58,10 +80,11 @@ confctl_from_line(const char *line)
 		ch = copy[i];
 		copy[j] = copy[i];
 		if (ch == '\0') {
-			len = strunvis(name, name);
+			len = strnunvis(name, name, strlen(name) + 1);
 			if (len < 0)
-				err(1, "invalid escape sequence");
+				return (from_line_fail(cc, copy, error, i, "invalid escape sequence"));
 			confctl_var_new(parent, name);
+			free(copy);
 			return (cc);
 		}
 		if (escaped) {
@@ -80,12 +103,12 @@ confctl_from_line(const char *line)
 		if (quoted || squoted)
 			continue;
 		if (isspace(ch))
-			errx(1, "whitespace inside variable specification");
+			return (from_line_fail(cc, copy, error, i, "whitespace inside variable specification"));
 		if (ch == '.' || ch == '=') {
 			copy[j] = '\0';
-			len = strunvis(name, name);
+			len = strnunvis(name, name, strlen(name) + 1);
 			if (len < 0)
-				err(1, "invalid escape sequence");
+				return (from_line_fail(cc, copy, error, i, "invalid escape sequence"));
 			cv = confctl_var_new(parent, name);
 			if (ch == '.') {
 				parent = cv;
@@ -95,11 +118,25 @@ confctl_from_line(const char *line)
 			i++;
 			j++;
 			value = &(copy[i]);
-			len = strunvis(value, value);
+			len = strnunvis(value, value, strlen(value) + 1);
 			if (len < 0)
-				err(1, "invalid escape sequence");
+				return (from_line_fail(cc, copy, error, i, "invalid escape sequence"));
 			confctl_var_set_value(cv, value);
+			free(copy);
 			return (cc);
 		}
 	}
 }
+
+struct confctl *
+confctl_from_line(const char *line)
+{
+	struct confctl_error error;
+	struct confctl *cc;
+
+	cc = confctl_from_line2(line, &error);
+	if (cc == NULL)
+		errx(1, "%s", error.ce_message);
+
+	return (cc);
+}
@@ -0,0 +1,240 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines to freeze the configuration tree,
+ * i.e. make a compact, read-only copy of it, and to access the copy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+static void
+cv_count(struct confctl_var *cv, size_t *nodes, size_t *bytes)
+{
+	struct confctl_var *child;
+
+	(*nodes)++;
+	*bytes += cv->cv_name->b_len + 1;
+	if (cv->cv_value != NULL)
+		*bytes += cv->cv_value->b_len + 1;
+
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		cv_count(child, nodes, bytes);
+}
+
+static size_t
+frozen_add_string(struct confctl_frozen *cf, const struct buf *b)
+{
+	size_t off;
+
+	off = cf->cf_strings_len;
+	memcpy(cf->cf_strings + off, b->b_buf, b->b_len);
+	cf->cf_strings[off + b->b_len] = '\0';
+	cf->cf_strings_len += b->b_len + 1;
+
+	return (off);
+}
+
+/*
+ * Copies 'cv' and its children, starting at index 'i'.
+ */
+static void
+cv_freeze(struct confctl_frozen *cf, struct confctl_var *cv, size_t i, size_t parent)
+{
+	struct confctl_var *child;
+	size_t childi, prev = CONFCTL_FROZEN_NONE;
+
+	cf->cf_name[i] = frozen_add_string(cf, cv->cv_name);
+	cf->cf_name_len[i] = cv->cv_name->b_len;
+	if (cv->cv_value != NULL) {
+		cf->cf_value[i] = frozen_add_string(cf, cv->cv_value);
+		cf->cf_value_len[i] = cv->cv_value->b_len;
+	} else {
+		cf->cf_value[i] = CONFCTL_FROZEN_NONE;
+		cf->cf_value_len[i] = 0;
+	}
+	cf->cf_parent[i] = parent;
+	cf->cf_next[i] = CONFCTL_FROZEN_NONE;
+
+	childi = i + 1;
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next) {
+		if (prev != CONFCTL_FROZEN_NONE)
+			cf->cf_next[prev] = childi;
+		cv_freeze(cf, child, childi, i);
+		prev = childi;
+		childi += cf->cf_size[childi];
+	}
+	cf->cf_size[i] = childi - i;
+}
+
+static void *
+frozen_array(size_t len, size_t size)
+{
+	void *p;
+
+	p = calloc(len, size);
+	if (p == NULL)
+		err(1, "calloc");
+	return (p);
+}
+
+struct confctl_frozen *
+confctl_freeze(struct confctl *cc)
+{
+	struct confctl_frozen *cf;
+	size_t nodes = 0, bytes = 0;
+
+	confctl_stats_begin(cc, CONFCTL_PHASE_FREEZE);
+
+	cv_count(cc->cc_root, &nodes, &bytes);
+
+	cf = frozen_array(1, sizeof(*cf));
+	cf->cf_len = nodes;
+	cf->cf_name = frozen_array(nodes, sizeof(*cf->cf_name));
+	cf->cf_name_len = frozen_array(nodes, sizeof(*cf->cf_name_len));
+	cf->cf_value = frozen_array(nodes, sizeof(*cf->cf_value));
+	cf->cf_value_len = frozen_array(nodes, sizeof(*cf->cf_value_len));
+	cf->cf_parent = frozen_array(nodes, sizeof(*cf->cf_parent));
+	cf->cf_next = frozen_array(nodes, sizeof(*cf->cf_next));
+	cf->cf_size = frozen_array(nodes, sizeof(*cf->cf_size));
+	cf->cf_strings = frozen_array(bytes, 1);
+
+	cv_freeze(cf, cc->cc_root, 0, CONFCTL_FROZEN_NONE);
+	assert(cf->cf_size[0] == nodes);
+	assert(cf->cf_strings_len == bytes);
+
+	confctl_stats_end(cc, CONFCTL_PHASE_FREEZE);
+
+	return (cf);
+}
+
+void
+confctl_frozen_delete(struct confctl_frozen *cf)
+{
+
+	free(cf->cf_name);
+	free(cf->cf_name_len);
+	free(cf->cf_value);
+	free(cf->cf_value_len);
+	free(cf->cf_parent);
+	free(cf->cf_next);
+	free(cf->cf_size);
+	free(cf->cf_strings);
+	free(cf);
+}
+
+size_t
+confctl_frozen_len(const struct confctl_frozen *cf)
+{
+
+	return (cf->cf_len);
+}
+
+const char *
+confctl_frozen_name(const struct confctl_frozen *cf, size_t i, size_t *lenp)
+{
+
+	assert(i < cf->cf_len);
+
+	if (lenp != NULL)
+		*lenp = cf->cf_name_len[i];
+	return (cf->cf_strings + cf->cf_name[i]);
+}
+
+const char *
+confctl_frozen_value(const struct confctl_frozen *cf, size_t i, size_t *lenp)
+{
+
+	assert(i < cf->cf_len);
+
+	if (cf->cf_value[i] == CONFCTL_FROZEN_NONE)
+		return (NULL);
+	if (lenp != NULL)
+		*lenp = cf->cf_value_len[i];
+	return (cf->cf_strings + cf->cf_value[i]);
+}
+
+bool
+confctl_frozen_has_children(const struct confctl_frozen *cf, size_t i)
+{
+
+	assert(i < cf->cf_len);
+
+	if (cf->cf_size[i] > 1)
+		return (true);
+	return (false);
+}
+
+size_t
+confctl_frozen_parent(const struct confctl_frozen *cf, size_t i)
+{
+
+	assert(i < cf->cf_len);
+
+	return (cf->cf_parent[i]);
+}
+
+size_t
+confctl_frozen_first_child(const struct confctl_frozen *cf, size_t i)
+{
+
+	assert(i < cf->cf_len);
+
+	if (cf->cf_size[i] > 1)
+		return (i + 1);
+	return (CONFCTL_FROZEN_NONE);
+}
+
+size_t
+confctl_frozen_next(const struct confctl_frozen *cf, size_t i)
+{
+
+	assert(i < cf->cf_len);
+
+	return (cf->cf_next[i]);
+}
+
+size_t
+confctl_frozen_subtree_size(const struct confctl_frozen *cf, size_t i)
+{
+
+	assert(i < cf->cf_len);
+
+	return (cf->cf_size[i]);
+}
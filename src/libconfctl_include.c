@@ -0,0 +1,605 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines to follow include directives: finding
+ * them in a freshly loaded tree, loading the files they refer to, several
+ * at a time, and grafting their variables into the tree.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define	_GNU_SOURCE
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <glob.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_parallel.h"
+#include "confctl_private.h"
+
+/*
+ * Directive found in the tree, and one of the files it refers to.
+ * Directives that match several files, or none, get one entry per file,
+ * or none at all.
+ */
+struct include_entry {
+	struct confctl_var	*ie_directive;
+	struct confctl_include	*ie_owner;	/* NULL for the main file. */
+	char			*ie_path;
+	struct stat		ie_sb;
+	struct confctl		*ie_cc;		/* Parsed file, from the cache. */
+};
+
+/*
+ * Files that weren't in the cache, to be loaded in parallel.
+ */
+struct include_job {
+	struct confctl		*ij_parent;
+	char			*ij_path;
+	const struct stat	*ij_sb;
+	struct confctl		*ij_cc;
+	unsigned int		ij_threads;
+	int			ij_error;
+};
+
+struct include_level {
+	struct include_entry	*il_entries;
+	size_t			il_len;
+	size_t			il_allocated;
+};
+
+static bool
+include_keyword(const char *name, size_t len)
+{
+
+	return ((len == strlen("include") &&
+	    memcmp(name, "include", len) == 0) ||
+	    (len == strlen(".include") &&
+	    memcmp(name, ".include", len) == 0));
+}
+
+/*
+ * Returns the path, or pattern, the variable refers to, with quotes
+ * removed, or NULL if it's not an include directive.  Usually it's
+ * the value; with equals sign syntax, the value is empty, and the path
+ * ends up in the name, after the keyword.
+ */
+static char *
+include_pattern(const struct confctl_var *cv)
+{
+	const char *name, *str;
+	size_t len, name_len;
+	char *pattern;
+
+	name = cv->cv_name->b_buf;
+	name_len = cv->cv_name->b_len;
+	if (cv->cv_value != NULL && cv->cv_value->b_len > 0) {
+		if (!include_keyword(name, name_len))
+			return (NULL);
+		str = cv->cv_value->b_buf;
+		len = cv->cv_value->b_len;
+	} else {
+		if (!TAILQ_EMPTY(&cv->cv_children))
+			return (NULL);
+		len = strcspn(name, " \t");
+		if (len == name_len || !include_keyword(name, len))
+			return (NULL);
+		str = name + len + strspn(name + len, " \t");
+		len = name_len - (str - name);
+	}
+
+	if (len >= 2 && (str[0] == '"' || str[0] == '\'') &&
+	    str[len - 1] == str[0]) {
+		str++;
+		len -= 2;
+	}
+	if (len == 0)
+		return (NULL);
+
+	pattern = strndup(str, len);
+	if (pattern == NULL)
+		err(1, "strndup");
+
+	return (pattern);
+}
+
+static void
+level_add(struct include_level *il, struct confctl_var *directive,
+    struct confctl_include *owner, const char *path)
+{
+	struct include_entry *ie;
+
+	if (il->il_len == il->il_allocated) {
+		il->il_allocated = il->il_allocated * 2 + 8;
+		il->il_entries = realloc(il->il_entries,
+		    il->il_allocated * sizeof(*il->il_entries));
+		if (il->il_entries == NULL)
+			err(1, "realloc");
+	}
+
+	ie = &il->il_entries[il->il_len];
+	memset(ie, 0, sizeof(*ie));
+	ie->ie_directive = directive;
+	ie->ie_owner = owner;
+	ie->ie_path = strdup(path);
+	if (ie->ie_path == NULL)
+		err(1, "strdup");
+	il->il_len++;
+}
+
+static void
+level_clear(struct include_level *il)
+{
+	size_t i;
+
+	for (i = 0; i < il->il_len; i++)
+		free(il->il_entries[i].ie_path);
+	il->il_len = 0;
+}
+
+/*
+ * Adds the files referred to by the directive to the level.  Relative
+ * paths are relative to the directory of the including file.  Patterns
+ * that don't match anything are fine; plain paths that don't exist
+ * are not, which is found out when trying to stat them.
+ */
+static void
+level_expand(struct include_level *il, struct confctl_var *directive,
+    struct confctl_include *owner, const char *includer)
+{
+	glob_t g;
+	char *pattern, *tmp, *full;
+	size_t i;
+	int error;
+
+	pattern = include_pattern(directive);
+	if (pattern == NULL)
+		return;
+	if (pattern[0] != '/' && strchr(includer, '/') != NULL) {
+		tmp = strdup(includer);
+		if (tmp == NULL)
+			err(1, "strdup");
+		error = asprintf(&full, "%s/%s", dirname(tmp), pattern);
+		if (error < 0)
+			err(1, "asprintf");
+		free(tmp);
+		free(pattern);
+		pattern = full;
+	}
+
+	error = glob(pattern, 0, NULL, &g);
+	if (error == 0) {
+		for (i = 0; i < g.gl_pathc; i++)
+			level_add(il, directive, owner, g.gl_pathv[i]);
+	} else if (error == GLOB_NOMATCH) {
+		if (strpbrk(pattern, "*?[") == NULL)
+			level_add(il, directive, owner, pattern);
+	} else if (error == GLOB_NOSPACE) {
+		errx(1, "glob: out of memory");
+	}
+	globfree(&g);
+	free(pattern);
+}
+
+/*
+ * Adds directives found in 'cv', its next siblings, and below them,
+ * to the level; with 'owner', only the siblings that came from that file.
+ */
+static void
+level_collect(struct include_level *il, struct confctl_var *cv,
+    struct confctl_include *owner, const char *includer)
+{
+	struct confctl_var *child;
+
+	for (; cv != NULL; cv = TAILQ_NEXT(cv, cv_next)) {
+		if (owner != NULL && CV_EXT(cv, cx_include) != owner)
+			break;
+		level_expand(il, cv, owner, includer);
+		child = TAILQ_FIRST(&cv->cv_children);
+		if (child != NULL)
+			level_collect(il, child, NULL, includer);
+	}
+}
+
+static bool
+identity_matches(const struct confctl_identity *ci, const struct stat *sb)
+{
+
+	return (ci->ci_dev == sb->st_dev && ci->ci_ino == sb->st_ino &&
+	    ci->ci_size == sb->st_size &&
+	    ci->ci_mtime.tv_sec == sb->st_mtim.tv_sec &&
+	    ci->ci_mtime.tv_nsec == sb->st_mtim.tv_nsec &&
+	    ci->ci_ctime.tv_sec == sb->st_ctim.tv_sec &&
+	    ci->ci_ctime.tv_nsec == sb->st_ctim.tv_nsec);
+}
+
+static struct confctl *
+cache_find(struct confctl_include_cache *cic, const struct stat *sb)
+{
+	size_t i;
+
+	for (i = 0; i < cic->cic_len; i++) {
+		if (identity_matches(cic->cic_ccs[i]->cc_identity, sb))
+			return (cic->cic_ccs[i]);
+	}
+
+	return (NULL);
+}
+
+static void
+cache_add(struct confctl_include_cache *cic, struct confctl *cc)
+{
+
+	if (cic->cic_len == cic->cic_allocated) {
+		cic->cic_allocated = cic->cic_allocated * 2 + 8;
+		cic->cic_ccs = realloc(cic->cic_ccs,
+		    cic->cic_allocated * sizeof(*cic->cic_ccs));
+		if (cic->cic_ccs == NULL)
+			err(1, "realloc");
+	}
+	cic->cic_ccs[cic->cic_len] = cc;
+	cic->cic_len++;
+}
+
+struct confctl_include_cache *
+confctl_include_cache_new(void)
+{
+	struct confctl_include_cache *cic;
+
+	cic = calloc(1, sizeof(*cic));
+	if (cic == NULL)
+		err(1, "calloc");
+
+	return (cic);
+}
+
+void
+confctl_include_cache_delete(struct confctl_include_cache *cic)
+{
+	size_t i;
+
+	for (i = 0; i < cic->cic_len; i++)
+		confctl_delete(cic->cic_ccs[i]);
+	free(cic->cic_ccs);
+	free(cic);
+}
+
+/*
+ * Included files are loaded with the same options as the including one,
+ * but without following includes; that's done level by level instead,
+ * so that loops can be detected, and files on the same level can be
+ * loaded at the same time.
+ */
+static void
+include_task(void *arg, size_t i)
+{
+	struct include_job *ij;
+	struct confctl *parent, *cc;
+
+	ij = (struct include_job *)arg + i;
+	parent = ij->ij_parent;
+	cc = confctl_new();
+	confctl_set_lossless(cc, !parent->cc_lossy);
+	confctl_set_read_only(cc, parent->cc_read_only);
+	confctl_set_threads(cc, ij->ij_threads);
+	confctl_set_equals_sign(cc, parent->cc_equals_sign);
+	confctl_set_rewrite_in_place(cc, parent->cc_rewrite_in_place);
+	confctl_set_semicolon(cc, parent->cc_semicolon);
+	confctl_set_slash_slash_comments(cc, parent->cc_slash_slash_comments);
+	confctl_set_slash_star_comments(cc, parent->cc_slash_star_comments);
+	ij->ij_error = confctl_load2(cc, ij->ij_path, NULL);
+	ij->ij_cc = cc;
+}
+
+/*
+ * Makes sure every entry of the level has its file parsed, either found
+ * in the cache, or loaded now, along with the others that weren't there.
+ */
+static int
+level_load(struct confctl *cc, struct include_level *il,
+    struct confctl_include_cache *cic)
+{
+	struct include_entry *ie;
+	struct include_job *jobs;
+	size_t i, j, njobs = 0;
+	unsigned int threads;
+	int error = 0;
+
+	jobs = calloc(il->il_len, sizeof(*jobs));
+	if (jobs == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < il->il_len; i++) {
+		ie = &il->il_entries[i];
+		if (cache_find(cic, &ie->ie_sb) != NULL)
+			continue;
+		for (j = 0; j < njobs; j++) {
+			if (jobs[j].ij_sb->st_dev == ie->ie_sb.st_dev &&
+			    jobs[j].ij_sb->st_ino == ie->ie_sb.st_ino)
+				break;
+		}
+		if (j < njobs)
+			continue;
+		jobs[njobs].ij_parent = cc;
+		jobs[njobs].ij_path = ie->ie_path;
+		jobs[njobs].ij_sb = &ie->ie_sb;
+		njobs++;
+	}
+
+	threads = cc->cc_threads;
+	if (threads == 0)
+		threads = njobs > 1 ? parallel_ncpus() : 0;
+	for (j = 0; j < njobs; j++)
+		jobs[j].ij_threads = njobs > 1 ? 1 : threads;
+	if (njobs > 0)
+		parallel_run(threads > 0 ? threads : 1, njobs, include_task, jobs);
+
+	for (j = 0; j < njobs; j++) {
+		if (jobs[j].ij_error != 0) {
+			if (error == 0)
+				cc->cc_error = jobs[j].ij_cc->cc_error;
+			confctl_delete(jobs[j].ij_cc);
+			error = -1;
+			continue;
+		}
+		if (cc->cc_stats != NULL) {
+			cc->cc_stats->css_stats.cs_bytes_read +=
+			    jobs[j].ij_cc->cc_identity->ci_size;
+		}
+		cache_add(cic, jobs[j].ij_cc);
+	}
+	free(jobs);
+	if (error != 0)
+		return (-1);
+
+	/*
+	 * A file that changed between being stat(2)ed and loaded is there
+	 * under its new identity; use whatever got loaded.
+	 */
+	for (i = 0; i < il->il_len; i++) {
+		ie = &il->il_entries[i];
+		ie->ie_cc = cache_find(cic, &ie->ie_sb);
+		for (j = cic->cic_len; ie->ie_cc == NULL && j > 0; j--) {
+			if (strcmp(cic->cic_ccs[j - 1]->cc_identity->ci_path,
+			    ie->ie_path) == 0)
+				ie->ie_cc = cic->cic_ccs[j - 1];
+		}
+		if (ie->ie_cc == NULL) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_CHANGED,
+			    0, "%s changed while being loaded", ie->ie_path);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Grafts copies of the variables from the entry's file into the tree,
+ * after 'prev', and returns the last one, or 'prev' if there weren't any.
+ * Directives among them go into 'next', to be followed afterwards.
+ */
+static struct confctl_var *
+level_graft(struct confctl *cc, struct include_entry *ie,
+    struct confctl_var *prev, struct include_level *next)
+{
+	struct confctl_include *ci;
+	struct confctl_identity *identity;
+	struct confctl_var *root, *child, *cv, *first = NULL;
+
+	ci = calloc(1, sizeof(*ci));
+	identity = calloc(1, sizeof(*identity));
+	if (ci == NULL || identity == NULL)
+		err(1, "calloc");
+	*identity = *ie->ie_cc->cc_identity;
+	identity->ci_path = strdup(ie->ie_path);
+	if (identity->ci_path == NULL)
+		err(1, "strdup");
+	ci->cin_identity = identity;
+	ci->cin_hash = identity->ci_hash;
+	ci->cin_parent = ie->ie_owner;
+	ci->cin_directive = ie->ie_directive;
+	ci->cin_where = ie->ie_directive->cv_parent;
+
+	root = confctl_root(ie->ie_cc);
+	ci->cin_before = confctl_buf_copy(cc, root->cv_before);
+	ci->cin_middle = confctl_buf_copy(cc, root->cv_middle);
+	ci->cin_after = confctl_buf_copy(cc, root->cv_after);
+	TAILQ_INSERT_TAIL(&cc->cc_includes, ci, cin_next);
+
+	TAILQ_FOREACH(child, &root->cv_children, cv_next) {
+		cv = confctl_var_clone(cc, child);
+		confctl_var_ext(cv)->cx_include = ci;
+		confctl_var_insert_after(prev, cv);
+		prev = cv;
+		if (first == NULL)
+			first = cv;
+	}
+	if (first != NULL)
+		level_collect(next, first, ci, ie->ie_path);
+
+	return (prev);
+}
+
+/*
+ * Includes files referred to by directives in the variables that were
+ * just loaded from 'path', starting with 'first', and in the files they
+ * include, and so on.  On failure, returns -1; the variables grafted
+ * so far are left in the tree, for the caller to get rid of along with
+ * the rest of what got loaded, and forgotten about.
+ */
+int
+confctl_include_expand(struct confctl *cc, const char *path,
+    const struct stat *sb, struct confctl_var *first)
+{
+	struct confctl_include_cache *cic;
+	struct confctl_include *last, *ci, *owner;
+	struct include_level il, next;
+	struct include_entry *ie;
+	struct confctl_var *prev;
+	size_t i;
+	int error = 0;
+
+	if (first == NULL)
+		return (0);
+
+	cic = cc->cc_include_cache;
+	if (cic == NULL)
+		cic = confctl_include_cache_new();
+	last = TAILQ_LAST(&cc->cc_includes, confctl_include_head);
+
+	memset(&il, 0, sizeof(il));
+	memset(&next, 0, sizeof(next));
+	level_collect(&il, first, NULL, path);
+
+	while (il.il_len > 0) {
+		/*
+		 * Stat everything first, for the cache lookups, and to find
+		 * files that include themselves, directly or not.
+		 */
+		for (i = 0; i < il.il_len; i++) {
+			ie = &il.il_entries[i];
+			if (stat(ie->ie_path, &ie->ie_sb) != 0) {
+				confctl_error_set(&cc->cc_error,
+				    CONFCTL_ERROR_SYSTEM, errno,
+				    "unable to open %s", ie->ie_path);
+				error = -1;
+				break;
+			}
+			for (owner = ie->ie_owner; owner != NULL;
+			    owner = owner->cin_parent) {
+				if (owner->cin_identity->ci_dev == ie->ie_sb.st_dev &&
+				    owner->cin_identity->ci_ino == ie->ie_sb.st_ino)
+					break;
+			}
+			if (owner != NULL || (sb->st_dev == ie->ie_sb.st_dev &&
+			    sb->st_ino == ie->ie_sb.st_ino)) {
+				confctl_error_set(&cc->cc_error,
+				    CONFCTL_ERROR_SYNTAX, 0,
+				    "%s: include loop", ie->ie_path);
+				error = -1;
+				break;
+			}
+		}
+		if (error == 0)
+			error = level_load(cc, &il, cic);
+		if (error != 0)
+			break;
+
+		/*
+		 * Files included by the same directive go after it,
+		 * one after another.
+		 */
+		prev = NULL;
+		for (i = 0; i < il.il_len; i++) {
+			ie = &il.il_entries[i];
+			if (i == 0 || ie->ie_directive != il.il_entries[i - 1].ie_directive)
+				prev = ie->ie_directive;
+			prev = level_graft(cc, ie, prev, &next);
+		}
+
+		level_clear(&il);
+		free(il.il_entries);
+		il = next;
+		memset(&next, 0, sizeof(next));
+	}
+	level_clear(&il);
+	free(il.il_entries);
+
+	if (cic != cc->cc_include_cache)
+		confctl_include_cache_delete(cic);
+
+	if (error != 0) {
+		for (;;) {
+			ci = TAILQ_LAST(&cc->cc_includes, confctl_include_head);
+			if (ci == last)
+				break;
+			TAILQ_REMOVE(&cc->cc_includes, ci, cin_next);
+			confctl_include_delete(ci);
+		}
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+confctl_include_delete(struct confctl_include *ci)
+{
+
+	confctl_buf_delete(ci->cin_before);
+	confctl_buf_delete(ci->cin_middle);
+	confctl_buf_delete(ci->cin_after);
+	free(ci->cin_identity->ci_path);
+	free(ci->cin_identity);
+	free(ci);
+}
+
+static bool
+is_below(const struct confctl_var *cv, const struct confctl_var *ancestor)
+{
+
+	for (; cv != NULL; cv = cv->cv_parent) {
+		if (cv == ancestor)
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Called before deleting 'cv'.  Files whose directives, or the variables
+ * they were grafted into, go away along with it, are not going to be saved
+ * anymore, and neither are the ones they include.  Removing a directive
+ * doesn't remove the file, just stops including it; the variables that
+ * came from it stay in the tree until it's loaded again, as deleting
+ * anything else than what was asked for would break callers iterating
+ * over siblings.
+ */
+void
+confctl_include_forget(struct confctl *cc, struct confctl_var *cv)
+{
+	struct confctl_include *ci;
+
+	TAILQ_FOREACH(ci, &cc->cc_includes, cin_next) {
+		if (ci->cin_detached)
+			continue;
+		if (is_below(ci->cin_directive, cv) || is_below(ci->cin_where, cv) ||
+		    (ci->cin_parent != NULL && ci->cin_parent->cin_detached))
+			ci->cin_detached = true;
+	}
+}
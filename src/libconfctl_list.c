@@ -0,0 +1,213 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines to go through elements of list values,
+ * like "10.1.1.1, 10.1.1.2", without copying them, and to change them
+ * one at a time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+static bool
+is_separator(const char *separators, char ch)
+{
+
+	return (ch != '\0' && strchr(separators, ch) != NULL);
+}
+
+/*
+ * Returns the offset of the first separator, quote, or backslash in 's',
+ * or 'len' if there is none.  Long elements are scanned sixteen bytes
+ * at a time, where SSE2 is available.
+ */
+static size_t
+scan(const char *s, size_t len, const char *separators)
+{
+	size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+	__m128i chunk, hits;
+	const char *sep;
+	unsigned int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		chunk = _mm_loadu_si128((const __m128i *)(s + i));
+		hits = _mm_or_si128(_mm_or_si128(
+		    _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')),
+		    _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\''))),
+		    _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\')));
+		for (sep = separators; *sep != '\0'; sep++) {
+			hits = _mm_or_si128(hits,
+			    _mm_cmpeq_epi8(chunk, _mm_set1_epi8(*sep)));
+		}
+		mask = _mm_movemask_epi8(hits);
+		if (mask != 0)
+			return (i + __builtin_ctz(mask));
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\'' || s[i] == '\\' ||
+		    is_separator(separators, s[i]))
+			return (i);
+	}
+
+	return (len);
+}
+
+/*
+ * Returns the offset just past the quoted part starting at 's[i]'.
+ */
+static size_t
+skip_quoted(const char *s, size_t len, size_t i)
+{
+	char quote;
+
+	quote = s[i++];
+	while (i < len && s[i] != quote) {
+		if (s[i] == '\\')
+			i++;
+		i++;
+	}
+
+	return (i + 1);
+}
+
+const char *
+confctl_list_first(struct confctl_list *cl, struct confctl_var *cv,
+    const char *separators, size_t *lenp)
+{
+
+	cl->cl_var = cv;
+	cl->cl_separators = separators;
+	cl->cl_start = 0;
+	cl->cl_len = 0;
+	cl->cl_next = 0;
+
+	return (confctl_list_next(cl, lenp));
+}
+
+const char *
+confctl_list_next(struct confctl_list *cl, size_t *lenp)
+{
+	const char *s;
+	size_t i, len;
+
+	*lenp = 0;
+	cl->cl_len = 0;
+	if (cl->cl_var->cv_value == NULL)
+		return (NULL);
+
+	s = cl->cl_var->cv_value->b_buf;
+	len = cl->cl_var->cv_value->b_len;
+	i = cl->cl_next;
+
+	while (i < len && is_separator(cl->cl_separators, s[i]))
+		i++;
+	if (i >= len) {
+		cl->cl_start = cl->cl_next = len;
+		return (NULL);
+	}
+
+	cl->cl_start = i;
+	while (i < len) {
+		i += scan(s + i, len - i, cl->cl_separators);
+		if (i >= len)
+			break;
+		if (s[i] == '\\')
+			i += 2;
+		else if (s[i] == '"' || s[i] == '\'')
+			i = skip_quoted(s, len, i);
+		else
+			break;
+	}
+	if (i > len)
+		i = len;
+
+	cl->cl_len = i - cl->cl_start;
+	cl->cl_next = i;
+	*lenp = cl->cl_len;
+
+	return (s + cl->cl_start);
+}
+
+void
+confctl_list_set(struct confctl_list *cl, const char *element)
+{
+	size_t len;
+
+	assert(cl->cl_len > 0);
+
+	len = strlen(element);
+	confctl_var_splice_value(cl->cl_var, cl->cl_start, cl->cl_len,
+	    element, len);
+	cl->cl_len = len;
+	cl->cl_next = cl->cl_start + len;
+}
+
+void
+confctl_list_append(struct confctl_var *cv, const char *separator,
+    const char *element)
+{
+	size_t separator_len, element_len;
+	char *str;
+
+	assert(!confctl_var_has_children(cv));
+
+	if (cv->cv_value == NULL || cv->cv_value->b_len == 0) {
+		confctl_var_set_value(cv, element);
+		return;
+	}
+
+	separator_len = strlen(separator);
+	element_len = strlen(element);
+	str = malloc(separator_len + element_len);
+	if (str == NULL)
+		err(1, "malloc");
+	memcpy(str, separator, separator_len);
+	memcpy(str + separator_len, element, element_len);
+
+	confctl_var_splice_value(cv, cv->cv_value->b_len, 0,
+	    str, separator_len + element_len);
+	free(str);
+}
@@ -0,0 +1,266 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines to report changes to the tree to
+ * the observer, either as they happen, or coalesced at the end of a batch.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+void
+confctl_set_observer(struct confctl *cc, const struct confctl_observer *co,
+    void *ctx)
+{
+
+	if (co == NULL) {
+		memset(&cc->cc_observer, 0, sizeof(cc->cc_observer));
+		cc->cc_observed = false;
+	} else {
+		cc->cc_observer = *co;
+		cc->cc_observed = true;
+	}
+	cc->cc_observer_ctx = ctx;
+}
+
+static void
+report(struct confctl *cc, struct confctl_var *cv, unsigned int events)
+{
+	const struct confctl_observer *co;
+	void *ctx;
+
+	if (!cc->cc_observed)
+		return;
+
+	co = &cc->cc_observer;
+	ctx = cc->cc_observer_ctx;
+
+	if ((events & CONFCTL_EVENT_DELETE) != 0) {
+		if (co->co_delete != NULL)
+			co->co_delete(ctx, cv);
+		return;
+	}
+	if ((events & CONFCTL_EVENT_NEW) != 0) {
+		if (co->co_new != NULL)
+			co->co_new(ctx, cv);
+		return;
+	}
+	if ((events & CONFCTL_EVENT_MOVE) != 0 && co->co_move != NULL)
+		co->co_move(ctx, cv);
+	if ((events & CONFCTL_EVENT_NAME) != 0 && co->co_set_name != NULL)
+		co->co_set_name(ctx, cv);
+	if ((events & CONFCTL_EVENT_VALUE) != 0 && co->co_set_value != NULL)
+		co->co_set_value(ctx, cv);
+}
+
+/*
+ * Called after every change, with the 'struct confctl' the variable
+ * belongs to, or NULL if none; for deletion, it's called before.
+ */
+void
+confctl_observe(struct confctl *cc, struct confctl_var *cv, unsigned int event)
+{
+
+	if (cc == NULL || (!cc->cc_observed && cc->cc_batch == 0))
+		return;
+
+	if (cc->cc_batch == 0) {
+		report(cc, cv, event);
+		return;
+	}
+
+	if (CV_EXT(cv, cx_events) == 0) {
+		if (cc->cc_pending_len == cc->cc_pending_allocated) {
+			cc->cc_pending_allocated = cc->cc_pending_allocated * 2 + 64;
+			cc->cc_pending = realloc(cc->cc_pending,
+			    cc->cc_pending_allocated * sizeof(*cc->cc_pending));
+			if (cc->cc_pending == NULL)
+				err(1, "realloc");
+		}
+		cc->cc_pending[cc->cc_pending_len++] = cv;
+	}
+	confctl_var_ext(cv)->cx_events |= event;
+}
+
+void
+confctl_batch_begin(struct confctl *cc)
+{
+
+	cc->cc_batch++;
+}
+
+/*
+ * Variables deleted during a batch were only taken out of the tree,
+ * with nothing left pointing to them; variables that were in the tree
+ * under them, or in another one, were moved away, don't get reported.
+ */
+static bool
+in_tree(const struct confctl *cc, const struct confctl_var *cv)
+{
+
+	while (cv->cv_parent != NULL)
+		cv = cv->cv_parent;
+
+	return (cv == cc->cc_root);
+}
+
+/*
+ * Frees the variables deleted during the batch.  The ones that were
+ * deleted along with their parent go along with it, so the rest
+ * of the list must not be looked at once the freeing starts.
+ */
+static void
+batch_free(struct confctl *cc)
+{
+	struct confctl_var *cv;
+	size_t i, ndeleted = 0;
+
+	for (i = 0; i < cc->cc_pending_len; i++) {
+		cv = cc->cc_pending[i];
+		if ((cv->cv_ext->cx_events & CONFCTL_EVENT_DELETE) != 0)
+			cc->cc_pending[ndeleted++] = cv;
+		cv->cv_ext->cx_events = 0;
+	}
+	cc->cc_pending_len = 0;
+
+	for (i = 0; i < ndeleted; i++)
+		confctl_var_delete(cc->cc_pending[i]);
+}
+
+/*
+ * Reports what the batch holds, and starts it anew.
+ */
+static void
+batch_flush(struct confctl *cc)
+{
+	struct confctl_var *cv;
+	unsigned int events;
+	size_t i;
+
+	for (i = 0; i < cc->cc_pending_len; i++) {
+		cv = cc->cc_pending[i];
+		events = cv->cv_ext->cx_events;
+		if ((events & CONFCTL_EVENT_DELETE) != 0) {
+			if ((events & CONFCTL_EVENT_NEW) == 0)
+				report(cc, cv, CONFCTL_EVENT_DELETE);
+			continue;
+		}
+		if (!in_tree(cc, cv))
+			continue;
+		report(cc, cv, events);
+	}
+
+	batch_free(cc);
+}
+
+void
+confctl_batch_end(struct confctl *cc)
+{
+
+	assert(cc->cc_batch > 0);
+
+	if (--cc->cc_batch > 0)
+		return;
+
+	batch_flush(cc);
+}
+
+/*
+ * Called when the file changed since it was loaded, and got loaded again
+ * as 'fresh', before replaying the changes into it.  Changes held back
+ * by an open batch are about the old tree, so they get reported right away,
+ * followed by the old top-level variables as deleted, and the new ones
+ * as added.  Changes replayed into 'fresh' go to the observer of 'cc',
+ * batched the same way.
+ */
+void
+confctl_observe_reload(struct confctl *cc, struct confctl *fresh)
+{
+	struct confctl_var *cv;
+
+	if (cc->cc_batch > 0)
+		batch_flush(cc);
+
+	TAILQ_FOREACH(cv, &cc->cc_root->cv_children, cv_next)
+		report(cc, cv, CONFCTL_EVENT_DELETE);
+	TAILQ_FOREACH(cv, &fresh->cc_root->cv_children, cv_next)
+		report(cc, cv, CONFCTL_EVENT_NEW);
+
+	fresh->cc_observer = cc->cc_observer;
+	fresh->cc_observed = cc->cc_observed;
+	fresh->cc_observer_ctx = cc->cc_observer_ctx;
+	fresh->cc_batch = cc->cc_batch;
+}
+
+/*
+ * Called after replaying, just before the trees get swapped; whatever
+ * the replay left in the batch is now held by 'cc'.
+ */
+void
+confctl_observe_replayed(struct confctl *cc, struct confctl *fresh)
+{
+
+	assert(cc->cc_pending_len == 0);
+
+	free(cc->cc_pending);
+	cc->cc_pending = fresh->cc_pending;
+	cc->cc_pending_len = fresh->cc_pending_len;
+	cc->cc_pending_allocated = fresh->cc_pending_allocated;
+	fresh->cc_pending = NULL;
+	fresh->cc_pending_len = 0;
+	fresh->cc_pending_allocated = 0;
+	fresh->cc_batch = 0;
+	confctl_set_observer(fresh, NULL, NULL);
+}
+
+/*
+ * Called when the tree goes away with a batch still open; nothing
+ * gets reported.
+ */
+void
+confctl_batch_discard(struct confctl *cc)
+{
+
+	batch_free(cc);
+	free(cc->cc_pending);
+	cc->cc_pending = NULL;
+	cc->cc_pending_allocated = 0;
+	cc->cc_batch = 0;
+}
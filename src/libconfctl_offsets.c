@@ -0,0 +1,914 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines to write the offset index, kept next
+ * to the configuration file, and to load just the parts of the file that
+ * can match a query, using it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define	_GNU_SOURCE
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+/*
+ * The index is a header, followed by entries sorted by key, and then
+ * by offset, followed by the keys.  The key is the path of the variable,
+ * i.e. its name preceded by names of its parents, separated with NUL
+ * characters.  Only variables with children, and top-level ones, get
+ * entries; the rest are found by reading their parents.  The header
+ * records the identity of the file the offsets are for.  Index is only
+ * meant to be read on the machine that wrote it, so it's all in native
+ * byte order.
+ */
+#define	OFFSETS_SUFFIX		".idx"
+#define	OFFSETS_MAGIC		"confidx"
+#define	OFFSETS_VERSION		1
+
+#define	OFFSETS_EQUALS_SIGN	0x01
+#define	OFFSETS_SEMICOLON	0x02
+#define	OFFSETS_SLASH_SLASH	0x04
+#define	OFFSETS_SLASH_STAR	0x08
+
+struct offsets_header {
+	char		oh_magic[8];
+	uint32_t	oh_version;
+	uint32_t	oh_syntax;	/* OFFSETS_* flags it was parsed with. */
+	uint64_t	oh_dev;
+	uint64_t	oh_ino;
+	uint64_t	oh_size;
+	int64_t		oh_mtime_sec;
+	int64_t		oh_mtime_nsec;
+	int64_t		oh_ctime_sec;
+	int64_t		oh_ctime_nsec;
+	uint64_t	oh_hash;
+	uint64_t	oh_len;		/* Number of entries. */
+	uint64_t	oh_keys_len;
+};
+
+struct offsets_entry {
+	uint64_t	oe_key;		/* Offset of the key within the keys. */
+	uint64_t	oe_key_len;
+	uint64_t	oe_start;	/* Where the name starts in the file. */
+	uint64_t	oe_end;		/* Where its cv_after ends. */
+};
+
+/*
+ * Entries and keys, collected while walking the tree.  Keys are stored
+ * in the order they were found in; only the entries get sorted.
+ */
+struct offsets_builder {
+	struct offsets_entry	*ob_entries;
+	size_t			ob_len;
+	size_t			ob_allocated;
+	char			*ob_keys;
+	size_t			ob_keys_len;
+	size_t			ob_keys_allocated;
+	char			*ob_path;	/* Key of the current variable. */
+	size_t			ob_path_len;
+	size_t			ob_path_allocated;
+	uint64_t		ob_offset;
+};
+
+/*
+ * Part of the file to be loaded; 'os_key' points to the key of the entry
+ * it came from, to know the names of its parents.
+ */
+struct offsets_span {
+	uint64_t	os_start;
+	uint64_t	os_end;
+	const char	*os_key;
+	size_t		os_key_len;
+};
+
+static char *
+offsets_path(const char *path)
+{
+	char *idxpath;
+
+	if (asprintf(&idxpath, "%s%s", path, OFFSETS_SUFFIX) < 0)
+		err(1, "asprintf");
+
+	return (idxpath);
+}
+
+static uint32_t
+offsets_syntax(const struct confctl *cc)
+{
+	uint32_t syntax = 0;
+
+	if (cc->cc_equals_sign)
+		syntax |= OFFSETS_EQUALS_SIGN;
+	if (cc->cc_semicolon)
+		syntax |= OFFSETS_SEMICOLON;
+	if (cc->cc_slash_slash_comments)
+		syntax |= OFFSETS_SLASH_SLASH;
+	if (cc->cc_slash_star_comments)
+		syntax |= OFFSETS_SLASH_STAR;
+
+	return (syntax);
+}
+
+static size_t
+buf_len(const struct buf *b)
+{
+
+	if (b == NULL)
+		return (0);
+	return (b->b_len);
+}
+
+static void *
+grow(void *p, size_t *allocated, size_t needed, size_t size)
+{
+
+	if (needed <= *allocated)
+		return (p);
+	while (*allocated < needed)
+		*allocated = *allocated * 2 + 64;
+	p = realloc(p, *allocated * size);
+	if (p == NULL)
+		err(1, "realloc");
+
+	return (p);
+}
+
+static size_t
+offsets_add(struct offsets_builder *ob)
+{
+	struct offsets_entry *oe;
+
+	ob->ob_entries = grow(ob->ob_entries, &ob->ob_allocated,
+	    ob->ob_len + 1, sizeof(*ob->ob_entries));
+	ob->ob_keys = grow(ob->ob_keys, &ob->ob_keys_allocated,
+	    ob->ob_keys_len + ob->ob_path_len, 1);
+
+	oe = &ob->ob_entries[ob->ob_len];
+	oe->oe_key = ob->ob_keys_len;
+	oe->oe_key_len = ob->ob_path_len;
+	oe->oe_start = ob->ob_offset;
+	oe->oe_end = ob->ob_offset;
+	memcpy(ob->ob_keys + ob->ob_keys_len, ob->ob_path, ob->ob_path_len);
+	ob->ob_keys_len += ob->ob_path_len;
+
+	return (ob->ob_len++);
+}
+
+/*
+ * Adds up the lengths of everything cv_write() would write out, which,
+ * for a tree that was just loaded or saved, is where it is in the file.
+ */
+static void
+offsets_walk(struct offsets_builder *ob, struct confctl_var *cv, unsigned int depth)
+{
+	struct confctl_var *child;
+	size_t i = SIZE_MAX, path_len;
+
+	path_len = ob->ob_path_len;
+	ob->ob_offset += buf_len(cv->cv_before);
+	if (depth > 0) {
+		ob->ob_path = grow(ob->ob_path, &ob->ob_path_allocated,
+		    path_len + 1 + cv->cv_name->b_len, 1);
+		if (depth > 1)
+			ob->ob_path[ob->ob_path_len++] = '\0';
+		memcpy(ob->ob_path + ob->ob_path_len, cv->cv_name->b_buf,
+		    cv->cv_name->b_len);
+		ob->ob_path_len += cv->cv_name->b_len;
+
+		if (depth == 1 || !TAILQ_EMPTY(&cv->cv_children))
+			i = offsets_add(ob);
+		ob->ob_offset += cv->cv_name->b_len;
+	}
+	ob->ob_offset += buf_len(cv->cv_middle);
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next) {
+		if (CV_EXT(child, cx_include) == NULL)
+			offsets_walk(ob, child, depth + 1);
+	}
+	ob->ob_offset += buf_len(cv->cv_value);
+	ob->ob_offset += buf_len(cv->cv_after);
+
+	if (i != SIZE_MAX)
+		ob->ob_entries[i].oe_end = ob->ob_offset;
+	ob->ob_path_len = path_len;
+}
+
+static int
+key_compare(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+	int cmp;
+
+	cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+	if (cmp != 0)
+		return (cmp);
+	if (a_len != b_len)
+		return (a_len < b_len ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Order of entries in the index: by key, and then by offset.
+ */
+static int
+offsets_compare(const void *a, const void *b)
+{
+	const struct offsets_span *x = a, *y = b;
+	int cmp;
+
+	cmp = key_compare(x->os_key, x->os_key_len, y->os_key, y->os_key_len);
+	if (cmp != 0)
+		return (cmp);
+	if (x->os_start != y->os_start)
+		return (x->os_start < y->os_start ? -1 : 1);
+	return (0);
+}
+
+static void
+offsets_sort(struct offsets_builder *ob)
+{
+	struct offsets_entry *oe;
+	struct offsets_span *spans;
+	size_t i;
+
+	if (ob->ob_len == 0)
+		return;
+	spans = calloc(ob->ob_len, sizeof(*spans));
+	if (spans == NULL)
+		err(1, "calloc");
+	for (i = 0; i < ob->ob_len; i++) {
+		oe = &ob->ob_entries[i];
+		spans[i].os_start = oe->oe_start;
+		spans[i].os_end = oe->oe_end;
+		spans[i].os_key = ob->ob_keys + oe->oe_key;
+		spans[i].os_key_len = oe->oe_key_len;
+	}
+	qsort(spans, ob->ob_len, sizeof(*spans), offsets_compare);
+	for (i = 0; i < ob->ob_len; i++) {
+		oe = &ob->ob_entries[i];
+		oe->oe_key = spans[i].os_key - ob->ob_keys;
+		oe->oe_key_len = spans[i].os_key_len;
+		oe->oe_start = spans[i].os_start;
+		oe->oe_end = spans[i].os_end;
+	}
+	free(spans);
+}
+
+/*
+ * Writes the index to a temporary file, and then renames it into place.
+ */
+static int
+offsets_write(struct confctl *cc, const char *path, const char *idxpath)
+{
+	struct offsets_builder ob;
+	struct offsets_header oh;
+	struct confctl_identity *ci;
+	struct stat sb;
+	FILE *fp;
+	char *tmppath;
+	int error, fd;
+
+	if (cc->cc_lossy || cc->cc_partial) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_LOSSY, 0,
+		    "cannot index %s: it wasn't loaded in full", path);
+		return (-1);
+	}
+	if (cc->cc_read_only) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_UNSUPPORTED, 0,
+		    "cannot index %s: loaded read-only", path);
+		return (-1);
+	}
+
+	/*
+	 * Only loaded files have their hash known.
+	 */
+	ci = cc->cc_identity;
+	if (ci == NULL || !ci->ci_hash_valid || strcmp(ci->ci_path, path) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_CHANGED, 0,
+		    "cannot index %s: it wasn't loaded", path);
+		return (-1);
+	}
+
+	memset(&ob, 0, sizeof(ob));
+	offsets_walk(&ob, confctl_root(cc), 0);
+	if (ob.ob_offset != (uint64_t)ci->ci_size) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_CHANGED, 0,
+		    "cannot index %s: changed since it was loaded", path);
+		error = -1;
+		goto out;
+	}
+
+	offsets_sort(&ob);
+
+	memset(&oh, 0, sizeof(oh));
+	memcpy(oh.oh_magic, OFFSETS_MAGIC, sizeof(oh.oh_magic));
+	oh.oh_version = OFFSETS_VERSION;
+	oh.oh_syntax = offsets_syntax(cc);
+	oh.oh_dev = ci->ci_dev;
+	oh.oh_ino = ci->ci_ino;
+	oh.oh_size = ci->ci_size;
+	oh.oh_mtime_sec = ci->ci_mtime.tv_sec;
+	oh.oh_mtime_nsec = ci->ci_mtime.tv_nsec;
+	oh.oh_ctime_sec = ci->ci_ctime.tv_sec;
+	oh.oh_ctime_nsec = ci->ci_ctime.tv_nsec;
+	oh.oh_hash = ci->ci_hash;
+	oh.oh_len = ob.ob_len;
+	oh.oh_keys_len = ob.ob_keys_len;
+
+	if (asprintf(&tmppath, "%s.XXXXXXXXX", idxpath) < 0)
+		err(1, "asprintf");
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot create temporary file %s", tmppath);
+		free(tmppath);
+		error = -1;
+		goto out;
+	}
+	/*
+	 * Whoever can read the file can read the index; nobody needs
+	 * to write it in place.
+	 */
+	if (stat(path, &sb) != 0 ||
+	    fchmod(fd, sb.st_mode & (S_IRUSR | S_IRGRP | S_IROTH)) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot set mode of %s", tmppath);
+		close(fd);
+		goto fail;
+	}
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fdopen");
+		close(fd);
+		goto fail;
+	}
+	fwrite(&oh, sizeof(oh), 1, fp);
+	fwrite(ob.ob_entries, sizeof(*ob.ob_entries), ob.ob_len, fp);
+	fwrite(ob.ob_keys, 1, ob.ob_keys_len, fp);
+	if (fflush(fp) != 0 || ferror(fp) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot write %s", tmppath);
+		fclose(fp);
+		goto fail;
+	}
+	/*
+	 * Without it, a crash could leave a torn index with a valid header.
+	 */
+	if (fsync(fd) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fsync");
+		fclose(fp);
+		goto fail;
+	}
+	if (fclose(fp) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fclose");
+		goto fail;
+	}
+	if (rename(tmppath, idxpath) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot replace %s", idxpath);
+		goto fail;
+	}
+	free(tmppath);
+	error = 0;
+	goto out;
+
+fail:
+	unlink(tmppath);
+	free(tmppath);
+	error = -1;
+out:
+	free(ob.ob_entries);
+	free(ob.ob_keys);
+	free(ob.ob_path);
+	return (error);
+}
+
+int
+confctl_save_index2(struct confctl *cc, const char *path,
+    const struct confctl_error **errorp)
+{
+	char *idxpath;
+	int error;
+
+	memset(&cc->cc_error, 0, sizeof(cc->cc_error));
+	if (errorp != NULL)
+		*errorp = &cc->cc_error;
+
+	idxpath = offsets_path(path);
+	error = offsets_write(cc, path, idxpath);
+	free(idxpath);
+
+	return (error);
+}
+
+void
+confctl_save_index(struct confctl *cc, const char *path)
+{
+
+	if (confctl_save_index2(cc, path, NULL) != 0)
+		confctl_error_exit(&cc->cc_error);
+}
+
+/*
+ * Called after saving the file.  The index is for the old file, so it
+ * wouldn't be used anyway, but there is no point in keeping it around.
+ * It's not rewritten, because the new file, parsed again, doesn't always
+ * make the same tree as the one it was written from.
+ */
+int
+confctl_offsets_invalidate(struct confctl *cc, const char *path)
+{
+	char *idxpath;
+	int error = 0;
+
+	idxpath = offsets_path(path);
+	if (unlink(idxpath) != 0 && errno != ENOENT) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot remove %s", idxpath);
+		error = -1;
+	}
+	free(idxpath);
+
+	return (error);
+}
+
+/*
+ * Index opened for reading, along with the file it's for.
+ */
+struct offsets_map {
+	const struct offsets_header	*om_header;
+	const struct offsets_entry	*om_entries;
+	const char			*om_keys;
+	size_t				om_len;
+	int				om_fd;		/* The configuration file. */
+};
+
+static bool
+timespec_matches(int64_t sec, int64_t nsec, const struct timespec *ts)
+{
+
+	return (sec == ts->tv_sec && nsec == ts->tv_nsec);
+}
+
+/*
+ * Records the identity of the file in the index, after finding out it's
+ * still the same file by comparing hashes, e.g. after touch(1), so that
+ * next time the hash doesn't have to be computed again.  The index is
+ * just a cache; if it can't be written to, it still works, only slower.
+ */
+static void
+offsets_refresh(int idxfd, const struct offsets_header *oh, const struct stat *sb)
+{
+	struct offsets_header header;
+
+	header = *oh;
+	header.oh_dev = sb->st_dev;
+	header.oh_ino = sb->st_ino;
+	header.oh_mtime_sec = sb->st_mtim.tv_sec;
+	header.oh_mtime_nsec = sb->st_mtim.tv_nsec;
+	header.oh_ctime_sec = sb->st_ctim.tv_sec;
+	header.oh_ctime_nsec = sb->st_ctim.tv_nsec;
+	(void)pwrite(idxfd, &header, sizeof(header), 0);
+}
+
+/*
+ * Returns true if the index, opened as 'idxfd', matches the file, opened
+ * as 'fd'; same rules as for saving apply, i.e. unless it's obviously
+ * the same file, it's compared by hash.
+ */
+static bool
+offsets_valid(struct confctl *cc, const char *path, const struct offsets_header *oh,
+    size_t idxsize, int idxfd, int fd)
+{
+	struct stat sb;
+	uint64_t hash;
+
+	if (idxsize < sizeof(*oh) ||
+	    memcmp(oh->oh_magic, OFFSETS_MAGIC, sizeof(oh->oh_magic)) != 0 ||
+	    oh->oh_version != OFFSETS_VERSION ||
+	    oh->oh_syntax != offsets_syntax(cc))
+		return (false);
+	if (oh->oh_len > (idxsize - sizeof(*oh)) / sizeof(struct offsets_entry) ||
+	    oh->oh_keys_len != idxsize - sizeof(*oh) -
+	    oh->oh_len * sizeof(struct offsets_entry))
+		return (false);
+
+	if (fstat(fd, &sb) != 0 || (uint64_t)sb.st_size != oh->oh_size)
+		return (false);
+	if ((uint64_t)sb.st_dev == oh->oh_dev && (uint64_t)sb.st_ino == oh->oh_ino &&
+	    timespec_matches(oh->oh_mtime_sec, oh->oh_mtime_nsec, &sb.st_mtim) &&
+	    timespec_matches(oh->oh_ctime_sec, oh->oh_ctime_nsec, &sb.st_ctim))
+		return (true);
+	if (confctl_hash_file(cc, fd, path, &hash) != 0 || hash != oh->oh_hash)
+		return (false);
+	offsets_refresh(idxfd, oh, &sb);
+	return (true);
+}
+
+/*
+ * Returns the key of entry 'i', or NULL if the index is damaged.
+ */
+static const char *
+offsets_key(const struct offsets_map *om, size_t i, size_t *lenp)
+{
+	const struct offsets_entry *oe;
+
+	oe = &om->om_entries[i];
+	if (oe->oe_key > om->om_header->oh_keys_len ||
+	    oe->oe_key_len > om->om_header->oh_keys_len - oe->oe_key ||
+	    oe->oe_start > oe->oe_end || oe->oe_end > om->om_header->oh_size)
+		return (NULL);
+	*lenp = oe->oe_key_len;
+	return (om->om_keys + oe->oe_key);
+}
+
+static void
+spans_add(struct offsets_span **spans, size_t *len, size_t *allocated,
+    const struct offsets_entry *oe, const char *key, size_t key_len)
+{
+	struct offsets_span *os;
+
+	*spans = grow(*spans, allocated, *len + 1, sizeof(**spans));
+	os = &(*spans)[*len];
+	os->os_start = oe->oe_start;
+	os->os_end = oe->oe_end;
+	os->os_key = key;
+	os->os_key_len = key_len;
+	(*len)++;
+}
+
+/*
+ * Adds spans of all the variables with the given key.  Returns -1
+ * if the index turns out to be damaged.
+ */
+static int
+offsets_lookup(const struct offsets_map *om, const char *key, size_t key_len,
+    struct offsets_span **spans, size_t *len, size_t *allocated)
+{
+	const char *k;
+	size_t lo, hi, mid, k_len;
+
+	lo = 0;
+	hi = om->om_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		k = offsets_key(om, mid, &k_len);
+		if (k == NULL)
+			return (-1);
+		if (key_compare(k, k_len, key, key_len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < om->om_len; lo++) {
+		k = offsets_key(om, lo, &k_len);
+		if (k == NULL)
+			return (-1);
+		if (key_compare(k, k_len, key, key_len) != 0)
+			break;
+		spans_add(spans, len, allocated, &om->om_entries[lo], k, k_len);
+	}
+
+	return (0);
+}
+
+static bool
+name_is_pattern(const char *name)
+{
+
+	return (strpbrk(name, "*?[") != NULL);
+}
+
+/*
+ * Looks up the parts of the file where variables matching the filter,
+ * below 'fv', can be.  These are variables named like the filter, up to
+ * the first pattern, and children of the ones the filter ends at, since
+ * they can have values.  'key' is the path of 'fv', with room to spare.
+ */
+static int
+offsets_query(const struct offsets_map *om, struct confctl_var *fv,
+    char **key, size_t *key_len, size_t *key_allocated, unsigned int depth,
+    struct offsets_span **spans, size_t *len, size_t *allocated)
+{
+	struct confctl_var *child;
+	const char *name;
+	size_t name_len, parent_len;
+	int error;
+
+	child = confctl_var_first_child(fv);
+	if (child == NULL) {
+		if (depth < 2)
+			return (offsets_lookup(om, *key, *key_len, spans, len, allocated));
+		parent_len = *key_len - strlen(confctl_var_name(fv)) - 1;
+		return (offsets_lookup(om, *key, parent_len, spans, len, allocated));
+	}
+
+	for (; child != NULL; child = confctl_var_next(child)) {
+		name = confctl_var_name(child);
+		if (strcmp(name, "**") == 0 && depth >= 2) {
+			/*
+			 * It matches zero components too, i.e. 'fv' itself,
+			 * which might have a value.
+			 */
+			parent_len = *key_len - strlen(confctl_var_name(fv)) - 1;
+			error = offsets_lookup(om, *key, parent_len, spans, len, allocated);
+		} else if (name_is_pattern(name)) {
+			error = offsets_lookup(om, *key, *key_len, spans, len, allocated);
+		} else {
+			name_len = strlen(name);
+			*key = grow(*key, key_allocated, *key_len + 1 + name_len, 1);
+			(*key)[*key_len] = '\0';
+			memcpy(*key + *key_len + 1, name, name_len);
+			*key_len += 1 + name_len;
+			error = offsets_query(om, child, key, key_len, key_allocated,
+			    depth + 1, spans, len, allocated);
+			*key_len -= 1 + name_len;
+		}
+		if (error != 0)
+			return (error);
+	}
+
+	return (0);
+}
+
+static int
+span_compare(const void *a, const void *b)
+{
+	const struct offsets_span *x = a, *y = b;
+
+	if (x->os_start != y->os_start)
+		return (x->os_start < y->os_start ? -1 : 1);
+	if (x->os_end != y->os_end)
+		return (x->os_end > y->os_end ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Reads the span from the file and parses it, adding variables found
+ * there to 'parent'.
+ */
+static int
+span_load(struct confctl *cc, const char *path, int fd,
+    const struct offsets_span *os, struct confctl_var *parent)
+{
+	struct confctl *piece;
+	struct confctl_var *cv;
+	size_t len, done;
+	ssize_t ret;
+	char *buf;
+	FILE *fp;
+	int error;
+
+	len = os->os_end - os->os_start;
+	if (len == 0)
+		return (0);
+	buf = malloc(len);
+	if (buf == NULL)
+		err(1, "malloc");
+	for (done = 0; done < len; done += ret) {
+		ret = pread(fd, buf + done, len - done, os->os_start + done);
+		if (ret <= 0) {
+			free(buf);
+			return (-1);
+		}
+	}
+
+	fp = fmemopen(buf, len, "r");
+	if (fp == NULL)
+		err(1, "fmemopen");
+	piece = confctl_new();
+	piece->cc_threads = 1;
+	piece->cc_equals_sign = cc->cc_equals_sign;
+	piece->cc_semicolon = cc->cc_semicolon;
+	piece->cc_slash_slash_comments = cc->cc_slash_slash_comments;
+	piece->cc_slash_star_comments = cc->cc_slash_star_comments;
+	confctl_set_lossless(piece, !cc->cc_lossy);
+	error = confctl_parse(piece, fp, path);
+	fclose(fp);
+	free(buf);
+
+	if (error == 0) {
+		while ((cv = confctl_var_first_child(confctl_root(piece))) != NULL)
+			confctl_var_move(cv, parent);
+		if (cc->cc_stats != NULL)
+			cc->cc_stats->css_stats.cs_bytes_read += len;
+	}
+	confctl_delete(piece);
+
+	return (error);
+}
+
+/*
+ * Recreates the parents of the span's variable, from its key, and loads
+ * the span below them.  Every span gets its own copy of the parents,
+ * the way they would if they were siblings with the same names.
+ */
+static int
+span_graft(struct confctl *cc, const char *path, int fd, const struct offsets_span *os)
+{
+	struct confctl_var *parent;
+	const char *name, *end, *next;
+	char *tmp;
+
+	parent = confctl_root(cc);
+	end = os->os_key + os->os_key_len;
+	for (name = os->os_key;; name = next + 1) {
+		next = memchr(name, '\0', end - name);
+		if (next == NULL)
+			break;
+		tmp = strndup(name, next - name);
+		if (tmp == NULL)
+			err(1, "strndup");
+		parent = confctl_var_new(parent, tmp);
+		free(tmp);
+	}
+
+	return (span_load(cc, path, fd, os, parent));
+}
+
+static int
+offsets_load(struct confctl *cc, const char *path, struct confctl *filter,
+    const struct offsets_map *om)
+{
+	struct offsets_span *spans = NULL;
+	struct confctl_var *fv, *root, *last, *cv;
+	const char *name;
+	char *key = NULL;
+	size_t i, len = 0, allocated = 0, key_len, key_allocated = 0;
+	uint64_t kept_start = 0, kept_end = 0;
+	int error = 0;
+
+	/*
+	 * Filters starting with a pattern need the whole file anyway.
+	 */
+	fv = confctl_var_first_child(confctl_root(filter));
+	if (fv == NULL)
+		return (-1);
+	for (; fv != NULL && error == 0; fv = confctl_var_next(fv)) {
+		name = confctl_var_name(fv);
+		if (name_is_pattern(name)) {
+			error = -1;
+			break;
+		}
+		key_len = strlen(name);
+		key = grow(key, &key_allocated, key_len, 1);
+		memcpy(key, name, key_len);
+		error = offsets_query(om, fv, &key, &key_len, &key_allocated, 1,
+		    &spans, &len, &allocated);
+	}
+	free(key);
+	if (error != 0) {
+		free(spans);
+		return (-1);
+	}
+
+	/*
+	 * Load the spans in the order they are in the file, skipping
+	 * the ones inside others.
+	 */
+	if (len > 0)
+		qsort(spans, len, sizeof(*spans), span_compare);
+	root = confctl_root(cc);
+	last = TAILQ_LAST(&root->cv_children, confctl_var_head);
+	for (i = 0; i < len; i++) {
+		if (i > 0 && (spans[i].os_start < kept_end ||
+		    spans[i].os_start == kept_start))
+			continue;
+		kept_start = spans[i].os_start;
+		kept_end = spans[i].os_end;
+		error = span_graft(cc, path, om->om_fd, &spans[i]);
+		if (error != 0)
+			break;
+	}
+	free(spans);
+
+	if (error != 0) {
+		for (;;) {
+			cv = TAILQ_LAST(&root->cv_children, confctl_var_head);
+			if (cv == last)
+				break;
+			confctl_var_delete(cv);
+		}
+		return (-1);
+	}
+
+	cc->cc_partial = true;
+	return (0);
+}
+
+int
+confctl_load_indexed(struct confctl *cc, const char *path, struct confctl *filter)
+{
+	struct offsets_map om;
+	struct stat sb;
+	void *base;
+	char *idxpath;
+	int error, idxfd;
+
+	/*
+	 * The index doesn't know anything about included files.
+	 */
+	if (cc->cc_follow_includes)
+		return (-1);
+
+	/*
+	 * Opened for writing too, if possible, to refresh the identity
+	 * of the file in there.
+	 */
+	idxpath = offsets_path(path);
+	idxfd = open(idxpath, O_RDWR | O_CLOEXEC);
+	if (idxfd < 0)
+		idxfd = open(idxpath, O_RDONLY | O_CLOEXEC);
+	free(idxpath);
+	if (idxfd < 0)
+		return (-1);
+	if (fstat(idxfd, &sb) != 0 || (uintmax_t)sb.st_size > SIZE_MAX ||
+	    (size_t)sb.st_size < sizeof(*om.om_header)) {
+		close(idxfd);
+		return (-1);
+	}
+	base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, idxfd, 0);
+	if (base == MAP_FAILED) {
+		close(idxfd);
+		return (-1);
+	}
+
+	om.om_header = base;
+	om.om_entries = (const struct offsets_entry *)(om.om_header + 1);
+
+	om.om_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (om.om_fd < 0) {
+		close(idxfd);
+		munmap(base, sb.st_size);
+		return (-1);
+	}
+	if (cc->cc_rewrite_in_place && flock(om.om_fd, LOCK_SH) != 0) {
+		close(om.om_fd);
+		close(idxfd);
+		munmap(base, sb.st_size);
+		return (-1);
+	}
+
+	confctl_stats_begin(cc, CONFCTL_PHASE_LOAD);
+	error = -1;
+	if (offsets_valid(cc, path, om.om_header, sb.st_size, idxfd, om.om_fd)) {
+		om.om_len = om.om_header->oh_len;
+		om.om_keys = (const char *)(om.om_entries + om.om_len);
+		error = offsets_load(cc, path, filter, &om);
+	}
+	if (error == 0)
+		confctl_stats_end(cc, CONFCTL_PHASE_LOAD);
+
+	/*
+	 * Closing the file also drops the lock.
+	 */
+	close(om.om_fd);
+	close(idxfd);
+	if (munmap(base, sb.st_size) != 0)
+		err(1, "munmap");
+
+	return (error);
+}
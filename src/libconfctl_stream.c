@@ -0,0 +1,846 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines to edit a file while reading it,
+ * a variable at a time, instead of loading it whole.
+ *
+ * What makes it harder than it sounds is reindenting: new and changed
+ * variables get formatted the way their siblings are, and the style
+ * of a block is learned from up to STYLE_SAMPLES of its children, falling
+ * back to up to STYLE_SIBLINGS of its previous siblings, and to its parent.
+ * So, while reading, the variables being read are kept in a skeleton tree,
+ * rooted at the root of the handle.  For every block that's still open,
+ * there are the children to learn its style from, and the last few ones;
+ * for the ones that are closed, just enough of them to learn their style
+ * again.  The rest gets freed as soon as it's been written out.
+ *
+ * That's still not enough when a change comes before the children the style
+ * would be learned from.  For those, the first pass, which doesn't write
+ * anything, learns the style of the block, without inheriting anything yet,
+ * and keeps it in a temporary file, by the number of the block, in the order
+ * they were read in.  The second pass takes it from there.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define	_GNU_SOURCE
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+/*
+ * A block being read, i.e. a variable whose children are coming next.
+ * Its children that are learned from - the window - come first, followed
+ * by the last few of the ones after that.
+ */
+struct stream_frame {
+	struct stream_frame	*sf_parent;
+	struct confctl_var	*sf_cv;
+	struct confctl_var	*sf_window_last;
+	size_t			sf_block;	/* Number, in the order read. */
+	unsigned int		sf_samples;	/* Children learned from. */
+	unsigned int		sf_tail;	/* Children past the window. */
+	bool			sf_complete;	/* Window won't change. */
+	bool			sf_needed;	/* Style needed before that. */
+	bool			sf_written;	/* Everything up to children is. */
+};
+
+struct stream {
+	struct confctl			*s_cc;
+	const struct confctl_stream_ops	*s_ops;
+	void				*s_arg;
+	const char			*s_path;
+	FILE				*s_in;
+	FILE				*s_out;		/* NULL if not writing. */
+	FILE				*s_styles;
+	FILE				*s_offsets;	/* Where the styles are. */
+	size_t				s_blocks;
+	uint64_t			s_written;
+	bool				s_failed;	/* Temporary file failed. */
+	bool				s_stale;	/* Style went missing. */
+};
+
+static void	stream_children(struct stream *s, struct stream_frame *f);
+
+static void
+stream_put_string(struct stream *s, const char *str)
+{
+	uint32_t len;
+
+	len = str != NULL ? strlen(str) : UINT32_MAX;
+	if (fwrite(&len, sizeof(len), 1, s->s_styles) != 1)
+		s->s_failed = true;
+	if (str != NULL && fwrite(str, 1, len, s->s_styles) != len)
+		s->s_failed = true;
+}
+
+static char *
+stream_get_string(struct stream *s)
+{
+	uint32_t len;
+	char *str;
+
+	if (fread(&len, sizeof(len), 1, s->s_styles) != 1) {
+		s->s_failed = true;
+		return (NULL);
+	}
+	if (len == UINT32_MAX)
+		return (NULL);
+	str = malloc(len + 1);
+	if (str == NULL)
+		err(1, "malloc");
+	if (fread(str, 1, len, s->s_styles) != len)
+		s->s_failed = true;
+	str[len] = '\0';
+
+	return (str);
+}
+
+static void
+stream_save_style(struct stream *s, size_t block, const struct confctl_style *st)
+{
+	uint64_t offset;
+	off_t off;
+	bool flags[3];
+
+	off = ftello(s->s_styles);
+	if (off < 0) {
+		s->s_failed = true;
+		return;
+	}
+	stream_put_string(s, st->st_indent);
+	stream_put_string(s, st->st_step);
+	stream_put_string(s, st->st_separator);
+	stream_put_string(s, st->st_align);
+	stream_put_string(s, st->st_brace);
+	flags[0] = st->st_semicolon;
+	flags[1] = st->st_brace_semicolon;
+	flags[2] = st->st_partial;
+	if (fwrite(&st->st_column, sizeof(st->st_column), 1, s->s_styles) != 1 ||
+	    fwrite(flags, sizeof(flags), 1, s->s_styles) != 1)
+		s->s_failed = true;
+
+	/*
+	 * Zero, where nothing got written, means there's nothing there.
+	 */
+	offset = off + 1;
+	if (pwrite(fileno(s->s_offsets), &offset, sizeof(offset),
+	    block * sizeof(offset)) != sizeof(offset))
+		s->s_failed = true;
+}
+
+static struct confctl_style *
+stream_load_style(struct stream *s, size_t block)
+{
+	struct confctl_style *st;
+	uint64_t offset;
+	bool flags[3];
+
+	if (pread(fileno(s->s_offsets), &offset, sizeof(offset),
+	    block * sizeof(offset)) != sizeof(offset) || offset == 0)
+		return (NULL);
+	if (fseeko(s->s_styles, offset - 1, SEEK_SET) != 0) {
+		s->s_failed = true;
+		return (NULL);
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		err(1, "calloc");
+	st->st_indent = stream_get_string(s);
+	st->st_step = stream_get_string(s);
+	st->st_separator = stream_get_string(s);
+	st->st_align = stream_get_string(s);
+	st->st_brace = stream_get_string(s);
+	if (fread(&st->st_column, sizeof(st->st_column), 1, s->s_styles) != 1 ||
+	    fread(flags, sizeof(flags), 1, s->s_styles) != 1)
+		s->s_failed = true;
+	st->st_semicolon = flags[0];
+	st->st_brace_semicolon = flags[1];
+	st->st_partial = flags[2];
+	st->st_own = true;
+
+	return (st);
+}
+
+static void
+stream_print(struct stream *s, const struct buf *b)
+{
+
+	if (b == NULL || b->b_len == 0)
+		return;
+	fwrite(b->b_buf, 1, b->b_len, s->s_out);
+	s->s_written += b->b_len;
+}
+
+static void
+stream_print_tree(struct stream *s, struct confctl_var *cv)
+{
+	struct confctl_var *child;
+
+	stream_print(s, cv->cv_before);
+	stream_print(s, cv->cv_name);
+	stream_print(s, cv->cv_middle);
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next)
+		stream_print_tree(s, child);
+	stream_print(s, cv->cv_value);
+	stream_print(s, cv->cv_after);
+}
+
+/*
+ * Writes out what comes before the children of the block, and of the ones
+ * it's in, unless done already.
+ */
+static void
+stream_print_heads(struct stream *s, struct stream_frame *f)
+{
+
+	if (f->sf_written)
+		return;
+	stream_print_heads(s, f->sf_parent);
+	stream_print(s, f->sf_cv->cv_before);
+	stream_print(s, f->sf_cv->cv_name);
+	stream_print(s, f->sf_cv->cv_middle);
+	f->sf_written = true;
+}
+
+/*
+ * Links and unlinks the skeleton directly, as opposed to the routines
+ * in libconfctl.c, to keep the styles learned so far.
+ */
+static void
+stream_attach(struct stream_frame *f, struct confctl_var *cv)
+{
+
+	cv->cv_parent = f->sf_cv;
+	TAILQ_INSERT_TAIL(&f->sf_cv->cv_children, cv, cv_next);
+}
+
+static void
+stream_forget(struct confctl_var *cv)
+{
+
+	if (cv->cv_parent != NULL) {
+		TAILQ_REMOVE(&cv->cv_parent->cv_children, cv, cv_next);
+		cv->cv_parent = NULL;
+	}
+	confctl_var_delete(cv);
+}
+
+/*
+ * Takes the style away from the variable, and gives it back, around
+ * calls that would otherwise throw it away.
+ */
+static struct confctl_style *
+stream_style_take(struct confctl_var *cv)
+{
+	struct confctl_style *st;
+
+	st = CV_EXT(cv, cx_style);
+	if (st != NULL)
+		cv->cv_ext->cx_style = NULL;
+	return (st);
+}
+
+static void
+stream_style_put(struct confctl_var *cv, struct confctl_style *st)
+{
+
+	if (st != NULL)
+		confctl_var_ext(cv)->cx_style = st;
+	else if (cv->cv_ext != NULL)
+		cv->cv_ext->cx_style = NULL;
+}
+
+/*
+ * Drops the children of a variable that nobody is going to learn from
+ * anymore, save for one, so that it still looks like a block.
+ */
+static void
+stream_prune(struct confctl_var *cv)
+{
+	struct confctl_var *first, *child;
+
+	first = TAILQ_FIRST(&cv->cv_children);
+	if (first == NULL)
+		return;
+	while ((child = TAILQ_NEXT(first, cv_next)) != NULL)
+		stream_forget(child);
+	while ((child = TAILQ_FIRST(&first->cv_children)) != NULL)
+		stream_forget(child);
+}
+
+/*
+ * Called when there's nothing more to learn the style of the block from.
+ */
+static void
+stream_complete(struct stream *s, struct stream_frame *f)
+{
+	struct confctl_style *st;
+
+	f->sf_complete = true;
+	if (s->s_out != NULL || !f->sf_needed)
+		return;
+
+	st = confctl_style_learn(f->sf_cv);
+	stream_save_style(s, f->sf_block, st);
+	confctl_style_delete(st);
+}
+
+/*
+ * Called before reindenting anything in the block.  In the first pass,
+ * notes what will need the style learned in advance; in the second,
+ * puts it in place, to be finished when actually used.
+ */
+static void
+stream_prepare(struct stream *s, struct stream_frame *f)
+{
+	struct confctl_style *st;
+
+	for (; f != NULL; f = f->sf_parent) {
+		if (f->sf_complete)
+			continue;
+		if (s->s_out == NULL) {
+			f->sf_needed = true;
+			continue;
+		}
+		if (CV_EXT(f->sf_cv, cx_style) != NULL)
+			continue;
+		st = stream_load_style(s, f->sf_block);
+		if (st == NULL) {
+			s->s_stale = true;
+			continue;
+		}
+		stream_style_put(f->sf_cv, st);
+	}
+}
+
+/*
+ * Called for every child kept in the block.  The last one, and the ones
+ * before it that it might learn from, are kept whole.
+ */
+static void
+stream_account(struct stream *s, struct stream_frame *f, struct confctl_var *cv)
+{
+	struct confctl_var *prev;
+	int i;
+
+	if (f->sf_complete) {
+		f->sf_tail++;
+		if (f->sf_tail > STYLE_SIBLINGS + 1) {
+			stream_forget(TAILQ_NEXT(f->sf_window_last, cv_next));
+			f->sf_tail--;
+		}
+	} else {
+		f->sf_window_last = cv;
+		if (f->sf_samples == STYLE_SAMPLES)
+			stream_complete(s, f);
+		else if (cv->cv_before != NULL)
+			f->sf_samples++;
+	}
+
+	prev = cv;
+	for (i = 0; i <= STYLE_SIBLINGS && prev != NULL; i++)
+		prev = TAILQ_PREV(prev, confctl_var_head, cv_next);
+	if (prev != NULL)
+		stream_prune(prev);
+}
+
+/*
+ * Runs the callbacks without letting them throw away the styles learned
+ * so far; new children don't make them stale, as they are not learned from.
+ */
+static bool
+stream_enter(struct stream *s, struct stream_frame *f, struct confctl_var *cv)
+{
+	struct confctl_style *st;
+	bool keep;
+
+	st = stream_style_take(f->sf_cv);
+	keep = s->s_ops->cso_enter(s->s_arg, cv);
+	stream_style_put(f->sf_cv, st);
+
+	return (keep);
+}
+
+static void
+stream_leave(struct stream *s, struct stream_frame *f)
+{
+	struct confctl_style *st, *parent_st = NULL;
+	struct confctl_var *cv, *last, *first_new, *child;
+	unsigned int samples;
+
+	cv = f->sf_cv;
+	if (!f->sf_complete)
+		stream_complete(s, f);
+
+	last = TAILQ_LAST(&cv->cv_children, confctl_var_head);
+	st = stream_style_take(cv);
+	if (f->sf_parent != NULL)
+		parent_st = stream_style_take(f->sf_parent->sf_cv);
+	s->s_ops->cso_leave(s->s_arg, cv);
+	stream_style_put(cv, st);
+	if (f->sf_parent != NULL)
+		stream_style_put(f->sf_parent->sf_cv, parent_st);
+
+	if (last != NULL)
+		first_new = TAILQ_NEXT(last, cv_next);
+	else
+		first_new = TAILQ_FIRST(&cv->cv_children);
+	if (first_new != NULL && st != NULL)
+		st->st_partial = true;
+
+	if (cv->cv_needs_reindent || first_new != NULL) {
+		stream_prepare(s, f->sf_parent);
+		if (s->s_out != NULL) {
+			if (cv->cv_needs_reindent) {
+				confctl_var_reindent(s->s_cc, cv);
+			} else {
+				for (child = first_new; child != NULL;
+				    child = TAILQ_NEXT(child, cv_next))
+					confctl_var_reindent(s->s_cc, child);
+			}
+		}
+	}
+
+	if (s->s_out != NULL) {
+		stream_print_heads(s, f);
+		for (child = first_new; child != NULL;
+		    child = TAILQ_NEXT(child, cv_next))
+			stream_print_tree(s, child);
+		stream_print(s, cv->cv_value);
+		stream_print(s, cv->cv_after);
+	}
+
+	/*
+	 * Style learned in advance, but not used, must not be mistaken
+	 * for a finished one when looking at the siblings.
+	 */
+	st = CV_EXT(cv, cx_style);
+	if (st != NULL && st->st_own) {
+		confctl_style_delete(st);
+		cv->cv_ext->cx_style = NULL;
+	}
+
+	/*
+	 * Keep just what it takes to learn the style again.
+	 */
+	samples = 0;
+	TAILQ_FOREACH(child, &cv->cv_children, cv_next) {
+		if (samples == STYLE_SAMPLES)
+			break;
+		if (child->cv_before != NULL)
+			samples++;
+		stream_prune(child);
+	}
+	if (child != NULL) {
+		while ((last = TAILQ_NEXT(child, cv_next)) != NULL)
+			stream_forget(last);
+		stream_prune(child);
+	}
+}
+
+/*
+ * Reads and throws away the children of a removed variable.
+ */
+static void
+stream_skip(struct stream *s, struct confctl_var *parent)
+{
+	struct confctl_var *cv, *inner;
+
+	for (;;) {
+		cv = confctl_parse_var(s->s_cc, parent, s->s_in, &inner);
+		if (cv == NULL)
+			break;
+		if (inner != NULL)
+			stream_skip(s, inner);
+		confctl_var_delete(cv);
+	}
+}
+
+/*
+ * Takes care of a variable just read, along with its children; 'inner'
+ * is where these go, as returned by confctl_parse_var().
+ */
+static void
+stream_var(struct stream *s, struct stream_frame *f, struct confctl_var *cv,
+    struct confctl_var *inner)
+{
+	struct stream_frame frame;
+	struct confctl_var *child;
+
+	stream_attach(f, cv);
+	if (!stream_enter(s, f, cv)) {
+		if (inner != NULL)
+			stream_skip(s, inner);
+		stream_forget(cv);
+		return;
+	}
+	stream_account(s, f, cv);
+
+	if (inner == NULL) {
+		if (cv->cv_needs_reindent) {
+			stream_prepare(s, f);
+			if (s->s_out != NULL)
+				confctl_var_reindent(s->s_cc, cv);
+		}
+		if (s->s_out != NULL) {
+			stream_print_heads(s, f);
+			stream_print_tree(s, cv);
+		}
+		return;
+	}
+
+	memset(&frame, 0, sizeof(frame));
+	frame.sf_parent = f;
+	frame.sf_cv = cv;
+	frame.sf_block = s->s_blocks++;
+	if (cv != inner) {
+		/*
+		 * Implicit container; the next one in the chain gets
+		 * treated as if it was just read.
+		 */
+		child = TAILQ_FIRST(&cv->cv_children);
+		TAILQ_REMOVE(&cv->cv_children, child, cv_next);
+		child->cv_parent = NULL;
+		stream_var(s, &frame, child, inner);
+	} else {
+		stream_children(s, &frame);
+	}
+	stream_leave(s, &frame);
+}
+
+static void
+stream_children(struct stream *s, struct stream_frame *f)
+{
+	struct confctl_var *cv, *inner;
+
+	for (;;) {
+		cv = confctl_parse_var(s->s_cc, f->sf_cv, s->s_in, &inner);
+		if (cv == NULL)
+			break;
+		stream_var(s, f, cv, inner);
+	}
+}
+
+/*
+ * Reads the whole file, calling the callbacks, and writing the result
+ * if there's somewhere to write it to.
+ */
+static int
+stream_pass(struct stream *s)
+{
+	struct confctl *cc;
+	struct confctl_var *root, *cv;
+	struct stream_frame frame;
+	off_t pos;
+	int error = 0;
+
+	cc = s->s_cc;
+	root = confctl_root(cc);
+	if (fseeko(s->s_in, 0, SEEK_SET) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot read %s", s->s_path);
+		return (-1);
+	}
+	confctl_parse_begin(cc);
+	s->s_ops->cso_begin(s->s_arg, s->s_out != NULL);
+
+	memset(&frame, 0, sizeof(frame));
+	frame.sf_cv = root;
+	frame.sf_written = true;
+	s->s_blocks = 1;
+	stream_children(s, &frame);
+	if (ferror(s->s_in) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot read %s", s->s_path);
+	}
+	pos = ftello(s->s_in);
+	if (cc->cc_error.ce_code == CONFCTL_ERROR_SYNTAX)
+		confctl_parse_locate_error(cc, s->s_in, s->s_path);
+	if (cc->cc_error.ce_code == CONFCTL_ERROR_NONE)
+		stream_leave(s, &frame);
+	else
+		error = -1;
+
+	while ((cv = TAILQ_FIRST(&root->cv_children)) != NULL)
+		stream_forget(cv);
+	confctl_style_delete(stream_style_take(root));
+	confctl_buf_delete(root->cv_after);
+	root->cv_after = NULL;
+	root->cv_needs_reindent = false;
+
+	if (error == 0 && s->s_failed) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot use temporary file");
+		error = -1;
+	}
+	if (error == 0 && cc->cc_stats != NULL && pos > 0)
+		cc->cc_stats->css_stats.cs_bytes_read += pos;
+
+	return (error);
+}
+
+/*
+ * Reads the file until the callbacks settle, learning the styles.
+ */
+static int
+stream_learn(struct stream *s)
+{
+	int error;
+
+	for (;;) {
+		if (fflush(s->s_styles) != 0 ||
+		    ftruncate(fileno(s->s_styles), 0) != 0 ||
+		    ftruncate(fileno(s->s_offsets), 0) != 0) {
+			confctl_error_set(&s->s_cc->cc_error,
+			    CONFCTL_ERROR_SYSTEM, errno,
+			    "cannot use temporary file");
+			return (-1);
+		}
+		rewind(s->s_styles);
+		error = stream_pass(s);
+		if (error != 0)
+			return (-1);
+		if (s->s_ops->cso_settled == NULL ||
+		    s->s_ops->cso_settled(s->s_arg))
+			break;
+	}
+
+	if (fflush(s->s_styles) != 0) {
+		confctl_error_set(&s->s_cc->cc_error, CONFCTL_ERROR_SYSTEM,
+		    errno, "cannot use temporary file");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Reads the file again, writing the result to a temporary file that replaces
+ * it.  Returns 1 if it's done, 0 if the file changed in the meantime,
+ * and -1 on failure.
+ */
+static int
+stream_write(struct stream *s)
+{
+	struct confctl *cc;
+	char *tmppath;
+	int error, fd, replaced;
+
+	cc = s->s_cc;
+	error = asprintf(&tmppath, "%s.XXXXXXXXX", s->s_path);
+	if (error < 0)
+		err(1, "asprintf");
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot create temporary file %s", tmppath);
+		free(tmppath);
+		return (-1);
+	}
+	s->s_out = fdopen(fd, "w");
+	if (s->s_out == NULL) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fdopen");
+		close(fd);
+		goto fail;
+	}
+
+	confctl_stats_begin(cc, CONFCTL_PHASE_WRITE);
+	s->s_written = 0;
+	s->s_stale = false;
+	error = stream_pass(s);
+	if (error != 0)
+		goto fail;
+	if (fflush(s->s_out) != 0 || ferror(s->s_out) != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot write %s", tmppath);
+		goto fail;
+	}
+	if (cc->cc_stats != NULL)
+		cc->cc_stats->css_stats.cs_bytes_written += s->s_written;
+	confctl_stats_end(cc, CONFCTL_PHASE_WRITE);
+
+	/*
+	 * The styles learned beforehand not being there means the file
+	 * is not the same as in the first pass anymore.
+	 */
+	if (s->s_stale) {
+		unlink(tmppath);
+		replaced = 0;
+		goto out;
+	}
+
+	confctl_stats_begin(cc, CONFCTL_PHASE_FSYNC);
+	error = fsync(fd);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fsync");
+		goto fail;
+	}
+	confctl_stats_end(cc, CONFCTL_PHASE_FSYNC);
+	confctl_stats_begin(cc, CONFCTL_PHASE_RENAME);
+	replaced = confctl_replace(cc, s->s_path, tmppath, fd);
+	confctl_stats_end(cc, CONFCTL_PHASE_RENAME);
+
+out:
+	free(tmppath);
+	error = fclose(s->s_out);
+	s->s_out = NULL;
+	if (replaced < 0)
+		return (-1);
+	if (error != 0) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "fclose");
+		return (-1);
+	}
+	return (replaced);
+
+fail:
+	if (s->s_out != NULL)
+		fclose(s->s_out);
+	s->s_out = NULL;
+	unlink(tmppath);
+	free(tmppath);
+	return (-1);
+}
+
+static int
+stream_file(struct stream *s)
+{
+	struct confctl *cc;
+	struct stat sb;
+	int attempts, error, replaced;
+
+	cc = s->s_cc;
+	for (attempts = 0;; attempts++) {
+		if (attempts >= SAVE_ATTEMPTS) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_CHANGED,
+			    0, "%s keeps changing; giving up", s->s_path);
+			return (-1);
+		}
+
+		s->s_in = fopen(s->s_path, "r");
+		if (s->s_in == NULL) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "unable to open %s", s->s_path);
+			return (-1);
+		}
+		error = fstat(fileno(s->s_in), &sb);
+		if (error != 0) {
+			confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM,
+			    errno, "cannot stat %s", s->s_path);
+			fclose(s->s_in);
+			return (-1);
+		}
+		confctl_set_identity(cc, s->s_path, &sb, NULL);
+
+		confctl_stats_begin(cc, CONFCTL_PHASE_LOAD);
+		error = stream_learn(s);
+		confctl_stats_end(cc, CONFCTL_PHASE_LOAD);
+		replaced = -1;
+		if (error == 0)
+			replaced = stream_write(s);
+		fclose(s->s_in);
+		s->s_in = NULL;
+		if (replaced < 0)
+			return (-1);
+		if (replaced > 0)
+			break;
+	}
+
+	confctl_stats_begin(cc, CONFCTL_PHASE_RENAME);
+	error = confctl_sync_dirs((char *const *)&s->s_path, 1, &cc->cc_error);
+	confctl_stats_end(cc, CONFCTL_PHASE_RENAME);
+
+	return (error);
+}
+
+int
+confctl_stream(struct confctl *cc, const char *path,
+    const struct confctl_stream_ops *ops, void *arg,
+    const struct confctl_error **errorp)
+{
+	struct stream s;
+	int error = -1;
+
+	if (errorp != NULL)
+		*errorp = &cc->cc_error;
+	confctl_parse_begin(cc);
+
+	if (cc->cc_follow_includes || cc->cc_rewrite_in_place ||
+	    !TAILQ_EMPTY(&confctl_root(cc)->cv_children)) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_UNSUPPORTED, 0,
+		    "cannot stream %s: includes, rewriting in place, or a tree already loaded",
+		    path);
+		return (-1);
+	}
+	if (cc->cc_lossy) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_LOSSY, 0,
+		    "cannot save %s: loaded without comments and formatting",
+		    path);
+		return (-1);
+	}
+	if (cc->cc_read_only) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_UNSUPPORTED, 0,
+		    "cannot save %s: loaded read-only", path);
+		return (-1);
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.s_cc = cc;
+	s.s_ops = ops;
+	s.s_arg = arg;
+	s.s_path = path;
+	s.s_styles = tmpfile();
+	s.s_offsets = tmpfile();
+	if (s.s_styles == NULL || s.s_offsets == NULL) {
+		confctl_error_set(&cc->cc_error, CONFCTL_ERROR_SYSTEM, errno,
+		    "cannot create temporary file");
+	} else {
+		error = stream_file(&s);
+	}
+	if (s.s_styles != NULL)
+		fclose(s.s_styles);
+	if (s.s_offsets != NULL)
+		fclose(s.s_offsets);
+
+	return (error);
+}
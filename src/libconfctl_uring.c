@@ -0,0 +1,928 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the routines to load and save many files at once.
+ * Where io_uring(7) is available, they use it to submit system calls
+ * for all the files in batches, instead of doing them one by one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define	_GNU_SOURCE
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define	URING_ENTRIES	256
+
+/*
+ * Files larger than URING_LOAD_MAX are loaded and saved the old way, instead
+ * of being kept in memory in one piece, to keep the peak memory usage down.
+ * Single writes are limited to URING_WRITE_MAX, which is below what Linux
+ * does in one go, and fits in the 32 bit sqe->len; the rest of the file
+ * is written the old way.
+ */
+#define	URING_LOAD_MAX	(64 * 1024 * 1024)
+#define	URING_WRITE_MAX	(1024 * 1024 * 1024)
+
+/*
+ * Minimal io_uring, without liburing.  Entries get queued with uring_sqe(),
+ * and then uring_run() submits them and waits for all of them to complete;
+ * callers must not queue more than u_entries at a time.
+ */
+struct uring {
+	int			u_fd;
+	unsigned int		u_entries;
+	unsigned int		u_tail;
+	unsigned int		u_queued;
+	unsigned int		*u_sq_tail;
+	unsigned int		*u_sq_mask;
+	unsigned int		*u_sq_array;
+	unsigned int		*u_cq_head;
+	unsigned int		*u_cq_tail;
+	unsigned int		*u_cq_mask;
+	struct io_uring_sqe	*u_sqes;
+	struct io_uring_cqe	*u_cqes;
+	void			*u_sq_ring;
+	void			*u_cq_ring;
+	size_t			u_sq_ring_len;
+	size_t			u_cq_ring_len;
+	size_t			u_sqes_len;
+};
+
+static const int uring_ops[] = {
+	IORING_OP_OPENAT,
+	IORING_OP_STATX,
+	IORING_OP_READ,
+	IORING_OP_WRITE,
+	IORING_OP_FSYNC,
+	IORING_OP_CLOSE,
+};
+
+/*
+ * Returns true if the kernel supports all the operations we need.
+ */
+static bool
+uring_probe(struct uring *u)
+{
+	struct io_uring_probe *probe;
+	size_t i, nops = 256;
+	bool supported = true;
+	int error;
+
+	probe = calloc(1, sizeof(*probe) + nops * sizeof(probe->ops[0]));
+	if (probe == NULL)
+		err(1, "calloc");
+	error = syscall(__NR_io_uring_register, u->u_fd, IORING_REGISTER_PROBE, probe, nops);
+	if (error != 0) {
+		free(probe);
+		return (false);
+	}
+	for (i = 0; i < sizeof(uring_ops) / sizeof(uring_ops[0]); i++) {
+		if (uring_ops[i] > probe->last_op ||
+		    (probe->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+			supported = false;
+	}
+	free(probe);
+
+	return (supported);
+}
+
+static void
+uring_fini(struct uring *u)
+{
+
+	if (u->u_sqes != NULL && u->u_sqes != MAP_FAILED)
+		munmap(u->u_sqes, u->u_sqes_len);
+	if (u->u_cq_ring != NULL && u->u_cq_ring != MAP_FAILED)
+		munmap(u->u_cq_ring, u->u_cq_ring_len);
+	if (u->u_sq_ring != NULL && u->u_sq_ring != MAP_FAILED)
+		munmap(u->u_sq_ring, u->u_sq_ring_len);
+	close(u->u_fd);
+}
+
+/*
+ * Returns false if io_uring is not available, e.g. because the kernel
+ * is too old, or because it's been disabled.
+ */
+static bool
+uring_init(struct uring *u)
+{
+	struct io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	u->u_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->u_fd < 0)
+		return (false);
+
+	u->u_entries = p.sq_entries;
+	u->u_sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->u_cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->u_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->u_sq_ring = mmap(NULL, u->u_sq_ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->u_fd, IORING_OFF_SQ_RING);
+	u->u_cq_ring = mmap(NULL, u->u_cq_ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->u_fd, IORING_OFF_CQ_RING);
+	u->u_sqes = mmap(NULL, u->u_sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->u_fd, IORING_OFF_SQES);
+	if (u->u_sq_ring == MAP_FAILED || u->u_cq_ring == MAP_FAILED ||
+	    u->u_sqes == MAP_FAILED || !uring_probe(u)) {
+		uring_fini(u);
+		return (false);
+	}
+
+	u->u_sq_tail = (unsigned int *)((char *)u->u_sq_ring + p.sq_off.tail);
+	u->u_sq_mask = (unsigned int *)((char *)u->u_sq_ring + p.sq_off.ring_mask);
+	u->u_sq_array = (unsigned int *)((char *)u->u_sq_ring + p.sq_off.array);
+	u->u_cq_head = (unsigned int *)((char *)u->u_cq_ring + p.cq_off.head);
+	u->u_cq_tail = (unsigned int *)((char *)u->u_cq_ring + p.cq_off.tail);
+	u->u_cq_mask = (unsigned int *)((char *)u->u_cq_ring + p.cq_off.ring_mask);
+	u->u_cqes = (struct io_uring_cqe *)((char *)u->u_cq_ring + p.cq_off.cqes);
+	u->u_tail = *u->u_sq_tail;
+
+	return (true);
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *u, int opcode, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	assert(u->u_queued < u->u_entries);
+
+	i = u->u_tail & *u->u_sq_mask;
+	sqe = &u->u_sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = data;
+	u->u_sq_array[i] = i;
+	u->u_tail++;
+	u->u_queued++;
+
+	return (sqe);
+}
+
+/*
+ * Returns -1, with errno set, if the entries couldn't be submitted.
+ */
+static int
+uring_run(struct uring *u, int *results)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, remaining, to_submit;
+	int submitted;
+
+	__atomic_store_n(u->u_sq_tail, u->u_tail, __ATOMIC_RELEASE);
+
+	to_submit = remaining = u->u_queued;
+	while (remaining > 0) {
+		submitted = syscall(__NR_io_uring_enter, u->u_fd, to_submit, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR)
+				continue;
+			u->u_queued = 0;
+			return (-1);
+		}
+		to_submit -= submitted;
+
+		head = *u->u_cq_head;
+		while (head != __atomic_load_n(u->u_cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->u_cqes[head & *u->u_cq_mask];
+			results[cqe->user_data] = cqe->res;
+			head++;
+			remaining--;
+		}
+		__atomic_store_n(u->u_cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	u->u_queued = 0;
+
+	return (0);
+}
+
+/*
+ * Loading is done in stages - first, open all the files, then get their
+ * sizes, then read them, and finally close them; each stage is a single
+ * batch of up to u_entries files.  On failure, returns -1, with the reason
+ * in 'ce'; the files before the one that failed stay loaded.
+ */
+static int
+uring_load(struct uring *u, struct confctl **ccs, char *const *paths, size_t n,
+    struct confctl_error *ce)
+{
+	struct io_uring_sqe *sqe;
+	struct confctl_hash ch;
+	struct statx *stx;
+	struct stat sb;
+	char **bufs;
+	size_t i, len, *lens;
+	uint64_t hash;
+	int *fds, *results, error = -1;
+	ssize_t done;
+	FILE *fp;
+
+	stx = calloc(n, sizeof(*stx));
+	bufs = calloc(n, sizeof(*bufs));
+	fds = calloc(n, sizeof(*fds));
+	results = calloc(n, sizeof(*results));
+	lens = calloc(n, sizeof(*lens));
+	if (stx == NULL || bufs == NULL || fds == NULL || results == NULL || lens == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; i++) {
+		confctl_stats_begin(ccs[i], CONFCTL_PHASE_LOAD);
+		sqe = uring_sqe(u, IORING_OP_OPENAT, AT_FDCWD, i);
+		sqe->addr = (uintptr_t)paths[i];
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		fds[i] = -1;
+	}
+	if (uring_run(u, results) != 0)
+		goto submit_fail;
+	for (i = 0; i < n; i++) {
+		if (results[i] >= 0)
+			fds[i] = results[i];
+	}
+	for (i = 0; i < n; i++) {
+		if (results[i] < 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, -results[i],
+			    "unable to open %s", paths[i]);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		sqe = uring_sqe(u, IORING_OP_STATX, fds[i], i);
+		sqe->addr = (uintptr_t)"";
+		sqe->len = STATX_BASIC_STATS;
+		sqe->statx_flags = AT_EMPTY_PATH;
+		sqe->off = (uintptr_t)&stx[i];
+	}
+	if (uring_run(u, results) != 0)
+		goto submit_fail;
+
+	for (i = 0; i < n; i++) {
+		if (results[i] < 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, -results[i],
+			    "cannot stat %s", paths[i]);
+			goto out;
+		}
+		len = stx[i].stx_size;
+		if (len > URING_LOAD_MAX)
+			continue;
+		bufs[i] = malloc(len + 1);
+		if (bufs[i] == NULL)
+			err(1, "malloc");
+		sqe = uring_sqe(u, IORING_OP_READ, fds[i], i);
+		sqe->addr = (uintptr_t)bufs[i];
+		sqe->len = len;
+	}
+	if (uring_run(u, results) != 0)
+		goto submit_fail;
+
+	for (i = 0; i < n; i++) {
+		if (bufs[i] == NULL)
+			continue;
+		if (results[i] < 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, -results[i],
+			    "cannot read %s", paths[i]);
+			goto out;
+		}
+		/*
+		 * Short read; read the rest of the file the old way.
+		 */
+		len = results[i];
+		while (len < stx[i].stx_size) {
+			done = pread(fds[i], bufs[i] + len, stx[i].stx_size - len, len);
+			if (done < 0) {
+				confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+				    errno, "cannot read %s", paths[i]);
+				goto out;
+			}
+			if (done == 0)
+				break;
+			len += done;
+		}
+		lens[i] = len;
+	}
+
+	/*
+	 * The descriptors are gone once the close is submitted, whatever
+	 * the result.
+	 */
+	for (i = 0; i < n; i++) {
+		uring_sqe(u, IORING_OP_CLOSE, fds[i], i);
+		fds[i] = -1;
+	}
+	if (uring_run(u, results) != 0)
+		goto submit_fail;
+
+	for (i = 0; i < n; i++) {
+		if (results[i] < 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, -results[i],
+			    "close");
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		/*
+		 * There is nothing fmemopen(3) could do with an empty file.
+		 */
+		if (bufs[i] == NULL || lens[i] == 0) {
+			confctl_stats_end(ccs[i], CONFCTL_PHASE_LOAD);
+			if (confctl_load2(ccs[i], paths[i], NULL) != 0) {
+				*ce = ccs[i]->cc_error;
+				goto out;
+			}
+			continue;
+		}
+
+		fp = fmemopen(bufs[i], lens[i], "r");
+		if (fp == NULL) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "fmemopen");
+			goto out;
+		}
+		if (confctl_parse_or_undo(ccs[i], fp, paths[i]) != 0) {
+			*ce = ccs[i]->cc_error;
+			fclose(fp);
+			goto out;
+		}
+		fclose(fp);
+
+		memset(&sb, 0, sizeof(sb));
+		sb.st_dev = makedev(stx[i].stx_dev_major, stx[i].stx_dev_minor);
+		sb.st_ino = stx[i].stx_ino;
+		sb.st_size = stx[i].stx_size;
+		sb.st_mtim.tv_sec = stx[i].stx_mtime.tv_sec;
+		sb.st_mtim.tv_nsec = stx[i].stx_mtime.tv_nsec;
+		sb.st_ctim.tv_sec = stx[i].stx_ctime.tv_sec;
+		sb.st_ctim.tv_nsec = stx[i].stx_ctime.tv_nsec;
+		if (ccs[i]->cc_lossy || ccs[i]->cc_read_only) {
+			confctl_set_identity(ccs[i], paths[i], &sb, NULL);
+		} else {
+			confctl_hash_init(&ch);
+			confctl_hash_update(&ch, bufs[i], lens[i]);
+			hash = confctl_hash_final(&ch);
+			confctl_set_identity(ccs[i], paths[i], &sb, &hash);
+		}
+		free(bufs[i]);
+		bufs[i] = NULL;
+		confctl_stats_end(ccs[i], CONFCTL_PHASE_LOAD);
+	}
+	error = 0;
+	goto out;
+
+submit_fail:
+	confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno, "io_uring_enter");
+out:
+	for (i = 0; i < n; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		free(bufs[i]);
+	}
+	free(lens);
+	free(results);
+	free(fds);
+	free(bufs);
+	free(stx);
+
+	return (error);
+}
+
+static void
+tmppath_randomize(char *tmppath)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	static uint64_t state;
+	struct timespec ts;
+	size_t i, len;
+
+	if (state == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		state = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 16) ^ (uintptr_t)&ts;
+		if (state == 0)
+			state = 1;
+	}
+
+	len = strlen(tmppath);
+	assert(len >= 9);
+	for (i = len - 9; i < len; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		tmppath[i] = chars[state % (sizeof(chars) - 1)];
+	}
+}
+
+static void
+remove_tmpfile(const char *tmppath)
+{
+	int error, saved_errno;
+
+	saved_errno = errno;
+	error = unlink(tmppath);
+	if (error != 0)
+		warn("unlink");
+	errno = saved_errno;
+}
+
+/*
+ * Each file is written using a chain of two linked operations; this is
+ * the index of each of them.
+ */
+#define	SAVE_WRITE	0
+#define	SAVE_FSYNC	1
+#define	SAVE_OPS	2
+
+/*
+ * Finishes writing a file the old way, starting at 'written', and syncs it.
+ * This is used when the chain got broken by a short write, or when
+ * the file was too large to be written in one go.  Returns -1, with errno
+ * set, on failure.
+ */
+static int
+save_finish(int fd, const char *buf, size_t len, size_t written)
+{
+	ssize_t done;
+
+	while (written < len) {
+		done = pwrite(fd, buf + written, len - written, written);
+		if (done < 0)
+			return (-1);
+		written += done;
+	}
+
+	return (fsync(fd));
+}
+
+/*
+ * Saving is done by first writing all the files into memory, then creating
+ * the temporary files, in batches, and then, for each of them, submitting
+ * a linked chain of write and fsync, again in batches.  Checking whether
+ * the files changed since they were loaded, and renaming, needs locking,
+ * and so is done the old way; parent directories get synced at the end.
+ * On failure, returns -1, with the reason in 'ce', after removing
+ * the temporary files that are left.
+ */
+static int
+uring_save(struct uring *u, struct confctl **ccs, char *const *paths, size_t n,
+    struct confctl_error *ce)
+{
+	struct io_uring_sqe *sqe;
+	char **bufs, **tmppaths, **renamed;
+	size_t *lens, i, first, last, batch, nrenamed = 0;
+	int *fds, *results, written, error;
+	bool retry, *conflicts, *saved;
+	FILE *fp;
+
+	bufs = calloc(n, sizeof(*bufs));
+	tmppaths = calloc(n, sizeof(*tmppaths));
+	renamed = calloc(n, sizeof(*renamed));
+	lens = calloc(n, sizeof(*lens));
+	fds = calloc(n, sizeof(*fds));
+	results = calloc(n * SAVE_OPS, sizeof(*results));
+	conflicts = calloc(n, sizeof(*conflicts));
+	saved = calloc(n, sizeof(*saved));
+	if (bufs == NULL || tmppaths == NULL || renamed == NULL || lens == NULL ||
+	    fds == NULL || results == NULL || conflicts == NULL || saved == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; i++)
+		fds[i] = -1;
+
+	for (i = 0; i < n; i++) {
+		confctl_stats_begin(ccs[i], CONFCTL_PHASE_WRITE);
+		fp = open_memstream(&bufs[i], &lens[i]);
+		if (fp == NULL)
+			err(1, "open_memstream");
+		if (confctl_write(ccs[i], fp) != 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "cannot write %s", paths[i]);
+			fclose(fp);
+			goto fail;
+		}
+		if (fclose(fp) != 0)
+			err(1, "fclose");
+		confctl_stats_end(ccs[i], CONFCTL_PHASE_WRITE);
+	}
+
+	/*
+	 * Create temporary files; retry the ones whose names were taken.
+	 */
+	for (first = 0; first < n; first += batch) {
+		batch = n - first;
+		if (batch > u->u_entries)
+			batch = u->u_entries;
+		do {
+			for (i = first; i < first + batch; i++) {
+				if (fds[i] >= 0)
+					continue;
+				if (tmppaths[i] == NULL &&
+				    asprintf(&tmppaths[i], "%s.XXXXXXXXX", paths[i]) < 0)
+					err(1, "asprintf");
+				tmppath_randomize(tmppaths[i]);
+				sqe = uring_sqe(u, IORING_OP_OPENAT, AT_FDCWD, i);
+				sqe->addr = (uintptr_t)tmppaths[i];
+				sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+				sqe->len = 0600;
+			}
+			if (uring_run(u, results) != 0)
+				goto submit_fail;
+			retry = false;
+			for (i = first; i < first + batch; i++) {
+				if (fds[i] >= 0)
+					continue;
+				if (results[i] == -EEXIST) {
+					retry = true;
+					continue;
+				}
+				if (results[i] >= 0)
+					fds[i] = results[i];
+			}
+			for (i = first; i < first + batch; i++) {
+				if (fds[i] < 0 && results[i] != -EEXIST) {
+					confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+					    -results[i], "cannot create temporary file %s; use -I to rewrite file in place",
+					    tmppaths[i]);
+					goto fail;
+				}
+			}
+		} while (retry);
+	}
+
+	for (first = 0; first < n; first += batch) {
+		batch = n - first;
+		if (batch > u->u_entries / SAVE_OPS)
+			batch = u->u_entries / SAVE_OPS;
+		last = first + batch;
+
+		for (i = first; i < last; i++) {
+			confctl_stats_begin(ccs[i], CONFCTL_PHASE_FSYNC);
+			sqe = uring_sqe(u, IORING_OP_WRITE, fds[i], i * SAVE_OPS + SAVE_WRITE);
+			sqe->addr = (uintptr_t)bufs[i];
+			sqe->len = lens[i] < URING_WRITE_MAX ? lens[i] : URING_WRITE_MAX;
+			sqe->flags = IOSQE_IO_LINK;
+			uring_sqe(u, IORING_OP_FSYNC, fds[i], i * SAVE_OPS + SAVE_FSYNC);
+		}
+		if (uring_run(u, results) != 0)
+			goto submit_fail;
+
+		for (i = first; i < last; i++) {
+			written = results[i * SAVE_OPS + SAVE_WRITE];
+			if (written < 0) {
+				confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+				    -written, "cannot write %s", tmppaths[i]);
+				goto fail;
+			}
+			/*
+			 * Short write breaks the chain, cancelling the fsync.
+			 */
+			if ((size_t)written < lens[i]) {
+				if (save_finish(fds[i], bufs[i], lens[i], written) != 0) {
+					confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+					    errno, "cannot write %s", tmppaths[i]);
+					goto fail;
+				}
+			} else if (results[i * SAVE_OPS + SAVE_FSYNC] != 0) {
+				confctl_error_set(ce, CONFCTL_ERROR_SYSTEM,
+				    -results[i * SAVE_OPS + SAVE_FSYNC], "fsync");
+				goto fail;
+			}
+			confctl_stats_end(ccs[i], CONFCTL_PHASE_FSYNC);
+			free(bufs[i]);
+			bufs[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		confctl_stats_begin(ccs[i], CONFCTL_PHASE_RENAME);
+		error = confctl_replace(ccs[i], paths[i], tmppaths[i], fds[i]);
+		/*
+		 * Whatever happened, the temporary file is gone now.
+		 */
+		free(tmppaths[i]);
+		tmppaths[i] = NULL;
+		if (error < 0) {
+			*ce = ccs[i]->cc_error;
+			goto fail;
+		}
+		if (error > 0) {
+			renamed[nrenamed] = paths[i];
+			nrenamed++;
+			saved[i] = true;
+		} else {
+			conflicts[i] = true;
+		}
+		error = close(fds[i]);
+		fds[i] = -1;
+		if (error != 0) {
+			confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno,
+			    "close");
+			goto fail;
+		}
+	}
+	if (confctl_sync_dirs(renamed, nrenamed, ce) != 0)
+		goto fail;
+	for (i = 0; i < n; i++)
+		confctl_stats_end(ccs[i], CONFCTL_PHASE_RENAME);
+
+	/*
+	 * Files changed by someone else in the meantime get loaded again,
+	 * and saved one by one.
+	 */
+	for (i = 0; i < n; i++) {
+		if (!conflicts[i])
+			continue;
+		if (confctl_reload(ccs[i], paths[i]) != 0 ||
+		    confctl_save2(ccs[i], paths[i], NULL) != 0) {
+			*ce = ccs[i]->cc_error;
+			goto fail;
+		}
+		saved[i] = true;
+	}
+
+	error = 0;
+	goto out;
+
+submit_fail:
+	confctl_error_set(ce, CONFCTL_ERROR_SYSTEM, errno, "io_uring_enter");
+fail:
+	confctl_error_saved(ce, paths, saved, n);
+	for (i = 0; i < n; i++) {
+		if (fds[i] >= 0) {
+			if (tmppaths[i] != NULL)
+				remove_tmpfile(tmppaths[i]);
+			close(fds[i]);
+		}
+		free(tmppaths[i]);
+		free(bufs[i]);
+	}
+	error = -1;
+out:
+	free(saved);
+	free(conflicts);
+	free(results);
+	free(fds);
+	free(lens);
+	free(renamed);
+	free(tmppaths);
+	free(bufs);
+
+	return (error);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * Files including other files share the cache, so that the ones included
+ * by more than one get parsed once.
+ */
+static int
+load_many_includes(struct confctl **ccs, char *const *paths, size_t n,
+    struct confctl_error *ce)
+{
+	struct confctl_include_cache *cic;
+	size_t i;
+	int error = 0;
+
+	cic = confctl_include_cache_new();
+	for (i = 0; i < n && error == 0; i++) {
+		ccs[i]->cc_include_cache = cic;
+		error = confctl_load2(ccs[i], paths[i], NULL);
+		ccs[i]->cc_include_cache = NULL;
+		if (error != 0)
+			*ce = ccs[i]->cc_error;
+	}
+	confctl_include_cache_delete(cic);
+
+	return (error);
+}
+
+static int
+load_many(struct confctl **ccs, char *const *paths, size_t n,
+    struct confctl_error *ce)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct uring u;
+	size_t i, first, batch;
+	int error = 0;
+#endif
+	size_t j;
+
+	for (j = 0; j < n; j++) {
+		if (ccs[j]->cc_follow_includes)
+			return (load_many_includes(ccs, paths, n, ce));
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	/*
+	 * Files rewritten in place need to be locked while loading.
+	 */
+	for (i = 0; i < n; i++) {
+		if (ccs[i]->cc_rewrite_in_place)
+			break;
+	}
+
+	if (i == n && uring_init(&u)) {
+		for (first = 0; first < n && error == 0; first += batch) {
+			batch = n - first;
+			if (batch > u.u_entries)
+				batch = u.u_entries;
+			error = uring_load(&u, ccs + first, paths + first, batch, ce);
+		}
+		uring_fini(&u);
+		return (error);
+	}
+#endif
+
+	for (j = 0; j < n; j++) {
+		if (confctl_load2(ccs[j], paths[j], NULL) != 0) {
+			*ce = ccs[j]->cc_error;
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+static int
+save_many(struct confctl **ccs, char *const *paths, size_t n,
+    struct confctl_error *ce)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct uring u;
+	size_t i;
+	int error;
+
+	/*
+	 * Saving with io_uring keeps the contents of all the files in memory;
+	 * don't do that for files that were large when loaded.
+	 */
+	for (i = 0; i < n; i++) {
+		if (ccs[i]->cc_rewrite_in_place || ccs[i]->cc_lossy ||
+		    ccs[i]->cc_partial || ccs[i]->cc_read_only ||
+		    !TAILQ_EMPTY(&ccs[i]->cc_includes))
+			break;
+		if (ccs[i]->cc_identity != NULL && ccs[i]->cc_identity->ci_size > URING_LOAD_MAX)
+			break;
+	}
+
+	if (i == n && uring_init(&u)) {
+		error = uring_save(&u, ccs, paths, n, ce);
+		uring_fini(&u);
+		return (error);
+	}
+#endif
+	struct confctl_save_group *csg;
+	const struct confctl_error *cep;
+	size_t j;
+
+	/*
+	 * Included files get saved along with the ones including them,
+	 * which doesn't fit in a group.
+	 */
+	for (j = 0; j < n; j++) {
+		if (!TAILQ_EMPTY(&ccs[j]->cc_includes))
+			break;
+	}
+	if (j < n) {
+		for (j = 0; j < n; j++) {
+			if (confctl_save2(ccs[j], paths[j], NULL) != 0) {
+				*ce = ccs[j]->cc_error;
+				return (-1);
+			}
+		}
+		return (0);
+	}
+
+	csg = confctl_save_group_begin();
+	for (j = 0; j < n; j++) {
+		if (confctl_save_group_add2(csg, ccs[j], paths[j], &cep) != 0) {
+			*ce = *cep;
+			confctl_save_group_delete(csg);
+			return (-1);
+		}
+	}
+	if (confctl_save_group_commit2(csg, &cep) != 0) {
+		*ce = *cep;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * On failure, the reason gets copied to all the handles, as it's not always
+ * about any single one of them.
+ */
+static void
+many_error(struct confctl **ccs, size_t n, const struct confctl_error *ce,
+    const struct confctl_error **errorp)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		ccs[i]->cc_error = *ce;
+	if (errorp != NULL)
+		*errorp = n > 0 ? &ccs[0]->cc_error : NULL;
+}
+
+int
+confctl_load_many2(struct confctl **ccs, char *const *paths, size_t n,
+    const struct confctl_error **errorp)
+{
+	struct confctl_error ce;
+	int error;
+
+	memset(&ce, 0, sizeof(ce));
+	error = load_many(ccs, paths, n, &ce);
+	many_error(ccs, n, &ce, errorp);
+
+	return (error);
+}
+
+int
+confctl_save_many2(struct confctl **ccs, char *const *paths, size_t n,
+    const struct confctl_error **errorp)
+{
+	struct confctl_error ce;
+	int error;
+
+	memset(&ce, 0, sizeof(ce));
+	error = save_many(ccs, paths, n, &ce);
+	many_error(ccs, n, &ce, errorp);
+
+	return (error);
+}
+
+void
+confctl_load_many(struct confctl **ccs, char *const *paths, size_t n)
+{
+	const struct confctl_error *ce;
+
+	if (confctl_load_many2(ccs, paths, n, &ce) != 0)
+		confctl_error_exit(ce);
+}
+
+void
+confctl_save_many(struct confctl **ccs, char *const *paths, size_t n)
+{
+	const struct confctl_error *ce;
+
+	if (confctl_save_many2(ccs, paths, n, &ce) != 0)
+		confctl_error_exit(ce);
+}
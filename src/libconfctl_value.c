@@ -0,0 +1,352 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the typed views of variable values: the value with
+ * quoting removed, and its conversions to numbers, booleans and addresses.
+ * Each is computed the first time it's asked for, and kept in the variable
+ * until its value changes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+enum {
+	VIEW_UNQUOTED,
+	VIEW_INT64,
+	VIEW_BOOL,
+	VIEW_INET,
+	VIEW_MAX
+};
+
+/*
+ * Conversions of a single value.  Those not in cvc_known weren't computed
+ * yet; those with non-zero cvc_errno failed, and that's the errno to report.
+ * The unquoted view points into the value itself, unless there was quoting
+ * in the middle of it or escapes to remove; then it's cvc_unescaped.
+ */
+struct confctl_value_cache {
+	char			*cvc_unescaped;
+	const char		*cvc_unquoted;
+	size_t			cvc_unquoted_len;
+	int64_t			cvc_int64;
+	struct confctl_inet	cvc_inet;
+	bool			cvc_bool;
+	unsigned int		cvc_known;
+	int			cvc_errno[VIEW_MAX];
+};
+
+void
+confctl_value_cache_delete(struct confctl_value_cache *cvc)
+{
+
+	if (cvc == NULL)
+		return;
+	free(cvc->cvc_unescaped);
+	free(cvc);
+}
+
+static struct confctl_value_cache *
+cvc_get(struct confctl_var *cv)
+{
+
+	struct confctl_var_ext *cx;
+
+	cx = confctl_var_ext(cv);
+	if (cx->cx_values == NULL) {
+		cx->cx_values = calloc(1, sizeof(*cx->cx_values));
+		if (cx->cx_values == NULL)
+			err(1, "calloc");
+	}
+
+	return (cx->cx_values);
+}
+
+/*
+ * Remove quoting the same way the parser interprets it: a backslash makes
+ * the next character literal, and double or single quotes, other than
+ * the ones inside the other kind, start or end a quoted part.  The usual
+ * cases - no quotes, or the whole value in one pair, and no backslashes -
+ * are just a part of the value.
+ */
+static void
+unquote(struct confctl_value_cache *cvc, const char *s, size_t len)
+{
+	char *out;
+	size_t i, n;
+	bool quoted = false, squoted = false;
+
+	if (memchr(s, '\\', len) == NULL) {
+		if (len >= 2 && (s[0] == '"' || s[0] == '\'') &&
+		    s[len - 1] == s[0] && memchr(s + 1, s[0], len - 2) == NULL) {
+			cvc->cvc_unquoted = s + 1;
+			cvc->cvc_unquoted_len = len - 2;
+			return;
+		}
+		if (memchr(s, '"', len) == NULL && memchr(s, '\'', len) == NULL) {
+			cvc->cvc_unquoted = s;
+			cvc->cvc_unquoted_len = len;
+			return;
+		}
+	}
+
+	out = malloc(len + 1);
+	if (out == NULL)
+		err(1, "malloc");
+
+	for (i = 0, n = 0; i < len; i++) {
+		if (s[i] == '\\' && i + 1 < len) {
+			out[n++] = s[++i];
+			continue;
+		}
+		if (s[i] == '"' && !squoted) {
+			quoted = !quoted;
+			continue;
+		}
+		if (s[i] == '\'' && !quoted) {
+			squoted = !squoted;
+			continue;
+		}
+		out[n++] = s[i];
+	}
+	out[n] = '\0';
+
+	cvc->cvc_unescaped = out;
+	cvc->cvc_unquoted = out;
+	cvc->cvc_unquoted_len = n;
+}
+
+const char *
+confctl_var_value_unquoted(struct confctl_var *cv, size_t *lenp)
+{
+	struct confctl_value_cache *cvc;
+
+	if (cv->cv_value == NULL) {
+		*lenp = 0;
+		return (NULL);
+	}
+
+	cvc = cvc_get(cv);
+	if ((cvc->cvc_known & (1 << VIEW_UNQUOTED)) == 0) {
+		unquote(cvc, cv->cv_value->b_buf, cv->cv_value->b_len);
+		cvc->cvc_known |= 1 << VIEW_UNQUOTED;
+	}
+
+	*lenp = cvc->cvc_unquoted_len;
+	return (cvc->cvc_unquoted);
+}
+
+/*
+ * Copy the unquoted value into 'buf', as a string, for the conversions
+ * that need one; values that don't fit can't be valid anyway.
+ */
+static int
+unquoted_string(struct confctl_var *cv, char *buf, size_t bufsize)
+{
+	const char *s;
+	size_t len;
+
+	s = confctl_var_value_unquoted(cv, &len);
+	if (s == NULL || len == 0 || len >= bufsize ||
+	    memchr(s, '\0', len) != NULL)
+		return (EINVAL);
+
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	return (0);
+}
+
+static int
+parse_int64(struct confctl_var *cv, int64_t *valp)
+{
+	char buf[32], *end;
+	const char *digits;
+	long long val;
+	int base = 10, error;
+
+	error = unquoted_string(cv, buf, sizeof(buf));
+	if (error != 0)
+		return (error);
+
+	digits = buf;
+	if (*digits == '-' || *digits == '+')
+		digits++;
+	if (digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+		base = 16;
+		digits += 2;
+	}
+	if (*digits < '0' || (*digits > '9' &&
+	    (base == 10 || strchr("abcdefABCDEF", *digits) == NULL)))
+		return (EINVAL);
+
+	errno = 0;
+	val = strtoll(buf, &end, base);
+	if (errno != 0)
+		return (errno);
+	if (*end != '\0')
+		return (EINVAL);
+
+	*valp = val;
+	return (0);
+}
+
+int
+confctl_var_value_int64(struct confctl_var *cv, int64_t *valp)
+{
+	struct confctl_value_cache *cvc;
+
+	cvc = cvc_get(cv);
+	if ((cvc->cvc_known & (1 << VIEW_INT64)) == 0) {
+		cvc->cvc_errno[VIEW_INT64] = parse_int64(cv, &cvc->cvc_int64);
+		cvc->cvc_known |= 1 << VIEW_INT64;
+	}
+
+	if (cvc->cvc_errno[VIEW_INT64] != 0) {
+		errno = cvc->cvc_errno[VIEW_INT64];
+		return (-1);
+	}
+	*valp = cvc->cvc_int64;
+	return (0);
+}
+
+static int
+parse_bool(struct confctl_var *cv, bool *valp)
+{
+	static const char *const trues[] = { "yes", "true", "on", "1" };
+	static const char *const falses[] = { "no", "false", "off", "0" };
+	char buf[8];
+	size_t i;
+	int error;
+
+	error = unquoted_string(cv, buf, sizeof(buf));
+	if (error != 0)
+		return (error);
+
+	for (i = 0; i < sizeof(trues) / sizeof(trues[0]); i++) {
+		if (strcasecmp(buf, trues[i]) == 0) {
+			*valp = true;
+			return (0);
+		}
+		if (strcasecmp(buf, falses[i]) == 0) {
+			*valp = false;
+			return (0);
+		}
+	}
+
+	return (EINVAL);
+}
+
+int
+confctl_var_value_bool(struct confctl_var *cv, bool *valp)
+{
+	struct confctl_value_cache *cvc;
+
+	cvc = cvc_get(cv);
+	if ((cvc->cvc_known & (1 << VIEW_BOOL)) == 0) {
+		cvc->cvc_errno[VIEW_BOOL] = parse_bool(cv, &cvc->cvc_bool);
+		cvc->cvc_known |= 1 << VIEW_BOOL;
+	}
+
+	if (cvc->cvc_errno[VIEW_BOOL] != 0) {
+		errno = cvc->cvc_errno[VIEW_BOOL];
+		return (-1);
+	}
+	*valp = cvc->cvc_bool;
+	return (0);
+}
+
+static int
+parse_inet(struct confctl_var *cv, struct confctl_inet *cia)
+{
+	char buf[INET6_ADDRSTRLEN + sizeof("/128")], *slash, *end;
+	long prefixlen = -1, maxlen;
+	int error;
+
+	error = unquoted_string(cv, buf, sizeof(buf));
+	if (error != 0)
+		return (error);
+
+	slash = strchr(buf, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		if (slash[1] < '0' || slash[1] > '9')
+			return (EINVAL);
+		prefixlen = strtol(slash + 1, &end, 10);
+		if (*end != '\0')
+			return (EINVAL);
+	}
+
+	memset(cia, 0, sizeof(*cia));
+	if (inet_pton(AF_INET, buf, &cia->cia_addr4) == 1) {
+		cia->cia_family = AF_INET;
+		maxlen = 32;
+	} else if (inet_pton(AF_INET6, buf, &cia->cia_addr6) == 1) {
+		cia->cia_family = AF_INET6;
+		maxlen = 128;
+	} else
+		return (EINVAL);
+
+	if (prefixlen > maxlen)
+		return (EINVAL);
+	cia->cia_prefixlen = prefixlen;
+	return (0);
+}
+
+int
+confctl_var_value_inet(struct confctl_var *cv, struct confctl_inet *cia)
+{
+	struct confctl_value_cache *cvc;
+
+	cvc = cvc_get(cv);
+	if ((cvc->cvc_known & (1 << VIEW_INET)) == 0) {
+		cvc->cvc_errno[VIEW_INET] = parse_inet(cv, &cvc->cvc_inet);
+		cvc->cvc_known |= 1 << VIEW_INET;
+	}
+
+	if (cvc->cvc_errno[VIEW_INET] != 0) {
+		errno = cvc->cvc_errno[VIEW_INET];
+		return (-1);
+	}
+	*cia = cvc->cvc_inet;
+	return (0);
+}
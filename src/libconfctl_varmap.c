@@ -0,0 +1,410 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This file contains the hash tables of variables used by the value index
+ * and for finding children by name.  The links live in the tables, so that
+ * variables that aren't in any don't need room for them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+#include "confctl.h"
+#include "confctl_private.h"
+
+uint32_t
+confctl_varmap_hash(const char *key)
+{
+	const unsigned char *p;
+	uint32_t hash = 2166136261u;
+
+	/*
+	 * FNV-1a.
+	 */
+	for (p = (const unsigned char *)key; *p != '\0'; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+
+	return (hash);
+}
+
+static const char *
+varmap_key(const struct confctl_varmap *cvm, const struct confctl_var *cv)
+{
+
+	if (cvm->cvm_by_value)
+		return (cv->cv_value->b_buf);
+	return (cv->cv_name->b_buf);
+}
+
+static struct confctl_varmap_bucket *
+varmap_bucket(struct confctl_varmap *cvm, const char *key)
+{
+
+	return (&cvm->cvm_buckets[confctl_varmap_hash(key) & (cvm->cvm_nbuckets - 1)]);
+}
+
+static size_t
+varmap_slot(const struct confctl_varmap *cvm, const struct confctl_var *cv)
+{
+	uint64_t hash;
+
+	/*
+	 * Fibonacci hashing; the low bits of addresses are mostly zero.
+	 */
+	hash = (uintptr_t)cv * UINT64_C(11400714819323198485);
+	return ((size_t)(hash >> 32) & (cvm->cvm_nslots - 1));
+}
+
+static void
+varmap_slot_insert(struct confctl_varmap *cvm, size_t entry)
+{
+	size_t i;
+
+	i = varmap_slot(cvm, cvm->cvm_entries[entry].cme_var);
+	while (cvm->cvm_slots[i] != CONFCTL_VARMAP_NONE)
+		i = (i + 1) & (cvm->cvm_nslots - 1);
+	cvm->cvm_slots[i] = entry;
+}
+
+/*
+ * Returns the index of the slot pointing to the variable's entry,
+ * or CONFCTL_VARMAP_NONE if it's not in the table.
+ */
+static size_t
+varmap_slot_find(const struct confctl_varmap *cvm, const struct confctl_var *cv)
+{
+	size_t i;
+
+	if (cvm->cvm_nslots == 0)
+		return (CONFCTL_VARMAP_NONE);
+
+	i = varmap_slot(cvm, cv);
+	while (cvm->cvm_slots[i] != CONFCTL_VARMAP_NONE) {
+		if (cvm->cvm_entries[cvm->cvm_slots[i]].cme_var == cv)
+			return (i);
+		i = (i + 1) & (cvm->cvm_nslots - 1);
+	}
+
+	return (CONFCTL_VARMAP_NONE);
+}
+
+/*
+ * Linear probing; instead of leaving a tombstone, move back the entries
+ * that would no longer be found past the now empty slot.
+ */
+static void
+varmap_slot_remove(struct confctl_varmap *cvm, size_t i)
+{
+	size_t j, home, mask;
+
+	mask = cvm->cvm_nslots - 1;
+	for (j = (i + 1) & mask; cvm->cvm_slots[j] != CONFCTL_VARMAP_NONE; j = (j + 1) & mask) {
+		home = varmap_slot(cvm, cvm->cvm_entries[cvm->cvm_slots[j]].cme_var);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			cvm->cvm_slots[i] = cvm->cvm_slots[j];
+			i = j;
+		}
+	}
+	cvm->cvm_slots[i] = CONFCTL_VARMAP_NONE;
+}
+
+static void
+varmap_append(struct confctl_varmap *cvm, size_t entry)
+{
+	struct confctl_varmap_bucket *cmb;
+	struct confctl_varmap_entry *cme;
+
+	cme = &cvm->cvm_entries[entry];
+	cmb = varmap_bucket(cvm, varmap_key(cvm, cme->cme_var));
+	cme->cme_prev = cmb->cmb_last;
+	cme->cme_next = CONFCTL_VARMAP_NONE;
+	if (cmb->cmb_last == CONFCTL_VARMAP_NONE)
+		cmb->cmb_first = entry;
+	else
+		cvm->cvm_entries[cmb->cmb_last].cme_next = entry;
+	cmb->cmb_last = entry;
+}
+
+static void
+varmap_grow(struct confctl_varmap *cvm)
+{
+	struct confctl_varmap_bucket *old;
+	size_t entry, next, i, nold;
+
+	old = cvm->cvm_buckets;
+	nold = cvm->cvm_nbuckets;
+
+	if (cvm->cvm_nbuckets == 0)
+		cvm->cvm_nbuckets = cvm->cvm_min;
+	else
+		cvm->cvm_nbuckets *= 2;
+	cvm->cvm_buckets = calloc(cvm->cvm_nbuckets, sizeof(*cvm->cvm_buckets));
+	if (cvm->cvm_buckets == NULL)
+		err(1, "calloc");
+	for (i = 0; i < cvm->cvm_nbuckets; i++) {
+		cvm->cvm_buckets[i].cmb_first = CONFCTL_VARMAP_NONE;
+		cvm->cvm_buckets[i].cmb_last = CONFCTL_VARMAP_NONE;
+	}
+
+	/*
+	 * Variables with the same key always end up in the same bucket,
+	 * so this preserves their order.
+	 */
+	for (i = 0; i < nold; i++) {
+		for (entry = old[i].cmb_first; entry != CONFCTL_VARMAP_NONE; entry = next) {
+			next = cvm->cvm_entries[entry].cme_next;
+			varmap_append(cvm, entry);
+		}
+	}
+	free(old);
+
+	/*
+	 * Keep the slots at most half full.
+	 */
+	free(cvm->cvm_slots);
+	cvm->cvm_nslots = cvm->cvm_nbuckets * 2;
+	cvm->cvm_slots = malloc(cvm->cvm_nslots * sizeof(*cvm->cvm_slots));
+	if (cvm->cvm_slots == NULL)
+		err(1, "malloc");
+	for (i = 0; i < cvm->cvm_nslots; i++)
+		cvm->cvm_slots[i] = CONFCTL_VARMAP_NONE;
+	for (i = 0; i < cvm->cvm_allocated; i++) {
+		if (cvm->cvm_entries[i].cme_var != NULL)
+			varmap_slot_insert(cvm, i);
+	}
+}
+
+struct confctl_varmap *
+confctl_varmap_new(bool by_value, size_t min)
+{
+	struct confctl_varmap *cvm;
+
+	cvm = calloc(1, sizeof(*cvm));
+	if (cvm == NULL)
+		err(1, "calloc");
+	cvm->cvm_by_value = by_value;
+	cvm->cvm_min = min;
+	cvm->cvm_free = CONFCTL_VARMAP_NONE;
+	varmap_grow(cvm);
+
+	return (cvm);
+}
+
+void
+confctl_varmap_delete(struct confctl_varmap *cvm)
+{
+
+	if (cvm == NULL)
+		return;
+	free(cvm->cvm_entries);
+	free(cvm->cvm_buckets);
+	free(cvm->cvm_slots);
+	free(cvm);
+}
+
+static size_t
+varmap_entry_new(struct confctl_varmap *cvm, struct confctl_var *cv)
+{
+	size_t entry;
+
+	assert(varmap_slot_find(cvm, cv) == CONFCTL_VARMAP_NONE);
+
+	if (cvm->cvm_len >= cvm->cvm_nbuckets)
+		varmap_grow(cvm);
+
+	if (cvm->cvm_free != CONFCTL_VARMAP_NONE) {
+		entry = cvm->cvm_free;
+		cvm->cvm_free = cvm->cvm_entries[entry].cme_next;
+	} else {
+		if (cvm->cvm_allocated == cvm->cvm_entries_allocated) {
+			cvm->cvm_entries_allocated = cvm->cvm_entries_allocated == 0 ?
+			    cvm->cvm_min : cvm->cvm_entries_allocated * 2;
+			cvm->cvm_entries = realloc(cvm->cvm_entries,
+			    cvm->cvm_entries_allocated * sizeof(*cvm->cvm_entries));
+			if (cvm->cvm_entries == NULL)
+				err(1, "realloc");
+		}
+		entry = cvm->cvm_allocated++;
+	}
+
+	cvm->cvm_entries[entry].cme_var = cv;
+
+	return (entry);
+}
+
+/*
+ * Adds the variable after the others with the same key.
+ */
+void
+confctl_varmap_insert(struct confctl_varmap *cvm, struct confctl_var *cv)
+{
+	size_t entry;
+
+	entry = varmap_entry_new(cvm, cv);
+	varmap_append(cvm, entry);
+	varmap_slot_insert(cvm, entry);
+	cvm->cvm_len++;
+}
+
+/*
+ * Adds the variable right after 'prev', which must be in the table
+ * with the same key, or before all the others with that key if 'prev'
+ * is NULL.
+ */
+void
+confctl_varmap_insert_after(struct confctl_varmap *cvm, struct confctl_var *cv,
+    struct confctl_var *prev)
+{
+	struct confctl_varmap_bucket *cmb;
+	struct confctl_varmap_entry *cme;
+	size_t entry, prev_entry;
+
+	entry = varmap_entry_new(cvm, cv);
+	cmb = varmap_bucket(cvm, varmap_key(cvm, cv));
+	cme = &cvm->cvm_entries[entry];
+	if (prev == NULL) {
+		prev_entry = CONFCTL_VARMAP_NONE;
+		cme->cme_next = cmb->cmb_first;
+		cmb->cmb_first = entry;
+	} else {
+		prev_entry = confctl_varmap_entry(cvm, prev);
+		assert(prev_entry != CONFCTL_VARMAP_NONE);
+		assert(strcmp(varmap_key(cvm, prev), varmap_key(cvm, cv)) == 0);
+		cme->cme_next = cvm->cvm_entries[prev_entry].cme_next;
+		cvm->cvm_entries[prev_entry].cme_next = entry;
+	}
+	cme->cme_prev = prev_entry;
+	if (cme->cme_next == CONFCTL_VARMAP_NONE)
+		cmb->cmb_last = entry;
+	else
+		cvm->cvm_entries[cme->cme_next].cme_prev = entry;
+	varmap_slot_insert(cvm, entry);
+	cvm->cvm_len++;
+}
+
+/*
+ * Removes the variable; its key must be the same as when it was inserted.
+ */
+void
+confctl_varmap_remove(struct confctl_varmap *cvm, struct confctl_var *cv)
+{
+	struct confctl_varmap_bucket *cmb;
+	struct confctl_varmap_entry *cme;
+	size_t entry, slot;
+
+	slot = varmap_slot_find(cvm, cv);
+	assert(slot != CONFCTL_VARMAP_NONE);
+	entry = cvm->cvm_slots[slot];
+	varmap_slot_remove(cvm, slot);
+
+	cme = &cvm->cvm_entries[entry];
+	cmb = varmap_bucket(cvm, varmap_key(cvm, cv));
+	if (cme->cme_prev == CONFCTL_VARMAP_NONE)
+		cmb->cmb_first = cme->cme_next;
+	else
+		cvm->cvm_entries[cme->cme_prev].cme_next = cme->cme_next;
+	if (cme->cme_next == CONFCTL_VARMAP_NONE)
+		cmb->cmb_last = cme->cme_prev;
+	else
+		cvm->cvm_entries[cme->cme_next].cme_prev = cme->cme_prev;
+
+	cme->cme_var = NULL;
+	cme->cme_next = cvm->cvm_free;
+	cvm->cvm_free = entry;
+	assert(cvm->cvm_len > 0);
+	cvm->cvm_len--;
+}
+
+/*
+ * Returns the variable's entry number, which stays the same for as long
+ * as it's in the table, or CONFCTL_VARMAP_NONE if it isn't.
+ */
+size_t
+confctl_varmap_entry(const struct confctl_varmap *cvm, const struct confctl_var *cv)
+{
+	size_t slot;
+
+	slot = varmap_slot_find(cvm, cv);
+	if (slot == CONFCTL_VARMAP_NONE)
+		return (CONFCTL_VARMAP_NONE);
+	return (cvm->cvm_slots[slot]);
+}
+
+bool
+confctl_varmap_contains(const struct confctl_varmap *cvm, const struct confctl_var *cv)
+{
+
+	return (varmap_slot_find(cvm, cv) != CONFCTL_VARMAP_NONE);
+}
+
+static struct confctl_var *
+varmap_match(struct confctl_varmap *cvm, size_t entry, const char *key)
+{
+	struct confctl_var *cv;
+
+	for (; entry != CONFCTL_VARMAP_NONE; entry = cvm->cvm_entries[entry].cme_next) {
+		cv = cvm->cvm_entries[entry].cme_var;
+		if (strcmp(varmap_key(cvm, cv), key) == 0)
+			return (cv);
+	}
+
+	return (NULL);
+}
+
+struct confctl_var *
+confctl_varmap_find(struct confctl_varmap *cvm, const char *key)
+{
+
+	return (varmap_match(cvm, varmap_bucket(cvm, key)->cmb_first, key));
+}
+
+/*
+ * Returns the next variable with the same key as 'cv', which must be
+ * in the table.
+ */
+struct confctl_var *
+confctl_varmap_find_next(struct confctl_varmap *cvm, struct confctl_var *cv)
+{
+	size_t entry;
+
+	entry = confctl_varmap_entry(cvm, cv);
+	assert(entry != CONFCTL_VARMAP_NONE);
+
+	return (varmap_match(cvm, cvm->cvm_entries[entry].cme_next, varmap_key(cvm, cv)));
+}
@@ -0,0 +1,652 @@
+/*-
+ * Copyright (c) 2012 Edward Tomasz Napierala <trasz@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test driver for the parts of the API the confctl(1) utility doesn't use.
+ * Loads the file, runs the operations given as the remaining arguments,
+ * in order, and prints out what they return, for the tests to compare
+ * against the expected output.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "confctl.h"
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: apitest config-path operation...\n");
+	exit(1);
+}
+
+/*
+ * Edits done so far, to redo after the file gets loaded again.
+ */
+static const char	*config_path;
+static char		**edits;
+static int		nedits;
+
+/*
+ * Finds the variable with the given dot-separated name; an empty one
+ * is the root.
+ */
+static struct confctl_var *
+lookup(struct confctl *cc, const char *name)
+{
+	struct confctl_var *cv;
+	char *copy, *component, *rest;
+
+	cv = confctl_root(cc);
+	if (name[0] == '\0')
+		return (cv);
+
+	copy = strdup(name);
+	if (copy == NULL)
+		err(1, "strdup");
+	rest = copy;
+	while (cv != NULL && (component = strsep(&rest, ".")) != NULL)
+		cv = confctl_var_find_child(cv, component);
+	free(copy);
+	if (cv == NULL)
+		errx(1, "%s: not found", name);
+
+	return (cv);
+}
+
+static void
+print_error(const char *name, const char *what)
+{
+
+	printf("%s: %s %s\n", name, what, errno == ERANGE ? "ERANGE" :
+	    errno == EINVAL ? "EINVAL" : strerror(errno));
+}
+
+static void
+print_unquoted(struct confctl *cc, const char *name)
+{
+	const char *value;
+	size_t len;
+
+	value = confctl_var_value_unquoted(lookup(cc, name), &len);
+	if (value == NULL) {
+		printf("%s: unquoted NULL\n", name);
+		return;
+	}
+	printf("%s: unquoted [%.*s]\n", name, (int)len, value);
+}
+
+static void
+print_int64(struct confctl *cc, const char *name)
+{
+	int64_t val;
+
+	if (confctl_var_value_int64(lookup(cc, name), &val) != 0) {
+		print_error(name, "int64");
+		return;
+	}
+	printf("%s: int64 %jd\n", name, (intmax_t)val);
+}
+
+static void
+print_bool(struct confctl *cc, const char *name)
+{
+	bool val;
+
+	if (confctl_var_value_bool(lookup(cc, name), &val) != 0) {
+		print_error(name, "bool");
+		return;
+	}
+	printf("%s: bool %s\n", name, val ? "true" : "false");
+}
+
+static void
+print_inet(struct confctl *cc, const char *name)
+{
+	struct confctl_inet cia;
+	char buf[INET6_ADDRSTRLEN];
+	const void *addr;
+
+	if (confctl_var_value_inet(lookup(cc, name), &cia) != 0) {
+		print_error(name, "inet");
+		return;
+	}
+	if (cia.cia_family == AF_INET)
+		addr = &cia.cia_addr4;
+	else
+		addr = &cia.cia_addr6;
+	if (inet_ntop(cia.cia_family, addr, buf, sizeof(buf)) == NULL)
+		err(1, "inet_ntop");
+	printf("%s: inet%s %s", name, cia.cia_family == AF_INET ? "4" : "6", buf);
+	if (cia.cia_prefixlen >= 0)
+		printf("/%d", cia.cia_prefixlen);
+	printf("\n");
+}
+
+/*
+ * Separators used for lists, unless the operation gives its own.
+ */
+#define	LIST_SEPARATORS	", \t"
+
+static void
+print_list(struct confctl *cc, const char *name, const char *separators)
+{
+	struct confctl_list cl;
+	const char *element;
+	size_t len;
+
+	printf("%s: list", name);
+	for (element = confctl_list_first(&cl, lookup(cc, name), separators, &len);
+	    element != NULL; element = confctl_list_next(&cl, &len))
+		printf(" [%.*s]", (int)len, element);
+	printf("\n");
+}
+
+/*
+ * Replaces the element number 'i', counting from zero, and prints the one
+ * after it.
+ */
+static void
+list_set(struct confctl *cc, const char *name, unsigned long i,
+    const char *element)
+{
+	struct confctl_list cl;
+	size_t len;
+
+	if (confctl_list_first(&cl, lookup(cc, name), LIST_SEPARATORS, &len) == NULL)
+		errx(1, "%s: empty list", name);
+	for (; i > 0; i--) {
+		if (confctl_list_next(&cl, &len) == NULL)
+			errx(1, "%s: not enough elements", name);
+	}
+	confctl_list_set(&cl, element);
+	element = confctl_list_next(&cl, &len);
+	if (element == NULL)
+		printf("%s: next NULL\n", name);
+	else
+		printf("%s: next [%.*s]\n", name, (int)len, element);
+}
+
+/*
+ * Splits the value the way confctl_list_next() is documented to, one byte
+ * at a time, to compare against.  Returns the length of the element
+ * starting at '*startp'.
+ */
+static size_t
+list_reference(const char *s, size_t len, size_t *startp)
+{
+	size_t i;
+	char quote;
+
+	i = *startp;
+	while (i < len && strchr(LIST_SEPARATORS, s[i]) != NULL)
+		i++;
+	*startp = i;
+	while (i < len && strchr(LIST_SEPARATORS, s[i]) == NULL) {
+		if (s[i] == '\\') {
+			i += 2;
+		} else if (s[i] == '"' || s[i] == '\'') {
+			quote = s[i++];
+			while (i < len && s[i] != quote) {
+				if (s[i] == '\\')
+					i++;
+				i++;
+			}
+			i++;
+		} else {
+			i++;
+		}
+	}
+	if (i > len)
+		i = len;
+
+	return (i - *startp);
+}
+
+/*
+ * Sets the value to pseudo-random strings, with elements long enough to be
+ * scanned sixteen bytes at a time, and checks that iterating over them
+ * finds the same elements as list_reference().
+ */
+static void
+list_check(struct confctl *cc, const char *name, unsigned long count)
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789"
+	    "abcdefghijklmnopqrstuvwxyz0123456789, ,\t\"'\\";
+	struct confctl_var *cv;
+	struct confctl_list cl;
+	const char *element;
+	char value[128];
+	uint32_t x = 1;
+	unsigned long n;
+	size_t i, len, ref_start, ref_len;
+
+	cv = lookup(cc, name);
+	for (n = 0; n < count; n++) {
+		len = n % (sizeof(value) - 1);
+		for (i = 0; i < len; i++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			value[i] = alphabet[x % (sizeof(alphabet) - 1)];
+		}
+		value[len] = '\0';
+		confctl_var_set_value(cv, value);
+
+		ref_start = 0;
+		element = confctl_list_first(&cl, cv, LIST_SEPARATORS, &len);
+		for (;;) {
+			ref_len = list_reference(value, strlen(value), &ref_start);
+			if (ref_len == 0) {
+				if (element != NULL)
+					errx(1, "%s: extra element in [%s]", name, value);
+				break;
+			}
+			if (element == NULL)
+				errx(1, "%s: missing element in [%s]", name, value);
+			if (element != confctl_var_value(cv) + ref_start || len != ref_len)
+				errx(1, "%s: wrong element in [%s]", name, value);
+			ref_start += ref_len;
+			element = confctl_list_next(&cl, &len);
+		}
+	}
+	printf("%s: listcheck %lu values\n", name, count);
+}
+
+/*
+ * Prints the values of the children with the given name, in the order
+ * confctl_var_find_next_child() goes through them.
+ */
+static void
+print_children(struct confctl *cc, const char *name, const char *child)
+{
+	struct confctl_var *cv;
+
+	printf("%s: children %s", name, child);
+	for (cv = confctl_var_find_child(lookup(cc, name), child); cv != NULL;
+	    cv = confctl_var_find_next_child(cv)) {
+		if (confctl_var_has_value(cv))
+			printf(" [%s]", confctl_var_value(cv));
+		else
+			printf(" {}");
+	}
+	printf("\n");
+}
+
+/*
+ * Prints the full name of the variable, as far up as it's still attached.
+ */
+static void
+print_name(struct confctl_var *cv)
+{
+	struct confctl_var *parent;
+
+	parent = confctl_var_parent(cv);
+	if (parent != NULL && confctl_var_parent(parent) != NULL) {
+		print_name(parent);
+		printf(".");
+	}
+	printf("%s", confctl_var_name(cv));
+}
+
+/*
+ * Prints the event, along with the value, which, for deleted variables,
+ * also makes sure they are still there to be looked at.
+ */
+static void
+print_event(const char *event, struct confctl_var *cv)
+{
+
+	printf("%s ", event);
+	print_name(cv);
+	if (confctl_var_has_value(cv))
+		printf("=%s", confctl_var_value(cv));
+	printf("\n");
+}
+
+static void
+observe_new(void *ctx, struct confctl_var *cv)
+{
+
+	print_event("new", cv);
+}
+
+static void
+observe_delete(void *ctx, struct confctl_var *cv)
+{
+
+	print_event("delete", cv);
+}
+
+static void
+observe_move(void *ctx, struct confctl_var *cv)
+{
+
+	print_event("move", cv);
+}
+
+static void
+observe_set_name(void *ctx, struct confctl_var *cv)
+{
+
+	print_event("name", cv);
+}
+
+static void
+observe_set_value(void *ctx, struct confctl_var *cv)
+{
+
+	print_event("value", cv);
+}
+
+static const struct confctl_observer observer = {
+	.co_new = observe_new,
+	.co_delete = observe_delete,
+	.co_move = observe_move,
+	.co_set_name = observe_set_name,
+	.co_set_value = observe_set_value,
+};
+
+/*
+ * Changes the file behind our back, the way another process would.
+ */
+static void
+change_file(const char *path, const char *name, const char *value)
+{
+	struct confctl *cc;
+
+	cc = confctl_new();
+	confctl_load(cc, path);
+	confctl_var_set_value(lookup(cc, name), value);
+	confctl_save(cc, path);
+	confctl_delete(cc);
+}
+
+/*
+ * Prints out how the error-returning forms of saving the index,
+ * or saving as a group of one, went.
+ */
+static void
+print_result(const char *what, int error, const struct confctl_error *ce)
+{
+
+	if (error == 0)
+		printf("%s: ok\n", what);
+	else
+		printf("%s: %s\n", what, ce->ce_message);
+}
+
+static void
+save_index(struct confctl *cc, const char *path)
+{
+	const struct confctl_error *ce;
+	int error;
+
+	error = confctl_save_index2(cc, path, &ce);
+	print_result("index", error, ce);
+}
+
+static void
+save_group(struct confctl *cc, const char *path)
+{
+	struct confctl_save_group *csg;
+	const struct confctl_error *ce;
+	int error;
+
+	csg = confctl_save_group_begin();
+	error = confctl_save_group_add2(csg, cc, path, &ce);
+	if (error != 0) {
+		confctl_save_group_delete(csg);
+		print_result("group", error, ce);
+		return;
+	}
+	error = confctl_save_group_commit2(csg, &ce);
+	print_result("group", error, ce);
+}
+
+static bool	run(struct confctl *cc, const char *path, char *op);
+
+static void
+replay(struct confctl *cc, void *arg)
+{
+	char *op;
+	int i;
+
+	printf("replay\n");
+	for (i = 0; i < nedits; i++) {
+		op = strdup(edits[i]);
+		if (op == NULL)
+			err(1, "strdup");
+		run(cc, config_path, op);
+		free(op);
+	}
+}
+
+/*
+ * Splits "name=value" in place, returning the value, or NULL if there's
+ * no '='.
+ */
+static char *
+split(char *arg)
+{
+	char *equals;
+
+	equals = strchr(arg, '=');
+	if (equals == NULL)
+		return (NULL);
+	*equals = '\0';
+
+	return (equals + 1);
+}
+
+/*
+ * Adds the comma-separated variables, each a name, optionally followed
+ * by an equals sign and the value, with a single confctl_var_append().
+ */
+static void
+append_bulk(struct confctl *cc, const char *name, char *arg)
+{
+	const char **names, **values;
+	char *element;
+	size_t n = 0;
+
+	names = calloc(strlen(arg) + 1, sizeof(*names));
+	values = calloc(strlen(arg) + 1, sizeof(*values));
+	if (names == NULL || values == NULL)
+		err(1, "calloc");
+	while ((element = strsep(&arg, ",")) != NULL) {
+		names[n] = element;
+		values[n] = split(element);
+		n++;
+	}
+	confctl_var_append(lookup(cc, name), names, values, n);
+	free(names);
+	free(values);
+}
+
+/*
+ * Appends a copy of the tree loaded from the file, or, if the path
+ * is followed by a colon and a name, of just that variable.
+ */
+static void
+append_copy(struct confctl *cc, const char *name, char *arg)
+{
+	struct confctl *source;
+	char *tree;
+
+	tree = strchr(arg, ':');
+	if (tree != NULL)
+		*tree++ = '\0';
+	source = confctl_new();
+	confctl_load(source, arg);
+	confctl_var_append_tree(lookup(cc, name),
+	    tree != NULL ? lookup(source, tree) : confctl_root(source));
+	confctl_delete(source);
+}
+
+/*
+ * Runs a single operation; they look like "op:name" or "op:name=argument".
+ * For "listset", the argument is the element number, a colon, and the new
+ * element; for "bulk" and "copy", see append_bulk() and append_copy().
+ * Returns true if it changed the tree.
+ */
+static bool
+run(struct confctl *cc, const char *path, char *op)
+{
+	struct confctl_var *cv;
+	char *name, *arg, *element;
+
+	name = strchr(op, ':');
+	if (name != NULL)
+		*name++ = '\0';
+
+	if (name == NULL) {
+		if (strcmp(op, "save") == 0)
+			confctl_save(cc, path);
+		else if (strcmp(op, "index") == 0)
+			save_index(cc, path);
+		else if (strcmp(op, "group") == 0)
+			save_group(cc, path);
+		else if (strcmp(op, "readonly") == 0)
+			confctl_set_read_only(cc, true);
+		else if (strcmp(op, "observe") == 0)
+			confctl_set_observer(cc, &observer, NULL);
+		else if (strcmp(op, "begin") == 0)
+			confctl_batch_begin(cc);
+		else if (strcmp(op, "end") == 0)
+			confctl_batch_end(cc);
+		else if (strcmp(op, "replay") == 0)
+			confctl_set_replay(cc, replay, NULL);
+		else
+			errx(1, "%s: unknown operation", op);
+		return (false);
+	}
+	arg = split(name);
+
+	if (strcmp(op, "unquoted") == 0) {
+		print_unquoted(cc, name);
+	} else if (strcmp(op, "int64") == 0) {
+		print_int64(cc, name);
+	} else if (strcmp(op, "bool") == 0) {
+		print_bool(cc, name);
+	} else if (strcmp(op, "inet") == 0) {
+		print_inet(cc, name);
+	} else if (strcmp(op, "list") == 0) {
+		print_list(cc, name, arg != NULL ? arg : LIST_SEPARATORS);
+	} else if (strcmp(op, "listcheck") == 0 && arg != NULL) {
+		list_check(cc, name, strtoul(arg, NULL, 10));
+	} else if (strcmp(op, "children") == 0 && arg != NULL) {
+		print_children(cc, name, arg);
+	} else if (strcmp(op, "external") == 0 && arg != NULL) {
+		change_file(path, name, arg);
+	} else if (strcmp(op, "new") == 0) {
+		element = strrchr(name, '.');
+		if (element == NULL) {
+			cv = confctl_var_new(confctl_root(cc), name);
+		} else {
+			*element = '\0';
+			cv = confctl_var_new(lookup(cc, name), element + 1);
+		}
+		if (arg != NULL)
+			confctl_var_set_value(cv, arg);
+		return (true);
+	} else if (strcmp(op, "delete") == 0) {
+		confctl_var_delete(lookup(cc, name));
+		return (true);
+	} else if (strcmp(op, "move") == 0 && arg != NULL) {
+		confctl_var_move(lookup(cc, name), lookup(cc, arg));
+		return (true);
+	} else if (strcmp(op, "rename") == 0 && arg != NULL) {
+		confctl_var_set_name(lookup(cc, name), arg);
+		return (true);
+	} else if (strcmp(op, "bulk") == 0 && arg != NULL) {
+		append_bulk(cc, name, arg);
+		return (true);
+	} else if (strcmp(op, "copy") == 0 && arg != NULL) {
+		append_copy(cc, name, arg);
+		return (true);
+	} else if (strcmp(op, "set") == 0 && arg != NULL) {
+		confctl_var_set_value(lookup(cc, name), arg);
+		return (true);
+	} else if (strcmp(op, "append") == 0 && arg != NULL) {
+		confctl_list_append(lookup(cc, name), ",", arg);
+		return (true);
+	} else if (strcmp(op, "listset") == 0 && arg != NULL &&
+	    (element = strchr(arg, ':')) != NULL) {
+		list_set(cc, name, strtoul(arg, NULL, 10), element + 1);
+		return (true);
+	} else {
+		errx(1, "%s: unknown operation", op);
+	}
+
+	return (false);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct confctl *cc;
+	char *op;
+	int i;
+
+	if (argc < 3)
+		usage();
+
+	config_path = argv[1];
+	edits = calloc(argc, sizeof(*edits));
+	if (edits == NULL)
+		err(1, "calloc");
+
+	cc = confctl_new();
+	confctl_load(cc, argv[1]);
+	for (i = 2; i < argc; i++) {
+		op = strdup(argv[i]);
+		if (op == NULL)
+			err(1, "strdup");
+		if (run(cc, argv[1], argv[i]))
+			edits[nedits++] = op;
+		else
+			free(op);
+	}
+	confctl_delete(cc);
+
+	for (i = 0; i < nedits; i++)
+		free(edits[i]);
+	free(edits);
+
+	return (0);
+}